@@ -43,22 +43,14 @@ static void alarm_task(struct cron_job_struct *job) {
   }
 }
 
-static void alarm_add_cmdhandler_dealloc_cb(CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "alarm_add_cmdhandler_dealloc_cb - freeing");
-  free(resp_out->alarm_add_response);
-}
-
 static CommandResponse__RetCodeT alarm_add_cmdhandler(CommandRequest *msg,
                                                       CommandResponse *resp_out,
-                                                      dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_ALARM_ADD_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
+                                                      mqttmgr_arena_t *arena) {
+  Alarm__AddResponse *alr = MQTTMGR_ARENA_NEW(arena, Alarm__AddResponse);
+  if (alr == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
-
   resp_out->resp_case = COMMAND_RESPONSE__RESP_ALARM_ADD_RESPONSE;
-  *cb = alarm_add_cmdhandler_dealloc_cb;
-  Alarm__AddResponse *alr =
-      (Alarm__AddResponse *)calloc(1, sizeof(Alarm__AddResponse));
   alarm__add_response__init(alr);
   resp_out->alarm_add_response = alr;
 
@@ -77,20 +69,13 @@ static CommandResponse__RetCodeT alarm_add_cmdhandler(CommandRequest *msg,
   return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
 }
 
-static void alarm_delete_cmdhandler_dealloc_cb(CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "alarm_delete_cmdhandler_dealloc_cb - freeing");
-  free(resp_out->alarm_delete_response);
-}
-
 static CommandResponse__RetCodeT alarm_delete_cmdhandler(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_ALARM_DELETE_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  Alarm__DeleteResponse *alr = MQTTMGR_ARENA_NEW(arena, Alarm__DeleteResponse);
+  if (alr == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
   resp_out->resp_case = COMMAND_RESPONSE__RESP_ALARM_DELETE_RESPONSE;
-  *cb = alarm_delete_cmdhandler_dealloc_cb;
-  Alarm__DeleteResponse *alr =
-      (Alarm__DeleteResponse *)calloc(1, sizeof(Alarm__DeleteResponse));
   alarm__delete_response__init(alr);
   resp_out->alarm_delete_response = alr;
 
@@ -115,15 +100,6 @@ static CommandResponse__RetCodeT alarm_delete_cmdhandler(
   return COMMAND_RESPONSE__RET_CODE_T__ERR;
 }
 
-static void alarm_list_cmdhandler_dealloc_cb(CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "alarm_list_cmdhandler_dealloc_cb - freeing");
-  Alarm__ListResponse *alr = resp_out->alarm_list_response;
-  if (alr->n_alarms > 0) {
-    free(alr->alarms);
-  }
-  free(alr);
-}
-
 // Return the index of the next alarm (start
 // The very first call to this should set last_idx = -1
 static int alarm_idx_iter(int last_idx) {
@@ -137,14 +113,10 @@ static int alarm_idx_iter(int last_idx) {
 }
 
 static CommandResponse__RetCodeT alarm_list_cmdhandler(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
   uint8_t i, n_alarms = 0;
   int alarm_idx = -1;
 
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_ALARM_LIST_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
-  }
-
   for (i = 0; i < CONFIG_ALARM_NUM_MAX; i++) {
     if (state.alarms[i].enabled == ENABLE_UNDEFINED) {
       continue;
@@ -152,28 +124,38 @@ static CommandResponse__RetCodeT alarm_list_cmdhandler(
     n_alarms++;
   }
 
+  Alarm__ListResponse *alr = MQTTMGR_ARENA_NEW(arena, Alarm__ListResponse);
+  if (alr == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
   resp_out->resp_case = COMMAND_RESPONSE__RESP_ALARM_LIST_RESPONSE;
-  *cb = alarm_list_cmdhandler_dealloc_cb;
-  Alarm__ListResponse *alr =
-      (Alarm__ListResponse *)calloc(1, sizeof(Alarm__ListResponse));
   alarm__list_response__init(alr);
   resp_out->alarm_list_response = alr;
 
   alr->n_alarms = n_alarms;
   if (n_alarms != 0) {
-    alr->alarms = calloc(n_alarms, sizeof(Alarm__ListResponse__Alarm *));
+    alr->alarms =
+        MQTTMGR_ARENA_NEW_ARRAY(arena, Alarm__ListResponse__Alarm *, n_alarms);
+    if (alr->alarms == NULL) {
+      alr->n_alarms = 0;
+      return COMMAND_RESPONSE__RET_CODE_T__ERR;
+    }
     for (i = 0; i < n_alarms; i++) {
       alarm_idx = alarm_idx_iter(alarm_idx);
       // We should be getting exactly the right number of idx
       if (alarm_idx == -2) {
         ESP_LOGW(TAG, "alarm_list_cmdhandler - Error finding all alarms");
-        alr->n_alarms = i;  // So the cleanup callback can correctly free
+        alr->n_alarms = i;
         return COMMAND_RESPONSE__RET_CODE_T__ERR;
       }
       ESP_LOGD(TAG, "alarm_list_cmdhandler - Adding alarm in list #%d state#%d",
                i, alarm_idx);
 
-      alr->alarms[i] = calloc(1, sizeof(Alarm__ListResponse__Alarm));
+      alr->alarms[i] = MQTTMGR_ARENA_NEW(arena, Alarm__ListResponse__Alarm);
+      if (alr->alarms[i] == NULL) {
+        alr->n_alarms = i;
+        return COMMAND_RESPONSE__RET_CODE_T__ERR;
+      }
       alarm__list_response__alarm__init(alr->alarms[i]);
       alr->alarms[i]->crontab = state.alarms[alarm_idx].crontab;
       alr->alarms[i]->oneshot = state.alarms[alarm_idx].oneshot;
@@ -302,9 +284,12 @@ esp_err_t alarm_init() {
   cron_job_init();
 
   // Register Command Handlers
-  mqttmgr_register_cmd_handler(alarm_add_cmdhandler);
-  mqttmgr_register_cmd_handler(alarm_delete_cmdhandler);
-  mqttmgr_register_cmd_handler(alarm_list_cmdhandler);
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_ALARM_ADD_REQUEST, alarm_add_cmdhandler));
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_ALARM_DELETE_REQUEST, alarm_delete_cmdhandler));
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_ALARM_LIST_REQUEST, alarm_list_cmdhandler));
 
   return ESP_OK;
 }
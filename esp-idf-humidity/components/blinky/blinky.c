@@ -91,26 +91,18 @@ static esp_err_t blinky_set_led(bool enabled) {
   return ESP_OK;
 }
 
-static void blinky_set_led_request_handler_dealloc_cb(
-    CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "blinky_set_led_request_handler_dealloc_cb - freeing");
-  free(resp_out->blinky_set_led_response);
-}
-
 static CommandResponse__RetCodeT blinky_set_led_request_handler(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_BLINKY_SET_LED_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
-  }
-
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
   ESP_LOGD(TAG, "blinky_set_led_request_handler()");
 
   Blinky__SetLEDRequest *cmd = msg->blinky_set_led_request;
 
-  resp_out->resp_case = COMMAND_RESPONSE__RESP_BLINKY_SET_LED_RESPONSE;
-  *cb = blinky_set_led_request_handler_dealloc_cb;
   Blinky__SetLEDResponse *cmd_resp =
-      (Blinky__SetLEDResponse *)calloc(1, sizeof(Blinky__SetLEDResponse));
+      MQTTMGR_ARENA_NEW(arena, Blinky__SetLEDResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  resp_out->resp_case = COMMAND_RESPONSE__RESP_BLINKY_SET_LED_RESPONSE;
   blinky__set_ledresponse__init(cmd_resp);
   resp_out->blinky_set_led_response = cmd_resp;
 
@@ -251,7 +243,9 @@ esp_err_t blinky_init() {
   gpio_set_level(GPIO_NUM_21, 1);
   gpio_set_level(GPIO_NUM_13, 1);
 
-  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(blinky_set_led_request_handler));
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_BLINKY_SET_LED_REQUEST,
+      blinky_set_led_request_handler));
 
   state.blinky_queue = xQueueCreate(2, sizeof(blinky_animation_t));
 
@@ -4,7 +4,6 @@
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
 #include <string.h>
-#include <time.h>
 
 #include "ltr390.h"
 #include "ltr390mgr.h"
@@ -16,70 +15,57 @@ typedef struct {
   i2c_dev_t dev;
 } state_t;
 
-typedef struct {
-  time_t timestamp;
-  float measurement;
-  Ltr390__ModeT mode;
-} sensor_data_t;
+typedef enum {
+  CHANNEL_LUX = 0,
+  CHANNEL_UVI,
+} channel_t;
+
+// Only the channel of the current sensor mode is measured each time
+static const sensormgr_channel_t channels[] = {
+    {.sensor = "ltr390", .unit = "lux", .decimals = 2},
+    {.sensor = "ltr390", .unit = "uvi", .decimals = 2},
+};
 
 static state_t state;
-static sensor_data_t sensor_reading;
 
-static esp_err_t ltr390mgr_measure(void **sensor_data_out, size_t *len) {
+static esp_err_t ltr390mgr_measure(float *values) {
   esp_err_t res;
-  sensor_data_t **sdo = (sensor_data_t **)sensor_data_out;
-  memset(&sensor_reading, 0, sizeof(sensor_data_t));  // Blank the reading out
+  float measurement;
+  Ltr390__ModeT mode;
 
   ESP_LOGD(TAG, "measure...");
-  time(&sensor_reading.timestamp);
-  res = ltr390_measure(&state.dev, &sensor_reading.measurement,
-                       &sensor_reading.mode);
+  res = ltr390_measure(&state.dev, &measurement, &mode);
   if (res != ESP_OK) {
     if (res != ESP_ERR_INVALID_STATE) {  // AKA Sensor not in standby
       ESP_LOGW(TAG, "measure - failed: %s", esp_err_to_name(res));
     }
-    *sdo = NULL;
-    *len = 0;
-    return res;  // Don't attempt to add a bad reading to ring buffer
+    return res;  // Don't attempt to add a bad reading to the sample queue
   }
 
+  values[mode == LTR390__MODE_T__ALS ? CHANNEL_LUX : CHANNEL_UVI] =
+      measurement;
   // Toggle the sensor mode between successful readings
-  ltr390_set_mode(&state.dev, !sensor_reading.mode);
+  ltr390_set_mode(&state.dev, !mode);
   ESP_LOGV(TAG, "measure - done");
-
-  *sdo = &sensor_reading;
-  *len = sizeof(sensor_reading);
   return ESP_OK;
 }
 
-static esp_err_t ltr390mgr_serialize_data(void *sensor_data,
-                                          cJSON *data_array) {
-  char iso8601[32];
-
-  sensor_data_t *data = (sensor_data_t *)sensor_data;
-  SENSORMGR_ISO8601(data->timestamp, iso8601);
-  cJSON *sensor_json = cJSON_CreateObject();
-  cJSON_AddStringToObject(sensor_json, "timestamp", iso8601);
-  cJSON_AddNumberToObject(sensor_json, "value", data->measurement);
-  cJSON_AddStringToObject(sensor_json, "unit",
-                          data->mode == LTR390__MODE_T__ALS ? "lux" : "uvi");
-  cJSON_AddStringToObject(sensor_json, "sensor", "ltr390");
-  cJSON_AddItemToArray(data_array, sensor_json);
-  return ESP_OK;
-}
+// Readings spilled by older firmware held the measurement and its mode
+static esp_err_t ltr390mgr_legacy(const uint32_t *fields, uint8_t field_cnt,
+                                  float *values) {
+  float measurement;
 
-static void ltr390mgr_cmd_set_optionshandler_dealloc_cb(
-    CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "ltr390mgmt_cmd_set_options_dealloc_cb - freeing");
-  free(resp_out->ltr390_set_options_response);
+  if (field_cnt < 2) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(&measurement, &fields[0], sizeof(measurement));
+  values[fields[1] == LTR390__MODE_T__ALS ? CHANNEL_LUX : CHANNEL_UVI] =
+      measurement;
+  return ESP_OK;
 }
 
 static CommandResponse__RetCodeT ltr390mgr_cmd_set_optionshandler(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_LTR390_SET_OPTIONS_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
-  }
-
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
   Ltr390__SetOptionsRequest *cmd = msg->ltr390_set_options_request;
 
   ESP_LOGD(TAG,
@@ -89,10 +75,12 @@ static CommandResponse__RetCodeT ltr390mgr_cmd_set_optionshandler(
            ltr390_resolution_to_str(cmd->resolution),
            ltr390_measurerate_to_str(cmd->measurerate),
            ltr390_gain_to_str(cmd->gain));
+  Ltr390__SetOptionsResponse *cmd_resp =
+      MQTTMGR_ARENA_NEW(arena, Ltr390__SetOptionsResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
   resp_out->resp_case = COMMAND_RESPONSE__RESP_LTR390_SET_OPTIONS_RESPONSE;
-  *cb = ltr390mgr_cmd_set_optionshandler_dealloc_cb;
-  Ltr390__SetOptionsResponse *cmd_resp = (Ltr390__SetOptionsResponse *)calloc(
-      1, sizeof(Ltr390__SetOptionsResponse));
   ltr390__set_options_response__init(cmd_resp);
   resp_out->ltr390_set_options_response = cmd_resp;
 
@@ -114,22 +102,14 @@ static CommandResponse__RetCodeT ltr390mgr_cmd_set_optionshandler(
   return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
 }
 
-static void ltr390mgr_cmd_get_optionshandler_dealloc_cb(
-    CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "ltr390mgmt_cmd_get_options_dealloc_cb - freeing");
-  free(resp_out->ltr390_get_options_response);
-}
-
 static CommandResponse__RetCodeT ltr390mgr_cmd_get_optionshandler(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_LTR390_GET_OPTIONS_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  Ltr390__GetOptionsResponse *cmd_resp =
+      MQTTMGR_ARENA_NEW(arena, Ltr390__GetOptionsResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
-
   resp_out->resp_case = COMMAND_RESPONSE__RESP_LTR390_GET_OPTIONS_RESPONSE;
-  *cb = ltr390mgr_cmd_get_optionshandler_dealloc_cb;
-  Ltr390__GetOptionsResponse *cmd_resp = (Ltr390__GetOptionsResponse *)calloc(
-      1, sizeof(Ltr390__GetOptionsResponse));
   ltr390__get_options_response__init(cmd_resp);
   resp_out->ltr390_get_options_response = cmd_resp;
   ltr390_get_cached_state((bool *)&cmd_resp->enable, &cmd_resp->gain,
@@ -152,11 +132,18 @@ esp_err_t ltr390mgr_init() {
   ESP_LOGI(TAG, "Register Handlers");
   sensormgr_register_sensor((sensormgr_registration_t){
       .measure = ltr390mgr_measure,
-      .marshall = ltr390mgr_serialize_data,
+      .legacy = ltr390mgr_legacy,
+      .channels = channels,
+      .channel_cnt = sizeof(channels) / sizeof(channels[0]),
+      .period_ms = CONFIG_LTR390_SAMPLE_RATE,
   });
 
-  mqttmgr_register_cmd_handler(ltr390mgr_cmd_set_optionshandler);
-  mqttmgr_register_cmd_handler(ltr390mgr_cmd_get_optionshandler);
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_LTR390_SET_OPTIONS_REQUEST,
+      ltr390mgr_cmd_set_optionshandler));
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_LTR390_GET_OPTIONS_REQUEST,
+      ltr390mgr_cmd_get_optionshandler));
 
   return ESP_OK;
 }
@@ -3,16 +3,33 @@
 #include <mqttlog.h>
 #include <mqttmgr.h>
 #include <stdatomic.h>
-#include <string.h>
 
-#define MQTTLOG_RINBUFFER_SIZE CONFIG_SENSORMGR_RINGBUF_SIZE * 1024
+#include "mqttlog_record.h"
+
+#define MQTTLOG_RINBUFFER_SIZE (CONFIG_MQTTLOG_RINGBUF_SIZE * 1024)
+// Shares of MQTTLOG_RINBUFFER_SIZE, in quarters, for each class
+#define MQTTLOG_RINBUFFER_SHARES {1, 1, 2}
 #define MQTTLOG_TASK_LOGSEND_NAME "mqttlog-logsend"
 #define MQTTLOG_TASK_LOGSEND_STACKSIZE 2560
+// Records batched into each message, up to this many bytes
+#define MQTTLOG_BATCH_LEN 512
+// Binary logs still go to the console as JSON, cut short at this length
+#define MQTTLOG_CONSOLE_LEN 256
+
+// Every class has a ring buffer of its own, a burst of INFO can only push
+// out older INFO. They are sent most severe first.
+typedef enum {
+  MQTTLOG_CLASS_ERROR,
+  MQTTLOG_CLASS_WARN,
+  MQTTLOG_CLASS_INFO,  // And chattier
+  MQTTLOG_CLASS_MAX,
+} mqttlog_class_t;
 
 typedef struct state_t {
   bool initialized;
-  atomic_uint_fast16_t msgs_discarded;
-  RingbufHandle_t ring_buffer;
+  atomic_uint_fast16_t msgs_discarded[MQTTLOG_CLASS_MAX];
+  atomic_uint_fast16_t msgs_limited;
+  RingbufHandle_t ring_buffers[MQTTLOG_CLASS_MAX];
   TaskHandle_t task_logsend;
 } state_t;
 
@@ -37,46 +54,236 @@ static const char *mqtt_log_level_to_str(esp_log_level_t level) {
   }
 }
 
-static esp_err_t mqttlog_drop_msg() {
-  mqttmgr_msg_t *buffered_msg;
+static mqttlog_class_t mqttlog_level_to_class(esp_log_level_t level) {
+  switch (level) {
+    case ESP_LOG_ERROR:
+      return MQTTLOG_CLASS_ERROR;
+    case ESP_LOG_WARN:
+      return MQTTLOG_CLASS_WARN;
+    default:
+      return MQTTLOG_CLASS_INFO;
+  }
+}
+
+bool mqttlog_limit_take(mqttlog_limit_t *limit) {
+  TickType_t now = xTaskGetTickCount();
+  TickType_t earned;
+
+  if (CONFIG_MQTTLOG_RATE_BURST == 0) {
+    return true;
+  }
+  // Racing callers of one call site only miscount a message
+  if (!limit->started) {
+    *limit = (mqttlog_limit_t){
+        .started = true,
+        .tokens = CONFIG_MQTTLOG_RATE_BURST,
+        .last = now,
+    };
+  }
+  earned = (now - limit->last) / pdMS_TO_TICKS(CONFIG_MQTTLOG_RATE_INTERVAL);
+  if (earned >= CONFIG_MQTTLOG_RATE_BURST - limit->tokens) {
+    limit->tokens = CONFIG_MQTTLOG_RATE_BURST;
+    limit->last = now;
+  } else if (earned != 0) {
+    limit->tokens += earned;
+    limit->last += earned * pdMS_TO_TICKS(CONFIG_MQTTLOG_RATE_INTERVAL);
+  }
+  if (limit->tokens == 0) {
+    state.msgs_limited++;
+    return false;
+  }
+  limit->tokens--;
+  return true;
+}
+
+/**
+ * @brief Reserve a ring buffer slot, dropping the oldest messages for room
+ *
+ * Only messages of the same class are dropped. Nothing is printed, drops are
+ * counted and reported once the queue drains.
+ *
+ * @return The slot, NULL if the message was dropped instead
+ */
+static void *mqttlog_acquire(mqttlog_class_t class, size_t len) {
+  RingbufHandle_t ring_buffer = state.ring_buffers[class];
+  void *rb_msg;
   size_t msg_size;
 
-  buffered_msg =
-      (mqttmgr_msg_t *)xRingbufferReceive(state.ring_buffer, &msg_size, 0);
-  if (buffered_msg == NULL) {
-    ESP_LOGE(TAG, "Expected msg but failed to receive!");
-    return ESP_FAIL;
+  if (len > xRingbufferGetMaxItemSize(ring_buffer)) {
+    state.msgs_discarded[class]++;
+    return NULL;
+  }
+  while (pdTRUE != xRingbufferSendAcquire(ring_buffer, &rb_msg, len, 0)) {
+    rb_msg = xRingbufferReceive(ring_buffer, &msg_size, 0);
+    if (rb_msg == NULL) {
+      // Whatever is left is being sent, drop the new message
+      state.msgs_discarded[class]++;
+      return NULL;
+    }
+    vRingbufferReturnItem(ring_buffer, rb_msg);
+    state.msgs_discarded[class]++;
+  }
+  return rb_msg;
+}
+
+/**
+ * @brief Receive the oldest message of the most severe class queued
+ */
+static void *mqttlog_receive(mqttlog_class_t *class, size_t *len) {
+  void *rb_msg;
+
+  for (*class = 0; *class < MQTTLOG_CLASS_MAX; (*class)++) {
+    rb_msg = xRingbufferReceive(state.ring_buffers[*class], len, 0);
+    if (rb_msg != NULL) {
+      return rb_msg;
+    }
   }
-  ESP_LOGW(TAG, "Dropping msg: %s", (char *)buffered_msg->msg);
-  vRingbufferReturnItem(state.ring_buffer, buffered_msg);
+  return NULL;
+}
+
+/**
+ * @brief Log what was dropped since the last report
+ */
+static void mqttlog_report_dropped() {
+  uint_fast16_t discarded[MQTTLOG_CLASS_MAX], discarded_cnt = 0, limited;
+  mqttlog_class_t class;
+
+  for (class = 0; class < MQTTLOG_CLASS_MAX; class++) {
+    discarded[class] = atomic_exchange(&state.msgs_discarded[class], 0);
+    discarded_cnt += discarded[class];
+  }
+  limited = atomic_exchange(&state.msgs_limited, 0);
+  if (discarded_cnt == 0 && limited == 0) {
+    return;
+  }
+  MQTTLOG_LOGW(TAG, "Messages dropped from queue",
+               MQTTLOG_UINT("message_count", discarded_cnt),
+               MQTTLOG_UINT("error", discarded[MQTTLOG_CLASS_ERROR]),
+               MQTTLOG_UINT("warn", discarded[MQTTLOG_CLASS_WARN]),
+               MQTTLOG_UINT("info", discarded[MQTTLOG_CLASS_INFO]),
+               MQTTLOG_UINT("rate_limited", limited));
+}
+
+#if CONFIG_MQTTLOG_BINARY
+/**
+ * @brief Encode a log message straight into a ring buffer slot
+ *
+ * Encoded twice, once to size the slot and once into it, so logging never
+ * touches the heap. The console still gets the JSON.
+ */
+esp_err_t mqttlog_log_render(const char *tag, esp_log_level_t level,
+                             const char *event, const mqttlog_tag_t *tags,
+                             size_t tag_cnt) {
+  mqttlog_class_t class = mqttlog_level_to_class(level);
+  uint8_t *record;
+  time_t now;
+  size_t record_len;
+  char console[MQTTLOG_CONSOLE_LEN];
+
+  time(&now);
+  mqttlog_render(console, sizeof(console), now, tag,
+                 mqtt_log_level_to_str(level), event, tags, tag_cnt);
+  ESP_LOG_LEVEL_LOCAL(level, tag, "%s", console);
+  record_len = mqttlog_record_encode(NULL, 0, now, tag, level, event, tags,
+                                     tag_cnt);
+  record = mqttlog_acquire(class, record_len);
+  if (record == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  mqttlog_record_encode(record, record_len, now, tag, level, event, tags,
+                        tag_cnt);
+  xRingbufferSendComplete(state.ring_buffers[class], record);
+  xTaskNotifyGive(state.task_logsend);
 
-  state.msgs_discarded++;
   return ESP_OK;
 }
 
-static esp_err_t mqttlog_queue_msg(char *msg) {
-  mqttmgr_msg_t *rb_msg;
-  size_t msg_len = strlen(msg);
-
-  while (pdTRUE != xRingbufferSendAcquire(state.ring_buffer, (void **)&rb_msg,
-                                          sizeof(mqttmgr_msg_t) + msg_len, 0)) {
-    ESP_LOGW(TAG, "Log buffer full... dropping oldest and retrying");
-    switch (mqttlog_drop_msg()) {
-      case ESP_OK:
-      case ESP_ERR_NO_MEM:
+static void mqttlog_task_logsend(void *pvParm) {
+  uint8_t *record = NULL;  // Received, not sent yet
+  mqttlog_class_t class;
+  size_t record_len, batch_len;
+  mqttmgr_msg_t *msg;
+  time_t prev;
+
+  ESP_LOGI(TAG, "Starting %s", MQTTLOG_TASK_LOGSEND_NAME);
+  while (true) {
+    // Wait for the queue_msg function to notify
+    xTaskNotifyWait(0, UINT32_MAX, NULL, portMAX_DELAY);
+
+    while (true) {
+      // If we're not connected to MQTT, then we can't really send messages
+      xEventGroupWaitBits(mqttmgr_events, MQTTMGR_CLIENT_CONNECTED_BIT, pdFALSE,
+                          pdTRUE, portMAX_DELAY);
+      mqttlog_report_dropped();
+      if (record == NULL) {
+        record = mqttlog_receive(&class, &record_len);
+      }
+      if (record == NULL) {
+        // No message means we've drained the queue, wait for notify
         break;
-      case ESP_FAIL:
-      default:
-        ESP_LOGE(TAG, "Error dropping message from buffer!");
-        abort();
+      }
+      batch_len = mqttmgr_msg_max_len();
+      if (batch_len > MQTTLOG_BATCH_LEN) {
+        batch_len = MQTTLOG_BATCH_LEN;
+      }
+      if (ESP_OK != mqttmgr_acquiremsg(MQTTMGR_TOPIC_LOG, batch_len, &msg,
+                                       portMAX_DELAY)) {
+        ESP_LOGE(TAG, "Dropping %u byte record on the floor", record_len);
+        state.msgs_discarded[class]++;
+        vRingbufferReturnItem(state.ring_buffers[class], record);
+        record = NULL;
+        continue;
+      }
+      // Batch records till one doesn't fit, it starts the next message
+      msg->len = mqttlog_record_batch_start(msg->msg, &prev);
+      while (record != NULL &&
+             mqttlog_record_batch_add(msg->msg, batch_len, &msg->len, &prev,
+                                      record, record_len)) {
+        vRingbufferReturnItem(state.ring_buffers[class], record);
+        record = mqttlog_receive(&class, &record_len);
+      }
+      if (msg->len == 1) {
+        ESP_LOGE(TAG, "Dropping %u byte record, too long", record_len);
+        state.msgs_discarded[class]++;
+        vRingbufferReturnItem(state.ring_buffers[class], record);
+        record = NULL;
+        msg->len = 0;  // Discards the slot
+      }
+      mqttmgr_commitmsg(msg);
     }
   }
+}
+#else
+/**
+ * @brief Render a log message straight into a ring buffer slot
+ *
+ * The message is rendered twice, once to size the slot and once into it, so
+ * logging never touches the heap.
+ */
+esp_err_t mqttlog_log_render(const char *tag, esp_log_level_t level,
+                             const char *event, const mqttlog_tag_t *tags,
+                             size_t tag_cnt) {
+  mqttlog_class_t class = mqttlog_level_to_class(level);
+  mqttmgr_msg_t *rb_msg;
+  time_t now;
+  size_t msg_len;
+
+  time(&now);
+  msg_len = mqttlog_render(NULL, 0, now, tag, mqtt_log_level_to_str(level),
+                           event, tags, tag_cnt);
+  // With room for the NUL, only the first msg_len bytes are sent
+  rb_msg = mqttlog_acquire(class, sizeof(mqttmgr_msg_t) + msg_len + 1);
+  if (rb_msg == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
   *rb_msg = (mqttmgr_msg_t){
       .len = msg_len,
       .topic = MQTTMGR_TOPIC_LOG,
   };
-  memcpy(rb_msg->msg, msg, msg_len);
-  xRingbufferSendComplete(state.ring_buffer, rb_msg);
+  mqttlog_render((char *)rb_msg->msg, msg_len + 1, now, tag,
+                 mqtt_log_level_to_str(level), event, tags, tag_cnt);
+  ESP_LOG_LEVEL_LOCAL(level, tag, "%s", (char *)rb_msg->msg);
+  xRingbufferSendComplete(state.ring_buffers[class], rb_msg);
   xTaskNotifyGive(state.task_logsend);
 
   return ESP_OK;
@@ -84,25 +291,21 @@ static esp_err_t mqttlog_queue_msg(char *msg) {
 
 static void mqttlog_task_logsend(void *pvParm) {
   mqttmgr_msg_t *buffered_msg;
+  mqttlog_class_t class;
   size_t msg_size;
 
   ESP_LOGI(TAG, "Starting %s", MQTTLOG_TASK_LOGSEND_NAME);
   while (true) {
     // Wait for the queue_msg function to notify
-    xTaskNotifyWait(0, ULONG_MAX, NULL, portMAX_DELAY);
+    xTaskNotifyWait(0, UINT32_MAX, NULL, portMAX_DELAY);
 
     while (true) {
       // If we're not connected to MQTT, then we can't really send messages
       xEventGroupWaitBits(mqttmgr_events, MQTTMGR_CLIENT_CONNECTED_BIT, pdFALSE,
                           pdTRUE, portMAX_DELAY);
-      if (state.msgs_discarded != 0) {
-        MQTTLOG_LOGW(TAG, "Messages dropped from queue", "message_count=%u",
-                     state.msgs_discarded);
-        state.msgs_discarded = 0;
-      }
-      // Dequeue ring buffer till empty or timeout
-      buffered_msg =
-          (mqttmgr_msg_t *)xRingbufferReceive(state.ring_buffer, &msg_size, 0);
+      mqttlog_report_dropped();
+      // Dequeue ring buffers till empty
+      buffered_msg = mqttlog_receive(&class, &msg_size);
       if (buffered_msg == NULL) {
         // No message means we've drained the queue, wait for notify
         break;
@@ -111,91 +314,18 @@ static void mqttlog_task_logsend(void *pvParm) {
                                      buffered_msg->msg, portMAX_DELAY)) {
         ESP_LOGE(TAG, "Dropping message on the floor: %s",
                  (char *)buffered_msg->msg);
-        state.msgs_discarded++;
+        state.msgs_discarded[class]++;
       }
-      vRingbufferReturnItem(state.ring_buffer, buffered_msg);
+      vRingbufferReturnItem(state.ring_buffers[class], buffered_msg);
     }
   }
 }
-
-esp_err_t mqttlog_log_render(const char *tag, esp_log_level_t level,
-                             const char *event, const char *tag_format, ...) {
-  esp_err_t ret;
-  va_list args;
-  cJSON *json, *tags;
-  time_t now;
-  char *token = NULL, *sub_token = NULL, *tag_name = NULL;
-  char *token_state = NULL, *sub_token_state = NULL, local_tag_format[256];
-  char *json_rendered, timestamp[32];
-
-  strncpy(local_tag_format, tag_format, sizeof(local_tag_format));
-
-  // create json with tag, level and event msg
-  json = cJSON_CreateObject();
-  time(&now);
-  MQTTLOG_ISO8601(now, timestamp);
-  cJSON_AddStringToObject(json, "timestamp", timestamp);
-  cJSON_AddStringToObject(json, "source", tag);
-  cJSON_AddStringToObject(json, "level", mqtt_log_level_to_str(level));
-  cJSON_AddStringToObject(json, "event", event);
-  cJSON_AddItemToObject(json, "tags", tags = cJSON_CreateObject());
-
-  // render tag data into json
-  va_start(args, tag_format);
-
-  token = strtok_r(local_tag_format, " ", &token_state);
-  while (token != NULL) {
-    tag_name = strtok_r(token, "=", &sub_token_state);
-    sub_token = strtok_r(NULL, "=", &sub_token_state);
-    if (*sub_token != '%') {
-      cJSON_AddStringToObject(tags, tag_name, sub_token);
-      token = strtok_r(NULL, " ", &token_state);
-      continue;
-    }
-    sub_token++;
-    switch (*sub_token) {
-      case 's':
-      case 'S':
-        cJSON_AddStringToObject(tags, tag_name, va_arg(args, char *));
-        break;
-      case 'b':
-      case 'B':
-        cJSON_AddBoolToObject(tags, tag_name, (bool)va_arg(args, int));
-        break;
-      case 'i':
-      case 'I':
-        cJSON_AddNumberToObject(tags, tag_name, va_arg(args, long));
-        break;
-      case 'u':
-      case 'U':
-        cJSON_AddNumberToObject(tags, tag_name, va_arg(args, ulong));
-        break;
-      case 'l':
-      case 'L':
-        cJSON_AddNumberToObject(tags, tag_name, va_arg(args, long long));
-        break;
-      case 'F':
-      case 'f':
-        cJSON_AddNumberToObject(tags, tag_name, va_arg(args, double));
-        break;
-      default:
-        ESP_LOGE(TAG, "Unknown format string: '%s' in %s", sub_token,
-                 tag_format);
-        abort();
-    }
-    token = strtok_r(NULL, " ", &token_state);
-  }
-  va_end(args);
-  json_rendered = cJSON_PrintUnformatted(json);
-  ESP_LOG_LEVEL_LOCAL(level, tag, "%s", json_rendered);
-  cJSON_Delete(json);
-
-  ret = mqttlog_queue_msg(json_rendered);
-  free(json_rendered);
-  return ret;
-}
+#endif
 
 esp_err_t mqttlog_init() {
+  const size_t shares[MQTTLOG_CLASS_MAX] = MQTTLOG_RINBUFFER_SHARES;
+  mqttlog_class_t class;
+
   if (state.initialized) {
     ESP_LOGE(TAG, "Attempt to re-initalize mqttlog");
     abort();
@@ -203,10 +333,15 @@ esp_err_t mqttlog_init() {
 
   state = (state_t){
       .initialized = true,
-      .msgs_discarded = 0,
-      .ring_buffer =
-          xRingbufferCreate(MQTTLOG_RINBUFFER_SIZE, RINGBUF_TYPE_NOSPLIT),
   };
+  for (class = 0; class < MQTTLOG_CLASS_MAX; class++) {
+    state.ring_buffers[class] = xRingbufferCreate(
+        MQTTLOG_RINBUFFER_SIZE / 4 * shares[class], RINGBUF_TYPE_NOSPLIT);
+    if (state.ring_buffers[class] == NULL) {
+      ESP_LOGE(TAG, "Failed to create ring buffer");
+      return ESP_FAIL;
+    }
+  }
 
   if (pdPASS != xTaskCreate(mqttlog_task_logsend, MQTTLOG_TASK_LOGSEND_NAME,
                             MQTTLOG_TASK_LOGSEND_STACKSIZE, (void *)1,
@@ -214,9 +349,5 @@ esp_err_t mqttlog_init() {
     ESP_LOGE(TAG, "Error starting %s", MQTTLOG_TASK_LOGSEND_NAME);
     abort();
   }
-  if (state.ring_buffer == NULL) {
-    ESP_LOGE(TAG, "Failed to create ring buffer");
-    return ESP_FAIL;
-  }
   return ESP_OK;
 }
@@ -1,31 +1,56 @@
 #ifndef MQTTLOG_H
 #define MQTTLOG_H
 
-#include <cJSON.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
 #include <sdkconfig.h>
 
+#include "mqttlog_render.h"
+
+// Token bucket of a MQTTLOG_LOG* call site
+typedef struct {
+  bool started;
+  uint16_t tokens;
+  TickType_t last;  // Tick the last token was earned
+} mqttlog_limit_t;
+
 esp_err_t mqttlog_init();
 esp_err_t mqttlog_log_render(const char *tag, esp_log_level_t level,
-                             const char *event, const char *tag_format, ...);
-
-#define MQTTLOG_LOGE(tag, event, tag_format, ...) \
-  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_ERROR, tag, event, tag_format, ##__VA_ARGS__)
-#define MQTTLOG_LOGW(tag, event, tag_format, ...) \
-  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_WARN, tag, event, tag_format, ##__VA_ARGS__)
-#define MQTTLOG_LOGI(tag, event, tag_format, ...) \
-  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_INFO, tag, event, tag_format, ##__VA_ARGS__)
-#define MQTTLOG_LOGD(tag, event, tag_format, ...) \
-  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG, tag, event, tag_format, ##__VA_ARGS__)
-#define MQTTLOG_LOGV(tag, event, tag_format, ...)                  \
-  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, tag, event, tag_format, \
-                          ##__VA_ARGS__)
-
-#define MQTTLOG_LOG_LEVEL_LOCAL(level, tag, event, tag_format, ...)     \
-  do {                                                                  \
-    if (LOG_LOCAL_LEVEL >= level)                                       \
-      mqttlog_log_render(tag, level, event, tag_format, ##__VA_ARGS__); \
+                             const char *event, const mqttlog_tag_t *tags,
+                             size_t tag_cnt);
+
+/**
+ * @brief Take a message from the rate limit of a call site
+ *
+ * A call site may log CONFIG_MQTTLOG_RATE_BURST messages at once and earns
+ * one back every CONFIG_MQTTLOG_RATE_INTERVAL ms. Messages over the limit are
+ * counted and skipped, console output included.
+ *
+ * @return Whether the message may be logged
+ */
+bool mqttlog_limit_take(mqttlog_limit_t *limit);
+
+// Tags are given as MQTTLOG_STR("file", f_name), MQTTLOG_UINT("offset", n)...
+#define MQTTLOG_LOGE(tag, event, ...) \
+  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_ERROR, tag, event, ##__VA_ARGS__)
+#define MQTTLOG_LOGW(tag, event, ...) \
+  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_WARN, tag, event, ##__VA_ARGS__)
+#define MQTTLOG_LOGI(tag, event, ...) \
+  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_INFO, tag, event, ##__VA_ARGS__)
+#define MQTTLOG_LOGD(tag, event, ...) \
+  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG, tag, event, ##__VA_ARGS__)
+#define MQTTLOG_LOGV(tag, event, ...) \
+  MQTTLOG_LOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, tag, event, ##__VA_ARGS__)
+
+#define MQTTLOG_LOG_LEVEL_LOCAL(level, tag, event, ...)                     \
+  do {                                                                      \
+    static mqttlog_limit_t mqttlog_limit_;                                  \
+    if (LOG_LOCAL_LEVEL >= level && mqttlog_limit_take(&mqttlog_limit_)) {  \
+      const mqttlog_tag_t mqttlog_tags_[] = {__VA_ARGS__};                  \
+      mqttlog_log_render(tag, level, event, mqttlog_tags_,                  \
+                         sizeof(mqttlog_tags_) / sizeof(mqttlog_tags_[0])); \
+    }                                                                       \
   } while (0)
 
 #define MQTTLOG_ISO8601(timestamp, charbuff)            \
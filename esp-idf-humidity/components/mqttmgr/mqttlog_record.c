@@ -0,0 +1,153 @@
+#include "mqttlog_record.h"
+
+#include <string.h>
+
+#define MQTTLOG_RECORD_FNV_OFFSET 2166136261u
+#define MQTTLOG_RECORD_FNV_PRIME 16777619u
+// Longest varint of a 64 bit value
+#define MQTTLOG_RECORD_VARINT_MAX 10
+
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  size_t len;  // Of the whole record, may be more than fits buf
+} mqttlog_record_writer_t;
+
+uint32_t mqttlog_record_hash(const char *s) {
+  uint32_t hash = MQTTLOG_RECORD_FNV_OFFSET;
+
+  for (; s != NULL && *s != '\0'; s++) {
+    hash = (hash ^ (uint8_t)*s) * MQTTLOG_RECORD_FNV_PRIME;
+  }
+  return hash;
+}
+
+static uint64_t mqttlog_record_zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static void mqttlog_record_put(mqttlog_record_writer_t *w, const void *data,
+                               size_t len) {
+  if (w->len + len <= w->size) {
+    memcpy(w->buf + w->len, data, len);
+  }
+  w->len += len;
+}
+
+static void mqttlog_record_put_u8(mqttlog_record_writer_t *w, uint8_t value) {
+  mqttlog_record_put(w, &value, 1);
+}
+
+static void mqttlog_record_put_u32(mqttlog_record_writer_t *w,
+                                   uint32_t value) {
+  uint8_t le[4] = {value, value >> 8, value >> 16, value >> 24};
+
+  mqttlog_record_put(w, le, sizeof(le));
+}
+
+/**
+ * @brief LEB128, returns its length
+ */
+static size_t mqttlog_record_varint(uint8_t *buf, uint64_t value) {
+  size_t len = 0;
+
+  do {
+    buf[len] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+    value >>= 7;
+    len++;
+  } while (value != 0);
+  return len;
+}
+
+static void mqttlog_record_put_varint(mqttlog_record_writer_t *w,
+                                      uint64_t value) {
+  uint8_t varint[MQTTLOG_RECORD_VARINT_MAX];
+
+  mqttlog_record_put(w, varint, mqttlog_record_varint(varint, value));
+}
+
+static void mqttlog_record_put_tag(mqttlog_record_writer_t *w,
+                                   const mqttlog_tag_t *tag) {
+  size_t len;
+
+  mqttlog_record_put_u32(w, mqttlog_record_hash(tag->key));
+  mqttlog_record_put_u8(w, tag->type);
+  switch (tag->type) {
+    case MQTTLOG_TAG_STR:
+      len = tag->s != NULL ? strnlen(tag->s, MQTTLOG_RECORD_STR_MAX) : 0;
+      mqttlog_record_put_varint(w, len);
+      mqttlog_record_put(w, tag->s, len);
+      break;
+    case MQTTLOG_TAG_BOOL:
+      mqttlog_record_put_u8(w, tag->b);
+      break;
+    case MQTTLOG_TAG_INT:
+      mqttlog_record_put_varint(w, mqttlog_record_zigzag(tag->i));
+      break;
+    case MQTTLOG_TAG_UINT:
+      mqttlog_record_put_varint(w, tag->u);
+      break;
+    case MQTTLOG_TAG_INT64:
+      mqttlog_record_put_varint(w, mqttlog_record_zigzag(tag->l));
+      break;
+    case MQTTLOG_TAG_FLOAT:
+      // Same byte order as the integers on the little-endian targets
+      mqttlog_record_put(w, &tag->f, sizeof(tag->f));
+      break;
+  }
+}
+
+size_t mqttlog_record_encode(uint8_t *buf, size_t size, time_t now,
+                             const char *source, uint8_t level,
+                             const char *event, const mqttlog_tag_t *tags,
+                             size_t tag_cnt) {
+  mqttlog_record_writer_t w = {.buf = buf, .size = size, .len = 0};
+  size_t idx;
+
+  if (tag_cnt > UINT8_MAX) {
+    tag_cnt = UINT8_MAX;
+  }
+  mqttlog_record_put_varint(&w, mqttlog_record_zigzag(now));
+  mqttlog_record_put_u8(&w, level);
+  mqttlog_record_put_u32(&w, mqttlog_record_hash(source));
+  mqttlog_record_put_u32(&w, mqttlog_record_hash(event));
+  mqttlog_record_put_u8(&w, tag_cnt);
+  for (idx = 0; idx < tag_cnt; idx++) {
+    mqttlog_record_put_tag(&w, &tags[idx]);
+  }
+  return w.len;
+}
+
+size_t mqttlog_record_batch_start(uint8_t *buf, time_t *prev) {
+  buf[0] = MQTTLOG_RECORD_VERSION;
+  *prev = 0;
+  return 1;
+}
+
+bool mqttlog_record_batch_add(uint8_t *buf, size_t size, size_t *len,
+                              time_t *prev, const uint8_t *record,
+                              size_t record_len) {
+  uint8_t delta[MQTTLOG_RECORD_VARINT_MAX];
+  size_t delta_len, ts_len = 0;
+  uint64_t zigzag = 0;
+  int64_t timestamp;
+
+  // Swap the timestamp for its delta, the rest is copied as is
+  do {
+    if (ts_len == record_len || ts_len == MQTTLOG_RECORD_VARINT_MAX) {
+      return false;  // Not a record
+    }
+    zigzag |= (uint64_t)(record[ts_len] & 0x7F) << (7 * ts_len);
+  } while (record[ts_len++] & 0x80);
+  timestamp = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+  delta_len =
+      mqttlog_record_varint(delta, mqttlog_record_zigzag(timestamp - *prev));
+  if (*len + delta_len + record_len - ts_len > size) {
+    return false;
+  }
+  memcpy(buf + *len, delta, delta_len);
+  memcpy(buf + *len + delta_len, record + ts_len, record_len - ts_len);
+  *len += delta_len + record_len - ts_len;
+  *prev = timestamp;
+  return true;
+}
@@ -0,0 +1,96 @@
+#ifndef MQTTLOG_RECORD_H
+#define MQTTLOG_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mqttlog_render.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary log records, a compact stand-in for the JSON of mqttlog_render.h
+ *
+ * Strings fixed at build time, the source, event and tag keys, are sent as
+ * the 32 bit FNV-1a hash of the string. They are string literals at the
+ * MQTTLOG_LOG* call sites, test/utils/mqttlog_decode.py hashes the literals
+ * of the firmware sources to turn them back into today's JSON.
+ *
+ * Record, integers little-endian, varints LEB128
+ *   varint   timestamp  Zigzag, Unix time when queued, delta from the previous
+ *                       record of the message once batched
+ *   uint8_t  level      esp_log_level_t
+ *   uint32_t source     Hash
+ *   uint32_t event      Hash
+ *   uint8_t  tag_cnt
+ *   tags[tag_cnt]
+ *     uint32_t key      Hash
+ *     uint8_t  type     mqttlog_tag_type_t
+ *     value             STR: varint length and the bytes, BOOL: uint8_t,
+ *                       INT and INT64: zigzag varint, UINT: varint,
+ *                       FLOAT: double
+ *
+ * Message
+ *   uint8_t  version    MQTTLOG_RECORD_VERSION
+ *   records back to back
+ */
+
+#define MQTTLOG_RECORD_VERSION 1
+// Longest string value kept, longer ones are cut short
+#define MQTTLOG_RECORD_STR_MAX 64
+
+/**
+ * @brief 32 bit FNV-1a hash a string is sent as
+ */
+uint32_t mqttlog_record_hash(const char *s);
+
+/**
+ * @brief Encode a log message as a record
+ *
+ * @param buf     Written up to size bytes, may be NULL when size is 0
+ * @param size    Of buf
+ * @param now     Wall clock time of the message
+ * @param source  Logging module
+ * @param level   esp_log_level_t of the message
+ * @param event   What happened
+ * @param tags    Of the message, at most 255
+ * @param tag_cnt Of tags
+ * @return Length of the whole record, it was cut short if that's over size
+ */
+size_t mqttlog_record_encode(uint8_t *buf, size_t size, time_t now,
+                             const char *source, uint8_t level,
+                             const char *event, const mqttlog_tag_t *tags,
+                             size_t tag_cnt);
+
+/**
+ * @brief Start a message of records
+ *
+ * @param buf  At least 1 byte
+ * @param prev Timestamp the next record is a delta from
+ * @return Length of the message so far
+ */
+size_t mqttlog_record_batch_start(uint8_t *buf, time_t *prev);
+
+/**
+ * @brief Add a record from mqttlog_record_encode to a message
+ *
+ * @param buf        Message
+ * @param size       Of buf
+ * @param len        Of the message, moved past the record
+ * @param prev       Timestamp of the last record added
+ * @param record     Encoded record
+ * @param record_len Of record
+ * @return Whether the record fit, the message is left alone when it didn't
+ */
+bool mqttlog_record_batch_add(uint8_t *buf, size_t size, size_t *len,
+                              time_t *prev, const uint8_t *record,
+                              size_t record_len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
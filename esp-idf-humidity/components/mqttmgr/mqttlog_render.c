@@ -0,0 +1,166 @@
+#include "mqttlog_render.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;  // Of the whole message, may be more than fits buf
+} mqttlog_writer_t;
+
+static void mqttlog_put_char(mqttlog_writer_t *w, char c) {
+  if (w->len + 1 < w->size) {
+    w->buf[w->len] = c;
+    w->buf[w->len + 1] = '\0';
+  }
+  w->len++;
+}
+
+static void mqttlog_put_fmt(mqttlog_writer_t *w, const char *fmt, ...) {
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  if (w->len < w->size) {
+    len = vsnprintf(w->buf + w->len, w->size - w->len, fmt, args);
+  } else {
+    len = vsnprintf(NULL, 0, fmt, args);
+  }
+  va_end(args);
+  w->len += len > 0 ? len : 0;
+}
+
+/**
+ * @brief Quoted JSON string, escaped like cJSON does
+ */
+static void mqttlog_put_str(mqttlog_writer_t *w, const char *s) {
+  mqttlog_put_char(w, '"');
+  for (; s != NULL && *s != '\0'; s++) {
+    switch (*s) {
+      case '"':
+      case '\\':
+        mqttlog_put_char(w, '\\');
+        mqttlog_put_char(w, *s);
+        break;
+      case '\b':
+        mqttlog_put_fmt(w, "\\b");
+        break;
+      case '\f':
+        mqttlog_put_fmt(w, "\\f");
+        break;
+      case '\n':
+        mqttlog_put_fmt(w, "\\n");
+        break;
+      case '\r':
+        mqttlog_put_fmt(w, "\\r");
+        break;
+      case '\t':
+        mqttlog_put_fmt(w, "\\t");
+        break;
+      default:
+        if ((unsigned char)*s < ' ') {
+          mqttlog_put_fmt(w, "\\u%04x", (unsigned char)*s);
+        } else {
+          mqttlog_put_char(w, *s);
+        }
+    }
+  }
+  mqttlog_put_char(w, '"');
+}
+
+/**
+ * @brief Shortest of 15 or 17 digits that reads back the same, like cJSON
+ */
+static void mqttlog_put_double(mqttlog_writer_t *w, double value) {
+  char digits[32];
+
+  if (isnan(value) || isinf(value)) {
+    mqttlog_put_fmt(w, "null");
+    return;
+  }
+  snprintf(digits, sizeof(digits), "%1.15g", value);
+  if (strtod(digits, NULL) != value) {
+    snprintf(digits, sizeof(digits), "%1.17g", value);
+  }
+  mqttlog_put_fmt(w, "%s", digits);
+}
+
+/**
+ * @brief Decimal int64, newlib nano printf has no %lld
+ */
+static void mqttlog_put_int64(mqttlog_writer_t *w, int64_t value) {
+  char digits[20];  // Without the sign
+  size_t len = 0;
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+  do {
+    digits[len++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    mqttlog_put_char(w, '-');
+  }
+  while (len != 0) {
+    mqttlog_put_char(w, digits[--len]);
+  }
+}
+
+static void mqttlog_put_tag(mqttlog_writer_t *w, const mqttlog_tag_t *tag) {
+  mqttlog_put_str(w, tag->key);
+  mqttlog_put_char(w, ':');
+  switch (tag->type) {
+    case MQTTLOG_TAG_STR:
+      mqttlog_put_str(w, tag->s);
+      break;
+    case MQTTLOG_TAG_BOOL:
+      mqttlog_put_fmt(w, tag->b ? "true" : "false");
+      break;
+    case MQTTLOG_TAG_INT:
+      mqttlog_put_fmt(w, "%ld", tag->i);
+      break;
+    case MQTTLOG_TAG_UINT:
+      mqttlog_put_fmt(w, "%lu", tag->u);
+      break;
+    case MQTTLOG_TAG_INT64:
+      mqttlog_put_int64(w, tag->l);
+      break;
+    case MQTTLOG_TAG_FLOAT:
+      mqttlog_put_double(w, tag->f);
+      break;
+    default:
+      mqttlog_put_fmt(w, "null");
+  }
+}
+
+size_t mqttlog_render(char *buf, size_t size, time_t now, const char *source,
+                      const char *level, const char *event,
+                      const mqttlog_tag_t *tags, size_t tag_cnt) {
+  mqttlog_writer_t w = {.buf = buf, .size = size, .len = 0};
+  struct tm now_tm;
+  char timestamp[32];
+  size_t idx;
+
+  if (size != 0) {
+    buf[0] = '\0';
+  }
+  gmtime_r(&now, &now_tm);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &now_tm);
+  mqttlog_put_fmt(&w, "{\"timestamp\":\"%s\",\"source\":", timestamp);
+  mqttlog_put_str(&w, source);
+  mqttlog_put_fmt(&w, ",\"level\":");
+  mqttlog_put_str(&w, level);
+  mqttlog_put_fmt(&w, ",\"event\":");
+  mqttlog_put_str(&w, event);
+  mqttlog_put_fmt(&w, ",\"tags\":{");
+  for (idx = 0; idx < tag_cnt; idx++) {
+    if (idx != 0) {
+      mqttlog_put_char(&w, ',');
+    }
+    mqttlog_put_tag(&w, &tags[idx]);
+  }
+  mqttlog_put_fmt(&w, "}}");
+  return w.len;
+}
@@ -0,0 +1,83 @@
+#ifndef MQTTLOG_RENDER_H
+#define MQTTLOG_RENDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Log messages as JSON, without building a cJSON tree
+ *
+ *   {"timestamp":"2022-04-15T05:20:00Z","source":"sensormgr","level":"INFO",
+ *    "event":"clock synced","tags":{"boot_ms":1834}}
+ *
+ * Tags are typed at the call site with the MQTTLOG_<type> macros, so nothing
+ * is parsed while logging. A message is written straight into the buffer it
+ * is sent from, snprintf style: rendering into a NULL buffer first tells how
+ * large that buffer has to be.
+ */
+
+typedef enum {
+  MQTTLOG_TAG_STR,
+  MQTTLOG_TAG_BOOL,
+  MQTTLOG_TAG_INT,
+  MQTTLOG_TAG_UINT,
+  MQTTLOG_TAG_INT64,
+  MQTTLOG_TAG_FLOAT,
+} mqttlog_tag_type_t;
+
+typedef struct {
+  const char *key;
+  mqttlog_tag_type_t type;
+  union {
+    const char *s;
+    bool b;
+    long i;
+    unsigned long u;
+    long long l;
+    double f;
+  };
+} mqttlog_tag_t;
+
+// Tags of a log message, replace the "key=%s" ... tag formats
+#define MQTTLOG_STR(key, value) \
+  ((mqttlog_tag_t){(key), MQTTLOG_TAG_STR, {.s = (value)}})
+#define MQTTLOG_BOOL(key, value) \
+  ((mqttlog_tag_t){(key), MQTTLOG_TAG_BOOL, {.b = (value)}})
+#define MQTTLOG_INT(key, value) \
+  ((mqttlog_tag_t){(key), MQTTLOG_TAG_INT, {.i = (value)}})
+#define MQTTLOG_UINT(key, value) \
+  ((mqttlog_tag_t){(key), MQTTLOG_TAG_UINT, {.u = (value)}})
+#define MQTTLOG_INT64(key, value) \
+  ((mqttlog_tag_t){(key), MQTTLOG_TAG_INT64, {.l = (value)}})
+#define MQTTLOG_FLOAT(key, value) \
+  ((mqttlog_tag_t){(key), MQTTLOG_TAG_FLOAT, {.f = (value)}})
+
+/**
+ * @brief Render a log message as JSON
+ *
+ * @param buf     Written up to size bytes, always NUL terminated, may be NULL
+ *                when size is 0
+ * @param size    Of buf
+ * @param now     Wall clock time of the message
+ * @param source  Logging module
+ * @param level   Name of the log level
+ * @param event   What happened
+ * @param tags    Of the message, in order
+ * @param tag_cnt Of tags
+ * @return Length of the whole message, without the NUL, it was cut short if
+ *         that's size or more
+ */
+size_t mqttlog_render(char *buf, size_t size, time_t now, const char *source,
+                      const char *level, const char *event,
+                      const mqttlog_tag_t *tags, size_t tag_cnt);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
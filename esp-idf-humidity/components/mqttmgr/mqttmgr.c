@@ -2,119 +2,638 @@
 
 #include <backoff_algorithm.h>
 #include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/ringbuf.h>
+#include <freertos/semphr.h>
 #include <mqtt_client.h>
+#include <mqttlog.h>
+#include <nvs_flash.h>
+#include <stdatomic.h>
+#include <string.h>
 
 #define MQTT_TASK_NAME "mqtt"
 #define MQTT_TASK_STACKSIZE 4 * 1024
 #define MQTT_HANDLERS_MAX 8
+#define MQTT_BUFFER_SIZE 4096
+// Room left in the client buffer for the fixed header, topic and msg_id
+#define MQTT_PUBLISH_OVERHEAD 128
 
 #define MQTT_CLIENTWATCHER_NAME "mqtt-watcher"
 #define MQTT_CLIENTWATCHER_STACKSIZE 2 * 1024
+#define MQTT_UPLINK_NAME "mqtt-uplink"
+// How often an uplink or flush checks whether everything has been sent
+#define MQTT_UPLINK_POLL_MS 500
+
+#define MQTT_CMD_TASK_NAME "mqtt-cmd"
+// Same as the esp-mqtt task the handlers used to run on
+#define MQTT_CMD_TASK_STACKSIZE 6 * 1024
+// Longest uuid sent back with a BUSY or ERR the esp-mqtt task answers
+#define MQTT_CMD_UUID_MAX 64
+#define MQTT_CMD_REJECT_SIZE (MQTT_CMD_UUID_MAX + 16)
+
+#define MQTT_HOUR_US (60 * 60 * 1000000LL)
 
 #define MQTT_BASE_BACKOFF_SEC 60
 #define MQTT_MAX_BACKOFF 15 * 60
+// Longest to wait for an IP address before starting the MQTT client anyway
+#define MQTT_WIFI_CONNECT_TIMEOUT_MS 15 * 1000
+
+// esp-mqtt expires unacknowledged outbox entries after 30 seconds, anything
+// still in flight after this is published again from its queue slot
+#define MQTT_INFLIGHT_TIMEOUT_MS 30 * 1000
+
+#define MQTTMGR_NVS_TOPIC_POLICY_KEY "topic_policy"
 
 static const char *TAG = "mqtt";  // Logging handle name
-char topic_names[4][64];
+char topic_names[MQTTMGR_TOPIC_MAX][64];
+
+// Till changed by mqttmgr_set_topic_policy. Logs can be lost, sensor data
+// can't, and nothing is retained for the broker to rewrite on every publish.
+static const mqttmgr_topic_policy_t topic_policy_defaults[] = {
+    [MQTTMGR_TOPIC_REQUEST] = {.qos = 1, .max_inflight = 1},
+    [MQTTMGR_TOPIC_RESPONSE] = {.qos = 1, .max_inflight = 1},
+    [MQTTMGR_TOPIC_LOG] = {.qos = 0, .max_inflight = MQTTMGR_INFLIGHT_MAX},
+    [MQTTMGR_TOPIC_SENSOR] = {.qos = 1, .max_inflight = MQTTMGR_INFLIGHT_MAX},
+    [MQTTMGR_TOPIC_SENSOR_BATCH] = {.qos = 1,
+                                    .max_inflight = MQTTMGR_INFLIGHT_MAX},
+    [MQTTMGR_TOPIC_SENSOR_BACKFILL] = {.qos = 1,
+                                       .max_inflight = MQTTMGR_INFLIGHT_MAX},
+};
 
 static BackoffAlgorithmContext_t retryParams;
 
+typedef struct _mqttmgr_inflight_t {
+  mqttmgr_msg_t *msg;  // NULL when the entry is free
+  int msg_id;
+  TickType_t published_at;
+} mqttmgr_inflight_t;
+
+// A received command waiting in the command queue
+typedef struct _mqttmgr_cmd_t {
+  TickType_t received_at;
+  size_t len;
+  uint8_t data[];  // Packed CommandRequest
+} mqttmgr_cmd_t;
+
 typedef struct _mqttmgr_state_t {
   TaskHandle_t task_client_watchdog;  // TODO: Make exposed function to notify
                                       // this handler
   TaskHandle_t task_msgqueue;
   RingbufHandle_t msg_queue;
+  SemaphoreHandle_t inflight_lock;
+  mqttmgr_inflight_t inflight[MQTTMGR_INFLIGHT_MAX];
+  int early_ack;  // PUBACK that beat its msg_id into the inflight table
+  atomic_uint pending_cnt;  // Committed messages not acknowledged yet
+  bool published;  // Anything published since boot, msgqueue task only
+
+  SemaphoreHandle_t radio_lock;
+  int64_t radio_on_at;  // esp_timer time counted up to, 0 while off
+  uint32_t radio_hour;  // Hour of uptime of the hour counters
+  uint32_t radio_hour_on_ms, radio_last_hour_on_ms;
+  uint64_t radio_on_ms;
+  uint32_t uplink_cnt;
 
   time_t disabled_at;
   uint8_t retry_count;
   uint8_t json_handler_cnt;
-  uint8_t cmd_handler_cnt;
+  uint8_t cmd_case_cnt;  // Highest cmd_case + 1
   esp_mqtt_client_handle_t client;
-  cmdhandler **cmd_handlers;
+  cmdhandler **cmd_handlers;  // Indexed by cmd_case
+  TaskHandle_t task_cmd;
+  RingbufHandle_t cmd_queue;  // Of mqttmgr_cmd_t
+  atomic_uint cmd_cnt;        // Commands queued or running
+  mqttmgr_arena_t cmd_arena;  // Of the command being dispatched, cmd task only
+  SemaphoreHandle_t policy_lock;
+  mqttmgr_topic_policy_t topic_policies[MQTTMGR_TOPIC_MAX];
 } mqttmgr_state_t;
 
 static mqttmgr_state_t state;
 
-static void mqttmgr_cmd_dispatch(esp_mqtt_event_handle_t event) {
-  // Parse input command
-  // Call all handlers, exit on first handler that claims to have handled
-  // Pack up and send response cmd to CMD_RESP_IDX topic
+/**
+ * @brief Hand the queue slot of a message that is done with back
+ */
+static void mqttmgr_return_slot(mqttmgr_msg_t *msg) {
+  vRingbufferReturnItem(state.msg_queue, msg);
+  atomic_fetch_sub(&state.pending_cnt, 1);
+}
+
+/**
+ * @brief Return the queue slot of an acknowledged message
+ *
+ * Called from the esp-mqtt event task on MQTT_EVENT_PUBLISHED.
+ */
+static void mqttmgr_inflight_release(int msg_id) {
+  uint8_t i;
+  uint32_t delivered_arg = 0;
+  mqttmgr_delivered_fn *delivered = NULL;
+
+  xSemaphoreTake(state.inflight_lock, portMAX_DELAY);
+  for (i = 0; i < MQTTMGR_INFLIGHT_MAX; i++) {
+    if (state.inflight[i].msg != NULL && state.inflight[i].msg_id == msg_id) {
+      delivered = state.inflight[i].msg->delivered;
+      delivered_arg = state.inflight[i].msg->delivered_arg;
+      mqttmgr_return_slot(state.inflight[i].msg);
+      state.inflight[i].msg = NULL;
+      break;
+    }
+  }
+  if (i == MQTTMGR_INFLIGHT_MAX) {
+    state.early_ack = msg_id;
+  }
+  xSemaphoreGive(state.inflight_lock);
+  if (i < MQTTMGR_INFLIGHT_MAX) {
+    xTaskNotifyGive(state.task_msgqueue);
+  }
+  if (delivered != NULL) {
+    delivered(delivered_arg);
+  }
+}
+
+/**
+ * @brief Lowest QoS a topic can be published with
+ *
+ * Sensor topics carry readings drained from spill files. Their delivered
+ * callback checkpoints the file, so they need a PUBACK before the file can
+ * go.
+ */
+static uint8_t mqttmgr_topic_min_qos(mqttmgr_topicidx topic) {
+  switch (topic) {
+    case MQTTMGR_TOPIC_SENSOR:
+    case MQTTMGR_TOPIC_SENSOR_BATCH:
+    case MQTTMGR_TOPIC_SENSOR_BACKFILL:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static bool mqttmgr_topic_policy_valid(mqttmgr_topicidx topic,
+                                       const mqttmgr_topic_policy_t *policy) {
+  return policy->qos >= mqttmgr_topic_min_qos(topic) && policy->qos <= 2 &&
+         policy->max_inflight >= 1 &&
+         policy->max_inflight <= MQTTMGR_INFLIGHT_MAX;
+}
+
+static esp_err_t mqttmgr_nvs_set_topic_policies() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  ESP_ERROR_CHECK(nvs_open("mqttmgr", NVS_READWRITE, &my_handle));
+  xSemaphoreTake(state.policy_lock, portMAX_DELAY);
+  ret = nvs_set_blob(my_handle, MQTTMGR_NVS_TOPIC_POLICY_KEY,
+                     state.topic_policies, sizeof(state.topic_policies));
+  xSemaphoreGive(state.policy_lock);
+  if (ESP_OK != ret) {
+    ESP_LOGE(TAG, "Errors (%s) saving topic policies to NVS",
+             esp_err_to_name(ret));
+  }
+  nvs_close(my_handle);
+  return ret;
+}
+
+static void mqttmgr_nvs_get_topic_policies() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  mqttmgr_topic_policy_t policies[MQTTMGR_TOPIC_MAX];
+  size_t len = sizeof(policies);
+  unsigned i;
+  ESP_ERROR_CHECK(nvs_open("mqttmgr", NVS_READWRITE, &my_handle));
+  ret = nvs_get_blob(my_handle, MQTTMGR_NVS_TOPIC_POLICY_KEY, policies, &len);
+  switch (ret) {
+    case ESP_OK:
+      for (i = 0; len == sizeof(policies) && i < MQTTMGR_TOPIC_MAX; i++) {
+        if (!mqttmgr_topic_policy_valid(i, &policies[i])) {
+          break;
+        }
+      }
+      if (i < MQTTMGR_TOPIC_MAX) {
+        ESP_LOGW(TAG, "Topic policies in NVS don't fit, using defaults");
+        break;
+      }
+      memcpy(state.topic_policies, policies, sizeof(policies));
+      ESP_LOGI(TAG, "Topic policies read from NVS");
+      break;
+    case ESP_ERR_NVS_NOT_FOUND:
+      ESP_LOGI(TAG, "MQTTMGR_NVS_TOPIC_POLICY_KEY not set, using defaults");
+      break;
+    case ESP_ERR_NVS_INVALID_LENGTH:
+      ESP_LOGW(TAG, "Topic policies in NVS don't fit, using defaults");
+      break;
+    default:
+      ESP_LOGE(TAG, "Errors (%s) opening NVS handle", esp_err_to_name(ret));
+      break;
+  }
+  nvs_close(my_handle);
+}
+
+/**
+ * @brief Publish a packed CommandResponse
+ */
+static void mqttmgr_cmd_respond(const uint8_t *buf, size_t len) {
+  mqttmgr_topic_policy_t policy;
+
+  mqttmgr_get_topic_policy(MQTTMGR_TOPIC_RESPONSE, &policy);
+  if (esp_mqtt_client_publish(state.client,
+                              topic_names[MQTTMGR_TOPIC_RESPONSE],
+                              (const char *)buf, len, policy.qos,
+                              policy.retain) == -1) {
+    ESP_LOGE(TAG, "mqttmgr_cmd_respond - publishing failed!");
+  }
+}
+
+/**
+ * @brief Run the handler registered for the cmd_case of a request
+ *
+ * @return ret_code of the response
+ */
+static CommandResponse__RetCodeT mqttmgr_cmd_run(CommandRequest *req,
+                                                 CommandResponse *resp,
+                                                 mqttmgr_arena_t *arena) {
+  CommandResponse__RetCodeT ret_code;
+  cmdhandler *handler = NULL;
+
+  if ((unsigned)req->cmd_case < state.cmd_case_cnt) {
+    handler = state.cmd_handlers[req->cmd_case];
+  }
+  if (handler == NULL) {
+    ESP_LOGE(TAG, "mqttmgr_cmd_run - UNDEFINED HANDLER(%d)", req->cmd_case);
+    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
+  }
+  ret_code = handler(req, resp, arena);
+  switch (ret_code) {
+    case COMMAND_RESPONSE__RET_CODE_T__HANDLED:
+      break;
+    case COMMAND_RESPONSE__RET_CODE_T__ERR:
+      ESP_LOGE(TAG, "mqttmgr_cmd_run - cmd dispatch err");
+      break;
+    default:
+      ESP_LOGE(TAG, "mqttmgr_cmd_run - UNDEFINED HANDLER ERR(%d)", ret_code);
+      break;
+  }
+  return ret_code;
+}
+
+/**
+ * @brief Handler of CommandBatchRequest, runs its requests in order
+ *
+ * Returns ERR when any request wasn't HANDLED, their own ret_codes are in the
+ * batch response.
+ */
+static CommandResponse__RetCodeT mqttmgr_cmd_batch(CommandRequest *msg,
+                                                   CommandResponse *resp_out,
+                                                   mqttmgr_arena_t *arena) {
+  CommandBatchRequest *batch = msg->batch_request;
+  CommandResponse__RetCodeT ret_code = COMMAND_RESPONSE__RET_CODE_T__HANDLED;
+  CommandResponse *resps;
+  CommandRequest *req;
+  size_t i;
+
+  CommandBatchResponse *batch_resp =
+      MQTTMGR_ARENA_NEW(arena, CommandBatchResponse);
+  resps = MQTTMGR_ARENA_NEW_ARRAY(arena, CommandResponse, batch->n_requests);
+  if (batch_resp == NULL || resps == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  command_batch_response__init(batch_resp);
+  batch_resp->responses =
+      MQTTMGR_ARENA_NEW_ARRAY(arena, CommandResponse *, batch->n_requests);
+  if (batch_resp->responses == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  resp_out->resp_case = COMMAND_RESPONSE__RESP_BATCH_RESPONSE;
+  resp_out->batch_response = batch_resp;
+
+  for (i = 0; i < batch->n_requests; i++) {
+    req = batch->requests[i];
+    command_response__init(&resps[i]);
+    resps[i].uuid = req->uuid;
+    if (req->cmd_case == COMMAND_REQUEST__CMD_BATCH_REQUEST) {
+      ESP_LOGE(TAG, "mqttmgr_cmd_batch - batch in a batch");
+      resps[i].ret_code = COMMAND_RESPONSE__RET_CODE_T__ERR;
+    } else {
+      resps[i].ret_code = mqttmgr_cmd_run(req, &resps[i], arena);
+    }
+    batch_resp->responses[i] = &resps[i];
+    batch_resp->n_responses = i + 1;
+    if (resps[i].ret_code != COMMAND_RESPONSE__RET_CODE_T__HANDLED) {
+      ret_code = COMMAND_RESPONSE__RET_CODE_T__ERR;
+      if (batch->stop_on_error) {
+        ESP_LOGW(TAG, "mqttmgr_cmd_batch - stopped after %u of %u", i + 1,
+                 batch->n_requests);
+        break;
+      }
+    }
+  }
+  return ret_code;
+}
+
+/**
+ * @brief The policy of every topic as TopicPolicy messages from the arena
+ *
+ * @return The messages, NULL when the arena is full
+ */
+static Mqttmgr__TopicPolicy **mqttmgr_cmd_topic_policies(
+    mqttmgr_arena_t *arena) {
+  Mqttmgr__TopicPolicy *msgs, **ptrs;
+  mqttmgr_topic_policy_t policy;
+  unsigned i;
+
+  msgs = MQTTMGR_ARENA_NEW_ARRAY(arena, Mqttmgr__TopicPolicy,
+                                 MQTTMGR_TOPIC_MAX);
+  ptrs = MQTTMGR_ARENA_NEW_ARRAY(arena, Mqttmgr__TopicPolicy *,
+                                 MQTTMGR_TOPIC_MAX);
+  if (msgs == NULL || ptrs == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < MQTTMGR_TOPIC_MAX; i++) {
+    mqttmgr_get_topic_policy(i, &policy);
+    mqttmgr__topic_policy__init(&msgs[i]);
+    msgs[i].topic = i;
+    msgs[i].qos = policy.qos;
+    msgs[i].retain = policy.retain;
+    msgs[i].max_inflight = policy.max_inflight;
+    ptrs[i] = &msgs[i];
+  }
+  return ptrs;
+}
+
+static CommandResponse__RetCodeT mqttmgr_cmd_set_topic_policy(
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  Mqttmgr__SetTopicPolicyRequest *cmd = msg->mqttmgr_set_topic_policy_request;
+  mqttmgr_topic_policy_t policy;
+  Mqttmgr__TopicPolicy *pb;
+  size_t i;
+
+  Mqttmgr__SetTopicPolicyResponse *cmd_resp =
+      MQTTMGR_ARENA_NEW(arena, Mqttmgr__SetTopicPolicyResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  resp_out->resp_case =
+      COMMAND_RESPONSE__RESP_MQTTMGR_SET_TOPIC_POLICY_RESPONSE;
+  mqttmgr__set_topic_policy_response__init(cmd_resp);
+  resp_out->mqttmgr_set_topic_policy_response = cmd_resp;
+
+  // All or nothing, check them before changing any
+  for (i = 0; i < cmd->n_policies; i++) {
+    pb = cmd->policies[i];
+    if ((unsigned)pb->topic >= MQTTMGR_TOPIC_MAX || pb->qos > 2 ||
+        pb->qos < mqttmgr_topic_min_qos(pb->topic) || pb->max_inflight < 1 ||
+        pb->max_inflight > MQTTMGR_INFLIGHT_MAX) {
+      MQTTLOG_LOGW(TAG, "cmd_set_topic_policy failed",
+                   MQTTLOG_INT("topic", pb->topic),
+                   MQTTLOG_UINT("qos", pb->qos),
+                   MQTTLOG_UINT("max_inflight", pb->max_inflight));
+      return COMMAND_RESPONSE__RET_CODE_T__ERR;
+    }
+  }
+  for (i = 0; i < cmd->n_policies; i++) {
+    pb = cmd->policies[i];
+    policy = (mqttmgr_topic_policy_t){
+        .qos = pb->qos,
+        .retain = pb->retain,
+        .max_inflight = pb->max_inflight,
+    };
+    xSemaphoreTake(state.policy_lock, portMAX_DELAY);
+    state.topic_policies[pb->topic] = policy;
+    xSemaphoreGive(state.policy_lock);
+  }
+  if (cmd->n_policies > 0) {
+    mqttmgr_nvs_set_topic_policies();
+    // The msgqueue task may be holding a message for its in-flight limit
+    xTaskNotifyGive(state.task_msgqueue);
+  }
+
+  cmd_resp->policies = mqttmgr_cmd_topic_policies(arena);
+  if (cmd_resp->policies == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  cmd_resp->n_policies = MQTTMGR_TOPIC_MAX;
+  return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
+}
+
+static CommandResponse__RetCodeT mqttmgr_cmd_get_topic_policy(
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  Mqttmgr__GetTopicPolicyResponse *cmd_resp =
+      MQTTMGR_ARENA_NEW(arena, Mqttmgr__GetTopicPolicyResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  resp_out->resp_case =
+      COMMAND_RESPONSE__RESP_MQTTMGR_GET_TOPIC_POLICY_RESPONSE;
+  mqttmgr__get_topic_policy_response__init(cmd_resp);
+  resp_out->mqttmgr_get_topic_policy_response = cmd_resp;
+
+  cmd_resp->policies = mqttmgr_cmd_topic_policies(arena);
+  if (cmd_resp->policies == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  cmd_resp->n_policies = MQTTMGR_TOPIC_MAX;
+  return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
+}
+
+static void mqttmgr_cmd_dispatch(const mqttmgr_cmd_t *cmd) {
+  // Parse input command into the arena
+  // Run the handler registered for its cmd_case, unless it waited too long
+  // Pack up and send response cmd to CMD_RESP_IDX topic, then reset the arena
+  mqttmgr_arena_t *arena = &state.cmd_arena;
+  const TickType_t timeout = CONFIG_MQTTMGR_CMD_TIMEOUT / portTICK_PERIOD_MS;
   uint8_t *buf;
   size_t len;
-  int i;
   CommandRequest *req;
-  dealloc_cb_fn *dealloc_cb = NULL;
 
   ESP_LOGD(TAG, "mqttmgr_cmd_dispatch - parsing protobuf");
-  req = command_request__unpack(NULL, event->data_len,
-                                (const unsigned char *)(event->data));
+  req = command_request__unpack(&arena->allocator, cmd->len, cmd->data);
   if (!req) {
     ESP_LOGE(TAG, "mqttmgr_cmd_dispatch - unable to parse protobuf");
+    mqttmgr_arena_reset(arena);
     return;
   }
 
   CommandResponse resp = COMMAND_RESPONSE__INIT;
-  resp.uuid = calloc(strlen(req->uuid) + 1, sizeof(char));
-  strcpy(resp.uuid, req->uuid);
+  resp.uuid = req->uuid;  // Both live till the arena is reset
 
   ESP_LOGD(TAG, "mqttmgr_cmd_dispatch - start cmd dispatch");
-  for (i = 0; i < state.cmd_handler_cnt; i++) {
-    resp.ret_code = state.cmd_handlers[i](req, &resp, &dealloc_cb);
-    switch (resp.ret_code) {
-      case COMMAND_RESPONSE__RET_CODE_T__NOTMINE:
-        continue;
-      case COMMAND_RESPONSE__RET_CODE_T__HANDLED:
-        goto loop_exit;
-      case COMMAND_RESPONSE__RET_CODE_T__ERR:
-        ESP_LOGE(TAG, "mqttmgr_cmd_dispatch - cmd dispatch err");
-        goto loop_exit;
-      default:
-        ESP_LOGE(TAG, "mqttmgr_cmd_dispatch - UNDEFINED HANDLER ERR(%d)",
-                 resp.ret_code);
-        goto loop_exit;
+  if (xTaskGetTickCount() - cmd->received_at >= timeout) {
+    ESP_LOGW(TAG, "mqttmgr_cmd_dispatch - cmd %d queued over %ums, not run",
+             req->cmd_case, CONFIG_MQTTMGR_CMD_TIMEOUT);
+    resp.ret_code = COMMAND_RESPONSE__RET_CODE_T__TIMEOUT;
+  } else {
+    resp.ret_code = mqttmgr_cmd_run(req, &resp, arena);
+    if (xTaskGetTickCount() - cmd->received_at >= timeout) {
+      ESP_LOGW(TAG, "mqttmgr_cmd_dispatch - cmd %d answered after %ums",
+               req->cmd_case,
+               (xTaskGetTickCount() - cmd->received_at) * portTICK_PERIOD_MS);
     }
   }
-loop_exit:
-  command_request__free_unpacked(req, NULL);
-  if (resp.ret_code == COMMAND_RESPONSE__RET_CODE_T__NOTMINE) {
-    ESP_LOGE(TAG, "mqttmgr_cmd_dispatch - UNDEFINED HANDLER cmd dispatch err");
-  }
 
   ESP_LOGI(TAG, "mqttmgr_cmd_dispatch - packing response");
   len = command_response__get_packed_size(&resp);
-  ESP_LOGI(TAG, "mqttmgr_cmd_dispatch - packedlen response");
-  buf = (uint8_t *)calloc(len, sizeof(char));
-  command_response__pack(&resp, buf);
+  buf = mqttmgr_arena_alloc(arena, len);
+  if (buf == NULL) {
+    // Still tell the sender the command failed
+    ESP_LOGE(TAG, "mqttmgr_cmd_dispatch - no room to pack %u bytes", len);
+    resp.resp_case = COMMAND_RESPONSE__RESP__NOT_SET;
+    resp.ret_code = COMMAND_RESPONSE__RET_CODE_T__ERR;
+    len = command_response__get_packed_size(&resp);
+    buf = mqttmgr_arena_alloc(arena, len);
+  }
+  if (buf != NULL) {
+    command_response__pack(&resp, buf);
+    ESP_LOGI(TAG, "mqttmgr_cmd_dispatch - publishing response");
+    mqttmgr_cmd_respond(buf, len);
+  }
+  ESP_LOGD(TAG, "mqttmgr_cmd_dispatch - arena used %u of %u bytes",
+           arena->used, arena->size);
+  mqttmgr_arena_reset(arena);
+}
+
+/**
+ * @brief Read a varint of a packed message
+ *
+ * @return Bytes read, 0 when it runs past end
+ */
+static size_t mqttmgr_cmd_varint(const uint8_t *p, const uint8_t *end,
+                                 uint64_t *value) {
+  size_t len = 0;
+
+  *value = 0;
+  do {
+    if (p + len == end || len == 10) {
+      return 0;
+    }
+    *value |= (uint64_t)(p[len] & 0x7F) << (7 * len);
+  } while (p[len++] & 0x80);
+  return len;
+}
+
+/**
+ * @brief Find the uuid of a packed CommandRequest without unpacking it
+ *
+ * Walks the top level fields for field 1, the uuid, and copies it cut short
+ * to size - 1 bytes. Left empty when it's not found.
+ */
+static void mqttmgr_cmd_peek_uuid(const uint8_t *data, size_t len,
+                                  char *uuid_out, size_t size) {
+  const uint8_t *p = data, *end = data + len;
+  uint64_t key, value;
+  size_t n;
+
+  uuid_out[0] = '\0';
+  while (p < end) {
+    if ((n = mqttmgr_cmd_varint(p, end, &key)) == 0) {
+      return;
+    }
+    p += n;
+    switch (key & 0x7) {
+      case 0:  // Varint
+        if ((n = mqttmgr_cmd_varint(p, end, &value)) == 0) {
+          return;
+        }
+        p += n;
+        break;
+      case 1:  // 64 bit
+        p += 8;
+        break;
+      case 2:  // Length delimited
+        if ((n = mqttmgr_cmd_varint(p, end, &value)) == 0 ||
+            value > (uint64_t)(end - p - n)) {
+          return;
+        }
+        p += n;
+        if (key >> 3 == 1) {
+          n = value < size - 1 ? value : size - 1;
+          memcpy(uuid_out, p, n);
+          uuid_out[n] = '\0';
+          return;
+        }
+        p += value;
+        break;
+      case 5:  // 32 bit
+        p += 4;
+        break;
+      default:
+        return;
+    }
+  }
+}
 
-  ESP_LOGI(TAG, "mqttmgr_cmd_dispatch - publishing response");
-  if (esp_mqtt_client_publish(state.client, topic_names[MQTTMGR_TOPIC_RESPONSE],
-                              (char *)buf, len * sizeof(char),
-                              1,  // QoS 1
-                              0   // Do not retain cmd responses
-                              ) == -1) {
-    ESP_LOGE(TAG, "mqttmgr_cmd_dispatch - publishing failed!");
+/**
+ * @brief Answer a command that wasn't queued on the esp-mqtt task
+ *
+ * Only the uuid is read from the command, so this costs no more than the
+ * stack.
+ */
+static void mqttmgr_cmd_reject(esp_mqtt_event_handle_t event,
+                               CommandResponse__RetCodeT ret_code) {
+  char uuid[MQTT_CMD_UUID_MAX];
+  uint8_t buf[MQTT_CMD_REJECT_SIZE];
+  CommandResponse resp = COMMAND_RESPONSE__INIT;
+
+  mqttmgr_cmd_peek_uuid((const uint8_t *)event->data, event->data_len, uuid,
+                        sizeof(uuid));
+  resp.uuid = uuid;
+  resp.ret_code = ret_code;
+  mqttmgr_cmd_respond(buf, command_response__pack(&resp, buf));
+}
+
+/**
+ * @brief Copy a received command into the command queue
+ *
+ * Runs on the esp-mqtt task, so it never waits. A full queue is answered with
+ * BUSY and a command too big for the queue with ERR.
+ */
+static void mqttmgr_cmd_enqueue(esp_mqtt_event_handle_t event) {
+  mqttmgr_cmd_t *cmd;
+  size_t size = sizeof(mqttmgr_cmd_t) + event->data_len;
+
+  if (size > xRingbufferGetMaxItemSize(state.cmd_queue)) {
+    ESP_LOGE(TAG, "Command of %d bytes is too big to queue", event->data_len);
+    mqttmgr_cmd_reject(event, COMMAND_RESPONSE__RET_CODE_T__ERR);
+    return;
+  }
+  if (pdTRUE != xRingbufferSendAcquire(state.cmd_queue, (void **)&cmd, size,
+                                       0)) {
+    ESP_LOGW(TAG, "Command queue full, answering BUSY");
+    mqttmgr_cmd_reject(event, COMMAND_RESPONSE__RET_CODE_T__BUSY);
+    return;
   }
+  cmd->received_at = xTaskGetTickCount();
+  cmd->len = event->data_len;
+  memcpy(cmd->data, event->data, event->data_len);
+  atomic_fetch_add(&state.cmd_cnt, 1);
+  xRingbufferSendComplete(state.cmd_queue, cmd);
+}
+
+/**
+ * @brief Task running the queued commands one at a time
+ *
+ * A command keeps its queue slot till it's answered, so the queue bounds
+ * the running command as well as the waiting ones.
+ */
+static void mqttmgr_task_cmd(void *pvParam) {
+  mqttmgr_cmd_t *cmd;
+  size_t size;
 
-  // TODO: This dealloc callback is a silly complexity that should be dropped
-  // Command handlers should return the packed reponse buffer only, so they can
-  // alloc build and free the msg completely in the call. That leave the mqtt
-  // manager to just forward the msg response itself
-  if (dealloc_cb != NULL) {
-    ESP_LOGI(TAG, "mqttmgr_cmd_dispatch - dealloc_cb start");
-    dealloc_cb(&resp);
-    ESP_LOGI(TAG, "mqttmgr_cmd_dispatch - dealloc_cb finish");
+  for (;;) {
+    cmd = (mqttmgr_cmd_t *)xRingbufferReceive(state.cmd_queue, &size,
+                                              portMAX_DELAY);
+    if (cmd == NULL) {
+      continue;
+    }
+    mqttmgr_cmd_dispatch(cmd);
+    vRingbufferReturnItem(state.cmd_queue, cmd);
+    atomic_fetch_sub(&state.cmd_cnt, 1);
   }
-  free(resp.uuid);
-  free(buf);
 }
 
 /**
  * @brief Attempt to reconnect to Wifi and MQTT server now
  *
- * Will reset the backoff algorithm as well.
+ * Will reset the backoff algorithm as well. With CONFIG_MQTTMGR_DUTY_CYCLE it
+ * starts an uplink instead.
  *
  * @return esp_err_t
  *    ESP_OK - Reconnect Task Notified
@@ -125,7 +644,11 @@ esp_err_t mqttmgr_reconnect_now() {
   if (!(current_state & MQTTMGR_CLIENT_NOTCONNECTED_BIT)) {
     return ESP_ERR_WIFI_STATE;
   }
+#if CONFIG_MQTTMGR_DUTY_CYCLE
+  xEventGroupSetBits(mqttmgr_events, MQTTMGR_UPLINK_NOW_BIT);
+#else
   xTaskNotifyGive(state.task_client_watchdog);
+#endif
   return ESP_OK;
 }
 
@@ -139,6 +662,7 @@ esp_err_t mqttmgr_reconnect_now() {
 static void mqttmgr_event_handler(void *handler_args, esp_event_base_t base,
                                   int32_t event_id, void *event_data) {
   esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
+  mqttmgr_topic_policy_t policy;
   ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%d", base,
            event_id);
 
@@ -154,8 +678,10 @@ static void mqttmgr_event_handler(void *handler_args, esp_event_base_t base,
       BackoffAlgorithm_InitializeParams(&retryParams, MQTT_BASE_BACKOFF_SEC,
                                         MQTT_MAX_BACKOFF,
                                         BACKOFF_ALGORITHM_RETRY_FOREVER);
-      if (esp_mqtt_client_subscribe(
-              state.client, topic_names[MQTTMGR_TOPIC_REQUEST], 1) == -1) {
+      mqttmgr_get_topic_policy(MQTTMGR_TOPIC_REQUEST, &policy);
+      if (esp_mqtt_client_subscribe(state.client,
+                                    topic_names[MQTTMGR_TOPIC_REQUEST],
+                                    policy.qos) == -1) {
         ESP_LOGE(TAG, "Failed to subscribe to control channel!");
       } else {
         ESP_LOGI(TAG, "Subscribed to %s", topic_names[MQTTMGR_TOPIC_REQUEST]);
@@ -170,12 +696,16 @@ static void mqttmgr_event_handler(void *handler_args, esp_event_base_t base,
     case MQTT_EVENT_SUBSCRIBED:
       ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
       break;
+    case MQTT_EVENT_PUBLISHED:
+      ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+      mqttmgr_inflight_release(event->msg_id);
+      break;
     case MQTT_EVENT_UNSUBSCRIBED:
       ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
       break;
     case MQTT_EVENT_DATA:
       if (strcmp(event->topic, topic_names[MQTTMGR_TOPIC_REQUEST]) == 0) {
-        mqttmgr_cmd_dispatch(event);
+        mqttmgr_cmd_enqueue(event);
       }
       break;
     default:
@@ -183,6 +713,105 @@ static void mqttmgr_event_handler(void *handler_args, esp_event_base_t base,
   }
 }
 
+/**
+ * @brief Move the radio hour counters on to the hour of uptime of now
+ *
+ * Caller must hold radio_lock.
+ */
+static void mqttmgr_radio_roll_locked(int64_t now) {
+  uint32_t hour = now / MQTT_HOUR_US;
+
+  if (hour == state.radio_hour) {
+    return;
+  }
+  state.radio_last_hour_on_ms =
+      hour == state.radio_hour + 1 ? state.radio_hour_on_ms : 0;
+  state.radio_hour_on_ms = 0;
+  state.radio_hour = hour;
+}
+
+/**
+ * @brief Count the radio on time up to now, split by hour of uptime
+ *
+ * Caller must hold radio_lock.
+ */
+static void mqttmgr_radio_account_locked(int64_t now) {
+  int64_t until;
+
+  while (state.radio_on_at != 0 && state.radio_on_at < now) {
+    mqttmgr_radio_roll_locked(state.radio_on_at);
+    until = (state.radio_on_at / MQTT_HOUR_US + 1) * MQTT_HOUR_US;
+    if (until > now) {
+      until = now;
+    }
+    state.radio_hour_on_ms += (until - state.radio_on_at) / 1000;
+    state.radio_on_ms += (until - state.radio_on_at) / 1000;
+    state.radio_on_at = until;
+  }
+  mqttmgr_radio_roll_locked(now);
+}
+
+/**
+ * @brief Track whether WiFi has an IP address for mqttmgr_radio_start
+ */
+static void mqttmgr_wifi_event_handler(void *handler_args,
+                                       esp_event_base_t base, int32_t event_id,
+                                       void *event_data) {
+  if (base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+    xEventGroupSetBits(mqttmgr_events, MQTTMGR_WIFI_CONNECTED_BIT);
+  } else if (base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    xEventGroupClearBits(mqttmgr_events, MQTTMGR_WIFI_CONNECTED_BIT);
+  }
+}
+
+/**
+ * @brief Start WiFi and the MQTT client
+ */
+static void mqttmgr_radio_start() {
+  int64_t now = esp_timer_get_time();
+
+  xSemaphoreTake(state.radio_lock, portMAX_DELAY);
+  mqttmgr_radio_account_locked(now);
+  if (state.radio_on_at == 0) {
+    state.radio_on_at = now;
+    state.uplink_cnt++;
+  }
+  xSemaphoreGive(state.radio_lock);
+  esp_wifi_start();
+  if (!(xEventGroupWaitBits(mqttmgr_events, MQTTMGR_WIFI_CONNECTED_BIT,
+                            pdFALSE,  // Do NOT clear the bits before returning
+                            pdTRUE,   // Wait for ALL bits to be set
+                            MQTT_WIFI_CONNECT_TIMEOUT_MS / portTICK_PERIOD_MS) &
+        MQTTMGR_WIFI_CONNECTED_BIT)) {
+    // The client retries on its own once WiFi comes up
+    ESP_LOGW(TAG, "No IP address after %dms, starting MQTT anyway",
+             MQTT_WIFI_CONNECT_TIMEOUT_MS);
+  }
+  esp_mqtt_client_start(state.client);
+  xEventGroupSetBits(mqttmgr_events, MQTTMGR_CLIENT_STARTED_BIT);
+}
+
+/**
+ * @brief Stop the MQTT client and WiFi
+ *
+ * Messages stay queued, and anything in flight is published again, once the
+ * radio is started again.
+ */
+static void mqttmgr_radio_stop() {
+  esp_mqtt_client_stop(state.client);
+  // TODO: Handle the Wifi radio elsewhere?
+  esp_wifi_disconnect();
+  esp_wifi_stop();
+  xEventGroupClearBits(mqttmgr_events, MQTTMGR_CLIENT_STARTED_BIT |
+                                           MQTTMGR_CLIENT_CONNECTED_BIT |
+                                           MQTTMGR_WIFI_CONNECTED_BIT);
+  xEventGroupSetBits(mqttmgr_events, MQTTMGR_CLIENT_NOTCONNECTED_BIT);
+  xSemaphoreTake(state.radio_lock, portMAX_DELAY);
+  mqttmgr_radio_account_locked(esp_timer_get_time());
+  state.radio_on_at = 0;
+  xSemaphoreGive(state.radio_lock);
+}
+
 /**
  * @brief Watchdog for ESP-MQTT-Client
  *
@@ -211,15 +840,10 @@ static void mqttmgr_client_watchdog(void *pvParam) {
                                       &nextRetryBackoff);
       ESP_LOGI(TAG, "Too many mqtt disconnections, backing off for %d seconds",
                nextRetryBackoff);
-      esp_mqtt_client_stop(state.client);
-      // TODO: Handle the Wifi radio elsewhere?
-      esp_wifi_disconnect();
-      esp_wifi_stop();
-      xEventGroupClearBits(mqttmgr_events, MQTTMGR_CLIENT_STARTED_BIT |
-                                               MQTTMGR_CLIENT_CONNECTED_BIT);
+      mqttmgr_radio_stop();
 
       if (pdTRUE ==
-          xTaskNotifyWait(0x0, ULONG_MAX, NULL,
+          xTaskNotifyWait(0x0, UINT32_MAX, NULL,
                           (nextRetryBackoff * 1000) / portTICK_PERIOD_MS)) {
         ESP_LOGI(TAG, "(notified) attempting to connect to mqtt again...");
         ESP_LOGI(TAG, "(notified) resetting backoff params...");
@@ -230,24 +854,246 @@ static void mqttmgr_client_watchdog(void *pvParam) {
         ESP_LOGI(TAG, "attempting to connect to mqtt again...");
       }
 
-      esp_wifi_start();
-      vTaskDelay(5000 / portTICK_PERIOD_MS);  // 5 seconds to connect WiFi
-      esp_mqtt_client_start(state.client);
-      xEventGroupSetBits(mqttmgr_events, MQTTMGR_CLIENT_STARTED_BIT);
+      mqttmgr_radio_start();
       disconn_event_count = 0;
     }
   }
 }
 
+#if CONFIG_MQTTMGR_DUTY_CYCLE
+/**
+ * @brief Whether every queued message has been delivered
+ *
+ * sensormgr keeps its low-water bit set till its own queue is drained.
+ */
+static bool mqttmgr_uplink_idle() {
+  return atomic_load(&state.pending_cnt) == 0 &&
+         atomic_load(&state.cmd_cnt) == 0 &&
+         !(xEventGroupGetBits(mqttmgr_events) & SENSORMGR_LOWWATER_BIT);
+}
+
+/**
+ * @brief Send everything queued while the radio is on
+ *
+ * sensormgr is told to drain whatever its flush policy says. Returns once
+ * nothing is left to send and commands had CONFIG_MQTTMGR_UPLINK_LINGER
+ * seconds to arrive, or after CONFIG_MQTTMGR_UPLINK_MAX_ON seconds.
+ */
+static void mqttmgr_uplink_drain() {
+  TickType_t start = xTaskGetTickCount(), connected_at;
+  const TickType_t max_on = CONFIG_MQTTMGR_UPLINK_MAX_ON * configTICK_RATE_HZ;
+  const TickType_t linger = CONFIG_MQTTMGR_UPLINK_LINGER * configTICK_RATE_HZ;
+
+  if (!(xEventGroupWaitBits(mqttmgr_events, MQTTMGR_CLIENT_CONNECTED_BIT,
+                            pdFALSE,  // Do NOT clear the bits before returning
+                            pdTRUE,   // Wait for ALL bits to be set
+                            max_on) &
+        MQTTMGR_CLIENT_CONNECTED_BIT)) {
+    ESP_LOGW(TAG, "Uplink failed to connect, trying again next uplink");
+    return;
+  }
+  connected_at = xTaskGetTickCount();
+  xEventGroupSetBits(mqttmgr_events, SENSORMGR_LOWWATER_BIT);
+  while (xTaskGetTickCount() - start < max_on) {
+    if (xTaskGetTickCount() - connected_at >= linger &&
+        mqttmgr_uplink_idle()) {
+      ESP_LOGI(TAG, "Uplink done after %ums",
+               (xTaskGetTickCount() - start) * portTICK_PERIOD_MS);
+      return;
+    }
+    vTaskDelay(MQTT_UPLINK_POLL_MS / portTICK_PERIOD_MS);
+  }
+  ESP_LOGW(TAG, "Uplink cut short after %us, %u messages left",
+           CONFIG_MQTTMGR_UPLINK_MAX_ON, atomic_load(&state.pending_cnt));
+}
+
+/**
+ * @brief Duty cycled replacement of the client watchdog
+ *
+ * Keeps the radio off between uplinks. An uplink starts every
+ * CONFIG_MQTTMGR_UPLINK_INTERVAL seconds, as soon as sensormgr reaches its
+ * flush watermark, or on mqttmgr_reconnect_now. The first one is the
+ * connection mqttmgr_start makes.
+ */
+static void mqttmgr_task_uplink(void *pvParam) {
+  EventBits_t wake;
+
+  ESP_LOGI(TAG, "Starting mqtt-uplink");
+  for (;;) {
+    mqttmgr_uplink_drain();
+    mqttmgr_radio_stop();
+    // Still at the watermark means the uplink failed or was cut short, only
+    // try again on the schedule
+    wake = MQTTMGR_UPLINK_NOW_BIT;
+    if (!(xEventGroupGetBits(mqttmgr_events) & SENSORMGR_LOWWATER_BIT)) {
+      wake |= SENSORMGR_LOWWATER_BIT;
+    }
+    xEventGroupWaitBits(mqttmgr_events, wake,
+                        pdFALSE,  // Do NOT clear the bits before returning
+                        pdFALSE,  // Wait for EITHER bit to be set
+                        CONFIG_MQTTMGR_UPLINK_INTERVAL * configTICK_RATE_HZ);
+    xEventGroupClearBits(mqttmgr_events, MQTTMGR_UPLINK_NOW_BIT);
+    mqttmgr_radio_start();
+  }
+}
+#endif
+
+/**
+ * @brief Publish a queued message, retrying with expo backoff on failures
+ *
+ * @return msg_id of the publish, 0 for QoS 0
+ */
+static int mqttmgr_publish(mqttmgr_msg_t *msg,
+                           BackoffAlgorithmContext_t *retry_params) {
+  bool resetBackoff = false;
+  int msg_id;
+  uint16_t nextRetryBackoff = 0;
+  mqttmgr_topic_policy_t policy;
+
+  xEventGroupWaitBits(mqttmgr_events,
+                      MQTTMGR_CLIENT_STARTED_BIT | MQTTMGR_CLIENT_CONNECTED_BIT,
+                      pdFALSE,  // Do NOT clear the bits before returning
+                      pdTRUE,   // Wait for ALL bits to be set
+                      portMAX_DELAY);
+  ESP_LOGD(TAG, "publishing message to topic: %s", topic_names[msg->topic]);
+  mqttmgr_get_topic_policy(msg->topic, &policy);
+  while (-1 == (msg_id = esp_mqtt_client_publish(
+                    state.client, topic_names[msg->topic], (char *)msg->msg,
+                    msg->len, policy.qos, policy.retain))) {
+    ESP_LOGE(TAG, "Failed to enqueue mqtt message!");
+    BackoffAlgorithm_GetNextBackoff(retry_params, esp_random(),
+                                    &nextRetryBackoff);
+    resetBackoff = true;
+    vTaskDelay((nextRetryBackoff * 1000) / portTICK_PERIOD_MS);
+  }
+  if (resetBackoff) {
+    BackoffAlgorithm_InitializeParams(retry_params, MQTT_BASE_BACKOFF_SEC,
+                                      MQTT_MAX_BACKOFF,
+                                      BACKOFF_ALGORITHM_RETRY_FOREVER);
+  }
+  return msg_id;
+}
+
+/**
+ * @brief Publish the message of an in-flight entry and record its msg_id
+ *
+ * The inflight lock can't be held over esp_mqtt_client_publish, esp-mqtt holds
+ * its own client lock while dispatching MQTT_EVENT_PUBLISHED. The caller parks
+ * the entry with a msg_id of -1 under the lock instead, so no PUBACK can return
+ * the slot meanwhile, and a PUBACK arriving before the msg_id is recorded is
+ * caught through early_ack.
+ *
+ * @param idx          Parked entry
+ * @param msg          Message of the entry, read while the lock was held
+ * @param retry_params Backoff of failed publishes
+ */
+static void mqttmgr_inflight_publish(uint8_t idx, mqttmgr_msg_t *msg,
+                                     BackoffAlgorithmContext_t *retry_params) {
+  int msg_id;
+  uint32_t delivered_arg = 0;
+  mqttmgr_delivered_fn *delivered = NULL;
+
+  msg_id = mqttmgr_publish(msg, retry_params);
+  if (!state.published) {
+    state.published = true;
+    MQTTLOG_LOGI(TAG, "first publish",
+                 MQTTLOG_INT64("boot_ms", esp_timer_get_time() / 1000),
+                 MQTTLOG_STR("topic", topic_names[msg->topic]));
+  }
+
+  xSemaphoreTake(state.inflight_lock, portMAX_DELAY);
+  if (msg_id == 0 || msg_id == state.early_ack) {
+    // QoS 0 or already acknowledged
+    delivered = msg->delivered;
+    delivered_arg = msg->delivered_arg;
+    mqttmgr_return_slot(msg);
+    state.inflight[idx].msg = NULL;
+  } else {
+    state.inflight[idx].msg_id = msg_id;
+    state.inflight[idx].published_at = xTaskGetTickCount();
+  }
+  xSemaphoreGive(state.inflight_lock);
+  if (delivered != NULL) {
+    delivered(delivered_arg);
+  }
+}
+
+/**
+ * @brief Publish again anything esp-mqtt has dropped from its outbox
+ *
+ * The message is still in its queue slot so it can be sent again as is, the
+ * broker may see a duplicate which is fine for QoS 1.
+ */
+static void mqttmgr_inflight_retry(BackoffAlgorithmContext_t *retry_params) {
+  uint8_t i;
+  bool expired;
+  mqttmgr_msg_t *msg;
+  TickType_t now = xTaskGetTickCount();
+
+  for (i = 0; i < MQTTMGR_INFLIGHT_MAX; i++) {
+    xSemaphoreTake(state.inflight_lock, portMAX_DELAY);
+    msg = state.inflight[i].msg;
+    expired = msg != NULL && now - state.inflight[i].published_at >=
+                                 MQTT_INFLIGHT_TIMEOUT_MS / portTICK_PERIOD_MS;
+    if (expired) {
+      // Parked, a PUBACK of the old msg_id can't return the slot any more
+      state.inflight[i].msg_id = -1;
+      state.early_ack = 0;
+    }
+    xSemaphoreGive(state.inflight_lock);
+    if (expired) {
+      ESP_LOGW(TAG, "Message to %s was not acknowledged, publishing again",
+               topic_names[msg->topic]);
+      mqttmgr_inflight_publish(i, msg, retry_params);
+    }
+  }
+}
+
+/**
+ * @brief Find a free in-flight entry
+ *
+ * @return Entry index, -1 if every entry is in use
+ */
+static int mqttmgr_inflight_free(void) {
+  uint8_t i;
+
+  for (i = 0; i < MQTTMGR_INFLIGHT_MAX; i++) {
+    if (state.inflight[i].msg == NULL) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Count the in-flight entries of a topic
+ */
+static uint8_t mqttmgr_inflight_cnt(mqttmgr_topicidx topic) {
+  uint8_t i, cnt = 0;
+
+  xSemaphoreTake(state.inflight_lock, portMAX_DELAY);
+  for (i = 0; i < MQTTMGR_INFLIGHT_MAX; i++) {
+    if (state.inflight[i].msg != NULL &&
+        state.inflight[i].msg->topic == topic) {
+      cnt++;
+    }
+  }
+  xSemaphoreGive(state.inflight_lock);
+  return cnt;
+}
+
 /**
  * @brief Task for sending sensor data
+ *
+ * Messages are published straight from their queue slot and the slot is only
+ * returned once the broker acknowledged it, see mqttmgr_inflight_release.
  */
 static void mqttmgr_task_msgqueue(void *pvParam) {
-  bool resetBackoff = false;
+  int idx;
   mqttmgr_msg_t *msg_buffer;
   size_t msg_size;
-  uint16_t nextRetryBackoff = 0;
   BackoffAlgorithmContext_t mqttRetryParams;
+  mqttmgr_topic_policy_t policy;
 
   BackoffAlgorithm_InitializeParams(&mqttRetryParams, MQTT_BASE_BACKOFF_SEC,
                                     MQTT_MAX_BACKOFF,
@@ -255,53 +1101,65 @@ static void mqttmgr_task_msgqueue(void *pvParam) {
 
   ESP_LOGD(TAG, "mqtt task entering loop");
   for (;;) {
-    msg_buffer = (mqttmgr_msg_t *)xRingbufferReceive(state.msg_queue, &msg_size,
-                                                     portMAX_DELAY);
+    // Only this task claims entries, so one found free stays free
+    while ((idx = mqttmgr_inflight_free()) < 0) {
+      ulTaskNotifyTake(pdTRUE, MQTT_INFLIGHT_TIMEOUT_MS / portTICK_PERIOD_MS);
+      mqttmgr_inflight_retry(&mqttRetryParams);
+    }
+
+    msg_buffer = (mqttmgr_msg_t *)xRingbufferReceive(
+        state.msg_queue, &msg_size,
+        MQTT_INFLIGHT_TIMEOUT_MS / portTICK_PERIOD_MS);
     if (msg_buffer == NULL) {
-      ESP_LOGE(TAG, "Failed to receive msg from msg queue!");
-      abort();
+      mqttmgr_inflight_retry(&mqttRetryParams);
+      continue;
     }
-    xEventGroupWaitBits(
-        mqttmgr_events,
-        MQTTMGR_CLIENT_STARTED_BIT | MQTTMGR_CLIENT_CONNECTED_BIT,
-        pdFALSE,  // Do NOT clear the bits before returning
-        pdTRUE,   // Wait for ALL bits to be set
-        portMAX_DELAY);
-    ESP_LOGD(TAG, "publishing message to topic: %s",
-             topic_names[msg_buffer->topic]);
-    // Retry publishing the msg on failures with expo backoff
-    while (-1 == esp_mqtt_client_publish(
-                     state.client, topic_names[msg_buffer->topic],
-                     (char *)msg_buffer->msg, msg_buffer->len,
-                     1,  // QoS 1
-                     1   // Retain as the last msg from this device
-                     )) {
-      ESP_LOGE(TAG, "Failed to enqueue mqtt message!");
-      BackoffAlgorithm_GetNextBackoff(&mqttRetryParams, esp_random(),
-                                      &nextRetryBackoff);
-      resetBackoff = true;
-      vTaskDelay((nextRetryBackoff * 1000) / portTICK_PERIOD_MS);
+    if (msg_buffer->len == 0) {
+      // Slot abandoned by its producer
+      mqttmgr_return_slot(msg_buffer);
+      continue;
     }
-    if (resetBackoff) {
-      BackoffAlgorithm_InitializeParams(&mqttRetryParams, MQTT_BASE_BACKOFF_SEC,
-                                        MQTT_MAX_BACKOFF,
-                                        BACKOFF_ALGORITHM_RETRY_FOREVER);
-      resetBackoff = false;
+    // Hold the message till its topic is under its in-flight limit
+    mqttmgr_get_topic_policy(msg_buffer->topic, &policy);
+    while (mqttmgr_inflight_cnt(msg_buffer->topic) >= policy.max_inflight) {
+      ulTaskNotifyTake(pdTRUE, MQTT_INFLIGHT_TIMEOUT_MS / portTICK_PERIOD_MS);
+      mqttmgr_inflight_retry(&mqttRetryParams);
+      mqttmgr_get_topic_policy(msg_buffer->topic, &policy);
     }
-    vRingbufferReturnItem(state.msg_queue, msg_buffer);
+
+    xSemaphoreTake(state.inflight_lock, portMAX_DELAY);
+    state.inflight[idx] = (mqttmgr_inflight_t){.msg = msg_buffer, .msg_id = -1};
+    state.early_ack = 0;
+    xSemaphoreGive(state.inflight_lock);
+    mqttmgr_inflight_publish(idx, msg_buffer, &mqttRetryParams);
   }
 }
 
 esp_err_t mqttmgr_init(char *device_id) {
+  const ProtobufCMessageDescriptor *cmd_desc = &command_request__descriptor;
+  uint8_t cmd_case_cnt = 0;
+  void *cmd_arena_buf;
+  unsigned i;
+
   // Setup topic names
   sprintf(topic_names[MQTTMGR_TOPIC_REQUEST], "command/%s/req/", device_id);
   sprintf(topic_names[MQTTMGR_TOPIC_RESPONSE], "command/%s/resp/", device_id);
   sprintf(topic_names[MQTTMGR_TOPIC_SENSOR], "sensordata/%s/", device_id);
+  // Kept outside of sensordata/# so the json_v2 telegraf consumer ignores it
+  sprintf(topic_names[MQTTMGR_TOPIC_SENSOR_BATCH], "sensorbatch/%s/",
+          device_id);
+  sprintf(topic_names[MQTTMGR_TOPIC_SENSOR_BACKFILL], "sensorbackfill/%s/",
+          device_id);
+#if CONFIG_MQTTLOG_BINARY
+  // Kept outside of logs/# so the JSON log consumer ignores it
+  sprintf(topic_names[MQTTMGR_TOPIC_LOG], "logbin/%s/", device_id);
+#else
   sprintf(topic_names[MQTTMGR_TOPIC_LOG], "logs/%s/", device_id);
+#endif
 
   // Configure MQTT client
   esp_mqtt_client_config_t mqtt_cfg = {
-      .buffer_size = 4096,
+      .buffer_size = MQTT_BUFFER_SIZE,
       .uri = "mqtt://mqtt.iot.kaffi.home"  // TODO: Make this configurable,
                                            // store in NVS?
   };
@@ -309,23 +1167,55 @@ esp_err_t mqttmgr_init(char *device_id) {
   // Init state, cmd_handlers, and backoff state
   mqttmgr_events = xEventGroupCreate();
   state = (mqttmgr_state_t){
-      .msg_queue = xRingbufferCreate(4096, RINGBUF_TYPE_NOSPLIT),
+      .msg_queue = xRingbufferCreate(CONFIG_MQTTMGR_RINGBUF_SIZE * 1024,
+                                     RINGBUF_TYPE_NOSPLIT),
+      .inflight_lock = xSemaphoreCreateMutex(),
+      .radio_lock = xSemaphoreCreateMutex(),
+      .policy_lock = xSemaphoreCreateMutex(),
+      .cmd_queue = xRingbufferCreate(CONFIG_MQTTMGR_CMD_QUEUE_SIZE,
+                                     RINGBUF_TYPE_NOSPLIT),
+      .radio_on_at = 0,  // Counted from mqttmgr_start
       .disabled_at = 0,
       .retry_count = 0,
       .client = esp_mqtt_client_init(&mqtt_cfg),
-      .cmd_handlers =
-          calloc(command_request__descriptor.n_fields, sizeof(cmdhandler *))};
+  };
+  // Cases are the field numbers of the cmd oneof
+  for (i = 0; i < cmd_desc->n_fields; i++) {
+    if (cmd_desc->fields[i].id >= cmd_case_cnt) {
+      cmd_case_cnt = cmd_desc->fields[i].id + 1;
+    }
+  }
+  state.cmd_case_cnt = cmd_case_cnt;
+  state.cmd_handlers = calloc(cmd_case_cnt, sizeof(cmdhandler *));
   if (state.cmd_handlers == NULL) {
     ESP_LOGE(TAG, "Failed to allocate cmd_handlers array");
     return ESP_FAIL;
   }
+  // Allocated once, commands never touch the heap
+  cmd_arena_buf = malloc(CONFIG_MQTTMGR_CMD_ARENA_SIZE);
+  if (cmd_arena_buf == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate command arena");
+    return ESP_FAIL;
+  }
+  mqttmgr_arena_init(&state.cmd_arena, cmd_arena_buf,
+                     CONFIG_MQTTMGR_CMD_ARENA_SIZE);
+  state.cmd_handlers[COMMAND_REQUEST__CMD_BATCH_REQUEST] = mqttmgr_cmd_batch;
+  state.cmd_handlers[COMMAND_REQUEST__CMD_MQTTMGR_SET_TOPIC_POLICY_REQUEST] =
+      mqttmgr_cmd_set_topic_policy;
+  state.cmd_handlers[COMMAND_REQUEST__CMD_MQTTMGR_GET_TOPIC_POLICY_REQUEST] =
+      mqttmgr_cmd_get_topic_policy;
 
-  if (state.msg_queue == NULL) {
+  if (state.msg_queue == NULL || state.inflight_lock == NULL ||
+      state.radio_lock == NULL || state.cmd_queue == NULL ||
+      state.policy_lock == NULL) {
     ESP_LOGE(TAG, "Failed to allocate message queue");
     return ESP_FAIL;
   }
+  memcpy(state.topic_policies, topic_policy_defaults,
+         sizeof(state.topic_policies));
+  mqttmgr_nvs_get_topic_policies();
 
-  xEventGroupClearBits(mqttmgr_events, 0xFF);  // Clear all event bits
+  xEventGroupClearBits(mqttmgr_events, 0x7FF);  // Clear all event bits
   BackoffAlgorithm_InitializeParams(&retryParams, MQTT_BASE_BACKOFF_SEC,
                                     MQTT_MAX_BACKOFF,
                                     BACKOFF_ALGORITHM_RETRY_FOREVER);
@@ -333,8 +1223,27 @@ esp_err_t mqttmgr_init(char *device_id) {
   return ESP_OK;
 }
 
+/**
+ * @brief Log every cmd no module registered a handler for
+ *
+ * Cmds of modules disabled in menuconfig are expected here.
+ */
+static void mqttmgr_check_cmd_handlers() {
+  const ProtobufCMessageDescriptor *cmd_desc = &command_request__descriptor;
+  unsigned i;
+
+  for (i = 0; i < cmd_desc->n_fields; i++) {
+    if ((cmd_desc->fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
+        state.cmd_handlers[cmd_desc->fields[i].id] == NULL) {
+      ESP_LOGW(TAG, "No handler for %s", cmd_desc->fields[i].name);
+    }
+  }
+}
+
 esp_err_t mqttmgr_start() {
   BaseType_t result;
+
+  mqttmgr_check_cmd_handlers();
   result =
       xTaskCreate(mqttmgr_task_msgqueue, MQTT_TASK_NAME, MQTT_TASK_STACKSIZE,
                   (void *)1, tskIDLE_PRIORITY, &state.task_msgqueue);
@@ -342,15 +1251,39 @@ esp_err_t mqttmgr_start() {
     ESP_LOGE(TAG, "Error starting mqtt task!");
     return ESP_FAIL;
   }
+  result = xTaskCreate(mqttmgr_task_cmd, MQTT_CMD_TASK_NAME,
+                       MQTT_CMD_TASK_STACKSIZE, (void *)1, tskIDLE_PRIORITY,
+                       &state.task_cmd);
+  if (result != pdPASS) {
+    ESP_LOGE(TAG, "Error starting mqtt-cmd task!");
+    return ESP_FAIL;
+  }
 
+#if CONFIG_MQTTMGR_DUTY_CYCLE
+  result = xTaskCreate(mqttmgr_task_uplink, MQTT_UPLINK_NAME,
+                       MQTT_CLIENTWATCHER_STACKSIZE, (void *)1,
+                       tskIDLE_PRIORITY, &state.task_client_watchdog);
+#else
   result = xTaskCreate(mqttmgr_client_watchdog, MQTT_CLIENTWATCHER_NAME,
                        MQTT_CLIENTWATCHER_STACKSIZE, (void *)1,
                        tskIDLE_PRIORITY, &state.task_client_watchdog);
+#endif
   if (result != pdPASS) {
     ESP_LOGE(TAG, "Error starting mqtt-client-watcher task!");
     return ESP_FAIL;
   }
 
+  // WiFi was started by wifi_provision, which returns once it has an IP
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      IP_EVENT, IP_EVENT_STA_GOT_IP, mqttmgr_wifi_event_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, mqttmgr_wifi_event_handler,
+      NULL));
+  xEventGroupSetBits(mqttmgr_events, MQTTMGR_WIFI_CONNECTED_BIT);
+  xSemaphoreTake(state.radio_lock, portMAX_DELAY);
+  state.radio_on_at = esp_timer_get_time();
+  xSemaphoreGive(state.radio_lock);
+
   esp_mqtt_client_register_event(state.client,
                                  (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID,
                                  mqttmgr_event_handler, state.client);
@@ -378,42 +1311,144 @@ esp_err_t mqttmgr_stop() {
   return ESP_OK;
 }
 
-esp_err_t mqttmgr_queuemsg(mqttmgr_topicidx topic, size_t msg_len, void *msg,
-                           TickType_t delay) {
+esp_err_t mqttmgr_flush(TickType_t timeout) {
+  TickType_t start = xTaskGetTickCount();
+
+  while (atomic_load(&state.pending_cnt) != 0) {
+    if (xTaskGetTickCount() - start >= timeout) {
+      ESP_LOGW(TAG, "%u messages not delivered",
+               atomic_load(&state.pending_cnt));
+      return ESP_ERR_TIMEOUT;
+    }
+    vTaskDelay(MQTT_UPLINK_POLL_MS / portTICK_PERIOD_MS);
+  }
+  return ESP_OK;
+}
+
+esp_err_t mqttmgr_acquiremsg(mqttmgr_topicidx topic, size_t max_len,
+                             mqttmgr_msg_t **msg_out, TickType_t delay) {
   mqttmgr_msg_t *rb_msg;
 
   if (state.task_msgqueue == NULL) {
     return ESP_ERR_INVALID_STATE;
   }
+  if (sizeof(mqttmgr_msg_t) + max_len >
+      xRingbufferGetMaxItemSize(state.msg_queue)) {
+    ESP_LOGE(TAG, "Unable to queue message: Message too large");
+    return ESP_ERR_INVALID_ARG;
+  }
   if (pdTRUE != xRingbufferSendAcquire(state.msg_queue, (void **)&rb_msg,
-                                       sizeof(mqttmgr_msg_t) + msg_len,
+                                       sizeof(mqttmgr_msg_t) + max_len,
                                        delay)) {
-    if (delay == portMAX_DELAY) {
-      ESP_LOGE(TAG, "Unable to queue message: Message too large");
-      return ESP_ERR_INVALID_ARG;
-    }
     ESP_LOGW(TAG, "Unable to queue msg!");
     return ESP_ERR_NO_MEM;
   }
   *rb_msg = (mqttmgr_msg_t){
-      .len = msg_len,
+      .delivered = NULL,
+      .len = 0,
       .topic = topic,
   };
-  memcpy(rb_msg->msg, msg, msg_len);
-  xRingbufferSendComplete(state.msg_queue, rb_msg);
+  *msg_out = rb_msg;
+  return ESP_OK;
+}
+
+esp_err_t mqttmgr_radio_stats(mqttmgr_radio_stats_t *stats) {
+  if (state.radio_lock == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(state.radio_lock, portMAX_DELAY);
+  mqttmgr_radio_account_locked(esp_timer_get_time());
+  *stats = (mqttmgr_radio_stats_t){
+      .on_ms = state.radio_on_ms,
+      .hour_on_ms = state.radio_hour_on_ms,
+      .last_hour_on_ms = state.radio_last_hour_on_ms,
+      .uplink_cnt = state.uplink_cnt,
+  };
+  xSemaphoreGive(state.radio_lock);
+  return ESP_OK;
+}
+
+esp_err_t mqttmgr_set_topic_policy(mqttmgr_topicidx topic,
+                                   const mqttmgr_topic_policy_t *policy) {
+  if (state.policy_lock == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if ((unsigned)topic >= MQTTMGR_TOPIC_MAX ||
+      !mqttmgr_topic_policy_valid(topic, policy)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(state.policy_lock, portMAX_DELAY);
+  state.topic_policies[topic] = *policy;
+  xSemaphoreGive(state.policy_lock);
+  if (state.task_msgqueue != NULL) {
+    xTaskNotifyGive(state.task_msgqueue);
+  }
+  return mqttmgr_nvs_set_topic_policies();
+}
+
+esp_err_t mqttmgr_get_topic_policy(mqttmgr_topicidx topic,
+                                   mqttmgr_topic_policy_t *policy) {
+  if (state.policy_lock == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if ((unsigned)topic >= MQTTMGR_TOPIC_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(state.policy_lock, portMAX_DELAY);
+  *policy = state.topic_policies[topic];
+  xSemaphoreGive(state.policy_lock);
   return ESP_OK;
 }
 
-esp_err_t mqttmgr_register_cmd_handler(cmdhandler *handler) {
+size_t mqttmgr_msg_max_len() {
+  size_t queue_max =
+      xRingbufferGetMaxItemSize(state.msg_queue) - sizeof(mqttmgr_msg_t);
+  size_t client_max = MQTT_BUFFER_SIZE - MQTT_PUBLISH_OVERHEAD;
+
+  return queue_max < client_max ? queue_max : client_max;
+}
+
+esp_err_t mqttmgr_commitmsg(mqttmgr_msg_t *msg) {
+  // Counted first, the slot can be returned as soon as it is committed
+  atomic_fetch_add(&state.pending_cnt, 1);
+  if (pdTRUE != xRingbufferSendComplete(state.msg_queue, msg)) {
+    atomic_fetch_sub(&state.pending_cnt, 1);
+    ESP_LOGE(TAG, "Unable to commit msg!");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+esp_err_t mqttmgr_queuemsg(mqttmgr_topicidx topic, size_t msg_len, void *msg,
+                           TickType_t delay) {
+  esp_err_t ret;
+  mqttmgr_msg_t *rb_msg;
+
+  ret = mqttmgr_acquiremsg(topic, msg_len, &rb_msg, delay);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  memcpy(rb_msg->msg, msg, msg_len);
+  rb_msg->len = msg_len;
+  return mqttmgr_commitmsg(rb_msg);
+}
+
+esp_err_t mqttmgr_register_cmd_handler(CommandRequest__CmdCase cmd_case,
+                                       cmdhandler *handler) {
   if (state.cmd_handlers == NULL) {
     ESP_LOGE(TAG, "Handler registration before initialization");
     return ESP_ERR_INVALID_STATE;
   }
-  if (state.cmd_handler_cnt >= command_request__descriptor.n_fields) {
-    ESP_LOGE(TAG, "Attempt to register too many cmd_handlers");
-    return ESP_FAIL;
+  if (cmd_case == COMMAND_REQUEST__CMD__NOT_SET ||
+      (unsigned)cmd_case >= state.cmd_case_cnt) {
+    ESP_LOGE(TAG, "Handler registration for unknown cmd %d", cmd_case);
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (state.cmd_handlers[cmd_case] != NULL) {
+    ESP_LOGE(TAG, "Second handler registered for cmd %d", cmd_case);
+    return ESP_ERR_INVALID_STATE;
   }
 
-  state.cmd_handlers[state.cmd_handler_cnt++] = handler;
+  state.cmd_handlers[cmd_case] = handler;
   return ESP_OK;
 }
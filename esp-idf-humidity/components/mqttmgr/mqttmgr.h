@@ -6,6 +6,9 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/queue.h>
+#include <stdbool.h>
+
+#include "mqttmgr_arena.h"
 
 #define MQTTMGR_CLIENT_STARTED_BIT (1 << 0)
 #define MQTTMGR_CLIENT_CONNECTED_BIT (1 << 1)
@@ -19,18 +22,30 @@
 // received a disconnection event
 #define MQTTMGR_CLIENT_DISCONNECTED_BIT (1 << 3)
 
-// Ring buffer has enough data to send via mqtt
+// Sample queue has enough data to send via mqtt
 #define SENSORMGR_LOWWATER_BIT (1 << 4)
 
-// Ring buffer is getting full and should be drained to file or mqtt
+// Sample queue is getting full and should be drained to file or mqtt
 #define SENSORMGR_HIGHWATER_BIT (1 << 5)
 
-// File is done writing and can be read safely
+// No spill file is being written
 #define SENSORMGR_DONEWRITING_BIT (1 << 6)
 
 // Sensor reading can continue till buffers are completely full
 #define SENSORMGR_POLLSENSORS_BIT (1 << 7)
 
+// Start an uplink now rather than on the schedule, CONFIG_MQTTMGR_DUTY_CYCLE
+#define MQTTMGR_UPLINK_NOW_BIT (1 << 8)
+
+// WiFi is associated and has an IP address
+#define MQTTMGR_WIFI_CONNECTED_BIT (1 << 9)
+
+// sensormgr_stop is waiting for the sensormgr tasks to park
+#define SENSORMGR_PARK_BIT (1 << 10)
+
+// Published messages waiting on a PUBACK before their queue slot is returned
+#define MQTTMGR_INFLIGHT_MAX 4
+
 EventGroupHandle_t mqttmgr_events;
 
 typedef int mqttmgr_cmderr_t;
@@ -39,45 +54,80 @@ typedef enum {
   MQTTMGR_TOPIC_REQUEST = 0,
   MQTTMGR_TOPIC_RESPONSE,
   MQTTMGR_TOPIC_LOG,
-  MQTTMGR_TOPIC_SENSOR
+  MQTTMGR_TOPIC_SENSOR,
+  MQTTMGR_TOPIC_SENSOR_BATCH,
+  MQTTMGR_TOPIC_SENSOR_BACKFILL,
+  MQTTMGR_TOPIC_MAX
 } mqttmgr_topicidx;
 
+/**
+ * @brief Called once the broker has acknowledged a message
+ *
+ * Runs on the esp-mqtt event task, so it must not block.
+ */
+typedef void(mqttmgr_delivered_fn)(uint32_t arg);
+
 typedef struct {
   mqttmgr_topicidx topic;
+  mqttmgr_delivered_fn *delivered;  // Optional, NULL from mqttmgr_acquiremsg
+  uint32_t delivered_arg;
   size_t len;
   uint8_t msg[];
 } mqttmgr_msg_t;
 
-typedef void(dealloc_cb_fn)(CommandResponse *resp_out);
+typedef struct {
+  uint64_t on_ms;            // Since boot
+  uint32_t hour_on_ms;       // So far in the current hour of uptime
+  uint32_t last_hour_on_ms;  // During the previous hour of uptime
+  uint32_t uplink_cnt;       // Times the radio was started again
+} mqttmgr_radio_stats_t;
+
+// How messages to a topic are published
+typedef struct {
+  uint8_t qos;  // 0, 1 or 2, only this for MQTTMGR_TOPIC_REQUEST
+  bool retain;
+  uint8_t max_inflight;  // Messages waiting on the broker at once
+} mqttmgr_topic_policy_t;
 
 /**
  * @brief A handler for a CommandRequest the fills in a CommandResponse
  *
- * Since CommandResponse object may have their own malloc's happening, the
- * dealloc_cb function pointer is expected to be set if the sub function needs
- * to de-allocate any nested structures. If left as null then no callback
- * happens.
+ * The request lives in arena, and everything the response points to must be
+ * allocated from it (MQTTMGR_ARENA_NEW) or outlive the dispatch. The arena is
+ * reset once the response is sent, so there is nothing to free. Return ERR
+ * when an allocation fails.
+ *
+ * Handlers run one at a time on the mqtt-cmd task, not the MQTT client task,
+ * so they may block. Commands queued behind a slow one are answered with
+ * TIMEOUT once they waited CONFIG_MQTTMGR_CMD_TIMEOUT ms.
  */
 typedef CommandResponse__RetCodeT(cmdhandler)(CommandRequest *message,
                                               CommandResponse *resp_out,
-                                              dealloc_cb_fn **dealloc_cb_out);
+                                              mqttmgr_arena_t *arena);
 
 /**
- * @brief Register command handler for received commands
+ * @brief Register the handler of a CommandRequest cmd
  *
- * Tasks that register a command handler must a message type defined in the
- * commands.proto file
+ * Each cmd of the oneof in commands.proto has at most one handler, looked up
+ * by msg->cmd_case when a command arrives. Cmds left without a handler are
+ * logged by mqttmgr_start and answered with NOTMINE.
  *
+ * @param cmd_case Cmd the handler takes, COMMAND_REQUEST__CMD_*
+ * @param handler  Only called for cmd_case
  * @return
  *  - ESP_OK: Success
- *  - ESP_FAIL: Failed to add handler
+ *  - ESP_ERR_INVALID_STATE: Before mqttmgr_init, or cmd_case already has a
+ *    handler
+ *  - ESP_ERR_INVALID_ARG: cmd_case isn't a cmd of CommandRequest
  */
-esp_err_t mqttmgr_register_cmd_handler(cmdhandler *);
+esp_err_t mqttmgr_register_cmd_handler(CommandRequest__CmdCase cmd_case,
+                                       cmdhandler *handler);
 
 /**
  * @brief Attempt to reconnect to Wifi and MQTT server now
  *
- * Will reset the backoff algorithm as well.
+ * Will reset the backoff algorithm as well. With CONFIG_MQTTMGR_DUTY_CYCLE it
+ * starts an uplink instead.
  *
  * @return esp_err_t
  *    ESP_OK - Reconnect Task Notified
@@ -85,6 +135,48 @@ esp_err_t mqttmgr_register_cmd_handler(cmdhandler *);
  */
 esp_err_t mqttmgr_reconnect_now();
 
+/**
+ * @brief How long the WiFi radio has been on
+ *
+ * @param stats Filled in with the radio on time up to now
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_STATE: mqttmgr has not been initialized
+ */
+esp_err_t mqttmgr_radio_stats(mqttmgr_radio_stats_t *stats);
+
+/**
+ * @brief Change how messages to a topic are published, kept in NVS
+ *
+ * Messages already published keep their QoS. The subscription to
+ * MQTTMGR_TOPIC_REQUEST takes its QoS on the next connection.
+ *
+ * @param topic  Topic the policy is for
+ * @param policy qos of 0 to 2, at least 1 for the sensor topics whose
+ *               PUBACKs checkpoint spill files, max_inflight of 1 to
+ *               MQTTMGR_INFLIGHT_MAX
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_STATE: mqttmgr has not been initialized
+ *  - ESP_ERR_INVALID_ARG: Unknown topic or policy out of range
+ *  - Others: From saving to NVS, the policy is used anyway
+ */
+esp_err_t mqttmgr_set_topic_policy(mqttmgr_topicidx topic,
+                                   const mqttmgr_topic_policy_t *policy);
+
+/**
+ * @brief How messages to a topic are published
+ *
+ * @param topic  Topic the policy is for
+ * @param policy Filled in with the policy
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_STATE: mqttmgr has not been initialized
+ *  - ESP_ERR_INVALID_ARG: Unknown topic
+ */
+esp_err_t mqttmgr_get_topic_policy(mqttmgr_topicidx topic,
+                                   mqttmgr_topic_policy_t *policy);
+
 /**
  * @brief Initalize MQTT config and internal state
  *
@@ -99,7 +191,8 @@ esp_err_t mqttmgr_init(char *device_id);
  * @brief Start ESP-MQTT-Client, MQTT Task handler
  *
  * Once MQTT task is running it waits for ESP-MQTT-Client to be fully connected
- * before getting messages from registered handlers
+ * before getting messages from registered handlers. WiFi has to be connected
+ * and the default event loop created, as wifi_provision leaves them.
  *
  * @return
  *  - ESP_OK: Success
@@ -116,6 +209,18 @@ esp_err_t mqttmgr_start();
  */
 esp_err_t mqttmgr_stop();
 
+/**
+ * @brief Wait for every queued message to be acknowledged by the broker
+ *
+ * For use before cutting power to the radio, e.g. going into deep sleep.
+ *
+ * @param timeout Ticks to wait at most
+ * @return
+ *  - ESP_OK: Nothing left to deliver
+ *  - ESP_ERR_TIMEOUT: Messages are still queued or in flight
+ */
+esp_err_t mqttmgr_flush(TickType_t timeout);
+
 /**
  * @brief Queue a message to be sent
  *
@@ -131,4 +236,46 @@ esp_err_t mqttmgr_stop();
 esp_err_t mqttmgr_queuemsg(mqttmgr_topicidx topic, size_t msg_len, void *msg,
                            TickType_t delay);
 
+/**
+ * @brief Reserve a slot in the outbound queue to serialize a message into
+ *
+ * Lets producers write a message straight into the queue instead of rendering
+ * it into a temporary buffer that mqttmgr_queuemsg then copies. msg->msg has
+ * room for max_len bytes, once written set msg->len to the bytes actually used
+ * and hand it to mqttmgr_commitmsg. Every acquired slot MUST be committed, a
+ * msg->len of 0 discards the slot.
+ *
+ * The slot stays reserved until the broker acknowledges the publish, set
+ * msg->delivered before committing to be told when that happens.
+ *
+ * @param topic   Topic to publish the message to
+ * @param max_len Bytes to reserve for the message body
+ * @param msg_out Reserved slot
+ * @param delay   Slot reservation timeout
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_STATE: mqttmgr has not been started
+ *  - ESP_ERR_INVALID_ARG: max_len can never fit in the queue
+ *  - ESP_ERR_NO_MEM: Queue full till the timeout
+ */
+esp_err_t mqttmgr_acquiremsg(mqttmgr_topicidx topic, size_t max_len,
+                             mqttmgr_msg_t **msg_out, TickType_t delay);
+
+/**
+ * @brief Largest message body that can be queued and published
+ *
+ * Bounded by both the outbound queue and the esp-mqtt client buffer.
+ */
+size_t mqttmgr_msg_max_len();
+
+/**
+ * @brief Queue a slot from mqttmgr_acquiremsg to be sent
+ *
+ * @param msg Slot with msg->len set
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_FAIL: Failed to commit the slot
+ */
+esp_err_t mqttmgr_commitmsg(mqttmgr_msg_t *msg);
+
 #endif
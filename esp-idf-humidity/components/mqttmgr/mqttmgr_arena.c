@@ -0,0 +1,48 @@
+#include "mqttmgr_arena.h"
+
+#include <stdalign.h>
+#include <string.h>
+
+#define MQTTMGR_ARENA_ALIGN alignof(max_align_t)
+
+static void *mqttmgr_arena_pb_alloc(void *allocator_data, size_t size) {
+  return mqttmgr_arena_alloc(allocator_data, size);
+}
+
+static void mqttmgr_arena_pb_free(void *allocator_data, void *pointer) {
+  // Freed all at once by mqttmgr_arena_reset
+}
+
+void mqttmgr_arena_init(mqttmgr_arena_t *arena, void *buf, size_t size) {
+  *arena = (mqttmgr_arena_t){
+      .buf = buf,
+      .size = size,
+      .used = 0,
+      .high_water = 0,
+      .allocator =
+          {
+              .alloc = mqttmgr_arena_pb_alloc,
+              .free = mqttmgr_arena_pb_free,
+              .allocator_data = arena,
+          },
+  };
+}
+
+void *mqttmgr_arena_alloc(mqttmgr_arena_t *arena, size_t size) {
+  size_t start = (arena->used + MQTTMGR_ARENA_ALIGN - 1) &
+                 ~(size_t)(MQTTMGR_ARENA_ALIGN - 1);
+  void *mem;
+
+  if (start > arena->size || size > arena->size - start) {
+    return NULL;
+  }
+  mem = arena->buf + start;
+  arena->used = start + size;
+  if (arena->used > arena->high_water) {
+    arena->high_water = arena->used;
+  }
+  memset(mem, 0, size);
+  return mem;
+}
+
+void mqttmgr_arena_reset(mqttmgr_arena_t *arena) { arena->used = 0; }
@@ -0,0 +1,60 @@
+#ifndef MQTTMGR_ARENA_H
+#define MQTTMGR_ARENA_H
+
+#include <protobuf-c/protobuf-c.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bump allocator for the messages of a single command
+ *
+ * The request is unpacked into the arena, command handlers build their
+ * response in it, and the packed response is written to it. Once the
+ * response is published the whole arena is reset at once, nothing is freed
+ * on its own.
+ */
+
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  size_t used;
+  size_t high_water;  // Most ever used
+  ProtobufCAllocator allocator;  // For protobuf-c, allocates from the arena
+} mqttmgr_arena_t;
+
+// Zeroed type from the arena, NULL when it's full
+#define MQTTMGR_ARENA_NEW(arena, type) \
+  ((type *)mqttmgr_arena_alloc((arena), sizeof(type)))
+// Zeroed array of cnt type from the arena, NULL when it's full
+#define MQTTMGR_ARENA_NEW_ARRAY(arena, type, cnt) \
+  ((type *)mqttmgr_arena_alloc((arena), (cnt) * sizeof(type)))
+
+/**
+ * @brief Set up an arena over a buffer
+ *
+ * @param arena Arena
+ * @param buf   Handed out by the arena, aligned for any type
+ * @param size  Of buf
+ */
+void mqttmgr_arena_init(mqttmgr_arena_t *arena, void *buf, size_t size);
+
+/**
+ * @brief Allocate zeroed memory, aligned for any type
+ *
+ * @return The memory, NULL when the arena doesn't have size bytes left
+ */
+void *mqttmgr_arena_alloc(mqttmgr_arena_t *arena, size_t size);
+
+/**
+ * @brief Free everything allocated from the arena
+ */
+void mqttmgr_arena_reset(mqttmgr_arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,23 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "mqttlog.h"
+#include "unity.h"
+
+TEST_CASE("mqttlog_limit_take allows a burst then one per interval",
+          "[mqttlog]") {
+  mqttlog_limit_t limit = {0};
+  int idx;
+
+  if (CONFIG_MQTTLOG_RATE_BURST == 0) {
+    TEST_IGNORE_MESSAGE("Rate limit turned off");
+  }
+  for (idx = 0; idx < CONFIG_MQTTLOG_RATE_BURST; idx++) {
+    TEST_ASSERT_TRUE(mqttlog_limit_take(&limit));
+  }
+  TEST_ASSERT_FALSE(mqttlog_limit_take(&limit));
+
+  vTaskDelay(pdMS_TO_TICKS(CONFIG_MQTTLOG_RATE_INTERVAL) + 1);
+  TEST_ASSERT_TRUE(mqttlog_limit_take(&limit));
+  TEST_ASSERT_FALSE(mqttlog_limit_take(&limit));
+}
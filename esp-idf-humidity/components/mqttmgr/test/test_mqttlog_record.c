@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "mqttlog_record.h"
+#include "mqttlog_render.h"
+#include "unity.h"
+
+#define RECORD_TIMESTAMP 1650000000
+// ESP_LOG_INFO
+#define RECORD_LEVEL 3
+
+static uint8_t record_buffer[512];
+static uint8_t batch_buffer[512];
+static char render_buffer[512];
+
+// Tags of a sensormgr stats line, the longest one logged
+static const mqttlog_tag_t stats_tags[] = {
+    MQTTLOG_UINT("disk_free_kb", 1400),
+    MQTTLOG_UINT("disk_total_size", 1512),
+    MQTTLOG_BOOL("low_water", false),
+    MQTTLOG_BOOL("high_water", true),
+    MQTTLOG_STR("uptime", "01:02:03.004"),
+    MQTTLOG_UINT("emitted", 123456),
+    MQTTLOG_INT("err", -259),
+    MQTTLOG_FLOAT("mean", 21.5),
+};
+#define STATS_TAG_CNT (sizeof(stats_tags) / sizeof(stats_tags[0]))
+
+static size_t encode_stats(uint8_t *buf, size_t size, time_t now) {
+  return mqttlog_record_encode(buf, size, now, "sensormgr", RECORD_LEVEL,
+                               "current stats", stats_tags, STATS_TAG_CNT);
+}
+
+static uint8_t *put_hash(uint8_t *p, const char *s) {
+  uint32_t hash = mqttlog_record_hash(s);
+
+  memcpy(p, &hash, sizeof(hash));
+  return p + sizeof(hash);
+}
+
+TEST_CASE("mqttlog_record_hash is 32 bit FNV-1a", "[mqttlog]") {
+  TEST_ASSERT_EQUAL_UINT32(2166136261u, mqttlog_record_hash(""));
+  TEST_ASSERT_EQUAL_UINT32(0xe40c292cu, mqttlog_record_hash("a"));
+  TEST_ASSERT_EQUAL_UINT32(0xbf9cf968u, mqttlog_record_hash("foobar"));
+}
+
+TEST_CASE("mqttlog_record_encode lays out a record", "[mqttlog]") {
+  const mqttlog_tag_t tags[] = {
+      MQTTLOG_INT("err", -1),
+      MQTTLOG_STR("ip", "10.0.0.2"),
+  };
+  uint8_t expected[64], *p = expected;
+  size_t len;
+
+  // Timestamp 2 zigzags to 4
+  *p++ = 4;
+  *p++ = RECORD_LEVEL;
+  p = put_hash(p, "main");
+  p = put_hash(p, "test message");
+  *p++ = 2;
+  p = put_hash(p, "err");
+  *p++ = MQTTLOG_TAG_INT;
+  *p++ = 1;
+  p = put_hash(p, "ip");
+  *p++ = MQTTLOG_TAG_STR;
+  *p++ = 8;
+  memcpy(p, "10.0.0.2", 8);
+  p += 8;
+
+  len = mqttlog_record_encode(record_buffer, sizeof(record_buffer), 2, "main",
+                              RECORD_LEVEL, "test message", tags, 2);
+  TEST_ASSERT_EQUAL(p - expected, len);
+  TEST_ASSERT_EQUAL_MEMORY(expected, record_buffer, len);
+  TEST_ASSERT_EQUAL(len, mqttlog_record_encode(NULL, 0, 2, "main",
+                                               RECORD_LEVEL, "test message",
+                                               tags, 2));
+}
+
+TEST_CASE("mqttlog_record_batch_add deltas timestamps till full",
+          "[mqttlog]") {
+  size_t record_len, len, single_len, cnt = 0;
+  time_t prev;
+
+  record_len = encode_stats(record_buffer, sizeof(record_buffer),
+                            RECORD_TIMESTAMP);
+  len = mqttlog_record_batch_start(batch_buffer, &prev);
+  TEST_ASSERT_EQUAL(1, len);
+  TEST_ASSERT_EQUAL(MQTTLOG_RECORD_VERSION, batch_buffer[0]);
+
+  // The first record keeps the full timestamp
+  TEST_ASSERT_TRUE(mqttlog_record_batch_add(batch_buffer, sizeof(batch_buffer),
+                                            &len, &prev, record_buffer,
+                                            record_len));
+  TEST_ASSERT_EQUAL(1 + record_len, len);
+  TEST_ASSERT_EQUAL_MEMORY(record_buffer, batch_buffer + 1, record_len);
+  TEST_ASSERT_EQUAL(RECORD_TIMESTAMP, prev);
+
+  // The next one second later has a one byte delta
+  single_len = len;
+  record_len = encode_stats(record_buffer, sizeof(record_buffer),
+                            RECORD_TIMESTAMP + 1);
+  TEST_ASSERT_TRUE(mqttlog_record_batch_add(batch_buffer, sizeof(batch_buffer),
+                                            &len, &prev, record_buffer,
+                                            record_len));
+  TEST_ASSERT_EQUAL(2, batch_buffer[single_len]);
+  TEST_ASSERT_EQUAL_MEMORY(record_buffer + 5, batch_buffer + single_len + 1,
+                           record_len - 5);
+
+  // Fill the message, a record that doesn't fit leaves it alone
+  while (mqttlog_record_batch_add(batch_buffer, sizeof(batch_buffer), &len,
+                                  &prev, record_buffer, record_len)) {
+    cnt++;
+  }
+  TEST_ASSERT_GREATER_THAN(0, cnt);
+  TEST_ASSERT_LESS_OR_EQUAL(sizeof(batch_buffer), len);
+  TEST_ASSERT_GREATER_THAN(sizeof(batch_buffer), len + record_len - 4);
+}
+
+TEST_CASE("mqttlog bench - JSON vs binary record per log line",
+          "[mqttlog][bench]") {
+  size_t json_len, record_len;
+
+  json_len = mqttlog_render(render_buffer, sizeof(render_buffer),
+                            RECORD_TIMESTAMP, "sensormgr", "INFO",
+                            "current stats", stats_tags, STATS_TAG_CNT);
+  record_len = encode_stats(record_buffer, sizeof(record_buffer),
+                            RECORD_TIMESTAMP);
+  // Batched records after the first carry a one byte timestamp
+  printf("JSON:    %u bytes per log line\n", json_len);
+  printf("binary:  %u bytes, %u batched\n", record_len, record_len - 4);
+  TEST_ASSERT_LESS_THAN(json_len / 2, record_len);
+}
@@ -0,0 +1,178 @@
+#include <cJSON.h>
+#include <esp_attr.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqttlog_render.h"
+#include "unity.h"
+
+#define RENDER_TIMESTAMP 1650000000
+// Log lines per bench run
+#define BENCH_LINE_CNT 100
+
+static size_t json_alloc_cnt;
+static volatile size_t render_alloc_cnt;
+static volatile TaskHandle_t render_task;  // Whose allocations are counted
+static char render_buffer[512];
+
+// Tags of a sensormgr stats line, the longest one logged
+static const mqttlog_tag_t stats_tags[] = {
+    MQTTLOG_UINT("disk_free_kb", 1400),
+    MQTTLOG_UINT("disk_total_size", 1512),
+    MQTTLOG_BOOL("low_water", false),
+    MQTTLOG_BOOL("high_water", true),
+    MQTTLOG_STR("uptime", "01:02:03.004"),
+    MQTTLOG_STR("location", "office \"north\"\n"),
+    MQTTLOG_UINT("emitted", 123456),
+    MQTTLOG_INT("err", -259),
+    MQTTLOG_INT64("boot_ms", 1834),
+    MQTTLOG_FLOAT("deadband", 0.1f),
+    MQTTLOG_FLOAT("mean", 21.5),
+};
+#define STATS_TAG_CNT (sizeof(stats_tags) / sizeof(stats_tags[0]))
+
+static void *counting_malloc(size_t sz) {
+  json_alloc_cnt++;
+  return malloc(sz);
+}
+
+#if CONFIG_HEAP_USE_HOOKS
+// Called by the heap for every allocation, including newlib's own
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size,
+                                         uint32_t caps) {
+  if (render_task != NULL && xTaskGetCurrentTaskHandle() == render_task) {
+    render_alloc_cnt++;
+  }
+}
+#endif
+
+/**
+ * @brief Render tags the way mqttlog did before, as a cJSON tree
+ */
+static char *render_cjson(const mqttlog_tag_t *tags, size_t tag_cnt) {
+  cJSON *json, *json_tags;
+  char *rendered;
+  size_t idx;
+
+  json = cJSON_CreateObject();
+  cJSON_AddStringToObject(json, "timestamp", "2022-04-15T05:20:00Z");
+  cJSON_AddStringToObject(json, "source", "sensormgr");
+  cJSON_AddStringToObject(json, "level", "INFO");
+  cJSON_AddStringToObject(json, "event", "current stats");
+  cJSON_AddItemToObject(json, "tags", json_tags = cJSON_CreateObject());
+  for (idx = 0; idx < tag_cnt; idx++) {
+    switch (tags[idx].type) {
+      case MQTTLOG_TAG_STR:
+        cJSON_AddStringToObject(json_tags, tags[idx].key, tags[idx].s);
+        break;
+      case MQTTLOG_TAG_BOOL:
+        cJSON_AddBoolToObject(json_tags, tags[idx].key, tags[idx].b);
+        break;
+      case MQTTLOG_TAG_INT:
+        cJSON_AddNumberToObject(json_tags, tags[idx].key, tags[idx].i);
+        break;
+      case MQTTLOG_TAG_UINT:
+        cJSON_AddNumberToObject(json_tags, tags[idx].key, tags[idx].u);
+        break;
+      case MQTTLOG_TAG_INT64:
+        cJSON_AddNumberToObject(json_tags, tags[idx].key, tags[idx].l);
+        break;
+      case MQTTLOG_TAG_FLOAT:
+        cJSON_AddNumberToObject(json_tags, tags[idx].key, tags[idx].f);
+        break;
+    }
+  }
+  rendered = cJSON_PrintUnformatted(json);
+  cJSON_Delete(json);
+  return rendered;
+}
+
+static size_t render_stats(char *buf, size_t size) {
+  return mqttlog_render(buf, size, RENDER_TIMESTAMP, "sensormgr", "INFO",
+                        "current stats", stats_tags, STATS_TAG_CNT);
+}
+
+TEST_CASE("mqttlog_render matches the cJSON rendering", "[mqttlog]") {
+  char *expected = render_cjson(stats_tags, STATS_TAG_CNT);
+  size_t len = render_stats(render_buffer, sizeof(render_buffer));
+
+  TEST_ASSERT_NOT_NULL(expected);
+  TEST_ASSERT_EQUAL_STRING(expected, render_buffer);
+  TEST_ASSERT_EQUAL(strlen(expected), len);
+  free(expected);
+
+  len = mqttlog_render(render_buffer, sizeof(render_buffer), RENDER_TIMESTAMP,
+                       "main", "WARN", "test message", NULL, 0);
+  TEST_ASSERT_EQUAL_STRING(
+      "{\"timestamp\":\"2022-04-15T05:20:00Z\",\"source\":\"main\","
+      "\"level\":\"WARN\",\"event\":\"test message\",\"tags\":{}}",
+      render_buffer);
+  TEST_ASSERT_EQUAL(strlen(render_buffer), len);
+}
+
+TEST_CASE("mqttlog_render formats int64 tags", "[mqttlog]") {
+  static const mqttlog_tag_t int64_tags[] = {
+      MQTTLOG_INT64("min", INT64_MIN),
+      MQTTLOG_INT64("max", INT64_MAX),
+      MQTTLOG_INT64("zero", 0),
+      MQTTLOG_INT64("neg", -1834),
+  };
+
+  mqttlog_render(render_buffer, sizeof(render_buffer), RENDER_TIMESTAMP,
+                 "main", "INFO", "int64", int64_tags,
+                 sizeof(int64_tags) / sizeof(int64_tags[0]));
+  TEST_ASSERT_NOT_NULL(strstr(render_buffer,
+                              "{\"min\":-9223372036854775808,"
+                              "\"max\":9223372036854775807,\"zero\":0,"
+                              "\"neg\":-1834}"));
+}
+
+TEST_CASE("mqttlog_render sizes and cuts short like snprintf", "[mqttlog]") {
+  size_t len = render_stats(NULL, 0);
+  char small[16];
+
+  TEST_ASSERT_EQUAL(len, render_stats(render_buffer, sizeof(render_buffer)));
+  TEST_ASSERT_EQUAL(len, render_stats(render_buffer, len + 1));
+  TEST_ASSERT_EQUAL(len, strlen(render_buffer));
+
+  memset(small, 'x', sizeof(small));
+  TEST_ASSERT_EQUAL(len, render_stats(small, sizeof(small)));
+  TEST_ASSERT_EQUAL(sizeof(small) - 1, strlen(small));
+  TEST_ASSERT_EQUAL_MEMORY(render_buffer, small, sizeof(small) - 1);
+}
+
+TEST_CASE("mqttlog bench - cJSON tree vs streaming render per log line",
+          "[mqttlog][bench]") {
+  cJSON_Hooks hooks = {.malloc_fn = counting_malloc, .free_fn = free};
+  size_t len = 0;
+  uint32_t idx;
+
+  cJSON_InitHooks(&hooks);
+  json_alloc_cnt = 0;
+  for (idx = 0; idx < BENCH_LINE_CNT; idx++) {
+    free(render_cjson(stats_tags, STATS_TAG_CNT));
+  }
+  cJSON_InitHooks(NULL);
+
+  render_alloc_cnt = 0;
+  render_task = xTaskGetCurrentTaskHandle();
+  for (idx = 0; idx < BENCH_LINE_CNT; idx++) {
+    len = render_stats(NULL, 0);
+    render_stats(render_buffer, len + 1);
+  }
+  render_task = NULL;
+
+  printf("cJSON:     %u heap allocations per log line\n",
+         json_alloc_cnt / BENCH_LINE_CNT);
+  printf("streaming: %u bytes, %u heap allocations\n", len,
+         render_alloc_cnt);
+  TEST_ASSERT_GREATER_THAN(STATS_TAG_CNT, json_alloc_cnt / BENCH_LINE_CNT);
+#if CONFIG_HEAP_USE_HOOKS
+  TEST_ASSERT_EQUAL(0, render_alloc_cnt);
+#else
+  TEST_IGNORE_MESSAGE("enable CONFIG_HEAP_USE_HOOKS to count allocations");
+#endif
+}
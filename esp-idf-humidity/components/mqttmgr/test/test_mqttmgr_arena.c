@@ -0,0 +1,60 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mqttmgr_arena.h"
+#include "unity.h"
+
+static alignas(max_align_t) uint8_t arena_buffer[256];
+
+TEST_CASE("mqttmgr_arena_alloc hands out zeroed aligned memory",
+          "[mqttmgr]") {
+  mqttmgr_arena_t arena;
+  uint8_t *a, *b;
+
+  memset(arena_buffer, 0xAA, sizeof(arena_buffer));
+  mqttmgr_arena_init(&arena, arena_buffer, sizeof(arena_buffer));
+  a = mqttmgr_arena_alloc(&arena, 3);
+  b = mqttmgr_arena_alloc(&arena, 8);
+  TEST_ASSERT_NOT_NULL(a);
+  TEST_ASSERT_NOT_NULL(b);
+  TEST_ASSERT_EQUAL(0, (uintptr_t)b % alignof(max_align_t));
+  TEST_ASSERT_TRUE(b >= a + 3);
+  TEST_ASSERT_EACH_EQUAL_UINT8(0, a, 3);
+  TEST_ASSERT_EACH_EQUAL_UINT8(0, b, 8);
+}
+
+TEST_CASE("mqttmgr_arena_alloc returns NULL when full till reset",
+          "[mqttmgr]") {
+  mqttmgr_arena_t arena;
+  void *first;
+
+  mqttmgr_arena_init(&arena, arena_buffer, sizeof(arena_buffer));
+  first = mqttmgr_arena_alloc(&arena, sizeof(arena_buffer) - 8);
+  TEST_ASSERT_NOT_NULL(first);
+  TEST_ASSERT_NULL(mqttmgr_arena_alloc(&arena, 16));
+  TEST_ASSERT_NULL(mqttmgr_arena_alloc(&arena, SIZE_MAX));
+  TEST_ASSERT_EQUAL(sizeof(arena_buffer) - 8, arena.high_water);
+
+  mqttmgr_arena_reset(&arena);
+  TEST_ASSERT_EQUAL(0, arena.used);
+  TEST_ASSERT_EQUAL(sizeof(arena_buffer) - 8, arena.high_water);
+  TEST_ASSERT_EQUAL_PTR(first, mqttmgr_arena_alloc(&arena, 16));
+}
+
+TEST_CASE("mqttmgr_arena allocator hooks allocate from the arena",
+          "[mqttmgr]") {
+  mqttmgr_arena_t arena;
+  ProtobufCAllocator *allocator = &arena.allocator;
+  uint8_t *mem;
+
+  mqttmgr_arena_init(&arena, arena_buffer, sizeof(arena_buffer));
+  mem = allocator->alloc(allocator->allocator_data, 32);
+  TEST_ASSERT_EQUAL_PTR(arena_buffer, mem);
+  TEST_ASSERT_EQUAL(32, arena.used);
+
+  // Freeing is left to the reset
+  allocator->free(allocator->allocator_data, mem);
+  TEST_ASSERT_EQUAL(32, arena.used);
+}
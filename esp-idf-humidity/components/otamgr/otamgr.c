@@ -66,28 +66,31 @@ static void otamgr_update_task(void *pvParam) {
 
   err = esp_https_ota_begin(&ota_config, &ota_handle);
   if (err != ESP_OK) {
-    MQTTLOG_LOGE(TAG, "OTA Update failed", "stage=begin");
+    MQTTLOG_LOGE(TAG, "OTA Update failed", MQTTLOG_STR("stage", "begin"));
     goto ota_end;
   }
-  MQTTLOG_LOGI(TAG, "OTA Update checkpoint complete", "stage=begin");
+  MQTTLOG_LOGI(TAG, "OTA Update checkpoint complete",
+               MQTTLOG_STR("stage", "begin"));
 
   esp_app_desc_t app_desc;
   err = esp_https_ota_get_img_desc(ota_handle, &app_desc);
   if (err != ESP_OK) {
-    MQTTLOG_LOGE(TAG, "OTA Update failed", "stage=esp_https_ota_read_img_desc");
+    MQTTLOG_LOGE(TAG, "OTA Update failed",
+                 MQTTLOG_STR("stage", "esp_https_ota_read_img_desc"));
     goto ota_end;
   }
   MQTTLOG_LOGI(TAG, "OTA Update checkpoint complete",
-               "stage=esp_https_ota_read_img_desc");
+               MQTTLOG_STR("stage", "esp_https_ota_read_img_desc"));
 
   err = validate_image_header(&app_desc);
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "image header verification failed");
-    MQTTLOG_LOGE(TAG, "OTA Update failed", "stage=validate_image_header");
+    MQTTLOG_LOGE(TAG, "OTA Update failed",
+                 MQTTLOG_STR("stage", "validate_image_header"));
     goto ota_end;
   }
   MQTTLOG_LOGI(TAG, "OTA Update checkpoint complete",
-               "stage=validate_image_header");
+               MQTTLOG_STR("stage", "validate_image_header"));
 
   while (1) {
     err = esp_https_ota_perform(ota_handle);
@@ -98,13 +101,15 @@ static void otamgr_update_task(void *pvParam) {
              esp_https_ota_get_image_len_read(ota_handle));
   }
 
-  MQTTLOG_LOGI(TAG, "OTA Update checkpoint complete", "stage=image_download");
+  MQTTLOG_LOGI(TAG, "OTA Update checkpoint complete",
+               MQTTLOG_STR("stage", "image_download"));
   if (esp_https_ota_is_complete_data_received(ota_handle) != true) {
     // the OTA image was not completely received and user can customise the
     // response to this situation.
     ESP_LOGE(TAG, "Complete data was not received.");
-    MQTTLOG_LOGE(TAG, "OTA Update failed",
-                 "stage=esp_https_ota_is_complete_data_received");
+    MQTTLOG_LOGE(
+        TAG, "OTA Update failed",
+        MQTTLOG_STR("stage", "esp_https_ota_is_complete_data_received"));
     err = ESP_FAIL;
   } else {
     err = esp_https_ota_finish(ota_handle);
@@ -115,53 +120,50 @@ static void otamgr_update_task(void *pvParam) {
       esp_restart();
     } else {
       if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-        MQTTLOG_LOGE(TAG, "OTA Update failed", "stage=image_corrupted");
+        MQTTLOG_LOGE(TAG, "OTA Update failed",
+                     MQTTLOG_STR("stage", "image_corrupted"));
       }
       MQTTLOG_LOGE(TAG, "OTA Update failed",
-                   "stage=image_validation_failed err=0x%u", err);
+                   MQTTLOG_STR("stage", "image_validation_failed"),
+                   MQTTLOG_INT("err", err));
     }
   }
 
 ota_end:
   esp_https_ota_abort(ota_handle);
-  MQTTLOG_LOGE(TAG, "OTA Update failed", "stage=ota_end");
+  MQTTLOG_LOGE(TAG, "OTA Update failed", MQTTLOG_STR("stage", "ota_end"));
   update_task_handle = NULL;
   vTaskDelete(NULL);
 }
 
-static void otamgr_cmd_update_request_dealloc_cb(CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "otamgr_cmd_update_request_dealloc_cb - freeing");
-  free(resp_out->otamgr_update_response);
-}
-
 static CommandResponse__RetCodeT otamgr_cmd_update_request(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_OTAMGR_UPDATE_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  Otamgr__UpdateResponse *cmd_resp =
+      MQTTMGR_ARENA_NEW(arena, Otamgr__UpdateResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
-
   resp_out->resp_case = COMMAND_RESPONSE__RESP_OTAMGR_UPDATE_RESPONSE;
-  *cb = otamgr_cmd_update_request_dealloc_cb;
-  Otamgr__UpdateResponse *cmd_resp =
-      (Otamgr__UpdateResponse *)calloc(1, sizeof(Otamgr__UpdateResponse));
   otamgr__update_response__init(cmd_resp);
   resp_out->otamgr_update_response = cmd_resp;
 
   if (update_task_handle != NULL) {
-    MQTTLOG_LOGW(TAG, "OTA Update request failed", "reason=already_running");
+    MQTTLOG_LOGW(TAG, "OTA Update request failed",
+                 MQTTLOG_STR("reason", "already_running"));
     return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
   if (pdPASS != xTaskCreate(otamgr_update_task, "otamgr", 4096, (void *)1, 1,
                             &update_task_handle)) {
     MQTTLOG_LOGW(TAG, "OTA Update request failed",
-                 "reason=task_creation_failed");
+                 MQTTLOG_STR("reason", "task_creation_failed"));
     return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
   return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
 }
 
 esp_err_t otamgr_init() {
-  mqttmgr_register_cmd_handler(otamgr_cmd_update_request);
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_OTAMGR_UPDATE_REQUEST, otamgr_cmd_update_request));
   return ESP_OK;
 }
 
@@ -1,59 +1,184 @@
 #include "sensormgr.h"
 
+#include <cJSON.h>
 #include <commands.pb-c.h>
+#include <esp_attr.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_sleep.h>
+#include <esp_system.h>
+#include <esp_timer.h>
 #include <esp_vfs.h>
 #include <esp_vfs_fat.h>
-#include <freertos/ringbuf.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <math.h>
 #include <mqttlog.h>
 #include <mqttmgr.h>
 #include <nvs_flash.h>
 #include <stdatomic.h>
 #include <string.h>
 
+#include "sensormgr_aggregate.h"
+#include "sensormgr_batch.h"
+#include "sensormgr_checkpoint.h"
+#include "sensormgr_clock.h"
+#include "sensormgr_deadband.h"
+#include "sensormgr_flush.h"
+#include "sensormgr_index.h"
+#include "sensormgr_queue.h"
+#include "sensormgr_rtc.h"
+#include "sensormgr_sample.h"
+#include "sensormgr_schedule.h"
+#include "sensormgr_spill.h"
+
 // TODO: Convert this to an actual kconfig value
 #define CONFIG_SENSOR_COUNT 4
+// Values measured across all sensors, temperature and humidity are two
+#define SENSORMGR_CHANNELS_MAX 8
 
 #define SENSORMGR_NVS_LOCATION_KEY "location"
+#define SENSORMGR_NVS_DATA_FORMAT_KEY "data_format"
+#define SENSORMGR_NVS_BACKFILL_KEY "backfill"
+#define SENSORMGR_NVS_AGGREGATE_KEY "agg_window"
+#define SENSORMGR_NVS_DEADBAND_KEY "deadbands"
+#define SENSORMGR_NVS_FLUSH_KEY "flush_policy"
+#define SENSORMGR_DATA_DIR "/log_data"
+#define SENSORMGR_INDEX_PATH SENSORMGR_DATA_DIR "/SPILL.IDX"
+#define SENSORMGR_INDEX_TMP_PATH SENSORMGR_DATA_DIR "/SPILL.TMP"
 #define SENSORMGR_TASKNAME_READ "sensormgr"
 #define SENSORMGR_TASKNAME_QUEUE "sensormgr-q"
-#define SENSORMGR_TASKNAME_FILEWRITER "sensormgr-fw"
 #define SENSORMGR_TASK_STACKSIZE 3 * 1024
-#define SENSORMGR_RINBUFFER_SIZE CONFIG_SENSORMGR_RINGBUF_SIZE * 1024
-// Ringbuffer free space is by max item size that can be sent in
-#define SENSORMGR_RINBUFFER_LOWWATER (SENSORMGR_RINBUFFER_SIZE / 2) - 32
-// TODO: This should be configurable via the command channel
-#define SENSORMGR_RINBUFFER_LOWWATER_ITEM_CNT 15
-// 12% space remaining means drain the queue to the FS
-#define SENSORMGR_RINBUFFER_HIGHWATER SENSORMGR_RINBUFFER_SIZE / 8
-// 128K left on FS means stop writing for now
-#define SENSORMGR_FS_HIGHWATER 128
+#define SENSORMGR_QUEUE_SIZE (CONFIG_SENSORMGR_RINGBUF_SIZE * 1024)
+// Wait for PUBACKs of a drained file this long before checking in again
+#define SENSORMGR_DRAIN_ACK_WAIT_MS 1000
+// Wait for room in the mqttmgr queue this long before checking whether the
+// sample queue has to be spilled instead
+#define SENSORMGR_DISPATCH_WAIT_MS 1000
+
+// Shortest deep sleep between wakes, however long measuring took
+#define SENSORMGR_DEEP_SLEEP_MIN_US 1000000LL
+// How often an upload checks whether everything has been sent
+#define SENSORMGR_UPLOAD_POLL_MS 500
+
+// Log stats as often as every 250 polls at the default rate did
+#define SENSORMGR_STATS_INTERVAL \
+  (250 * pdMS_TO_TICKS(CONFIG_SENSORMGR_SAMPLE_RATE))
+
+// Longest aggregation window, a day
+#define SENSORMGR_AGGREGATE_WINDOW_MAX (24 * 60 * 60)
+
+// SensorBackfill.spill, field 4 length delimited
+#define SENSORMGR_BACKFILL_SPILL_TAG ((4 << 3) | 2)
+// Tag and the largest length varint of SensorBackfill.spill
+#define SENSORMGR_BACKFILL_SPILL_OVERHEAD (1 + 3)
+
+_Static_assert(SENSORMGR_CHANNELS_MAX <= SENSORMGR_SPILL_SENSORS_MAX,
+               "spill files can't describe every channel");
+_Static_assert(SENSORMGR_CHANNELS_MAX <= SENSORMGR_BATCH_CHANNELS_MAX &&
+                   SENSORMGR_MSG_READING_CNT <= SENSORMGR_BATCH_READINGS_MAX,
+               "a message of samples doesn't fit a SensorBatch");
+_Static_assert(CONFIG_SENSOR_COUNT <= SENSORMGR_SCHEDULE_MAX,
+               "not every sensor can be scheduled");
+_Static_assert(SENSORMGR_CHANNELS_MAX <= SENSORMGR_SAMPLE_CHANNEL_MAX + 1,
+               "samples can't hold every channel index");
+
+// Deadband of a channel as persisted in NVS, keyed by sensor and unit
+typedef struct {
+  char sensor[16];
+  char unit[8];
+  float deadband;
+  uint32_t heartbeat_sec;
+} deadband_entry_t;
+
+// Deadbands with the ones of a SetOptions request set, till it is applied
+typedef struct {
+  uint8_t entry_cnt;
+  deadband_entry_t entries[SENSORMGR_CHANNELS_MAX];
+  sensormgr_deadband_cfg_t cfgs[SENSORMGR_CHANNELS_MAX];
+} deadband_set_t;
 
 typedef struct _state_t {
   bool initilized;
   uint8_t sensor_cnt;
-  uint8_t LOWWATER_ITEM_CNT;
+  uint8_t channel_cnt;
   sensormgr_registration_t sensors[CONFIG_SENSOR_COUNT];
-  TaskHandle_t measure_task_handle, queue_task_handle, filewriter_task_handle;
-  RingbufHandle_t ring_buffer;
+  uint8_t sensor_channel[CONFIG_SENSOR_COUNT];  // First channel of the sensor
+  sensormgr_schedule_t schedule;  // Of the sensor read task
+  sensormgr_channel_t channels[SENSORMGR_CHANNELS_MAX];
+  uint8_t spill_data_len[SENSORMGR_CHANNELS_MAX];  // For the spill file header
+  Sensormgr__SensorBackfill__Channel backfill_channels[SENSORMGR_CHANNELS_MAX];
+  Sensormgr__SensorBackfill__Channel
+      *backfill_channel_ptrs[SENSORMGR_CHANNELS_MAX];
+  TaskHandle_t measure_task_handle, queue_task_handle;
+  // Handshakes of sensormgr_stop and sensormgr_start with each task
+  SemaphoreHandle_t read_parked, read_resume;
+  SemaphoreHandle_t dispatch_parked, dispatch_resume;
+  bool stopped;  // Both tasks parked
+  sensormgr_queue_t queue;  // Sensor read task to the dispatch task
   wl_handle_t wl_handle;
-  atomic_uint_fast32_t ring_buffer_item_count;
+  atomic_bool stopping;   // Spill the sample queue even while connected
   atomic_bool has_files;  // Are there files that need to be drained?
+  atomic_uint aggregate_window;  // Seconds, 0 sends every reading
+  uint32_t aggregates_window;    // Window of aggregates, read task only
+  sensormgr_aggregate_t aggregates[SENSORMGR_CHANNELS_MAX];  // Read task only
+  SemaphoreHandle_t deadband_lock;  // Entries and configurations
+  uint8_t deadband_entry_cnt;
+  deadband_entry_t deadband_entries[SENSORMGR_CHANNELS_MAX];
+  sensormgr_deadband_cfg_t deadband_cfgs[SENSORMGR_CHANNELS_MAX];
+  sensormgr_deadband_t deadbands[SENSORMGR_CHANNELS_MAX];  // Read task only
+  SemaphoreHandle_t clock_lock;
+  sensormgr_clock_t clk;  // Anchors of this boot, none till SNTP syncs
+  uint32_t boot_id;       // Tells spill files of this boot apart
+  time_t spill_time;      // Named the last spill file, dispatch task only
+  atomic_uint readings_emitted;
+  atomic_uint readings_suppressed;  // By a deadband
+  SemaphoreHandle_t flush_lock;
+  sensormgr_flush_t flush;  // Policy and how stretched it is
+  sensormgr_index_t index;
+  SemaphoreHandle_t index_lock;
+  sensormgr_checkpoint_t checkpoint;  // Of the file being drained
+  SemaphoreHandle_t checkpoint_lock;
+  Sensormgr__DataFormatT data_format;
+  Sensormgr__BackfillT backfill;
   char location_name[32];
 } state_t;
 
-typedef struct _sensor_reading_t {
+// Formats of spill files written before samples, holding driver readings
+typedef enum {
+  LEGACY_NONE = 0,
+  LEGACY_V1,   // Version 1 spill file
+  LEGACY_RAW,  // Records of legacy_raw_header_t and the reading, fwrite'd
+} legacy_format_t;
+
+// sensor_reading_t of firmware from before the spill format, as laid out on
+// the ESP32
+typedef struct {
   uint8_t type_idx;
-  size_t sensor_data_len;
-  uint8_t sensor_data[];
-} sensor_reading_t;
+  uint32_t sensor_data_len;
+} legacy_raw_header_t;
+
+// Driver reading of a legacy file, handed out one channel at a time
+typedef struct {
+  uint8_t type_idx;   // Sensor in registration order
+  uint8_t value_cnt;  // 0 when the reading was dropped
+  uint8_t value_idx;  // Next value to turn into a sample
+  time_t timestamp;
+  float values[SENSORMGR_CHANNELS_MAX];
+  uint32_t offset;  // Where to resume f_in once every value is sent
+} legacy_reading_t;
+
+static const char *sensormgr_stat_names[] = {
+    [SENSORMGR_STAT_RAW] = "raw",       [SENSORMGR_STAT_MEAN] = "mean",
+    [SENSORMGR_STAT_MIN] = "min",       [SENSORMGR_STAT_MAX] = "max",
+    [SENSORMGR_STAT_STDDEV] = "stddev", [SENSORMGR_STAT_COUNT] = "count",
+};
 
 typedef enum _sensor_iterator_state_t {
   INIT = 0,
   HFNO,  // Has Files, None Open
   HFOO,  // Has Files, One Open
+  HFDR,  // Has Files, Done Reading, waiting on PUBACKs to remove it
   NFRB,  // No Files, Ring Buffer
 } sensor_iterator_state_t;
 
@@ -61,38 +186,166 @@ typedef struct sensor_iterator_t {
   sensor_iterator_state_t state;
   FILE *f_in;
   char f_name[24];
-  sensor_reading_t *reading;
-  size_t reading_size;
+  sensormgr_spill_decoder_t *decoder;
+  legacy_format_t legacy;  // Of f_in
+  legacy_reading_t legacy_reading;
+  uint32_t file_offset;  // Where to resume f_in after the last reading
+  const sensormgr_sample_t *reading;  // Sample queue or file_reading
+  sensormgr_sample_t file_reading;    // Last sample decoded from f_in
+  int64_t timestamp;  // Of reading in ms, Unix time unless spilling
+  uint32_t queue_pos;  // Sample queue records peeked at, not released yet
 } sensor_iterator_t;
 
 static const char *TAG = SENSORMGR_TASKNAME_READ;
 static state_t state;
+// Only used by the dispatch task
+static sensormgr_batch_t batch;
+// Only used by the dispatch task
+static sensormgr_spill_encoder_t spill_encoder;
 
 // Pre-declare my static functions
-static esp_err_t sensormgr_get_first_datafile(FILE **fp, char *f_name,
-                                              size_t f_name_size);
 static esp_err_t sensormgr_read_iter(sensor_iterator_t *iter_state,
                                      bool read_files);
 static uint32_t sensormgr_free_space();
-static void sensormgr_task_file_writer(void *pvParam);
 static void sensormgr_get_free_space(uint32_t *fre_kb, uint32_t *tot_kb);
 static void sensormgr_log_free_space();
-static void sensormgr_task_queuesend(void *pvParam);
+static void sensormgr_task_dispatch(void *pvParam);
+static void sensormgr_index_commit_add(const sensormgr_index_entry_t *entry);
+static void sensormgr_index_commit_drained(uint32_t offset);
+static void sensormgr_index_commit_remove();
 static void sensormgr_task_sensorread(void *pvParam);
 
+/**
+ * @brief Copy of the flush policy, SetOptions may replace it at any time
+ */
+static sensormgr_flush_t sensormgr_flush_get() {
+  sensormgr_flush_t flush;
+
+  xSemaphoreTake(state.flush_lock, portMAX_DELAY);
+  flush = state.flush;
+  xSemaphoreGive(state.flush_lock);
+  return flush;
+}
+
+/**
+ * @brief Adapt the flush policy to whether a flush made it out
+ */
+static void sensormgr_flush_feedback(bool delivered) {
+  xSemaphoreTake(state.flush_lock, portMAX_DELAY);
+  sensormgr_flush_link(&state.flush, delivered);
+  xSemaphoreGive(state.flush_lock);
+}
+
+/**
+ * @brief ms since boot, readings are stamped with these
+ *
+ * Unlike the wall clock it never steps or slews, readings are only rebased
+ * to the wall clock when they're sent, see sensormgr_clock.h.
+ */
+static int64_t sensormgr_now() { return esp_timer_get_time() / 1000; }
+
+/**
+ * @brief Copy of the clock anchors, SNTP may add one at any time
+ */
+static sensormgr_clock_t sensormgr_clock_get() {
+  sensormgr_clock_t clk;
+
+  xSemaphoreTake(state.clock_lock, portMAX_DELAY);
+  clk = state.clk;
+  xSemaphoreGive(state.clock_lock);
+  return clk;
+}
+
+/**
+ * @brief Whether readings can be rebased to the wall clock yet
+ */
+static bool sensormgr_clock_synced() {
+  return sensormgr_clock_get().anchor_cnt != 0;
+}
+
+/**
+ * @brief Wall clock time in ms of a timestamp in ms, ms since boot stay as
+ *        they are till SNTP synced
+ */
+static int64_t sensormgr_wall_time(int64_t timestamp) {
+  int64_t boot_time;
+  sensormgr_clock_t clk;
+
+  if (timestamp >= SENSORMGR_SAMPLE_EPOCH_MS) {
+    return timestamp;  // Taken in deep sleep, by the wall clock
+  }
+  clk = sensormgr_clock_get();
+  boot_time = sensormgr_clock_boot_time(&clk, timestamp);
+  return boot_time != 0 ? boot_time + timestamp : timestamp;
+}
+
+/**
+ * @brief Stamp a timestamp in ms with the wall clock of the boot it was taken
+ *        in, for sending
+ *
+ * With the boot time still unknown it is clamped to SENSORMGR_SAMPLE_EPOCH_MS.
+ */
+static int64_t sensormgr_rebase(const sensormgr_clock_t *clk,
+                                int64_t timestamp) {
+  if (timestamp >= SENSORMGR_SAMPLE_EPOCH_MS) {
+    return timestamp;
+  }
+  timestamp += sensormgr_clock_boot_time(clk, timestamp);
+  return timestamp > SENSORMGR_SAMPLE_EPOCH_MS ? timestamp
+                                               : SENSORMGR_SAMPLE_EPOCH_MS;
+}
+
+/**
+ * @brief Anchor the clock at the current time since boot
+ */
+static void sensormgr_clock_sync(int64_t wall) {
+  int64_t mono = sensormgr_now();
+  bool first, added;
+  int64_t drift;
+
+  xSemaphoreTake(state.clock_lock, portMAX_DELAY);
+  first = state.clk.anchor_cnt == 0;
+  drift = wall - mono - sensormgr_clock_boot_time(&state.clk, mono);
+  added = sensormgr_clock_anchor(&state.clk, mono, wall);
+  xSemaphoreGive(state.clock_lock);
+  if (first) {
+    MQTTLOG_LOGI(TAG, "clock synced",
+                 MQTTLOG_INT64("boot_ms", esp_timer_get_time() / 1000));
+  } else if (added) {
+    // newlib nano printf has no %lld, a drift of ms fits an int
+    ESP_LOGI(TAG, "Clock anchored at %us, %dms off", (uint32_t)(mono / 1000),
+             (int)drift);
+  }
+}
+
+void sensormgr_time_synced(const struct timeval *tv) {
+  sensormgr_clock_sync(tv->tv_sec * 1000LL + tv->tv_usec / 1000);
+}
+
 static esp_err_t sensormgr_get_stats(Sensormgr__GetStatsResponse *stats) {
   EventBits_t curr_events = xEventGroupGetBits(mqttmgr_events);
+  sensormgr_flush_t flush = sensormgr_flush_get();
+  mqttmgr_radio_stats_t radio;
   stats->uptime_microsec = esp_timer_get_time();
   sensormgr_get_free_space(&stats->disk_free_kb, &stats->disk_total_kb);
   stats->ringbuffer_low_water = curr_events & SENSORMGR_LOWWATER_BIT;
   stats->ringbuffer_high_water = curr_events & SENSORMGR_HIGHWATER_BIT;
-  stats->disk_high_water = stats->disk_free_kb < SENSORMGR_FS_HIGHWATER;
+  stats->disk_high_water = stats->disk_free_kb < flush.cfg.fs_reserve_kb;
+  stats->readings_emitted = atomic_load(&state.readings_emitted);
+  stats->readings_suppressed = atomic_load(&state.readings_suppressed);
+  stats->flush_stretch = flush.stretch;
+  if (ESP_OK == mqttmgr_radio_stats(&radio)) {
+    stats->radio_on_ms_last_hour = radio.last_hour_on_ms;
+    stats->radio_on_ms_hour = radio.hour_on_ms;
+    stats->radio_on_ms = radio.on_ms;
+    stats->uplink_cnt = radio.uplink_cnt;
+  }
 
   return ESP_OK;
 }
 
 static void sensormgr_log_stats() {
-  Sensormgr__GetStatsResponse local;
+  Sensormgr__GetStatsResponse local = SENSORMGR__GET_STATS_RESPONSE__INIT;
   const uint64_t q = 1000, s = 60;
   char uptime[64];
 
@@ -104,28 +357,28 @@ static void sensormgr_log_stats() {
            local.uptime_microsec / q / q % s, local.uptime_microsec / q % q);
 
   MQTTLOG_LOGI(TAG, "current stats",
-               "disk_free_kb=%u disk_total_size=%u low_water=%b high_water=%b "
-               "uptime=%s location=%s",
-               local.disk_free_kb, local.disk_total_kb,
-               local.ringbuffer_low_water, local.ringbuffer_high_water, uptime,
-               state.location_name);
-}
-
-static void sensormgr_cmd_get_stats_dealloc_cb(CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "sensormgrmgmt_cmd_set_options_dealloc_cb - freeing");
-  free(resp_out->sensormgr_get_stats_response);
+               MQTTLOG_UINT("disk_free_kb", local.disk_free_kb),
+               MQTTLOG_UINT("disk_total_size", local.disk_total_kb),
+               MQTTLOG_BOOL("low_water", local.ringbuffer_low_water),
+               MQTTLOG_BOOL("high_water", local.ringbuffer_high_water),
+               MQTTLOG_STR("uptime", uptime),
+               MQTTLOG_STR("location", state.location_name),
+               MQTTLOG_UINT("emitted", local.readings_emitted),
+               MQTTLOG_UINT("suppressed", local.readings_suppressed),
+               MQTTLOG_UINT("flush_stretch", local.flush_stretch),
+               MQTTLOG_UINT("radio_on_ms_last_hour",
+                            local.radio_on_ms_last_hour),
+               MQTTLOG_UINT("uplinks", local.uplink_cnt));
 }
 
 static CommandResponse__RetCodeT sensormgr_cmd_get_stats(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_SENSORMGR_GET_STATS_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  Sensormgr__GetStatsResponse *cmd_resp =
+      MQTTMGR_ARENA_NEW(arena, Sensormgr__GetStatsResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
-
   resp_out->resp_case = COMMAND_RESPONSE__RESP_SENSORMGR_GET_STATS_RESPONSE;
-  *cb = sensormgr_cmd_get_stats_dealloc_cb;
-  Sensormgr__GetStatsResponse *cmd_resp = (Sensormgr__GetStatsResponse *)calloc(
-      1, sizeof(Sensormgr__GetStatsResponse));
   sensormgr__get_stats_response__init(cmd_resp);
   resp_out->sensormgr_get_stats_response = cmd_resp;
 
@@ -135,10 +388,383 @@ static CommandResponse__RetCodeT sensormgr_cmd_get_stats(
   return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
 }
 
+/**
+ * @brief PUBACK of a message holding readings of the file being drained
+ *
+ * Runs on the esp-mqtt event task, the checkpoint is saved by the queuesend
+ * task.
+ */
+static void sensormgr_drain_delivered(uint32_t seq) {
+  xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+  sensormgr_checkpoint_acked(&state.checkpoint, seq);
+  xSemaphoreGive(state.checkpoint_lock);
+  xTaskNotifyGive(state.queue_task_handle);
+}
+
+/**
+ * @brief Have the drain position of a message checkpointed once delivered
+ *
+ * Called right before committing a message holding file readings.
+ */
+static void sensormgr_drain_track(sensor_iterator_t *iter_state,
+                                  mqttmgr_msg_t *msg) {
+  uint32_t seq;
+  esp_err_t ret;
+
+  xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+  ret = sensormgr_checkpoint_sent(&state.checkpoint, iter_state->file_offset,
+                                  &seq);
+  xSemaphoreGive(state.checkpoint_lock);
+  if (ret == ESP_OK) {
+    msg->delivered = sensormgr_drain_delivered;
+    msg->delivered_arg = seq;
+  }
+}
+
+/**
+ * @brief Save how far the file has been delivered, if it is time to
+ *
+ * The offset only counts readings the broker acknowledged, so a restart
+ * resumes after them without losing anything still in flight.
+ */
+static void sensormgr_drain_checkpoint() {
+  bool due;
+  uint32_t acked;
+
+  xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+  due = sensormgr_checkpoint_due(&state.checkpoint,
+                                 CONFIG_SENSORMGR_CHECKPOINT_BYTES);
+  acked = state.checkpoint.acked;
+  xSemaphoreGive(state.checkpoint_lock);
+  if (!due) {
+    return;
+  }
+  sensormgr_index_commit_drained(acked);
+  xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+  state.checkpoint.durable = acked;
+  xSemaphoreGive(state.checkpoint_lock);
+}
+
+/**
+ * @brief Wait for room to track another message of the file
+ *
+ * Bounded so the dispatch task gets back to the sample queue when PUBACKs
+ * stop coming in.
+ *
+ * @return false when no PUBACK made room in time
+ */
+static bool sensormgr_drain_wait_room() {
+  bool full;
+  uint8_t attempt;
+
+  for (attempt = 0;; attempt++) {
+    xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+    full = sensormgr_checkpoint_full(&state.checkpoint);
+    xSemaphoreGive(state.checkpoint_lock);
+    if (!full || attempt != 0) {
+      return !full;
+    }
+    ulTaskNotifyTake(pdTRUE, SENSORMGR_DRAIN_ACK_WAIT_MS / portTICK_PERIOD_MS);
+    sensormgr_drain_checkpoint();
+  }
+}
+
+/**
+ * @brief Stop reading a file, it is removed once every message is delivered
+ */
+static void sensormgr_iter_finish_file(sensor_iterator_t *iter_state) {
+  fclose(iter_state->f_in);
+  iter_state->f_in = NULL;
+  free(iter_state->decoder);
+  iter_state->decoder = NULL;
+  iter_state->reading = NULL;
+  iter_state->state = HFDR;
+}
+
+/**
+ * @brief Remove a fully published file and go look for the next one
+ *
+ * @return false while messages of the file still wait on their PUBACK, state
+ *         stays HFDR
+ */
+static bool sensormgr_iter_close_file(sensor_iterator_t *iter_state) {
+  bool idle;
+
+  ulTaskNotifyTake(pdTRUE, 0);
+  for (;;) {
+    xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+    idle = sensormgr_checkpoint_idle(&state.checkpoint);
+    xSemaphoreGive(state.checkpoint_lock);
+    if (idle) {
+      break;
+    }
+    sensormgr_drain_checkpoint();
+    if (0 == ulTaskNotifyTake(pdTRUE, SENSORMGR_DRAIN_ACK_WAIT_MS /
+                                          portTICK_PERIOD_MS)) {
+      return false;
+    }
+  }
+  // The acked offset is of this file, not the next head of the index
+  xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+  sensormgr_checkpoint_reset(&state.checkpoint, 0);
+  xSemaphoreGive(state.checkpoint_lock);
+  ESP_LOGI(TAG, "iter - unlinking published file: %s", iter_state->f_name);
+  remove(iter_state->f_name);  // Delete the file
+  iter_state->f_name[0] = '\0';
+  iter_state->state = HFNO;
+  sensormgr_index_commit_remove();
+  ESP_LOGI(TAG, "%u spill files left, %u readings in %u bytes",
+           state.index.file_cnt, state.index.reading_cnt, state.index.len);
+  return true;
+}
+
+/**
+ * @brief Open the next file to drain, continuing where a previous boot left it
+ *
+ * @return
+ *  - ESP_OK: File opened, state is HFOO
+ *  - ESP_ERR_NOT_FOUND: No files left, state is NFRB
+ */
+static esp_err_t sensormgr_iter_open_file(sensor_iterator_t *iter_state) {
+  uint32_t resume_offset;
+
+  iter_state->decoder =
+      (sensormgr_spill_decoder_t *)calloc(1, sizeof(sensormgr_spill_decoder_t));
+  if (iter_state->decoder == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate spill decoder");
+    abort();
+  }
+  // Files are only added to the index once written, and the index hands out
+  // the oldest file, no directory walk needed
+  for (;;) {
+    xSemaphoreTake(state.index_lock, portMAX_DELAY);
+    if (state.index.file_cnt == 0) {
+      state.has_files = false;
+      xSemaphoreGive(state.index_lock);
+      free(iter_state->decoder);
+      iter_state->decoder = NULL;
+      iter_state->state = NFRB;
+      return ESP_ERR_NOT_FOUND;
+    }
+    snprintf(iter_state->f_name, sizeof(iter_state->f_name), "%s/%s",
+             SENSORMGR_DATA_DIR, state.index.head.name);
+    resume_offset = state.index.head.drained;
+    xSemaphoreGive(state.index_lock);
+    iter_state->f_in = fopen(iter_state->f_name, "rb");
+    if (iter_state->f_in != NULL) {
+      break;
+    }
+    MQTTLOG_LOGE(TAG, "indexed spill file missing, skipping",
+                 MQTTLOG_STR("file", iter_state->f_name));
+    sensormgr_index_commit_remove();
+  }
+
+  // Files of older firmware hold whole driver readings, they are turned into
+  // samples while reading them
+  if (ESP_OK != sensormgr_spill_decoder_init(iter_state->decoder,
+                                             iter_state->f_in)) {
+    iter_state->legacy = LEGACY_RAW;
+  } else if (iter_state->decoder->version == 1) {
+    iter_state->legacy = LEGACY_V1;
+  } else {
+    iter_state->legacy = LEGACY_NONE;
+  }
+  iter_state->legacy_reading.value_cnt = 0;
+  if (iter_state->legacy != LEGACY_NONE) {
+    MQTTLOG_LOGI(TAG, "spill file of older firmware",
+                 MQTTLOG_STR("file", iter_state->f_name),
+                 MQTTLOG_UINT("format", iter_state->legacy));
+  }
+
+  // Anchors SNTP added since the file was written apply to it too
+  if (iter_state->decoder->boot_id == state.boot_id) {
+    iter_state->decoder->clk = sensormgr_clock_get();
+  }
+  iter_state->state = HFOO;
+  iter_state->file_offset = 0;
+  ESP_LOGI(TAG, "iter - reading file: %s", iter_state->f_name);
+  if (resume_offset != 0) {
+    ESP_LOGI(TAG, "iter - resuming %s at %u", iter_state->f_name,
+             resume_offset);
+    if (iter_state->legacy == LEGACY_RAW
+            ? 0 != fseek(iter_state->f_in, resume_offset, SEEK_SET)
+            : ESP_OK != sensormgr_spill_seek(iter_state->decoder,
+                                             resume_offset)) {
+      ESP_LOGW(TAG, "Invalid resume offset %u, starting over", resume_offset);
+      resume_offset = 0;
+    }
+  }
+  xSemaphoreTake(state.checkpoint_lock, portMAX_DELAY);
+  sensormgr_checkpoint_reset(&state.checkpoint, resume_offset);
+  xSemaphoreGive(state.checkpoint_lock);
+  return ESP_OK;
+}
+
+/**
+ * @brief Read the next driver reading of a legacy file
+ *
+ * @return
+ *  - ESP_OK: Success, value_cnt is 0 when the reading was dropped
+ *  - ESP_ERR_NOT_FOUND: End of file
+ *  - ESP_ERR_INVALID_RESPONSE: Corrupt file
+ */
+static esp_err_t sensormgr_legacy_read(sensor_iterator_t *iter_state) {
+  uint8_t idx, field_cnt;
+  // With room for the trailing padding of a driver's struct
+  uint8_t data[sizeof(time_t) +
+               (SENSORMGR_SPILL_VALUES_MAX + 1) * sizeof(uint32_t)];
+  uint32_t fields[SENSORMGR_SPILL_VALUES_MAX];
+  size_t data_len;
+  esp_err_t ret;
+  legacy_raw_header_t header;
+  legacy_reading_t *reading = &iter_state->legacy_reading;
+  const sensormgr_registration_t *sensor;
+
+  reading->value_cnt = 0;
+  reading->value_idx = 0;
+  if (iter_state->legacy == LEGACY_V1) {
+    ret = sensormgr_spill_decode(iter_state->decoder, &reading->type_idx,
+                                 data, sizeof(data), &data_len);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+    reading->offset = sensormgr_spill_resume_offset(iter_state->decoder);
+  } else {
+    if (fread(&header, sizeof(header), 1, iter_state->f_in) != 1) {
+      return ESP_ERR_NOT_FOUND;
+    }
+    if (header.sensor_data_len < sizeof(time_t) ||
+        header.sensor_data_len > sizeof(data) ||
+        fread(data, header.sensor_data_len, 1, iter_state->f_in) != 1) {
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    reading->type_idx = header.type_idx;
+    data_len = header.sensor_data_len;
+    reading->offset = ftell(iter_state->f_in);
+  }
+
+  if (reading->type_idx >= state.sensor_cnt) {
+    ESP_LOGW(TAG, "Spilled reading of unknown sensor %u, dropped",
+             reading->type_idx);
+    return ESP_OK;
+  }
+  sensor = &state.sensors[reading->type_idx];
+  memcpy(&reading->timestamp, data, sizeof(time_t));
+  field_cnt = (data_len - sizeof(time_t)) / sizeof(uint32_t);
+  if (field_cnt > SENSORMGR_SPILL_VALUES_MAX) {
+    field_cnt = SENSORMGR_SPILL_VALUES_MAX;
+  }
+  memcpy(fields, &data[sizeof(time_t)], field_cnt * sizeof(uint32_t));
+  for (idx = 0; idx < sensor->channel_cnt; idx++) {
+    reading->values[idx] = NAN;
+  }
+  if (sensor->legacy != NULL) {
+    if (ESP_OK != sensor->legacy(fields, field_cnt, reading->values)) {
+      ESP_LOGW(TAG, "Spilled reading of sensor %u not understood, dropped",
+               reading->type_idx);
+      return ESP_OK;
+    }
+  } else {
+    for (idx = 0; idx < field_cnt && idx < sensor->channel_cnt; idx++) {
+      memcpy(&reading->values[idx], &fields[idx], sizeof(float));
+    }
+  }
+  reading->value_cnt = sensor->channel_cnt;
+  return ESP_OK;
+}
+
+/**
+ * @brief Next sample of a legacy file
+ *
+ * Sensors are taken to be registered in the same order as by the firmware
+ * that wrote the file, value k of sensor i goes to channel
+ * sensor_channel[i] + k.
+ *
+ * @return
+ *  - ESP_OK: file_reading is the next sample
+ *  - ESP_ERR_NOT_FOUND: End of file
+ *  - ESP_ERR_INVALID_RESPONSE: Corrupt file
+ */
+static esp_err_t sensormgr_legacy_next(sensor_iterator_t *iter_state) {
+  uint8_t idx, channel;
+  esp_err_t ret;
+  legacy_reading_t *reading = &iter_state->legacy_reading;
+
+  for (;;) {
+    while (reading->value_idx < reading->value_cnt) {
+      idx = reading->value_idx++;
+      channel = state.sensor_channel[reading->type_idx] + idx;
+      // Stamped in seconds, those before SNTP synced can't be rebased as
+      // these files have no anchors
+      iter_state->timestamp = sensormgr_rebase(
+          &iter_state->decoder->clk, reading->timestamp * 1000LL);
+      if (isnan(reading->values[idx]) ||
+          ESP_OK != sensormgr_sample_set(&iter_state->file_reading, channel,
+                                         state.channels[channel].decimals,
+                                         iter_state->timestamp,
+                                         reading->values[idx])) {
+        continue;
+      }
+      // A partly sent reading is sent again after a reboot
+      if (reading->value_idx == reading->value_cnt) {
+        iter_state->file_offset = reading->offset;
+      }
+      return ESP_OK;
+    }
+    ret = sensormgr_legacy_read(iter_state);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+}
+
+/**
+ * @brief Decode the next sample of a spill file, in ms whatever its version
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NOT_FOUND: End of file
+ *  - ESP_ERR_INVALID_RESPONSE: Corrupt or truncated block
+ *  - ESP_ERR_INVALID_SIZE: Not a sample
+ */
+static esp_err_t sensormgr_spill_decode_sample(
+    sensormgr_spill_decoder_t *dec, uint8_t *channel,
+    sensormgr_spill_sample_t *spilled) {
+  uint8_t data[sizeof(sensormgr_spill_sample_t)];
+  size_t len, timestamp_len;
+  time_t seconds;
+  esp_err_t ret;
+
+  ret = sensormgr_spill_decode(dec, channel, data, sizeof(data), &len);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  timestamp_len = dec->version < 4 ? sizeof(time_t) : sizeof(int64_t);
+  if (len != timestamp_len + sizeof(int32_t) &&
+      len != timestamp_len + sizeof(int32_t) + sizeof(uint32_t)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (dec->version < 4) {
+    memcpy(&seconds, data, sizeof(time_t));
+    spilled->timestamp = seconds * 1000LL;
+  } else {
+    memcpy(&spilled->timestamp, data, sizeof(int64_t));
+  }
+  memcpy(&spilled->value, &data[timestamp_len], sizeof(int32_t));
+  spilled->stat = SENSORMGR_STAT_RAW;
+  if (len > timestamp_len + sizeof(int32_t)) {
+    memcpy(&spilled->stat, &data[timestamp_len + sizeof(int32_t)],
+           sizeof(uint32_t));
+  }
+  return ESP_OK;
+}
+
 static esp_err_t sensormgr_read_iter(sensor_iterator_t *iter_state,
                                      bool read_files) {
-  size_t free_buf_size;
+  uint8_t channel;
+  sensormgr_spill_sample_t spilled;
   esp_err_t ret;
+  sensormgr_clock_t clk;
 
   // cases
   //  Initial state unknown INIT
@@ -147,8 +773,10 @@ static esp_err_t sensormgr_read_iter(sensor_iterator_t *iter_state,
   //    detect file --> HFOO
   //    detect no more file --> NFRB
   //  has files, one open HFOO
-  //    eof --> cleanup & HFNO
-  //  ring buffer NFRB
+  //    eof --> close & HFDR
+  //  has files, done reading HFDR
+  //    everything delivered --> remove & HFNO
+  //  sample queue NFRB
   while (1) {
     switch (iter_state->state) {
       case INIT:
@@ -159,89 +787,75 @@ static esp_err_t sensormgr_read_iter(sensor_iterator_t *iter_state,
         }
         break;
       case HFNO:
-        ret = sensormgr_get_first_datafile(&(iter_state->f_in),
-                                           iter_state->f_name,
-                                           sizeof(iter_state->f_name));
-        if (ESP_ERR_NOT_FOUND == ret) {
-          state.has_files = false;
-          iter_state->state = NFRB;
-          break;
-        } else if (ESP_OK == ret) {
-          iter_state->state = HFOO;
-          ESP_LOGI(TAG, "iter - reading file: %s", iter_state->f_name);
-          break;
-        }
-        ESP_LOGE(TAG, "Bad state transition HFNO --> UNKNOWN");
-        abort();
+        sensormgr_iter_open_file(iter_state);
         break;
       case HFOO:
-        // Don't read while writing, unlikely but safety first!
-        xEventGroupWaitBits(mqttmgr_events, SENSORMGR_DONEWRITING_BIT,
-                            pdFALSE,  // Do NOT clear the bits before returning
-                            pdTRUE,   // Wait for ALL bits to be set
-                            portMAX_DELAY);
-        if (iter_state->reading == NULL) {
-          iter_state->reading = (sensor_reading_t *)calloc(512, 1);
-        }
-        if (fread(iter_state->reading, sizeof(sensor_reading_t), 1,
-                  iter_state->f_in) < 1) {
-          // Got less than one result, thus EOF
-          ESP_LOGI(TAG, "iter - unlinking published file: %s",
-                   iter_state->f_name);
-          fclose(iter_state->f_in);
-          remove(iter_state->f_name);  // Delete the file
-          iter_state->f_in = NULL;
-          free(iter_state->reading);
+        if (!sensormgr_drain_wait_room()) {
           iter_state->reading = NULL;
-          iter_state->f_name[0] = '\0';
-          iter_state->state = HFNO;
-          sensormgr_log_free_space();
-          break;
+          return ESP_ERR_TIMEOUT;  // End the message, PUBACKs are overdue
+        }
+        if (iter_state->legacy != LEGACY_NONE) {
+          ret = sensormgr_legacy_next(iter_state);
+          if (ret == ESP_OK) {
+            iter_state->reading = &iter_state->file_reading;
+            return ESP_OK;
+          }
+        } else {
+          ret = sensormgr_spill_decode_sample(iter_state->decoder, &channel,
+                                              &spilled);
         }
-        // Sanity check sensor reading to prevent overflow
-        if ((sizeof(sensor_reading_t) + iter_state->reading->sensor_data_len) >
-            512) {
-          ESP_LOGE(
-              TAG, "Sensor read is larger than buffer! %u > 512",
-              sizeof(sensor_reading_t) + iter_state->reading->sensor_data_len);
-          abort();
+        if (ret == ESP_OK) {
+          iter_state->file_offset =
+              sensormgr_spill_resume_offset(iter_state->decoder);
+          if (channel >= state.channel_cnt ||
+              spilled.stat > SENSORMGR_STAT_COUNT) {
+            ESP_LOGW(TAG, "Spilled sample of unknown channel %u, dropped",
+                     channel);
+            break;
+          }
+          // The timestamp is kept in iter_state, a sample only holds whole
+          // seconds of Unix time
+          iter_state->file_reading = (sensormgr_sample_t){
+              .channel = channel,
+              .stat = spilled.stat,
+              .value = spilled.value,
+          };
+          // ms since boot are of the boot the file was written in
+          iter_state->timestamp =
+              sensormgr_rebase(&iter_state->decoder->clk, spilled.timestamp);
+          iter_state->reading = &iter_state->file_reading;
+          return ESP_OK;
+        } else if (ret != ESP_ERR_NOT_FOUND) {
+          // Aborting would only boot loop on the same file
+          MQTTLOG_LOGE(TAG, "corrupt spill file, dropping the rest",
+                       MQTTLOG_STR("file", iter_state->f_name),
+                       MQTTLOG_INT("err", ret));
         }
-        if (fread(iter_state->reading->sensor_data,
-                  iter_state->reading->sensor_data_len, 1,
-                  iter_state->f_in) < 1) {
-          ESP_LOGE(TAG, "Failed to read a sensor reading");
-          abort();
+        sensormgr_iter_finish_file(iter_state);
+        return ESP_OK;  // End the message so it can be acknowledged
+      case HFDR:
+        if (!sensormgr_iter_close_file(iter_state)) {
+          return ESP_OK;  // Nothing to send till the PUBACKs are in
         }
-        return ESP_OK;
         break;
       case NFRB:
+        // Records stay queued till sensormgr_iter_consume, the message they
+        // went into may still fail to be queued
+        iter_state->reading = (const sensormgr_sample_t *)sensormgr_queue_peek(
+            &state.queue, iter_state->queue_pos);
         if (iter_state->reading != NULL) {
-          vRingbufferReturnItem(state.ring_buffer,
-                                (void *)(iter_state->reading));
-          state.ring_buffer_item_count--;
-        }
-        iter_state->reading = (sensor_reading_t *)xRingbufferReceive(
-            state.ring_buffer, &(iter_state->reading_size), 0);
-        // Clear highwater only when reading from ring buffer if space is
-        // correct Clear lowwater only when reading from ring buffer on empty
-        free_buf_size = xRingbufferGetCurFreeSize(state.ring_buffer);
-        if (free_buf_size >= SENSORMGR_RINBUFFER_HIGHWATER) {
-          xEventGroupClearBits(mqttmgr_events, SENSORMGR_HIGHWATER_BIT);
-          ESP_LOGV(TAG, "high-water bit clear: %d >= %d", free_buf_size,
-                   SENSORMGR_RINBUFFER_HIGHWATER);
-        }
-        if (state.ring_buffer_item_count == 0) {
-          xEventGroupClearBits(mqttmgr_events, SENSORMGR_LOWWATER_BIT);
-          ESP_LOGI(TAG, "low-water bit clear: %d (item cnt) = 0",
-                   state.ring_buffer_item_count);
-        }
-        if (iter_state->reading == NULL) {
-          // Reset the state since the ring buffer has been drained
+          iter_state->queue_pos++;
+          iter_state->timestamp = sensormgr_sample_timestamp(
+              iter_state->reading, sensormgr_now());
+          // Spilled as they are, the anchors go into the file with them
+          if (read_files) {
+            clk = sensormgr_clock_get();
+            iter_state->timestamp =
+                sensormgr_rebase(&clk, iter_state->timestamp);
+          }
+        } else {
+          // Reset the state since the sample queue has been drained
           iter_state->state = INIT;
-          // Set Polling enabled since at least the RB has been drained
-          // In normal cases this would also mean the file system has been
-          // fully drained as well
-          xEventGroupSetBits(mqttmgr_events, SENSORMGR_POLLSENSORS_BIT);
         }
         return ESP_OK;
         break;
@@ -251,6 +865,58 @@ static esp_err_t sensormgr_read_iter(sensor_iterator_t *iter_state,
   }
 }
 
+/**
+ * @brief Remove the sample queue records of a message that has been queued
+ *
+ * Watermarks follow the exact occupancy once released, polling resumes when
+ * the queue is empty.
+ */
+static void sensormgr_iter_consume(sensor_iterator_t *iter_state) {
+  uint32_t queued;
+  sensormgr_flush_t flush = sensormgr_flush_get();
+
+  if (iter_state->queue_pos != 0) {
+    sensormgr_queue_release(&state.queue, iter_state->queue_pos);
+    iter_state->queue_pos = 0;
+  }
+  queued = sensormgr_queue_count(&state.queue);
+  if (queued < sensormgr_flush_highwater(&flush, state.queue.slot_cnt)) {
+    xEventGroupClearBits(mqttmgr_events, SENSORMGR_HIGHWATER_BIT);
+  }
+  if (queued != 0) {
+    return;
+  }
+  if (!state.has_files) {
+    xEventGroupClearBits(mqttmgr_events, SENSORMGR_LOWWATER_BIT);
+    ESP_LOGI(TAG, "low-water bit clear: sample queue and files drained");
+  }
+  xEventGroupSetBits(mqttmgr_events, SENSORMGR_POLLSENSORS_BIT);
+}
+
+/**
+ * @brief Hand the readings of a message that failed to be queued out again
+ *
+ * Sample queue records were only peeked at. A file is reopened at its last
+ * checkpoint, so readings after it are sent again rather than lost. The
+ * mqttmgr queue not draining counts against the link.
+ */
+static void sensormgr_iter_rewind(sensor_iterator_t *iter_state,
+                                  bool from_file) {
+  sensormgr_flush_feedback(false);
+  iter_state->queue_pos = 0;
+  if (!from_file) {
+    return;
+  }
+  if (iter_state->f_in != NULL) {
+    fclose(iter_state->f_in);
+    iter_state->f_in = NULL;
+    free(iter_state->decoder);
+    iter_state->decoder = NULL;
+  }
+  iter_state->reading = NULL;
+  iter_state->state = INIT;
+}
+
 static void sensormgr_get_free_space(uint32_t *fre_kb, uint32_t *tot_kb) {
   FATFS *fs;
   f_getfree("0:", fre_kb, &fs);
@@ -272,253 +938,679 @@ static void sensormgr_log_free_space() {
 }
 
 /**
- * @brief Get the first file and open a file handle to it
+ * @brief Wait for sensormgr_start, once sensormgr_stop is told of it
  *
- * @param fp File pointer to open against or set NULL of no file
+ * Only called where the task holds no lock.
  */
-static esp_err_t sensormgr_get_first_datafile(FILE **fp, char *f_name,
-                                              size_t f_name_size) {
-  FILINFO fno;
-  FF_DIR dj;
-
-  ESP_LOGI(TAG, "Searching for datafiles");
-  f_opendir(&dj, "/");
-  while (F_OK == f_readdir(&dj, &fno) && fno.fname[0]) {
-    ESP_LOGI(TAG, "manual fileiter - %s", fno.fname);
-    snprintf(f_name, f_name_size, "/log_data/%s", fno.fname);
-    *fp = fopen(f_name, "rb");
-    if (*fp == NULL) {
-      ESP_LOGE(TAG, "Error opening datafile: %s", f_name);
-      abort();
-    }
-    f_closedir(&dj);
-    return ESP_OK;
-  }
-  ESP_LOGI(TAG, "manual filtiter - complete");
-  *fp = NULL;
-
-  return ESP_ERR_NOT_FOUND;
+static void sensormgr_park(SemaphoreHandle_t parked,
+                           SemaphoreHandle_t resume) {
+  xSemaphoreGive(parked);
+  xSemaphoreTake(resume, portMAX_DELAY);
 }
 
 // At highwater and disconnected, buffer to file
-
-static void sensormgr_task_file_writer(void *pvParam) {
-  uint32_t bytes_free, bytes_written;
+static void sensormgr_dispatch_spill(sensor_iterator_t *iter_state) {
+  uint32_t bytes_free, free_kb;
+  uint32_t reserve_kb = sensormgr_flush_get().cfg.fs_reserve_kb;
   time_t timestamp;
+  esp_err_t ret;
   struct tm timestamp_tm;
   char f_name[24];
-  FILE *f_out = NULL;
-  sensor_iterator_t iter_state = {
-      .state = INIT,
-      .f_in = NULL,
-      .f_name[0] = '\0',
-      .reading = NULL,
-      .reading_size = 0,
-  };
-
-  // High watermark means drain ring buffer to the file till either empty or low
-  // watermark
-
-  ESP_LOGI(TAG, "File writing task starting...");
-  sensormgr_log_free_space();
-  for (;;) {
-    xEventGroupWaitBits(
-        mqttmgr_events,
-        MQTTMGR_CLIENT_NOTCONNECTED_BIT | SENSORMGR_HIGHWATER_BIT,
-        pdFALSE,  // Do NOT clear the bits before returning
-        pdTRUE,   // Wait for ALL bits to be set
-        portMAX_DELAY);
-    ESP_LOGI(TAG, "File writing task wake...");
-    // Check freespace, if we're too low then wait till something else has
-    // drained the FS for us
-    if (sensormgr_free_space() < SENSORMGR_FS_HIGHWATER) {
-      ESP_LOGI(TAG, "File writing task paused, not enough free space...");
-      ESP_LOGI(TAG, "File writing task pausing sensor polling...");
-      // Clear polling, but make sure the system wants to drain the queue
-      xEventGroupClearBits(mqttmgr_events, SENSORMGR_POLLSENSORS_BIT);
-      xEventGroupSetBits(mqttmgr_events, SENSORMGR_LOWWATER_BIT);
-      xEventGroupWaitBits(
-          mqttmgr_events,
-          SENSORMGR_POLLSENSORS_BIT,  // Will be re-enabled by the read iterator
-          pdFALSE,                    // Do NOT clear the bits before returning
-          pdTRUE,                     // Wait for ALL bits to be set
-          portMAX_DELAY);
-      // Restart the loop, since we expect the iter to have drained everything
-      // here
-      continue;
-    }
-    // About to go active writing to a file
-    xEventGroupClearBits(mqttmgr_events, SENSORMGR_DONEWRITING_BIT);
-    // open a timestamped file DDHHMMSS e.g. 01121500 - 1st of month, 12:15:00;
-    // full month wrap-around is a _lot_ of data, beyond what could likely be
-    // stored on one of these esp's
-    time(&timestamp);
-    gmtime_r(&timestamp, &timestamp_tm);
-    strftime(f_name, 24, "/log_data/%d%H%M%S.BIN", &timestamp_tm);
-    if (f_out != NULL) {
-      ESP_LOGE(TAG, "Previously open file was not closed! Aborting");
-      abort();
+  FILE *f_out;
+  sensormgr_index_entry_t entry;
+  sensormgr_spill_sample_t spilled;
+  sensormgr_clock_t clk = sensormgr_clock_get();
+
+  // High watermark means drain the sample queue to the file till empty
+  ESP_LOGI(TAG, "Spilling sample queue...");
+  // Check freespace, if we're too low then wait till MQTT has drained the FS
+  free_kb = sensormgr_free_space();
+  if (free_kb < reserve_kb) {
+    ESP_LOGI(TAG, "Spilling paused, not enough free space...");
+    ESP_LOGI(TAG, "Pausing sensor polling...");
+    // Re-enabled once the sample queue has been drained
+    xEventGroupClearBits(mqttmgr_events, SENSORMGR_POLLSENSORS_BIT);
+    if (xEventGroupWaitBits(
+            mqttmgr_events,
+            MQTTMGR_CLIENT_CONNECTED_BIT | SENSORMGR_PARK_BIT,
+            pdFALSE,  // Do NOT clear the bits before returning
+            pdFALSE,  // Wait for EITHER bit to be set
+            portMAX_DELAY) &
+        SENSORMGR_PARK_BIT) {
+      // Nowhere to spill the rest to, it stays queued
+      sensormgr_park(state.dispatch_parked, state.dispatch_resume);
     }
-    ESP_LOGI(TAG, "Writing current ringbuffer to: %s", f_name);
-    f_out = fopen(f_name, "wb");
-    if (f_out == NULL) {
-      ESP_LOGE(TAG, "Failed to output file");
-      abort();
+    return;
+  }
+  // About to go active writing to a file
+  xEventGroupClearBits(mqttmgr_events, SENSORMGR_DONEWRITING_BIT);
+  // open a timestamped file DDHHMMSS e.g. 01121500 - 1st of month, 12:15:00;
+  // full month wrap-around is a _lot_ of data, beyond what could likely be
+  // stored on one of these esp's
+  time(&timestamp);
+  // Spills within the same second would reuse, and truncate, the same file
+  if (timestamp <= state.spill_time) {
+    timestamp = state.spill_time + 1;
+  }
+  state.spill_time = timestamp;
+  gmtime_r(&timestamp, &timestamp_tm);
+  strftime(entry.name, sizeof(entry.name), "%d%H%M%S.BIN", &timestamp_tm);
+  snprintf(f_name, sizeof(f_name), "%s/%s", SENSORMGR_DATA_DIR, entry.name);
+  entry.first_timestamp = entry.last_timestamp = 0;
+  entry.reading_cnt = 0;
+  ESP_LOGI(TAG, "Writing current sample queue to: %s", f_name);
+  f_out = fopen(f_name, "wb");
+  if (f_out == NULL) {
+    ESP_LOGE(TAG, "Failed to output file");
+    abort();
+  }
+  if (ESP_OK != sensormgr_spill_encoder_init(
+                    &spill_encoder, f_out, sensormgr_now(),
+                    state.spill_data_len, state.channel_cnt, state.boot_id,
+                    &clk)) {
+    ESP_LOGE(TAG, "Failed to write spill file header");
+    abort();
+  }
+  bytes_free = (free_kb - reserve_kb) * 1024;
+  for (;;) {
+    // Read JUST the sample queue
+    sensormgr_read_iter(iter_state, false);
+    if (iter_state->reading == NULL) {
+      break;
     }
-    bytes_free = (sensormgr_free_space() - SENSORMGR_FS_HIGHWATER) * 1024;
-    bytes_written = 0;
-    for (;;) {
-      // Read JUST the ring buffers
-      sensormgr_read_iter(&iter_state, false);
-      if (iter_state.reading == NULL) {
-        break;
-      }
-      // Dump the entry straight to the file
-      fwrite(iter_state.reading, iter_state.reading_size, 1, f_out);
-      bytes_written += iter_state.reading_size;
-      // Allowed to go slightly over "free" due to reserved space
-      if (bytes_written > bytes_free) {
-        break;
+    spilled = (sensormgr_spill_sample_t){
+        .timestamp = iter_state->timestamp,
+        .value = iter_state->reading->value,
+        .stat = iter_state->reading->stat,
+    };
+    ret = sensormgr_spill_encode(&spill_encoder, iter_state->reading->channel,
+                                 &spilled, sizeof(spilled));
+    if (ret != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to encode channel %u sample (%s), dropped",
+               iter_state->reading->channel, esp_err_to_name(ret));
+    } else {
+      // The index keeps whole seconds
+      if (entry.reading_cnt++ == 0) {
+        entry.first_timestamp = sensormgr_wall_time(spilled.timestamp) / 1000;
       }
+      entry.last_timestamp = sensormgr_wall_time(spilled.timestamp) / 1000;
+    }
+    sensormgr_iter_consume(iter_state);
+    // Allowed to go slightly over "free" due to reserved space and the
+    // blocks still being filled
+    if (spill_encoder.bytes_written > bytes_free) {
+      break;
     }
-    fclose(f_out);
-    state.has_files = true;
-    ESP_LOGI(TAG, "closing: %s", f_name);
-    f_out = NULL;
-    xEventGroupSetBits(mqttmgr_events, SENSORMGR_DONEWRITING_BIT);
   }
+  if (ESP_OK != sensormgr_spill_encoder_finish(&spill_encoder)) {
+    ESP_LOGE(TAG, "Failed to flush spill file: %s", f_name);
+  }
+  entry.len = spill_encoder.bytes_written;
+  fclose(f_out);
+  ESP_LOGI(TAG, "closing: %s (%u readings)", f_name, entry.reading_cnt);
+  if (entry.reading_cnt == 0) {
+    remove(f_name);
+  } else {
+    sensormgr_index_commit_add(&entry);
+  }
+  xEventGroupSetBits(mqttmgr_events, SENSORMGR_DONEWRITING_BIT);
 }
 
-// At low-water try to send data if connected, till empty.
-static void sensormgr_task_queuesend(void *pvParam) {
+/**
+ * @brief Add a sample to the data array of a JSON sensor data message
+ *
+ * The JSON format only has whole seconds.
+ */
+static void sensormgr_marshall_sample(const sensormgr_sample_t *sample,
+                                      int64_t timestamp_ms,
+                                      cJSON *data_array) {
+  char iso8601[32];
+  time_t timestamp = timestamp_ms / 1000;
+  const sensormgr_channel_t *channel = &state.channels[sample->channel];
+  cJSON *sensor_json = cJSON_CreateObject();
+
+  SENSORMGR_ISO8601(timestamp, iso8601);
+  cJSON_AddStringToObject(sensor_json, "timestamp", iso8601);
+  cJSON_AddNumberToObject(sensor_json, "value",
+                          sensormgr_sample_value(sample, channel->decimals));
+  cJSON_AddStringToObject(sensor_json, "unit", channel->unit);
+  cJSON_AddStringToObject(sensor_json, "sensor", channel->sensor);
+  if (sample->stat != SENSORMGR_STAT_RAW) {
+    cJSON_AddStringToObject(sensor_json, "stat",
+                            sensormgr_stat_names[sample->stat]);
+  }
+  cJSON_AddItemToArray(data_array, sensor_json);
+}
+
+static void sensormgr_queuesend_json(sensor_iterator_t *iter_state) {
   uint8_t idx;
-  sensor_iterator_t iter_state = {
-      .state = INIT,
-      .f_in = NULL,
-      .f_name[0] = '\0',
-      .reading = NULL,
-      .reading_size = 0,
-  };
-  cJSON *root, *sensor_array, *sensor_data, *metadata;
-  char *json_text;
+  bool from_file = false;
+  size_t len;
+  cJSON *root, *sensor_array, *metadata;
+  char *json_text = NULL;
   esp_err_t ret;
-
-  ESP_LOGI(TAG, "Staring %s task", SENSORMGR_TASKNAME_QUEUE);
-  for (;;) {
-    xEventGroupWaitBits(mqttmgr_events,
-                        MQTTMGR_CLIENT_STARTED_BIT |
-                            MQTTMGR_CLIENT_CONNECTED_BIT |
-                            SENSORMGR_LOWWATER_BIT,
-                        pdFALSE,  // Do NOT clear the bits before returning
-                        pdTRUE,   // Wait for ALL bits to be set
-                        portMAX_DELAY);
-    ESP_LOGD(TAG, "marshalling loop...");
-    root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "metadata", metadata = cJSON_CreateObject());
-    cJSON_AddStringToObject(metadata, "location", state.location_name);
-    cJSON_AddItemToObject(root, "data", sensor_array = cJSON_CreateArray());
-    for (idx = 0; idx < 10; idx++) {
-      sensormgr_read_iter(&iter_state, true);
-      if (iter_state.reading == NULL) {
-        break;  // No data in ringbuffer, wait to be signled
+  mqttmgr_msg_t *msg;
+
+  root = cJSON_CreateObject();
+  cJSON_AddItemToObject(root, "metadata", metadata = cJSON_CreateObject());
+  cJSON_AddStringToObject(metadata, "location", state.location_name);
+  cJSON_AddItemToObject(root, "data", sensor_array = cJSON_CreateArray());
+  for (idx = 0; idx < SENSORMGR_MSG_READING_CNT; idx++) {
+    sensormgr_read_iter(iter_state, true);
+    if (iter_state->reading == NULL) {
+      break;  // No data in sample queue, wait to be signled
+    }
+    from_file |= iter_state->state == HFOO;
+    sensormgr_marshall_sample(iter_state->reading, iter_state->timestamp,
+                              sensor_array);
+  }
+  if (idx != 0) {
+    do {
+      json_text = cJSON_PrintUnformatted(root);
+      if (json_text == NULL) {
+        ESP_LOGE(TAG,
+                 "Marshalling Failed! Delaying in hope of more memory...");
+        vTaskDelay(5000 / portTICK_PERIOD_MS);
       }
-      state.sensors[iter_state.reading->type_idx].marshall(
-          iter_state.reading->sensor_data, sensor_array);
-    }
-    if (idx != 0) {
-      do {
-        json_text = cJSON_PrintUnformatted(root);
-        if (json_text == NULL) {
-          ESP_LOGE(TAG,
-                   "Marshalling Failed! Delaying in hope of more memory...");
-          vTaskDelay(5000 / portTICK_PERIOD_MS);
-        }
-      } while (json_text == NULL);
-      ret = mqttmgr_queuemsg(MQTTMGR_TOPIC_SENSOR, strlen(json_text), json_text,
-                             portMAX_DELAY);
-      if (ret == ESP_ERR_INVALID_ARG) {
-        abort();  // We configured messages badly if this happens
+    } while (json_text == NULL);
+    len = strlen(json_text);
+    ret = mqttmgr_acquiremsg(MQTTMGR_TOPIC_SENSOR, len, &msg,
+                             SENSORMGR_DISPATCH_WAIT_MS / portTICK_PERIOD_MS);
+    if (ret == ESP_ERR_INVALID_ARG) {
+      abort();  // We configured messages badly if this happens
+    } else if (ret == ESP_OK) {
+      memcpy(msg->msg, json_text, len);
+      msg->len = len;
+      if (from_file) {
+        sensormgr_drain_track(iter_state, msg);
       }
+      mqttmgr_commitmsg(msg);
+      sensormgr_iter_consume(iter_state);
+    } else {
+      sensormgr_iter_rewind(iter_state, from_file);
     }
-    cJSON_Delete(root);  // Cleanup after all that JSON
-    free(json_text);
-    root = sensor_array = sensor_data = metadata = NULL;
-    json_text = NULL;
+  } else {
+    sensormgr_iter_consume(iter_state);
+  }
+  cJSON_Delete(root);  // Cleanup after all that JSON
+  free(json_text);
+}
+
+static void sensormgr_queuesend_protobuf(sensor_iterator_t *iter_state) {
+  uint8_t idx;
+  bool from_file = false;
+  size_t len;
+  esp_err_t ret;
+  mqttmgr_msg_t *msg;
+  const sensormgr_channel_t *channel;
+
+  sensormgr_batch_reset(&batch, state.location_name);
+  for (idx = 0; idx < SENSORMGR_MSG_READING_CNT; idx++) {
+    sensormgr_read_iter(iter_state, true);
+    if (iter_state->reading == NULL) {
+      break;  // No data in sample queue, wait to be signled
+    }
+    from_file |= iter_state->state == HFOO;
+    channel = &state.channels[iter_state->reading->channel];
+    if (ESP_OK !=
+        sensormgr_batch_add_stat(
+            &batch, channel->sensor, channel->unit, iter_state->reading->stat,
+            iter_state->timestamp,
+            sensormgr_sample_value(iter_state->reading, channel->decimals))) {
+      ESP_LOGE(TAG, "Packing channel %u sample failed, dropped",
+               iter_state->reading->channel);
+    }
+  }
+  if (batch.msg.n_readings == 0) {
+    sensormgr_iter_consume(iter_state);
+    return;
+  }
+  // Pack straight into the outbound queue slot, no intermediate buffer
+  len = sensormgr__sensor_batch__get_packed_size(&batch.msg);
+  ret = mqttmgr_acquiremsg(MQTTMGR_TOPIC_SENSOR_BATCH, len, &msg,
+                           SENSORMGR_DISPATCH_WAIT_MS / portTICK_PERIOD_MS);
+  if (ret == ESP_ERR_INVALID_ARG) {
+    abort();  // We configured messages badly if this happens
+  } else if (ret != ESP_OK) {
+    sensormgr_iter_rewind(iter_state, from_file);
+    return;
+  }
+  sensormgr_batch_pack(&batch, msg->msg, len, &msg->len);
+  if (from_file) {
+    sensormgr_drain_track(iter_state, msg);
+  }
+  mqttmgr_commitmsg(msg);
+  sensormgr_iter_consume(iter_state);
+}
+
+static size_t sensormgr_varint_put(uint8_t *buf, uint32_t value) {
+  size_t len = 0;
+
+  do {
+    buf[len++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+    value >>= 7;
+  } while (value != 0);
+  return len;
+}
+
+/**
+ * @brief Send the next run of spill blocks as a SensorBackfill message
+ *
+ * Whole blocks are read from the file straight into the outbound slot, each
+ * message is as large as mqttmgr allows instead of SENSORMGR_MSG_READING_CNT
+ * readings. The offset of the next block is checkpointed to the spill index
+ * once the broker acknowledged the message, so draining resumes after a
+ * reboot.
+ *
+ * @return
+ *  - ESP_OK: Chunk queued, or a file finished
+ *  - ESP_ERR_NOT_FOUND: Nothing to backfill, send readings instead
+ */
+static esp_err_t sensormgr_backfill(sensor_iterator_t *iter_state) {
+  uint8_t *out;
+  uint32_t offset;
+  size_t meta_len, header_len, blocks_len, spill_len;
+  esp_err_t ret;
+  mqttmgr_msg_t *msg;
+  Sensormgr__SensorBackfill backfill = SENSORMGR__SENSOR_BACKFILL__INIT;
+
+  switch (iter_state->state) {
+    case INIT:
+      if (!state.has_files) {
+        return ESP_ERR_NOT_FOUND;
+      }
+      iter_state->state = HFNO;
+      // fall through
+    case HFNO:
+      if (ESP_OK != sensormgr_iter_open_file(iter_state)) {
+        return ESP_ERR_NOT_FOUND;
+      }
+      break;
+    case HFOO:
+      break;
+    case HFDR:
+      sensormgr_iter_close_file(iter_state);
+      return ESP_OK;
+    default:
+      return ESP_ERR_NOT_FOUND;  // Draining the sample queue
+  }
+  if (iter_state->legacy != LEGACY_NONE) {
+    return ESP_ERR_NOT_FOUND;  // Driver readings, sent as samples
+  }
+
+  if (!sensormgr_drain_wait_room()) {
+    return ESP_OK;  // PUBACKs are overdue, check the sample queue
+  }
+  backfill.location_name = state.location_name;
+  backfill.file_name = iter_state->f_name;
+  backfill.n_channels = state.channel_cnt;
+  backfill.channels = state.backfill_channel_ptrs;
+  backfill.offset = UINT32_MAX;  // Largest varint while sizing the run
+  meta_len = sensormgr__sensor_backfill__get_packed_size(&backfill);
+  header_len = sensormgr_spill_header(iter_state->decoder, NULL);
+  ret = sensormgr_spill_next_blocks(
+      iter_state->decoder,
+      mqttmgr_msg_max_len() - meta_len - SENSORMGR_BACKFILL_SPILL_OVERHEAD -
+          header_len,
+      &offset, &blocks_len);
+  switch (ret) {
+    case ESP_OK:
+      break;
+    case ESP_ERR_NOT_FOUND:
+      sensormgr_iter_finish_file(iter_state);
+      return ESP_OK;
+    case ESP_ERR_INVALID_STATE:
+      return ESP_ERR_NOT_FOUND;  // Block partly sent as readings, finish it
+    default:
+      MQTTLOG_LOGE(TAG, "corrupt spill file, dropping the rest",
+                   MQTTLOG_STR("file", iter_state->f_name),
+                   MQTTLOG_INT("err", ret));
+      sensormgr_iter_finish_file(iter_state);
+      return ESP_OK;
+  }
+
+  backfill.offset = offset;
+  spill_len = header_len + blocks_len;
+  ret = mqttmgr_acquiremsg(
+      MQTTMGR_TOPIC_SENSOR_BACKFILL,
+      sensormgr__sensor_backfill__get_packed_size(&backfill) +
+          SENSORMGR_BACKFILL_SPILL_OVERHEAD + spill_len,
+      &msg, SENSORMGR_DISPATCH_WAIT_MS / portTICK_PERIOD_MS);
+  if (ret == ESP_ERR_INVALID_ARG) {
+    abort();  // We configured messages badly if this happens
+  } else if (ret != ESP_OK) {
+    sensormgr_iter_rewind(iter_state, true);
+    return ESP_OK;
+  }
+  // protobuf-c would need the spill bytes in RAM first, so the bytes field is
+  // appended by hand after the packed metadata
+  out = msg->msg;
+  out += sensormgr__sensor_backfill__pack(&backfill, out);
+  *out++ = SENSORMGR_BACKFILL_SPILL_TAG;
+  out += sensormgr_varint_put(out, spill_len);
+  out += sensormgr_spill_header(iter_state->decoder, out);
+  if (fread(out, blocks_len, 1, iter_state->f_in) != 1) {
+    MQTTLOG_LOGE(TAG, "spill file read failed, dropping the rest",
+                 MQTTLOG_STR("file", iter_state->f_name),
+                 MQTTLOG_UINT("offset", offset));
+    mqttmgr_commitmsg(msg);  // Still empty, discards the slot
+    sensormgr_iter_finish_file(iter_state);
+    return ESP_OK;
+  }
+  msg->len = out + blocks_len - msg->msg;
+  iter_state->file_offset = offset + blocks_len;
+  sensormgr_drain_track(iter_state, msg);
+  mqttmgr_commitmsg(msg);
+  return ESP_OK;
+}
+
+// At low-water try to send data if connected, till empty.
+static void sensormgr_dispatch_mqtt(sensor_iterator_t *iter_state) {
+  ESP_LOGD(TAG, "marshalling loop...");
+  sensormgr_drain_checkpoint();
+  if (state.backfill == SENSORMGR__BACKFILL_T__BACKFILL_ON &&
+      sensormgr_backfill(iter_state) != ESP_ERR_NOT_FOUND) {
+    return;
+  }
+  if (state.data_format == SENSORMGR__DATA_FORMAT_T__PROTOBUF) {
+    sensormgr_queuesend_protobuf(iter_state);
+  } else {
+    sensormgr_queuesend_json(iter_state);
+  }
+}
+
+// Only consumer of the sample queue, decides between MQTT and the FS
+static void sensormgr_task_dispatch(void *pvParam) {
+  EventBits_t bits;
+  bool synced;
+  sensor_iterator_t drain_iter = {
+      .state = INIT,
+      .f_in = NULL,
+      .f_name[0] = '\0',
+      .decoder = NULL,
+      .file_offset = 0,
+      .reading = NULL,
+      .queue_pos = 0,
+  };
+  sensor_iterator_t spill_iter = drain_iter;
+
+  ESP_LOGI(TAG, "Staring %s task", SENSORMGR_TASKNAME_QUEUE);
+  sensormgr_log_free_space();
+  for (;;) {
+    if (!state.stopping) {
+      xEventGroupWaitBits(mqttmgr_events, SENSORMGR_LOWWATER_BIT,
+                          pdFALSE,  // Do NOT clear the bits before returning
+                          pdTRUE,   // Wait for ALL bits to be set
+                          portMAX_DELAY);
+    }
+    // The read task is parked by now, nothing more gets queued
+    if (state.stopping && sensormgr_queue_count(&state.queue) == 0) {
+      sensormgr_park(state.dispatch_parked, state.dispatch_resume);
+      continue;
+    }
+    bits = xEventGroupGetBits(mqttmgr_events);
+    synced = sensormgr_clock_synced();
+    if (state.stopping ||
+        ((bits & SENSORMGR_HIGHWATER_BIT) &&
+         (!(bits & MQTTMGR_CLIENT_CONNECTED_BIT) || !synced))) {
+      sensormgr_dispatch_spill(&spill_iter);
+      if (!state.stopping) {
+        sensormgr_flush_feedback(false);
+      }
+    } else if ((bits & MQTTMGR_CLIENT_CONNECTED_BIT) && !synced) {
+      // Readings are held till SNTP syncs, when they were taken isn't known
+      // before that
+      xEventGroupWaitBits(mqttmgr_events, SENSORMGR_HIGHWATER_BIT,
+                          pdFALSE,  // Do NOT clear the bits before returning
+                          pdTRUE,   // Wait for ALL bits to be set
+                          SENSORMGR_DISPATCH_WAIT_MS / portTICK_PERIOD_MS);
+    } else if (bits & MQTTMGR_CLIENT_CONNECTED_BIT) {
+      sensormgr_dispatch_mqtt(&drain_iter);
+      if (!(xEventGroupGetBits(mqttmgr_events) & SENSORMGR_LOWWATER_BIT)) {
+        sensormgr_flush_feedback(true);  // Drained, the flush is done
+      }
+    } else {
+      // Nowhere to put the readings yet, wait to connect or to fill up
+      sensormgr_flush_feedback(false);
+      xEventGroupWaitBits(
+          mqttmgr_events,
+          MQTTMGR_CLIENT_CONNECTED_BIT | SENSORMGR_HIGHWATER_BIT,
+          pdFALSE,  // Do NOT clear the bits before returning
+          pdFALSE,  // Wait for EITHER bit to be set
+          portMAX_DELAY);
+    }
+  }
+}
+
+// Blocks while the sample queue is full
+static sensormgr_sample_t *sensormgr_acquire_sample() {
+  sensormgr_sample_t *sample;
+
+  while (NULL == (sample = (sensormgr_sample_t *)sensormgr_queue_acquire(
+                      &state.queue))) {
+    // This likely means the FS is full
+    // The sample queue is full
+    // AND MQTT is offline
+    // We have to wait for that to come back, and for the buffers to drain
+    // It can take a bit for the FS to drain as well so delay for 5
+    // seconds here too
+    ESP_LOGE(TAG, "Error storing measurement in sample queue");
+    // Bounded, so a sensormgr_stop while offline isn't waiting on MQTT
+    xEventGroupWaitBits(
+        mqttmgr_events,
+        MQTTMGR_CLIENT_CONNECTED_BIT | SENSORMGR_POLLSENSORS_BIT,
+        pdFALSE,  // Do NOT clear the bits before returning
+        pdTRUE,   // Wait for ALL bits to be set
+        5000 / portTICK_PERIOD_MS);
+    if (!(xEventGroupWaitBits(mqttmgr_events, SENSORMGR_PARK_BIT, pdFALSE,
+                              pdTRUE, 5000 / portTICK_PERIOD_MS) &
+          SENSORMGR_PARK_BIT)) {
+      continue;
+    }
+    // No lock is held here, the sample is taken once started again
+    sensormgr_park(state.read_parked, state.read_resume);
+  }
+  return sample;
+}
+
+static void sensormgr_queue_stat(uint8_t channel, sensormgr_stat_t stat,
+                                 int64_t timestamp, double value) {
+  sensormgr_sample_t sample;
+  sensormgr_deadband_cfg_t cfg;
+
+  if (ESP_OK != sensormgr_sample_set_stat(&sample, channel,
+                                          state.channels[channel].decimals,
+                                          stat, timestamp, value)) {
+    ESP_LOGE(TAG, "Channel %u %s %f out of range, dropped", channel,
+             sensormgr_stat_names[stat], value);
+    return;
+  }
+  if (stat == SENSORMGR_STAT_RAW) {
+    xSemaphoreTake(state.deadband_lock, portMAX_DELAY);
+    cfg = state.deadband_cfgs[channel];
+    xSemaphoreGive(state.deadband_lock);
+    if (!sensormgr_deadband_pass(&state.deadbands[channel], &cfg, &sample,
+                                 timestamp)) {
+      atomic_fetch_add(&state.readings_suppressed, 1);
+      return;
+    }
+  }
+  *sensormgr_acquire_sample() = sample;
+  sensormgr_queue_commit(&state.queue);
+  if (atomic_fetch_add(&state.readings_emitted, 1) == 0) {
+    MQTTLOG_LOGI(TAG, "first sample",
+                 MQTTLOG_INT64("boot_ms", esp_timer_get_time() / 1000));
+  }
+}
+
+/**
+ * @brief Queue the summary of a channel's window, if it has any readings
+ */
+static void sensormgr_aggregate_flush(uint8_t channel) {
+  sensormgr_aggregate_t *agg = &state.aggregates[channel];
+  int64_t timestamp = agg->window_start * 1000LL;
+
+  if (agg->count == 0) {
+    return;
+  }
+  sensormgr_queue_stat(channel, SENSORMGR_STAT_MEAN, timestamp, agg->mean);
+  sensormgr_queue_stat(channel, SENSORMGR_STAT_MIN, timestamp, agg->min);
+  sensormgr_queue_stat(channel, SENSORMGR_STAT_MAX, timestamp, agg->max);
+  sensormgr_queue_stat(channel, SENSORMGR_STAT_STDDEV, timestamp,
+                       sensormgr_aggregate_stddev(agg));
+  sensormgr_queue_stat(channel, SENSORMGR_STAT_COUNT, timestamp, agg->count);
+  sensormgr_aggregate_reset(agg, agg->window_start);
+}
+
+/**
+ * @brief Flush the windows that are over, and all of them when the window
+ *        length has been changed
+ *
+ * @param now Wall clock time, seconds since boot till SNTP synced
+ */
+static void sensormgr_aggregate_check(time_t now) {
+  uint8_t channel;
+  uint32_t window = atomic_load(&state.aggregate_window);
+  bool changed = window != state.aggregates_window;
+
+  for (channel = 0; channel < state.channel_cnt; channel++) {
+    if (changed || now >= state.aggregates[channel].window_start +
+                               (time_t)state.aggregates_window) {
+      sensormgr_aggregate_flush(channel);
+    }
+  }
+  state.aggregates_window = window;
+}
+
+static void sensormgr_aggregate_reading(uint8_t channel, time_t timestamp,
+                                        float value) {
+  sensormgr_aggregate_t *agg = &state.aggregates[channel];
+  time_t window_start =
+      sensormgr_aggregate_window(timestamp, state.aggregates_window);
+
+  if (agg->window_start != window_start) {
+    sensormgr_aggregate_flush(channel);  // Previous window is over
+    sensormgr_aggregate_reset(agg, window_start);
+  }
+  sensormgr_aggregate_add(agg, value);
+}
+
+/**
+ * @brief Queue a reading, or add it to its channel's window when aggregating
+ */
+static void sensormgr_store_reading(uint8_t channel, int64_t timestamp,
+                                    float value) {
+  if (state.aggregates_window != 0) {
+    // Windows are aligned to the wall clock once it is known
+    sensormgr_aggregate_reading(channel, sensormgr_wall_time(timestamp) / 1000,
+                                value);
+  } else {
+    sensormgr_queue_stat(channel, SENSORMGR_STAT_RAW, timestamp, value);
+  }
+}
+
+static void sensormgr_poll_sensor(uint8_t idx) {
+  uint8_t value_idx;
+  int64_t timestamp;
+  float values[SENSORMGR_CHANNELS_MAX];
+  esp_err_t ret;
+
+  for (value_idx = 0; value_idx < state.sensors[idx].channel_cnt;
+       value_idx++) {
+    values[value_idx] = NAN;
+  }
+  timestamp = sensormgr_now();
+  ret = state.sensors[idx].measure(values);
+  ESP_LOGV(TAG, "Storing sensor %u in sample queue (queued: %u)", idx,
+           sensormgr_queue_count(&state.queue));
+  if (ret != ESP_OK) {
+    return;
+  }
+  for (value_idx = 0; value_idx < state.sensors[idx].channel_cnt;
+       value_idx++) {
+    if (isnan(values[value_idx])) {
+      continue;  // Not measured this time
+    }
+    sensormgr_store_reading(state.sensor_channel[idx] + value_idx, timestamp,
+                            values[value_idx]);
   }
 }
 
 // Poll only while able to buffer safely
 static void sensormgr_task_sensorread(void *pvParam) {
-  uint8_t idx, loop_cnt = 0;
-  void *sensor_data_ptr;
-  size_t sensor_data_len, free_buf_size;
-  esp_err_t ret;
-  sensor_reading_t *wrapped_reading;
+  uint8_t idx;
+  uint32_t queued, wait, age_sec;
+  int64_t timestamp;
+  TickType_t now, stats_tick = xTaskGetTickCount(), pending_tick = 0;
+  bool pending = false;  // Samples queued since the last flush
+  sensormgr_flush_t flush;
 
   ESP_LOGI(TAG, "Starting %s task", SENSORMGR_TASKNAME_READ);
-  for (;; loop_cnt++) {
-    xEventGroupWaitBits(mqttmgr_events, SENSORMGR_POLLSENSORS_BIT,
-                        pdFALSE,  // Do NOT clear the bits before returning
-                        pdTRUE,   // Wait for ALL bits to be set
-                        portMAX_DELAY);
-    ESP_LOGD(TAG, "Polling %x sensors", state.sensor_cnt);
-    for (idx = 0; idx < state.sensor_cnt; idx++) {
-      sensor_data_ptr = NULL;
-      sensor_data_len = 0;
-      ret = state.sensors[idx].measure(&sensor_data_ptr, &sensor_data_len);
-      ESP_LOGV(TAG, "Storing %d in ringbuf (free: %d)", sensor_data_len,
-               xRingbufferGetCurFreeSize(state.ring_buffer));
-      if (ret == ESP_OK) {
-        while (pdTRUE != xRingbufferSendAcquire(
-                             state.ring_buffer, (void **)&wrapped_reading,
-                             sizeof(sensor_reading_t) + sensor_data_len, 0)) {
-          // This likely means the FS is full
-          // The ring buffer is full
-          // AND MQTT is offline
-          // We have to wait for that to come back, and for the buffers to drain
-          // It can take a bit for the FS to drain as well so delay for 5
-          // seconds here too
-          ESP_LOGE(TAG, "Error storing measurement in ring buffer");
-          xEventGroupWaitBits(
-              mqttmgr_events,
-              MQTTMGR_CLIENT_CONNECTED_BIT | SENSORMGR_POLLSENSORS_BIT,
-              pdFALSE,  // Do NOT clear the bits before returning
-              pdTRUE,   // Wait for ALL bits to be set
-              portMAX_DELAY);
-          vTaskDelay(5000 / portTICK_PERIOD_MS);
-        }
-        *wrapped_reading = (sensor_reading_t){
-            .type_idx = idx,
-            .sensor_data_len = sensor_data_len,
-        };
-        memcpy(wrapped_reading->sensor_data, sensor_data_ptr, sensor_data_len);
-        xRingbufferSendComplete(state.ring_buffer, wrapped_reading);
-        state.ring_buffer_item_count++;
+  for (;;) {
+    if (xEventGroupWaitBits(
+            mqttmgr_events, SENSORMGR_POLLSENSORS_BIT | SENSORMGR_PARK_BIT,
+            pdFALSE,  // Do NOT clear the bits before returning
+            pdFALSE,  // Wait for EITHER bit to be set
+            portMAX_DELAY) &
+        SENSORMGR_PARK_BIT) {
+      sensormgr_park(state.read_parked, state.read_resume);
+      continue;
+    }
+    timestamp = sensormgr_now();
+    sensormgr_aggregate_check(sensormgr_wall_time(timestamp) / 1000);
+    now = xTaskGetTickCount();
+    while (sensormgr_schedule_pop_due(&state.schedule, now, &idx)) {
+      ESP_LOGD(TAG, "Polling sensor %u", idx);
+      sensormgr_poll_sensor(idx);
+    }
+    ESP_LOGV(TAG, "data written to sample queue");
+    // Exact occupancy, records only leave once the dispatcher is done with
+    // them
+    queued = sensormgr_queue_count(&state.queue);
+    flush = sensormgr_flush_get();
+    // Age the first sample queued since the dispatcher last drained the
+    // queue, checked as often as sensors are polled
+    if (!(xEventGroupGetBits(mqttmgr_events) & SENSORMGR_LOWWATER_BIT)) {
+      if (queued == 0) {
+        pending = false;
+      } else if (!pending) {
+        pending = true;
+        pending_tick = now;
       }
     }
-    ESP_LOGV(TAG, "data written to ringbuffer");
-    free_buf_size = xRingbufferGetCurFreeSize(state.ring_buffer);
-    if (free_buf_size < SENSORMGR_RINBUFFER_LOWWATER ||
-        (state.LOWWATER_ITEM_CNT != 0 &&
-         state.ring_buffer_item_count > state.LOWWATER_ITEM_CNT)) {
+    age_sec = pending ? (now - pending_tick) / configTICK_RATE_HZ : 0;
+    if (sensormgr_flush_due(&flush, state.queue.slot_cnt, queued, age_sec)) {
+      pending = false;
       xEventGroupSetBits(mqttmgr_events, SENSORMGR_LOWWATER_BIT);
       ESP_LOGI(TAG,
-               "low-water bit set: (low: %d, high: %d) %d < %d | %d (item cnt) "
-               "> %d (low water mark)",
-               SENSORMGR_RINBUFFER_LOWWATER, SENSORMGR_RINBUFFER_HIGHWATER,
-               free_buf_size, SENSORMGR_RINBUFFER_LOWWATER,
-               state.ring_buffer_item_count, state.LOWWATER_ITEM_CNT);
+               "low-water bit set: (low: %u, high: %u) %u queued, %us old | "
+               "items: %u bytes: %u age: %us x%u",
+               sensormgr_flush_lowwater(&flush, state.queue.slot_cnt),
+               sensormgr_flush_highwater(&flush, state.queue.slot_cnt),
+               queued, age_sec, flush.cfg.items, flush.cfg.bytes,
+               flush.cfg.age_sec, flush.stretch);
     }
-    if (free_buf_size < SENSORMGR_RINBUFFER_HIGHWATER) {
+    if (queued >= sensormgr_flush_highwater(&flush, state.queue.slot_cnt)) {
       xEventGroupSetBits(mqttmgr_events, SENSORMGR_HIGHWATER_BIT);
-      ESP_LOGI(TAG, "high-water bit set: %d < %d", free_buf_size,
-               SENSORMGR_RINBUFFER_HIGHWATER);
+      ESP_LOGI(TAG, "high-water bit set: %u >= %u", queued,
+               sensormgr_flush_highwater(&flush, state.queue.slot_cnt));
     }
-    vTaskDelay(CONFIG_SENSORMGR_SAMPLE_RATE / portTICK_RATE_MS);
 
-    if (loop_cnt > 250) {
+    if (now - stats_tick >= SENSORMGR_STATS_INTERVAL) {
       sensormgr_log_stats();
-      loop_cnt = 0;
+      stats_tick = now;
+    }
+
+    // Sleep until the next sensor is due, the idle task can light sleep
+    // through it
+    wait = sensormgr_schedule_wait(&state.schedule, xTaskGetTickCount());
+    if (wait == UINT32_MAX) {
+      wait = pdMS_TO_TICKS(CONFIG_SENSORMGR_SAMPLE_RATE);  // None registered
+    }
+    if (wait > 0) {
+      // Cut short by sensormgr_stop
+      xEventGroupWaitBits(mqttmgr_events, SENSORMGR_PARK_BIT, pdFALSE, pdTRUE,
+                          wait);
     }
   }
 }
@@ -559,106 +1651,754 @@ static void sensormgr_nvs_get_location() {
   nvs_close(my_handle);
 }
 
-static void sensormgr_cmd_get_options_dealloc_cb(CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "sensormgr_cmd_get_options_dealloc_cb - freeing");
-  free(resp_out->sensormgr_get_options_response);
+static esp_err_t sensormgr_nvs_set_data_format(
+    Sensormgr__DataFormatT data_format) {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_set_u8(my_handle, SENSORMGR_NVS_DATA_FORMAT_KEY, data_format);
+  if (ESP_OK != ret) {
+    ESP_LOGE(TAG, "Errors (%s) saving data format to NVS",
+             esp_err_to_name(ret));
+  }
+  nvs_close(my_handle);
+  state.data_format = data_format;
+  return ret;
 }
 
-static CommandResponse__RetCodeT sensormgr_cmd_get_options(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_SENSORMGR_GET_OPTIONS_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
+static void sensormgr_nvs_get_data_format() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  uint8_t data_format;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_get_u8(my_handle, SENSORMGR_NVS_DATA_FORMAT_KEY, &data_format);
+  switch (ret) {
+    case ESP_OK:
+      state.data_format = data_format;
+      ESP_LOGI(TAG, "Data format read from NVS: %u", data_format);
+      break;
+    case ESP_ERR_NVS_NOT_FOUND:
+      ESP_LOGI(TAG, "SENSORMGR_NVS_DATA_FORMAT_KEY not set, using JSON");
+      break;
+    default:
+      ESP_LOGE(TAG, "Errors (%s) opening NVS handle", esp_err_to_name(ret));
+      break;
   }
+  nvs_close(my_handle);
+}
+
+static esp_err_t sensormgr_nvs_set_backfill(Sensormgr__BackfillT backfill) {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_set_u8(my_handle, SENSORMGR_NVS_BACKFILL_KEY, backfill);
+  if (ESP_OK != ret) {
+    ESP_LOGE(TAG, "Errors (%s) saving backfill to NVS", esp_err_to_name(ret));
+  }
+  nvs_close(my_handle);
+  state.backfill = backfill;
+  return ret;
+}
+
+static void sensormgr_nvs_get_backfill() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  uint8_t backfill;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_get_u8(my_handle, SENSORMGR_NVS_BACKFILL_KEY, &backfill);
+  switch (ret) {
+    case ESP_OK:
+      state.backfill = backfill;
+      ESP_LOGI(TAG, "Backfill read from NVS: %u", backfill);
+      break;
+    case ESP_ERR_NVS_NOT_FOUND:
+      ESP_LOGI(TAG, "SENSORMGR_NVS_BACKFILL_KEY not set, backfill off");
+      break;
+    default:
+      ESP_LOGE(TAG, "Errors (%s) opening NVS handle", esp_err_to_name(ret));
+      break;
+  }
+  nvs_close(my_handle);
+}
+
+static esp_err_t sensormgr_nvs_set_aggregate_window(uint32_t window) {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_set_u32(my_handle, SENSORMGR_NVS_AGGREGATE_KEY, window);
+  if (ESP_OK != ret) {
+    ESP_LOGE(TAG, "Errors (%s) saving aggregate window to NVS",
+             esp_err_to_name(ret));
+  }
+  nvs_close(my_handle);
+  atomic_store(&state.aggregate_window, window);
+  return ret;
+}
+
+static void sensormgr_nvs_get_aggregate_window() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  uint32_t window;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_get_u32(my_handle, SENSORMGR_NVS_AGGREGATE_KEY, &window);
+  switch (ret) {
+    case ESP_OK:
+      atomic_store(&state.aggregate_window, window);
+      ESP_LOGI(TAG, "Aggregate window read from NVS: %us", window);
+      break;
+    case ESP_ERR_NVS_NOT_FOUND:
+      ESP_LOGI(TAG, "SENSORMGR_NVS_AGGREGATE_KEY not set, sending raw");
+      break;
+    default:
+      ESP_LOGE(TAG, "Errors (%s) opening NVS handle", esp_err_to_name(ret));
+      break;
+  }
+  nvs_close(my_handle);
+}
+
+/**
+ * @brief Save the deadband entries
+ *
+ * Caller must hold deadband_lock.
+ */
+static esp_err_t sensormgr_nvs_set_deadbands_locked() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  if (state.deadband_entry_cnt == 0) {
+    ret = nvs_erase_key(my_handle, SENSORMGR_NVS_DEADBAND_KEY);
+    ret = ret == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : ret;
+  } else {
+    ret = nvs_set_blob(my_handle, SENSORMGR_NVS_DEADBAND_KEY,
+                       state.deadband_entries,
+                       state.deadband_entry_cnt * sizeof(deadband_entry_t));
+  }
+  if (ESP_OK != ret) {
+    ESP_LOGE(TAG, "Errors (%s) saving deadbands to NVS",
+             esp_err_to_name(ret));
+  }
+  nvs_close(my_handle);
+  return ret;
+}
+
+static void sensormgr_nvs_get_deadbands() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  size_t len = sizeof(state.deadband_entries);
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_get_blob(my_handle, SENSORMGR_NVS_DEADBAND_KEY,
+                     state.deadband_entries, &len);
+  switch (ret) {
+    case ESP_OK:
+      state.deadband_entry_cnt = len / sizeof(deadband_entry_t);
+      ESP_LOGI(TAG, "Deadbands read from NVS: %u", state.deadband_entry_cnt);
+      break;
+    case ESP_ERR_NVS_NOT_FOUND:
+      ESP_LOGI(TAG, "SENSORMGR_NVS_DEADBAND_KEY not set, sending every value");
+      break;
+    default:
+      ESP_LOGE(TAG, "Errors (%s) opening NVS handle", esp_err_to_name(ret));
+      break;
+  }
+  nvs_close(my_handle);
+}
+
+static esp_err_t sensormgr_nvs_set_flush(const sensormgr_flush_cfg_t *cfg) {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_set_blob(my_handle, SENSORMGR_NVS_FLUSH_KEY, cfg, sizeof(*cfg));
+  if (ESP_OK != ret) {
+    ESP_LOGE(TAG, "Errors (%s) saving flush policy to NVS",
+             esp_err_to_name(ret));
+  }
+  nvs_close(my_handle);
+  xSemaphoreTake(state.flush_lock, portMAX_DELAY);
+  sensormgr_flush_init(&state.flush, cfg);
+  xSemaphoreGive(state.flush_lock);
+  return ret;
+}
+
+static void sensormgr_nvs_get_flush() {
+  esp_err_t ret;
+  nvs_handle_t my_handle;
+  sensormgr_flush_cfg_t cfg;
+  size_t len = sizeof(cfg);
+  ESP_ERROR_CHECK(nvs_open("sensormgr", NVS_READWRITE, &my_handle));
+  ret = nvs_get_blob(my_handle, SENSORMGR_NVS_FLUSH_KEY, &cfg, &len);
+  switch (ret) {
+    case ESP_OK:
+      if (len != sizeof(cfg) || ESP_OK != sensormgr_flush_validate(&cfg)) {
+        ESP_LOGW(TAG, "Flush policy in NVS invalid, using defaults");
+        break;
+      }
+      sensormgr_flush_init(&state.flush, &cfg);
+      ESP_LOGI(TAG, "Flush policy read from NVS: %u items %u bytes %us",
+               cfg.items, cfg.bytes, cfg.age_sec);
+      break;
+    case ESP_ERR_NVS_NOT_FOUND:
+      ESP_LOGI(TAG, "SENSORMGR_NVS_FLUSH_KEY not set, using defaults");
+      break;
+    default:
+      ESP_LOGE(TAG, "Errors (%s) opening NVS handle", esp_err_to_name(ret));
+      break;
+  }
+  nvs_close(my_handle);
+}
+
+/**
+ * @brief Rewrite the index with only the live files
+ *
+ * Caller must hold index_lock and have closed the index file.
+ */
+static void sensormgr_index_compact_locked() {
+  FILE *f_in, *f_out;
+  esp_err_t ret = ESP_FAIL;
+
+  f_in = fopen(SENSORMGR_INDEX_PATH, "rb");
+  f_out = fopen(SENSORMGR_INDEX_TMP_PATH, "w+b");
+  if (f_in != NULL && f_out != NULL) {
+    ret = sensormgr_index_compact(&state.index, f_in, f_out);
+  }
+  if (f_in != NULL) {
+    fclose(f_in);
+  }
+  if (f_out != NULL) {
+    fclose(f_out);
+  }
+  if (ESP_OK != ret || 0 != remove(SENSORMGR_INDEX_PATH) ||
+      0 != rename(SENSORMGR_INDEX_TMP_PATH, SENSORMGR_INDEX_PATH)) {
+    ESP_LOGE(TAG, "Failed to compact spill index");
+    return;
+  }
+  ESP_LOGI(TAG, "Compacted spill index to %u records",
+           state.index.record_cnt);
+}
+
+typedef esp_err_t(sensormgr_index_op_fn)(sensormgr_index_t *idx, FILE *f,
+                                         const void *arg);
+
+static esp_err_t sensormgr_index_op_add(sensormgr_index_t *idx, FILE *f,
+                                        const void *arg) {
+  return sensormgr_index_add(idx, f, (const sensormgr_index_entry_t *)arg);
+}
+
+static esp_err_t sensormgr_index_op_drained(sensormgr_index_t *idx, FILE *f,
+                                            const void *arg) {
+  return sensormgr_index_drained(idx, f, *(const uint32_t *)arg);
+}
+
+static esp_err_t sensormgr_index_op_remove(sensormgr_index_t *idx, FILE *f,
+                                           const void *arg) {
+  return sensormgr_index_remove(idx, f);
+}
+
+/**
+ * @brief Append a record to the on-flash index and apply it to state.index
+ */
+static void sensormgr_index_commit(sensormgr_index_op_fn *op,
+                                   const void *arg) {
+  FILE *f;
+  esp_err_t ret = ESP_FAIL;
+
+  xSemaphoreTake(state.index_lock, portMAX_DELAY);
+  f = fopen(SENSORMGR_INDEX_PATH, "a+b");
+  if (f != NULL) {
+    ret = op(&state.index, f, arg);
+    fclose(f);
+  }
+  state.has_files = state.index.file_cnt != 0;
+  if (ESP_OK != ret) {
+    MQTTLOG_LOGE(TAG, "spill index update failed", MQTTLOG_INT("err", ret),
+                 MQTTLOG_UINT("files", state.index.file_cnt));
+  } else if (state.index.file_cnt == 0) {
+    // Everything drained, start over with an empty index
+    remove(SENSORMGR_INDEX_PATH);
+    state.index.record_cnt = 0;
+  } else if (sensormgr_index_needs_compact(&state.index)) {
+    sensormgr_index_compact_locked();
+  }
+  xSemaphoreGive(state.index_lock);
+}
+
+static void sensormgr_index_commit_add(const sensormgr_index_entry_t *entry) {
+  sensormgr_index_commit(sensormgr_index_op_add, entry);
+}
+
+static void sensormgr_index_commit_drained(uint32_t offset) {
+  sensormgr_index_commit(sensormgr_index_op_drained, &offset);
+}
+
+static void sensormgr_index_commit_remove() {
+  sensormgr_index_commit(sensormgr_index_op_remove, NULL);
+}
+
+static int sensormgr_index_name_cmp(const void *a, const void *b) {
+  return strcmp(((const sensormgr_index_entry_t *)a)->name,
+                ((const sensormgr_index_entry_t *)b)->name);
+}
+
+/**
+ * @brief Index the spill files left by firmware without an index
+ *
+ * The only directory walk left, done once when there is no index file. File
+ * names sort in the order they were written within a month.
+ */
+static void sensormgr_index_rebuild() {
+  FILINFO fno;
+  FF_DIR dj;
+  size_t idx, entry_cnt = 0, entry_max = 0;
+  sensormgr_index_entry_t *entries = NULL, *grown;
+  FILE *f;
+
+  ESP_LOGI(TAG, "No spill index, searching for datafiles");
+  f_opendir(&dj, "/");
+  while (F_OK == f_readdir(&dj, &fno) && fno.fname[0]) {
+    if (strstr(fno.fname, ".BIN") == NULL ||
+        strlen(fno.fname) > SENSORMGR_INDEX_NAME_LEN) {
+      continue;
+    }
+    if (entry_cnt == entry_max) {
+      entry_max = entry_max ? entry_max * 2 : 16;
+      grown = realloc(entries, entry_max * sizeof(*entries));
+      if (grown == NULL) {
+        ESP_LOGE(TAG, "Out of memory indexing datafiles, rest skipped");
+        break;
+      }
+      entries = grown;
+    }
+    // Timestamps and reading count are unknown for these
+    entries[entry_cnt] = (sensormgr_index_entry_t){.len = fno.fsize};
+    strcpy(entries[entry_cnt++].name, fno.fname);
+  }
+  f_closedir(&dj);
+  qsort(entries, entry_cnt, sizeof(*entries), sensormgr_index_name_cmp);
+
+  sensormgr_index_load(&state.index, NULL);
+  if (entry_cnt != 0) {
+    f = fopen(SENSORMGR_INDEX_PATH, "a+b");
+    if (f == NULL) {
+      ESP_LOGE(TAG, "Failed to create spill index");
+      abort();
+    }
+    for (idx = 0; idx < entry_cnt; idx++) {
+      ESP_LOGI(TAG, "indexing datafile - %s", entries[idx].name);
+      sensormgr_index_add(&state.index, f, &entries[idx]);
+    }
+    fclose(f);
+  }
+  free(entries);
+}
+
+/**
+ * @brief Load the spill index, compacting it if it needs repairs
+ */
+static void sensormgr_index_init() {
+  FILE *f;
+  esp_err_t ret;
+
+  f = fopen(SENSORMGR_INDEX_PATH, "rb");
+  if (f == NULL) {
+    sensormgr_index_rebuild();
+    return;
+  }
+  ret = sensormgr_index_load(&state.index, f);
+  fclose(f);
+  if (ESP_OK != ret) {
+    MQTTLOG_LOGW(TAG, "spill index damaged, repairing",
+                 MQTTLOG_INT("err", ret),
+                 MQTTLOG_UINT("files", state.index.file_cnt));
+  }
+  if (ESP_OK != ret || sensormgr_index_needs_compact(&state.index)) {
+    xSemaphoreTake(state.index_lock, portMAX_DELAY);
+    sensormgr_index_compact_locked();
+    xSemaphoreGive(state.index_lock);
+  }
+}
+
+/**
+ * @brief Filter configuration of a channel from its persisted deadband
+ *
+ * Caller must hold deadband_lock.
+ */
+static void sensormgr_deadband_apply_locked(uint8_t channel) {
+  uint8_t idx;
+  const sensormgr_channel_t *desc = &state.channels[channel];
+  const deadband_entry_t *entry;
+
+  state.deadband_cfgs[channel] = (sensormgr_deadband_cfg_t){0};
+  for (idx = 0; idx < state.deadband_entry_cnt; idx++) {
+    entry = &state.deadband_entries[idx];
+    if (strcmp(entry->sensor, desc->sensor) != 0 ||
+        strcmp(entry->unit, desc->unit) != 0) {
+      continue;
+    }
+    if (ESP_OK != sensormgr_deadband_config(&state.deadband_cfgs[channel],
+                                            desc->decimals, entry->deadband,
+                                            entry->heartbeat_sec)) {
+      ESP_LOGW(TAG, "Deadband of %s %s out of range, ignored", desc->sensor,
+               desc->unit);
+    }
+    return;
+  }
+}
+
+/**
+ * @brief Set the deadband of every channel a Deadband message matches
+ *
+ * Only changes set, nothing is applied till the whole request checks out.
+ */
+static CommandResponse__RetCodeT sensormgr_deadband_set(
+    deadband_set_t *set, const Sensormgr__Deadband *db) {
+  uint8_t channel, idx;
+  bool matched = false;
+  const sensormgr_channel_t *desc;
+  deadband_entry_t *entry;
+  sensormgr_deadband_cfg_t cfg;
+
+  for (channel = 0; channel < state.channel_cnt; channel++) {
+    desc = &state.channels[channel];
+    if (strcmp(desc->sensor, db->sensor) != 0 ||
+        (db->unit[0] != '\0' && strcmp(desc->unit, db->unit) != 0)) {
+      continue;
+    }
+    matched = true;
+    if (ESP_OK != sensormgr_deadband_config(&cfg, desc->decimals,
+                                            db->deadband, db->heartbeat_sec) ||
+        strlen(desc->sensor) >= sizeof(entry->sensor) ||
+        strlen(desc->unit) >= sizeof(entry->unit)) {
+      MQTTLOG_LOGW(TAG, "cmd_set_options failed",
+                   MQTTLOG_STR("reason", "invalid_deadband"),
+                   MQTTLOG_STR("sensor", desc->sensor),
+                   MQTTLOG_STR("unit", desc->unit),
+                   MQTTLOG_FLOAT("deadband", db->deadband));
+      return COMMAND_RESPONSE__RET_CODE_T__ERR;
+    }
+    for (idx = 0; idx < set->entry_cnt; idx++) {
+      entry = &set->entries[idx];
+      if (strcmp(entry->sensor, desc->sensor) == 0 &&
+          strcmp(entry->unit, desc->unit) == 0) {
+        break;
+      }
+    }
+    if (db->deadband == 0 && db->heartbeat_sec == 0) {
+      if (idx < set->entry_cnt) {
+        set->entries[idx] = set->entries[--set->entry_cnt];
+      }
+    } else {
+      if (idx == set->entry_cnt) {
+        if (idx >= SENSORMGR_CHANNELS_MAX) {
+          MQTTLOG_LOGW(TAG, "cmd_set_options failed",
+                       MQTTLOG_STR("reason", "max_deadbands_exceeded"),
+                       MQTTLOG_UINT("max_deadbands", SENSORMGR_CHANNELS_MAX));
+          return COMMAND_RESPONSE__RET_CODE_T__ERR;
+        }
+        entry = &set->entries[set->entry_cnt++];
+        *entry = (deadband_entry_t){0};
+        strcpy(entry->sensor, desc->sensor);
+        strcpy(entry->unit, desc->unit);
+      }
+      set->entries[idx].deadband = db->deadband;
+      set->entries[idx].heartbeat_sec = db->heartbeat_sec;
+    }
+    set->cfgs[channel] = cfg;
+  }
+  if (!matched) {
+    MQTTLOG_LOGW(TAG, "cmd_set_options failed",
+                 MQTTLOG_STR("reason", "unknown_channel"),
+                 MQTTLOG_STR("sensor", db->sensor),
+                 MQTTLOG_STR("unit", db->unit));
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
+}
+
+static CommandResponse__RetCodeT sensormgr_cmd_get_options(
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  uint8_t idx;
+  Sensormgr__Deadband *deadbands;
+  Sensormgr__FlushPolicy *flush_msg;
+  sensormgr_flush_t flush;
 
-  resp_out->resp_case = COMMAND_RESPONSE__RESP_SENSORMGR_GET_OPTIONS_RESPONSE;
-  *cb = sensormgr_cmd_get_options_dealloc_cb;
   Sensormgr__GetOptionsResponse *cmd_resp =
-      (Sensormgr__GetOptionsResponse *)calloc(
-          1, sizeof(Sensormgr__GetOptionsResponse));
+      MQTTMGR_ARENA_NEW(arena, Sensormgr__GetOptionsResponse);
+  flush_msg = MQTTMGR_ARENA_NEW(arena, Sensormgr__FlushPolicy);
+  if (cmd_resp == NULL || flush_msg == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  resp_out->resp_case = COMMAND_RESPONSE__RESP_SENSORMGR_GET_OPTIONS_RESPONSE;
   sensormgr__get_options_response__init(cmd_resp);
   resp_out->sensormgr_get_options_response = cmd_resp;
+  cmd_resp->location_name = state.location_name;
+  cmd_resp->data_format = state.data_format;
+  cmd_resp->backfill = state.backfill;
+  cmd_resp->aggregate_window_sec = atomic_load(&state.aggregate_window);
+  xSemaphoreTake(state.deadband_lock, portMAX_DELAY);
+  deadbands = MQTTMGR_ARENA_NEW_ARRAY(arena, Sensormgr__Deadband,
+                                      state.deadband_entry_cnt);
+  cmd_resp->deadbands = MQTTMGR_ARENA_NEW_ARRAY(
+      arena, Sensormgr__Deadband *, state.deadband_entry_cnt);
+  if (deadbands == NULL || cmd_resp->deadbands == NULL) {
+    xSemaphoreGive(state.deadband_lock);
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  for (idx = 0; idx < state.deadband_entry_cnt; idx++) {
+    sensormgr__deadband__init(&deadbands[idx]);
+    deadbands[idx].sensor = state.deadband_entries[idx].sensor;
+    deadbands[idx].unit = state.deadband_entries[idx].unit;
+    deadbands[idx].deadband = state.deadband_entries[idx].deadband;
+    deadbands[idx].heartbeat_sec = state.deadband_entries[idx].heartbeat_sec;
+    cmd_resp->deadbands[idx] = &deadbands[idx];
+  }
+  cmd_resp->n_deadbands = state.deadband_entry_cnt;
+  xSemaphoreGive(state.deadband_lock);
+  flush = sensormgr_flush_get();
+  sensormgr__flush_policy__init(flush_msg);
+  flush_msg->items = flush.cfg.items;
+  flush_msg->bytes = flush.cfg.bytes;
+  flush_msg->age_sec = flush.cfg.age_sec;
+  flush_msg->fill_pct = flush.cfg.fill_pct;
+  flush_msg->spill_pct = flush.cfg.spill_pct;
+  flush_msg->fs_reserve_kb = flush.cfg.fs_reserve_kb;
+  flush_msg->adaptive = flush.cfg.adaptive;
+  cmd_resp->flush_policy = flush_msg;
 
   return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
 }
 
-static void sensormgr_cmd_set_options_dealloc_cb(CommandResponse *resp_out) {
-  ESP_LOGD(TAG, "sensormgr_cmd_set_options_dealloc_cb - freeing");
-  free(resp_out->sensormgr_get_stats_response);
-}
-
 static CommandResponse__RetCodeT sensormgr_cmd_set_options(
-    CommandRequest *msg, CommandResponse *resp_out, dealloc_cb_fn **cb) {
-  if (msg->cmd_case != COMMAND_REQUEST__CMD_SENSORMGR_SET_OPTIONS_REQUEST) {
-    return COMMAND_RESPONSE__RET_CODE_T__NOTMINE;
-  }
+    CommandRequest *msg, CommandResponse *resp_out, mqttmgr_arena_t *arena) {
+  size_t idx;
+  CommandResponse__RetCodeT ret;
+  sensormgr_flush_cfg_t flush_cfg;
+  deadband_set_t deadbands;
+
   Sensormgr__SetOptionsRequest *cmd = msg->sensormgr_set_options_request;
 
-  resp_out->resp_case = COMMAND_RESPONSE__RESP_SENSORMGR_SET_OPTIONS_RESPONSE;
-  *cb = sensormgr_cmd_set_options_dealloc_cb;
   Sensormgr__SetOptionsResponse *cmd_resp =
-      (Sensormgr__SetOptionsResponse *)calloc(
-          1, sizeof(Sensormgr__SetOptionsResponse));
+      MQTTMGR_ARENA_NEW(arena, Sensormgr__SetOptionsResponse);
+  if (cmd_resp == NULL) {
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  resp_out->resp_case = COMMAND_RESPONSE__RESP_SENSORMGR_SET_OPTIONS_RESPONSE;
   sensormgr__set_options_response__init(cmd_resp);
   resp_out->sensormgr_set_options_response = cmd_resp;
   size_t location_name_len = strlen(cmd->location_name);
   if (location_name_len > sizeof(state.location_name)) {
     MQTTLOG_LOGW(TAG, "cmd_set_options failed",
-                 "reason=max_len_exceeded max_len=%u received_len=%u",
-                 sizeof(state.location_name), location_name_len);
+                 MQTTLOG_STR("reason", "max_len_exceeded"),
+                 MQTTLOG_UINT("max_len", sizeof(state.location_name)),
+                 MQTTLOG_UINT("received_len", location_name_len));
     return COMMAND_RESPONSE__RET_CODE_T__ERR;
   }
-  sensormgr_nvs_set_location(cmd->location_name);
+  if (cmd->flush_policy != NULL) {
+    flush_cfg = (sensormgr_flush_cfg_t){
+        .items = cmd->flush_policy->items,
+        .bytes = cmd->flush_policy->bytes,
+        .age_sec = cmd->flush_policy->age_sec,
+        .fill_pct = cmd->flush_policy->fill_pct,
+        .spill_pct = cmd->flush_policy->spill_pct,
+        .fs_reserve_kb = cmd->flush_policy->fs_reserve_kb,
+        .adaptive = cmd->flush_policy->adaptive,
+    };
+    if (cmd->flush_policy->fill_pct > 100 ||
+        cmd->flush_policy->spill_pct > 100 ||
+        ESP_OK != sensormgr_flush_validate(&flush_cfg)) {
+      MQTTLOG_LOGW(TAG, "cmd_set_options failed",
+                   MQTTLOG_STR("reason", "invalid_flush_policy"),
+                   MQTTLOG_UINT("fill_pct", cmd->flush_policy->fill_pct),
+                   MQTTLOG_UINT("spill_pct", cmd->flush_policy->spill_pct));
+      return COMMAND_RESPONSE__RET_CODE_T__ERR;
+    }
+  }
+  switch (cmd->data_format) {
+    case SENSORMGR__DATA_FORMAT_T__UNCHANGED:
+    case SENSORMGR__DATA_FORMAT_T__JSON:
+    case SENSORMGR__DATA_FORMAT_T__PROTOBUF:
+      break;
+    default:
+      MQTTLOG_LOGW(TAG, "cmd_set_options failed",
+                   MQTTLOG_STR("reason", "unknown_data_format"),
+                   MQTTLOG_UINT("data_format", cmd->data_format));
+      return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  switch (cmd->backfill) {
+    case SENSORMGR__BACKFILL_T__BACKFILL_UNCHANGED:
+    case SENSORMGR__BACKFILL_T__BACKFILL_OFF:
+    case SENSORMGR__BACKFILL_T__BACKFILL_ON:
+      break;
+    default:
+      MQTTLOG_LOGW(TAG, "cmd_set_options failed",
+                   MQTTLOG_STR("reason", "unknown_backfill"),
+                   MQTTLOG_UINT("backfill", cmd->backfill));
+      return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  if (!cmd->aggregate_off &&
+      cmd->aggregate_window_sec > SENSORMGR_AGGREGATE_WINDOW_MAX) {
+    MQTTLOG_LOGW(TAG, "cmd_set_options failed",
+                 MQTTLOG_STR("reason", "max_window_exceeded"),
+                 MQTTLOG_UINT("max_window", SENSORMGR_AGGREGATE_WINDOW_MAX),
+                 MQTTLOG_UINT("received", cmd->aggregate_window_sec));
+    return COMMAND_RESPONSE__RET_CODE_T__ERR;
+  }
+  if (cmd->n_deadbands != 0) {
+    xSemaphoreTake(state.deadband_lock, portMAX_DELAY);
+    deadbands.entry_cnt = state.deadband_entry_cnt;
+    memcpy(deadbands.entries, state.deadband_entries,
+           sizeof(deadbands.entries));
+    memcpy(deadbands.cfgs, state.deadband_cfgs, sizeof(deadbands.cfgs));
+    xSemaphoreGive(state.deadband_lock);
+    for (idx = 0; idx < cmd->n_deadbands; idx++) {
+      ret = sensormgr_deadband_set(&deadbands, cmd->deadbands[idx]);
+      if (ret != COMMAND_RESPONSE__RET_CODE_T__HANDLED) {
+        return ret;
+      }
+    }
+  }
+
+  // Everything checked out, nothing has been changed till here
+  if (cmd->n_deadbands != 0) {
+    xSemaphoreTake(state.deadband_lock, portMAX_DELAY);
+    state.deadband_entry_cnt = deadbands.entry_cnt;
+    memcpy(state.deadband_entries, deadbands.entries,
+           sizeof(state.deadband_entries));
+    memcpy(state.deadband_cfgs, deadbands.cfgs, sizeof(state.deadband_cfgs));
+    sensormgr_nvs_set_deadbands_locked();
+    xSemaphoreGive(state.deadband_lock);
+  }
+  if (cmd->data_format != SENSORMGR__DATA_FORMAT_T__UNCHANGED) {
+    sensormgr_nvs_set_data_format(cmd->data_format);
+  }
+  if (cmd->backfill != SENSORMGR__BACKFILL_T__BACKFILL_UNCHANGED) {
+    sensormgr_nvs_set_backfill(cmd->backfill);
+  }
+  if (cmd->aggregate_off) {
+    sensormgr_nvs_set_aggregate_window(0);
+  } else if (cmd->aggregate_window_sec != 0) {
+    sensormgr_nvs_set_aggregate_window(cmd->aggregate_window_sec);
+  }
+  if (cmd->flush_policy != NULL) {
+    sensormgr_nvs_set_flush(&flush_cfg);
+  }
+  if (location_name_len != 0) {
+    sensormgr_nvs_set_location(cmd->location_name);
+  }
   return COMMAND_RESPONSE__RET_CODE_T__HANDLED;
 }
 
 // Check filebuffers, vfat space remaining, set can buffer flags
+/**
+ * @brief Mount the log data partition and pick up files spilled before
+ */
+static void sensormgr_storage_init() {
+  esp_vfs_fat_sdmmc_mount_config_t vfat_config = {
+      .format_if_mount_failed = true,
+      .max_files = 5,  // Spill writer, drain, index and index compaction
+      .allocation_unit_size = 0,
+  };
+
+  ESP_LOGI(TAG, "Attempting to mount log data partition");
+  esp_vfs_fat_spiflash_mount(SENSORMGR_DATA_DIR, "log_data", &vfat_config,
+                             &state.wl_handle);
+  sensormgr_index_init();
+  if (state.index.file_cnt != 0) {
+    state.has_files = true;
+    ESP_LOGI(TAG, "Previously saved sensordata detected! %u files, %u readings",
+             state.index.file_cnt, state.index.reading_cnt);
+  }
+}
+
+#if CONFIG_SENSORMGR_DEEP_SLEEP
+// Readings taken while waking up from deep sleep, kept through the next sleep
+static RTC_DATA_ATTR sensormgr_rtc_t rtc_samples;
+
+static bool sensormgr_woken_to_measure() {
+  return esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER;
+}
+#endif
+
 esp_err_t sensormgr_init() {
-  FILE *f_test;
-  char f_name[24];
+  void *queue_storage = malloc(SENSORMGR_QUEUE_SIZE);
+  sensormgr_flush_cfg_t flush_cfg;
+  struct timeval now;
 
   state = (state_t){
-      .LOWWATER_ITEM_CNT = SENSORMGR_RINBUFFER_LOWWATER_ITEM_CNT,
-      .filewriter_task_handle = NULL,
       .location_name = "unknown",
       .measure_task_handle = NULL,
       .queue_task_handle = NULL,
-      .ring_buffer =
-          xRingbufferCreate(SENSORMGR_RINBUFFER_SIZE, RINGBUF_TYPE_NOSPLIT),
-      .ring_buffer_item_count = 0,
       .wl_handle = 0,
+      .stopping = false,
+      .data_format = SENSORMGR__DATA_FORMAT_T__JSON,
+      .backfill = SENSORMGR__BACKFILL_T__BACKFILL_OFF,
+      .index_lock = xSemaphoreCreateMutex(),
+      .checkpoint_lock = xSemaphoreCreateMutex(),
+      .deadband_lock = xSemaphoreCreateMutex(),
+      .flush_lock = xSemaphoreCreateMutex(),
+      .clock_lock = xSemaphoreCreateMutex(),
+      .read_parked = xSemaphoreCreateBinary(),
+      .read_resume = xSemaphoreCreateBinary(),
+      .dispatch_parked = xSemaphoreCreateBinary(),
+      .dispatch_resume = xSemaphoreCreateBinary(),
+      .stopped = false,
+      .boot_id = esp_random(),
       .initilized = true,
   };
+  sensormgr_clock_init(&state.clk);
+  sensormgr_flush_defaults(&flush_cfg);
+  sensormgr_flush_init(&state.flush, &flush_cfg);
 
   sensormgr_nvs_get_location();
+  sensormgr_nvs_get_data_format();
+  sensormgr_nvs_get_backfill();
+  sensormgr_nvs_get_aggregate_window();
+  sensormgr_nvs_get_deadbands();
+  sensormgr_nvs_get_flush();
 
   // While this starts the polling process, if there are files pending
   // it'll take till LOW-WATER for those to get drained
   xEventGroupSetBits(mqttmgr_events,
                      SENSORMGR_POLLSENSORS_BIT | SENSORMGR_DONEWRITING_BIT);
 
-  if (state.ring_buffer == NULL) {
-    ESP_LOGE(TAG, "Failed to create ring buffer");
+  if (queue_storage == NULL ||
+      ESP_OK != sensormgr_queue_init(&state.queue, queue_storage,
+                                     SENSORMGR_QUEUE_SIZE,
+                                     sizeof(sensormgr_sample_t))) {
+    ESP_LOGE(TAG, "Failed to create sample queue");
+    free(queue_storage);
     return ESP_FAIL;
   }
-
-  esp_vfs_fat_sdmmc_mount_config_t vfat_config = {
-      .format_if_mount_failed = true,
-      .max_files = 4,
-      .allocation_unit_size = 0,
-  };
-
-  ESP_LOGI(TAG, "Attempting to mount log data partition");
-  esp_vfs_fat_spiflash_mount("/log_data", "log_data", &vfat_config,
-                             &state.wl_handle);
-  if (ESP_OK == sensormgr_get_first_datafile(&f_test, f_name, sizeof(f_name))) {
-    fclose(f_test);
-    state.has_files = true;
-    ESP_LOGI(TAG, "Previously saved sensordata detected!");
+  ESP_LOGI(TAG, "Sample queue holds %u readings", state.queue.slot_cnt);
+  sensormgr_schedule_init(&state.schedule);
+  if (state.index_lock == NULL || state.checkpoint_lock == NULL ||
+      state.deadband_lock == NULL || state.flush_lock == NULL ||
+      state.clock_lock == NULL) {
+    ESP_LOGE(TAG, "Failed to create sensormgr locks");
+    return ESP_FAIL;
+  }
+  // Kept through deep sleep, SNTP may not sync again this boot
+  gettimeofday(&now, NULL);
+  if (now.tv_sec >= SENSORMGR_SAMPLE_EPOCH) {
+    sensormgr_time_synced(&now);
   }
 
-  mqttmgr_register_cmd_handler(sensormgr_cmd_get_stats);
-  mqttmgr_register_cmd_handler(sensormgr_cmd_get_options);
-  mqttmgr_register_cmd_handler(sensormgr_cmd_set_options);
+#if CONFIG_SENSORMGR_DEEP_SLEEP
+  // Left to sensormgr_sleep_cycle, a wake to measure doesn't touch flash
+  if (!sensormgr_woken_to_measure()) {
+    sensormgr_storage_init();
+  }
+#else
+  sensormgr_storage_init();
+#endif
+
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_SENSORMGR_GET_STATS_REQUEST,
+      sensormgr_cmd_get_stats));
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_SENSORMGR_GET_OPTIONS_REQUEST,
+      sensormgr_cmd_get_options));
+  ESP_ERROR_CHECK(mqttmgr_register_cmd_handler(
+      COMMAND_REQUEST__CMD_SENSORMGR_SET_OPTIONS_REQUEST,
+      sensormgr_cmd_set_options));
 
   return ESP_OK;
 }
@@ -676,34 +2416,24 @@ esp_err_t sensormgr_start() {
                             &state.measure_task_handle)) {
     ESP_LOGE(TAG, "Failed creating task sensorread!");
     return ESP_FAIL;
-  } else if (state.measure_task_handle != NULL &&
-             eTaskGetState(state.measure_task_handle) == eSuspended) {
-    vTaskResume(state.measure_task_handle);
   }
 
+  // Dispatching is also slightly higher priority as spilling the sample queue
+  // will prevent running out of memory.
   if (state.queue_task_handle == NULL &&
-      pdPASS != xTaskCreate(sensormgr_task_queuesend, SENSORMGR_TASKNAME_QUEUE,
-                            SENSORMGR_TASK_STACKSIZE, (void *)1,
-                            tskIDLE_PRIORITY, &state.queue_task_handle)) {
-    ESP_LOGE(TAG, "Failed creating task queuesend!");
+      pdPASS != xTaskCreate(sensormgr_task_dispatch, SENSORMGR_TASKNAME_QUEUE,
+                            SENSORMGR_TASK_STACKSIZE, (void *)1, 1,
+                            &state.queue_task_handle)) {
+    ESP_LOGE(TAG, "Failed creating task dispatch!");
     return ESP_FAIL;
-  } else if (state.queue_task_handle != NULL &&
-             eTaskGetState(state.queue_task_handle) == eSuspended) {
-    vTaskResume(state.queue_task_handle);
   }
 
-  // Sensor writing tasks are also slightly higher priority as dumping data out
-  // will prevent running out of memory.
-  if (state.filewriter_task_handle == NULL &&
-      pdPASS != xTaskCreate(sensormgr_task_file_writer,
-                            SENSORMGR_TASKNAME_FILEWRITER,
-                            SENSORMGR_TASK_STACKSIZE, (void *)1, 1,
-                            &state.filewriter_task_handle)) {
-    ESP_LOGE(TAG, "Failed creating task filewriter!");
-    return ESP_FAIL;
-  } else if (state.filewriter_task_handle != NULL &&
-             eTaskGetState(state.filewriter_task_handle) == eSuspended) {
-    vTaskResume(state.filewriter_task_handle);
+  if (state.stopped) {
+    state.stopped = false;
+    state.stopping = false;
+    xEventGroupClearBits(mqttmgr_events, SENSORMGR_PARK_BIT);
+    xSemaphoreGive(state.read_resume);
+    xSemaphoreGive(state.dispatch_resume);
   }
 
   sensormgr_log_stats();
@@ -712,27 +2442,197 @@ esp_err_t sensormgr_start() {
 }
 
 esp_err_t sensormgr_stop() {
-  xEventGroupClearBits(mqttmgr_events, SENSORMGR_POLLSENSORS_BIT);
+  if (state.stopped || state.measure_task_handle == NULL ||
+      state.queue_task_handle == NULL) {
+    return ESP_OK;
+  }
 
-  vTaskSuspend(state.measure_task_handle);
-  vTaskSuspend(state.queue_task_handle);
+  // The tasks park themselves where they hold no lock, suspending them could
+  // leave one taken that the other tasks or the esp-mqtt task are waiting on
+  xEventGroupSetBits(mqttmgr_events, SENSORMGR_PARK_BIT);
+  xSemaphoreTake(state.read_parked, portMAX_DELAY);
 
-  xEventGroupSetBits(mqttmgr_events, SENSORMGR_HIGHWATER_BIT);
-  ESP_LOGW(TAG, "Waiting for file writer task to finish up");
-  vTaskDelay(1000 / portTICK_PERIOD_MS);
-  xEventGroupWaitBits(mqttmgr_events, SENSORMGR_DONEWRITING_BIT, pdFALSE,
-                      pdTRUE, portMAX_DELAY);
+  // Spill whatever is queued, even while connected
+  state.stopping = true;
+  xEventGroupSetBits(mqttmgr_events,
+                     SENSORMGR_LOWWATER_BIT | SENSORMGR_HIGHWATER_BIT);
+  ESP_LOGW(TAG, "Waiting for dispatch task to finish up");
+  xSemaphoreTake(state.dispatch_parked, portMAX_DELAY);
 
-  vTaskSuspend(state.filewriter_task_handle);
+  state.stopped = true;
   return ESP_OK;
 }
 
+#if CONFIG_SENSORMGR_DEEP_SLEEP
+/**
+ * @brief Measure every sensor once into RTC memory
+ */
+static void sensormgr_rtc_measure() {
+  uint8_t idx, value_idx, channel;
+  time_t timestamp;
+  float values[SENSORMGR_CHANNELS_MAX];
+  sensormgr_sample_t sample;
+
+  for (idx = 0; idx < state.sensor_cnt; idx++) {
+    for (value_idx = 0; value_idx < state.sensors[idx].channel_cnt;
+         value_idx++) {
+      values[value_idx] = NAN;
+    }
+    time(&timestamp);
+    if (ESP_OK != state.sensors[idx].measure(values)) {
+      continue;
+    }
+    for (value_idx = 0; value_idx < state.sensors[idx].channel_cnt;
+         value_idx++) {
+      channel = state.sensor_channel[idx] + value_idx;
+      if (isnan(values[value_idx])) {
+        continue;  // Not measured this time
+      }
+      if (ESP_OK != sensormgr_sample_set(&sample, channel,
+                                         state.channels[channel].decimals,
+                                         timestamp * 1000LL,
+                                         values[value_idx])) {
+        ESP_LOGE(TAG, "Channel %u %f out of range, dropped", channel,
+                 values[value_idx]);
+        continue;
+      }
+      sensormgr_rtc_push(&rtc_samples, &sample);
+    }
+  }
+}
+
+/**
+ * @brief Hand the readings kept through deep sleep to the sample queue
+ *
+ * Runs before the sensor read task exists, so it can stand in for it.
+ */
+static void sensormgr_rtc_replay() {
+  const sensormgr_sample_t *sample;
+  uint16_t idx;
+  int64_t timestamp;
+
+  for (idx = 0; NULL != (sample = sensormgr_rtc_peek(&rtc_samples, idx));
+       idx++) {
+    timestamp = sensormgr_sample_timestamp(sample, sensormgr_now());
+    sensormgr_aggregate_check(timestamp / 1000);
+    sensormgr_store_reading(
+        sample->channel, timestamp,
+        sensormgr_sample_value(sample,
+                               state.channels[sample->channel].decimals));
+  }
+  sensormgr_rtc_clear(&rtc_samples);
+  ESP_LOGI(TAG, "Queued %u readings taken in deep sleep", idx);
+}
+
+void sensormgr_deep_sleep() {
+  const int64_t period = CONFIG_SENSORMGR_DEEP_SLEEP_PERIOD * 1000000LL;
+  int64_t awake = esp_timer_get_time();
+
+  // Measure on a steady period, whatever time was spent awake
+  esp_sleep_enable_timer_wakeup(
+      awake + SENSORMGR_DEEP_SLEEP_MIN_US < period
+          ? period - awake
+          : SENSORMGR_DEEP_SLEEP_MIN_US);
+  // newlib nano printf has no %lld
+  ESP_LOGI(TAG, "Deep sleeping after %ums awake", (uint32_t)(awake / 1000));
+  esp_deep_sleep_start();
+}
+
+esp_err_t sensormgr_sleep_cycle() {
+  bool woken = sensormgr_woken_to_measure();
+  time_t now;
+
+  if (!state.initilized) {
+    ESP_LOGE(TAG, "Sleep cycle before init!");
+    abort();
+  }
+
+  // Without a valid clock, readings can only be taken once SNTP set it
+  time(&now);
+  if (sensormgr_rtc_open(&rtc_samples, state.channel_cnt, woken) &&
+      now >= SENSORMGR_SAMPLE_EPOCH && state.channel_cnt != 0) {
+    sensormgr_rtc_measure();
+    if (sensormgr_rtc_room(&rtc_samples) >= state.channel_cnt) {
+      sensormgr_deep_sleep();
+    }
+  }
+
+  if (woken) {
+    sensormgr_storage_init();
+  }
+  sensormgr_rtc_replay();
+  return ESP_OK;
+}
+
+esp_err_t sensormgr_upload(TickType_t timeout) {
+  TickType_t start = xTaskGetTickCount();
+  esp_err_t ret = ESP_ERR_TIMEOUT;
+
+  // Everything queued or spilled goes out, whatever the flush policy says
+  xEventGroupSetBits(mqttmgr_events, SENSORMGR_LOWWATER_BIT);
+  xEventGroupWaitBits(mqttmgr_events, MQTTMGR_CLIENT_CONNECTED_BIT,
+                      pdFALSE,  // Do NOT clear the bits before returning
+                      pdTRUE,   // Wait for ALL bits to be set
+                      timeout);
+  while (xTaskGetTickCount() - start < timeout) {
+    if (!(xEventGroupGetBits(mqttmgr_events) & SENSORMGR_LOWWATER_BIT) &&
+        !state.has_files) {
+      ret = ESP_OK;
+      break;
+    }
+    vTaskDelay(SENSORMGR_UPLOAD_POLL_MS / portTICK_PERIOD_MS);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGW(TAG, "Upload cut short, the rest is spilled till next time");
+  }
+  sensormgr_stop();
+  return ret;
+}
+#endif
+
 esp_err_t sensormgr_register_sensor(sensormgr_registration_t reg) {
+  uint8_t idx;
+  TickType_t period;
+  Sensormgr__SensorBackfill__Channel *channel;
+
   if (state.sensor_cnt >= CONFIG_SENSOR_COUNT) {
     ESP_LOGE(TAG, "Sensor register overflow");
     return ESP_ERR_NO_MEM;
   }
 
+  if (reg.channel_cnt > SENSORMGR_CHANNELS_MAX - state.channel_cnt) {
+    ESP_LOGE(TAG, "Sensor channel register overflow");
+    return ESP_ERR_NO_MEM;
+  }
+
+  if (reg.period_ms == 0) {
+    reg.period_ms = CONFIG_SENSORMGR_SAMPLE_RATE;
+  }
+  // Polling any faster than the tick rate isn't possible
+  period = pdMS_TO_TICKS(reg.period_ms);
+  if (ESP_OK != sensormgr_schedule_add(
+                    &state.schedule, state.sensor_cnt, period ? period : 1,
+                    xTaskGetTickCount() + pdMS_TO_TICKS(reg.phase_ms))) {
+    ESP_LOGE(TAG, "Sensor period of %ums can't be scheduled", reg.period_ms);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  state.sensor_channel[state.sensor_cnt] = state.channel_cnt;
   state.sensors[state.sensor_cnt++] = reg;
+  for (idx = 0; idx < reg.channel_cnt; idx++, state.channel_cnt++) {
+    state.channels[state.channel_cnt] = reg.channels[idx];
+    // Spill files and backfill messages describe channels, not sensors
+    state.spill_data_len[state.channel_cnt] =
+        sizeof(sensormgr_spill_sample_t);
+    channel = &state.backfill_channels[state.channel_cnt];
+    sensormgr__sensor_backfill__channel__init(channel);
+    channel->sensor = (char *)reg.channels[idx].sensor;
+    channel->unit = (char *)reg.channels[idx].unit;
+    channel->decimals = reg.channels[idx].decimals;
+    state.backfill_channel_ptrs[state.channel_cnt] = channel;
+    xSemaphoreTake(state.deadband_lock, portMAX_DELAY);
+    sensormgr_deadband_apply_locked(state.channel_cnt);
+    xSemaphoreGive(state.deadband_lock);
+  }
   return ESP_OK;
 }
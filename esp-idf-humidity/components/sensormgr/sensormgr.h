@@ -1,20 +1,47 @@
 #ifndef SENSORMGR_H
 #define SENSORMGR_H
 
-#include <cJSON.h>
 #include <esp_err.h>
 #include <freertos/FreeRTOS.h>
+#include <sdkconfig.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "sensormgr_sample.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef esp_err_t(measure_fn)(void **sensor_data_out, size_t *len);
-typedef esp_err_t(marshall_fn)(void *sensor_data, cJSON *data_array);
+/**
+ * @brief Take a reading of every channel of a sensor
+ *
+ * @param values One value per registered channel, left NAN for channels not
+ *               measured this time
+ */
+typedef esp_err_t(measure_fn)(float *values);
+
+/**
+ * @brief Turn a reading spilled by older firmware into channel values
+ *
+ * Firmware from before channels spilled the driver's own reading: a time_t
+ * followed by its 32 bit fields.
+ *
+ * @param fields    32 bit fields of the reading, after the timestamp
+ * @param field_cnt Number of fields
+ * @param values    One value per registered channel, left NAN for channels
+ *                  the reading doesn't hold
+ */
+typedef esp_err_t(legacy_fn)(const uint32_t *fields, uint8_t field_cnt,
+                             float *values);
 
 typedef struct {
   measure_fn *measure;
-  marshall_fn *marshall;
+  legacy_fn *legacy;  // NULL when the fields are floats in channel order
+  const sensormgr_channel_t *channels;  // Must outlive sensormgr
+  uint8_t channel_cnt;
+  uint32_t period_ms;  // Between polls, 0 for CONFIG_SENSORMGR_SAMPLE_RATE
+  uint32_t phase_ms;   // Delay of the first poll after registering
 } sensormgr_registration_t;
 
 esp_err_t sensormgr_init();
@@ -22,6 +49,60 @@ esp_err_t sensormgr_init();
 esp_err_t sensormgr_start();
 esp_err_t sensormgr_stop();
 
+/**
+ * @brief Anchor the monotonic clock readings are stamped with to SNTP
+ *
+ * To be called from the SNTP time sync notification, every time it syncs.
+ *
+ * @param tv Wall clock time SNTP synced to
+ */
+void sensormgr_time_synced(const struct timeval *tv);
+
+#if CONFIG_SENSORMGR_DEEP_SLEEP
+/**
+ * @brief Measure into RTC memory and deep sleep, unless it's time to upload
+ *
+ * Called once the sensors are registered, before starting WiFi. Woken up by
+ * the timer with room left in RTC memory for another round of readings, it
+ * never returns. Otherwise the readings kept in RTC memory are queued and the
+ * device has to boot all the way, then sensormgr_start and sensormgr_upload.
+ *
+ * @return
+ *  - ESP_OK: Boot all the way
+ */
+esp_err_t sensormgr_sleep_cycle();
+
+/**
+ * @brief Send everything measured and spilled, then stop
+ *
+ * What couldn't be sent is spilled to flash for the next upload.
+ *
+ * @param timeout Ticks to keep trying at most
+ * @return
+ *  - ESP_OK: Nothing left to send
+ *  - ESP_ERR_TIMEOUT: Readings were left spilled
+ */
+esp_err_t sensormgr_upload(TickType_t timeout);
+
+/**
+ * @brief Deep sleep till the next measurement is due
+ *
+ * Stop WiFi first, measurements are CONFIG_SENSORMGR_DEEP_SLEEP_PERIOD apart.
+ */
+void sensormgr_deep_sleep();
+#endif
+
+/**
+ * @brief Add a sensor and its channels to the ones polled
+ *
+ * Each sensor is polled on its own period, sensors with the same period can
+ * be spread out by giving them different phases.
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NO_MEM: No room left for the sensor or its channels
+ *  - ESP_ERR_INVALID_ARG: Period too long
+ */
 esp_err_t sensormgr_register_sensor(sensormgr_registration_t reg);
 
 #define SENSORMGR_ISO8601(timestamp, charbuff)          \
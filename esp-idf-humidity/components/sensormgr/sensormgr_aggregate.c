@@ -0,0 +1,43 @@
+#include "sensormgr_aggregate.h"
+
+#include <math.h>
+
+time_t sensormgr_aggregate_window(time_t timestamp, uint32_t window_sec) {
+  time_t rem = timestamp % (time_t)window_sec;
+
+  // Round down for timestamps before the epoch too
+  return timestamp - (rem < 0 ? rem + window_sec : rem);
+}
+
+void sensormgr_aggregate_reset(sensormgr_aggregate_t *agg,
+                               time_t window_start) {
+  *agg = (sensormgr_aggregate_t){
+      .window_start = window_start,
+      .count = 0,
+      .mean = 0,
+      .m2 = 0,
+      .min = INFINITY,
+      .max = -INFINITY,
+  };
+}
+
+void sensormgr_aggregate_add(sensormgr_aggregate_t *agg, float value) {
+  double delta = value - agg->mean;
+
+  agg->count++;
+  agg->mean += delta / agg->count;
+  agg->m2 += delta * (value - agg->mean);
+  if (value < agg->min) {
+    agg->min = value;
+  }
+  if (value > agg->max) {
+    agg->max = value;
+  }
+}
+
+double sensormgr_aggregate_stddev(const sensormgr_aggregate_t *agg) {
+  if (agg->count < 2) {
+    return 0;
+  }
+  return sqrt(agg->m2 / agg->count);
+}
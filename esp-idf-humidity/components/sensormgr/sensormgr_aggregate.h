@@ -0,0 +1,54 @@
+#ifndef SENSORMGR_AGGREGATE_H
+#define SENSORMGR_AGGREGATE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Streaming summary of the readings of a channel over a tumbling window
+ *
+ * Windows are aligned to multiples of their length since the Unix epoch, so
+ * devices with the same window summarize the same stretch of time. The mean
+ * and variance are updated with Welford's algorithm, a window takes constant
+ * memory however many readings fall into it.
+ */
+
+typedef struct {
+  time_t window_start;  // Of the readings added so far
+  uint32_t count;
+  double mean;
+  double m2;  // Sum of squared differences from the mean
+  float min;
+  float max;
+} sensormgr_aggregate_t;
+
+/**
+ * @brief Start of the window a timestamp falls into
+ */
+time_t sensormgr_aggregate_window(time_t timestamp, uint32_t window_sec);
+
+/**
+ * @brief Start an empty window
+ */
+void sensormgr_aggregate_reset(sensormgr_aggregate_t *agg,
+                               time_t window_start);
+
+/**
+ * @brief Add a reading to the window
+ */
+void sensormgr_aggregate_add(sensormgr_aggregate_t *agg, float value);
+
+/**
+ * @brief Population standard deviation of the readings added, 0 for fewer
+ *        than two
+ */
+double sensormgr_aggregate_stddev(const sensormgr_aggregate_t *agg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,87 @@
+#include "sensormgr_batch.h"
+
+#include <string.h>
+
+void sensormgr_batch_reset(sensormgr_batch_t *batch, char *location_name) {
+  uint8_t idx;
+
+  sensormgr__sensor_batch__init(&batch->msg);
+  batch->msg.location_name = location_name;
+  batch->msg.channels = batch->channel_ptrs;
+  batch->msg.readings = batch->reading_ptrs;
+  for (idx = 0; idx < SENSORMGR_BATCH_CHANNELS_MAX; idx++) {
+    batch->channel_ptrs[idx] = &batch->channels[idx];
+  }
+  for (idx = 0; idx < SENSORMGR_BATCH_READINGS_MAX; idx++) {
+    batch->reading_ptrs[idx] = &batch->readings[idx];
+  }
+}
+
+static int sensormgr_batch_channel(sensormgr_batch_t *batch,
+                                   const char *sensor, const char *unit) {
+  size_t idx;
+  Sensormgr__SensorBatch__Channel *channel;
+
+  // Channel descriptors are shared so a pointer compare almost always hits
+  for (idx = 0; idx < batch->msg.n_channels; idx++) {
+    channel = &batch->channels[idx];
+    if ((channel->sensor == sensor || strcmp(channel->sensor, sensor) == 0) &&
+        (channel->unit == unit || strcmp(channel->unit, unit) == 0)) {
+      return idx;
+    }
+  }
+  if (batch->msg.n_channels >= SENSORMGR_BATCH_CHANNELS_MAX) {
+    return -1;
+  }
+  channel = &batch->channels[batch->msg.n_channels];
+  sensormgr__sensor_batch__channel__init(channel);
+  channel->sensor = (char *)sensor;
+  channel->unit = (char *)unit;
+  return batch->msg.n_channels++;
+}
+
+esp_err_t sensormgr_batch_add(sensormgr_batch_t *batch, const char *sensor,
+                              const char *unit, int64_t timestamp,
+                              float value) {
+  return sensormgr_batch_add_stat(batch, sensor, unit, SENSORMGR_STAT_RAW,
+                                  timestamp, value);
+}
+
+esp_err_t sensormgr_batch_add_stat(sensormgr_batch_t *batch,
+                                   const char *sensor, const char *unit,
+                                   sensormgr_stat_t stat, int64_t timestamp,
+                                   float value) {
+  int channel;
+  Sensormgr__SensorBatch__Reading *reading;
+
+  if (batch->msg.n_readings >= SENSORMGR_BATCH_READINGS_MAX) {
+    return ESP_ERR_NO_MEM;
+  }
+  channel = sensormgr_batch_channel(batch, sensor, unit);
+  if (channel < 0) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (batch->msg.n_readings == 0) {
+    batch->msg.base_timestamp = timestamp / 1000;
+  }
+
+  reading = &batch->readings[batch->msg.n_readings++];
+  sensormgr__sensor_batch__reading__init(reading);
+  reading->channel = channel;
+  reading->timestamp_offset = timestamp - batch->msg.base_timestamp * 1000;
+  reading->value = value;
+  reading->stat = (Sensormgr__StatT)stat;
+  return ESP_OK;
+}
+
+esp_err_t sensormgr_batch_pack(sensormgr_batch_t *batch, uint8_t *buf,
+                               size_t buf_size, size_t *len_out) {
+  size_t len = sensormgr__sensor_batch__get_packed_size(&batch->msg);
+
+  if (len > buf_size) {
+    *len_out = 0;
+    return ESP_ERR_INVALID_SIZE;
+  }
+  *len_out = sensormgr__sensor_batch__pack(&batch->msg, buf);
+  return ESP_OK;
+}
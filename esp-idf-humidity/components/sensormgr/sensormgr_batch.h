@@ -0,0 +1,84 @@
+#ifndef SENSORMGR_BATCH_H
+#define SENSORMGR_BATCH_H
+
+#include <commands.pb-c.h>
+#include <esp_err.h>
+#include <stdint.h>
+
+#include "sensormgr_sample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Distinct sensor / unit pairs that can be in a single batch
+#define SENSORMGR_BATCH_CHANNELS_MAX 8
+// Individual values in a single batch, one per sample
+#define SENSORMGR_BATCH_READINGS_MAX 24
+
+/**
+ * @brief Preallocated SensorBatch protobuf message
+ *
+ * All the submessages live inside of this struct so building and packing a
+ * batch never touches the heap.
+ */
+typedef struct {
+  Sensormgr__SensorBatch msg;
+  Sensormgr__SensorBatch__Channel channels[SENSORMGR_BATCH_CHANNELS_MAX];
+  Sensormgr__SensorBatch__Channel *channel_ptrs[SENSORMGR_BATCH_CHANNELS_MAX];
+  Sensormgr__SensorBatch__Reading readings[SENSORMGR_BATCH_READINGS_MAX];
+  Sensormgr__SensorBatch__Reading *reading_ptrs[SENSORMGR_BATCH_READINGS_MAX];
+} sensormgr_batch_t;
+
+/**
+ * @brief Empty out a batch so it can be filled again
+ *
+ * @param batch         Batch to reset
+ * @param location_name Location name for the metadata, must outlive the batch
+ */
+void sensormgr_batch_reset(sensormgr_batch_t *batch, char *location_name);
+
+/**
+ * @brief Append a single value to a SensorBatch
+ *
+ * The sensor and unit strings are not copied and must outlive the batch, the
+ * registered channel descriptors are expected here. Timestamps are Unix time
+ * in ms, the batch keeps whole seconds in base_timestamp and the ms in the
+ * offsets.
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NO_MEM: Batch has no room left for the reading or channel
+ */
+esp_err_t sensormgr_batch_add(sensormgr_batch_t *batch, const char *sensor,
+                              const char *unit, int64_t timestamp,
+                              float value);
+
+/**
+ * @brief Append a window statistic to a SensorBatch
+ *
+ * Same as sensormgr_batch_add, SENSORMGR_STAT_RAW values are plain readings.
+ */
+esp_err_t sensormgr_batch_add_stat(sensormgr_batch_t *batch,
+                                   const char *sensor, const char *unit,
+                                   sensormgr_stat_t stat, int64_t timestamp,
+                                   float value);
+
+/**
+ * @brief Pack a batch into a caller owned buffer
+ *
+ * @param batch     Batch to pack
+ * @param buf       Output buffer
+ * @param buf_size  Size of the output buffer
+ * @param len_out   Number of bytes written to buf
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_SIZE: Packed batch is larger than buf_size
+ */
+esp_err_t sensormgr_batch_pack(sensormgr_batch_t *batch, uint8_t *buf,
+                               size_t buf_size, size_t *len_out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,58 @@
+#include "sensormgr_checkpoint.h"
+
+#include <string.h>
+
+void sensormgr_checkpoint_reset(sensormgr_checkpoint_t *cp, uint32_t offset) {
+  cp->acked_seq = cp->next_seq;
+  cp->acked = offset;
+  cp->durable = offset;
+  memset(cp->done, 0, sizeof(cp->done));
+}
+
+esp_err_t sensormgr_checkpoint_sent(sensormgr_checkpoint_t *cp, uint32_t end,
+                                    uint32_t *seq_out) {
+  uint8_t slot = cp->next_seq % SENSORMGR_CHECKPOINT_PENDING_MAX;
+
+  if (sensormgr_checkpoint_full(cp)) {
+    return ESP_ERR_NO_MEM;
+  }
+  cp->end[slot] = end;
+  cp->done[slot] = false;
+  *seq_out = cp->next_seq++;
+  return ESP_OK;
+}
+
+void sensormgr_checkpoint_acked(sensormgr_checkpoint_t *cp, uint32_t seq) {
+  uint8_t slot;
+
+  // Unsigned wrap-around puts older sequence numbers out of the window too
+  if (seq - cp->acked_seq >= cp->next_seq - cp->acked_seq) {
+    return;
+  }
+  cp->done[seq % SENSORMGR_CHECKPOINT_PENDING_MAX] = true;
+  while (cp->acked_seq != cp->next_seq) {
+    slot = cp->acked_seq % SENSORMGR_CHECKPOINT_PENDING_MAX;
+    if (!cp->done[slot]) {
+      break;
+    }
+    cp->done[slot] = false;
+    cp->acked = cp->end[slot];
+    cp->acked_seq++;
+  }
+}
+
+bool sensormgr_checkpoint_full(const sensormgr_checkpoint_t *cp) {
+  return cp->next_seq - cp->acked_seq >= SENSORMGR_CHECKPOINT_PENDING_MAX;
+}
+
+bool sensormgr_checkpoint_idle(const sensormgr_checkpoint_t *cp) {
+  return cp->acked_seq == cp->next_seq;
+}
+
+bool sensormgr_checkpoint_due(const sensormgr_checkpoint_t *cp,
+                              uint32_t interval) {
+  if (cp->acked == cp->durable) {
+    return false;
+  }
+  return cp->acked - cp->durable >= interval || sensormgr_checkpoint_idle(cp);
+}
@@ -0,0 +1,91 @@
+#ifndef SENSORMGR_CHECKPOINT_H
+#define SENSORMGR_CHECKPOINT_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Drain checkpoints of the spill file being published
+ *
+ * Every message holding readings of the file is given a sequence number and
+ * the file offset a drain can safely resume at once it has been delivered.
+ * The acknowledged offset only moves past a message once it and every message
+ * before it got their PUBACK, so PUBACKs arriving out of order or for a
+ * message published again never skip over an undelivered one.
+ */
+
+// Messages of a file that can wait on a PUBACK at the same time
+#define SENSORMGR_CHECKPOINT_PENDING_MAX 16
+
+// Samples pulled from the buffers for each MQTT message
+#define SENSORMGR_MSG_READING_CNT 20
+
+typedef struct {
+  uint32_t next_seq;   // Sequence number of the next message
+  uint32_t acked_seq;  // Oldest message without a PUBACK
+  uint32_t acked;      // Offset everything before has been delivered
+  uint32_t durable;    // Offset last saved to flash
+  uint32_t end[SENSORMGR_CHECKPOINT_PENDING_MAX];
+  bool done[SENSORMGR_CHECKPOINT_PENDING_MAX];
+} sensormgr_checkpoint_t;
+
+/**
+ * @brief Start tracking a new file
+ *
+ * PUBACKs still outstanding for the previous file are ignored afterwards.
+ *
+ * @param cp     Checkpoint state
+ * @param offset Offset the drain starts at, already durable
+ */
+void sensormgr_checkpoint_reset(sensormgr_checkpoint_t *cp, uint32_t offset);
+
+/**
+ * @brief Record a message handed to mqttmgr
+ *
+ * @param cp      Checkpoint state
+ * @param end     Offset to resume at once the message is delivered
+ * @param seq_out Sequence number to acknowledge the message with
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NO_MEM: Too many messages waiting on a PUBACK
+ */
+esp_err_t sensormgr_checkpoint_sent(sensormgr_checkpoint_t *cp, uint32_t end,
+                                    uint32_t *seq_out);
+
+/**
+ * @brief Record the PUBACK of a message
+ *
+ * Unknown or repeated sequence numbers are ignored.
+ */
+void sensormgr_checkpoint_acked(sensormgr_checkpoint_t *cp, uint32_t seq);
+
+/**
+ * @brief Is there room for another message
+ */
+bool sensormgr_checkpoint_full(const sensormgr_checkpoint_t *cp);
+
+/**
+ * @brief Has every message been acknowledged
+ */
+bool sensormgr_checkpoint_idle(const sensormgr_checkpoint_t *cp);
+
+/**
+ * @brief Should the acknowledged offset be saved to flash
+ *
+ * @param cp       Checkpoint state
+ * @param interval Bytes acknowledged between saves, everything waiting on a
+ *                 PUBACK being acknowledged also triggers a save
+ * @return true when due, the caller saves cp->acked and sets cp->durable
+ */
+bool sensormgr_checkpoint_due(const sensormgr_checkpoint_t *cp,
+                              uint32_t interval);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,58 @@
+#include "sensormgr_clock.h"
+
+#include <string.h>
+
+void sensormgr_clock_init(sensormgr_clock_t *clk) { clk->anchor_cnt = 0; }
+
+/**
+ * @brief Unix time in ms of boot according to an anchor
+ */
+static int64_t sensormgr_clock_offset(const sensormgr_clock_anchor_t *anchor) {
+  return anchor->wall - anchor->mono;
+}
+
+bool sensormgr_clock_anchor(sensormgr_clock_t *clk, int64_t mono,
+                            int64_t wall) {
+  const sensormgr_clock_anchor_t *last;
+
+  if (clk->anchor_cnt != 0) {
+    last = &clk->anchors[clk->anchor_cnt - 1];
+    if (mono < last->mono || wall - mono == sensormgr_clock_offset(last)) {
+      return false;
+    }
+  }
+  if (clk->anchor_cnt == SENSORMGR_CLOCK_ANCHORS_MAX) {
+    memmove(&clk->anchors[0], &clk->anchors[1],
+            sizeof(clk->anchors[0]) * (SENSORMGR_CLOCK_ANCHORS_MAX - 1));
+    clk->anchor_cnt--;
+  }
+  clk->anchors[clk->anchor_cnt++] =
+      (sensormgr_clock_anchor_t){.mono = mono, .wall = wall};
+  return true;
+}
+
+int64_t sensormgr_clock_boot_time(const sensormgr_clock_t *clk,
+                                  int64_t mono) {
+  uint8_t idx;
+  const sensormgr_clock_anchor_t *prev, *next;
+  int64_t prev_offset, next_offset;
+
+  if (clk->anchor_cnt == 0) {
+    return 0;
+  }
+  if (mono <= clk->anchors[0].mono) {
+    return sensormgr_clock_offset(&clk->anchors[0]);
+  }
+  for (idx = 1; idx < clk->anchor_cnt; idx++) {
+    next = &clk->anchors[idx];
+    if (mono < next->mono) {
+      prev = &clk->anchors[idx - 1];
+      prev_offset = sensormgr_clock_offset(prev);
+      next_offset = sensormgr_clock_offset(next);
+      return prev_offset + (next_offset - prev_offset) *
+                               (mono - prev->mono) /
+                               (next->mono - prev->mono);
+    }
+  }
+  return sensormgr_clock_offset(&clk->anchors[clk->anchor_cnt - 1]);
+}
@@ -0,0 +1,64 @@
+#ifndef SENSORMGR_CLOCK_H
+#define SENSORMGR_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Wall clock of a boot, from the monotonic clock
+ *
+ * Readings are stamped with ms since boot (esp_timer) and only turned into
+ * wall clock time when they're sent. Every time SNTP updates the clock an
+ * anchor pairs the ms since boot with the wall clock time. Readings between
+ * two anchors are interpolated, so an SNTP step or slew doesn't stretch or
+ * squeeze the intervals between them, readings before the first or after the
+ * last anchor take its offset.
+ */
+
+// Anchors kept per boot, the oldest ones make room for new ones
+#define SENSORMGR_CLOCK_ANCHORS_MAX 4
+
+typedef struct {
+  int64_t mono;  // ms since boot
+  int64_t wall;  // Unix time in ms at mono
+} sensormgr_clock_anchor_t;
+
+typedef struct {
+  uint8_t anchor_cnt;
+  sensormgr_clock_anchor_t anchors[SENSORMGR_CLOCK_ANCHORS_MAX];  // By mono
+} sensormgr_clock_t;
+
+/**
+ * @brief Start without anchors, the wall clock is unknown
+ */
+void sensormgr_clock_init(sensormgr_clock_t *clk);
+
+/**
+ * @brief Pair ms since boot with the wall clock
+ *
+ * @param clk   Clock
+ * @param mono  ms since boot, not before the last anchor
+ * @param wall  Unix time in ms
+ * @return Whether the anchor was added, it isn't when mono went backwards
+ *         or the last anchor already predicts wall
+ */
+bool sensormgr_clock_anchor(sensormgr_clock_t *clk, int64_t mono,
+                            int64_t wall);
+
+/**
+ * @brief Unix time in ms of boot as seen from a moment since boot
+ *
+ * @param clk   Clock
+ * @param mono  ms since boot
+ * @return 0 without anchors
+ */
+int64_t sensormgr_clock_boot_time(const sensormgr_clock_t *clk, int64_t mono);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
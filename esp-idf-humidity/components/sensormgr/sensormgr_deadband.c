@@ -0,0 +1,39 @@
+#include "sensormgr_deadband.h"
+
+#include <stdlib.h>
+
+esp_err_t sensormgr_deadband_config(sensormgr_deadband_cfg_t *cfg,
+                                    uint8_t decimals, float deadband,
+                                    uint32_t heartbeat_sec) {
+  sensormgr_sample_t scaled;
+
+  // Also false for NaN
+  if (!(deadband >= 0) ||
+      ESP_OK != sensormgr_sample_set(&scaled, 0, decimals,
+                                     SENSORMGR_SAMPLE_EPOCH_MS, deadband)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  cfg->deadband = scaled.value;
+  cfg->heartbeat_sec = heartbeat_sec;
+  return ESP_OK;
+}
+
+void sensormgr_deadband_reset(sensormgr_deadband_t *db) { db->sent = false; }
+
+bool sensormgr_deadband_pass(sensormgr_deadband_t *db,
+                             const sensormgr_deadband_cfg_t *cfg,
+                             const sensormgr_sample_t *sample,
+                             int64_t timestamp) {
+  bool off = cfg->deadband == 0 && cfg->heartbeat_sec == 0;
+
+  if (!off && db->sent && timestamp >= db->last_time &&
+      llabs((int64_t)sample->value - db->last_value) <= cfg->deadband &&
+      (cfg->heartbeat_sec == 0 ||
+       timestamp - db->last_time < cfg->heartbeat_sec * 1000LL)) {
+    return false;
+  }
+  db->sent = true;
+  db->last_value = sample->value;
+  db->last_time = timestamp;
+  return true;
+}
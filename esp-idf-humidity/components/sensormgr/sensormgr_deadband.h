@@ -0,0 +1,72 @@
+#ifndef SENSORMGR_DEADBAND_H
+#define SENSORMGR_DEADBAND_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sensormgr_sample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Change of value filter of a channel
+ *
+ * A reading is only sent when it moved more than the deadband away from the
+ * last value sent, or when the channel has been silent for a heartbeat. The
+ * comparison is on the fixed point sample value, so changes below the
+ * decimals of the channel never count.
+ */
+
+typedef struct {
+  int32_t deadband;        // Fixed point, like the sample value
+  uint32_t heartbeat_sec;  // Longest silence, 0 for none
+} sensormgr_deadband_cfg_t;
+
+typedef struct {
+  bool sent;           // Whether there is a last value
+  int32_t last_value;  // Of the last sample sent
+  int64_t last_time;   // ms
+} sensormgr_deadband_t;
+
+/**
+ * @brief Scale a deadband to the decimals of its channel
+ *
+ * A deadband and heartbeat of 0 turn the filter off.
+ *
+ * @param cfg           Filter configuration to fill in
+ * @param decimals      Decimals of the channel
+ * @param deadband      In the unit of the channel
+ * @param heartbeat_sec Longest silence, 0 for none
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: Deadband is negative, NaN or out of range
+ */
+esp_err_t sensormgr_deadband_config(sensormgr_deadband_cfg_t *cfg,
+                                    uint8_t decimals, float deadband,
+                                    uint32_t heartbeat_sec);
+
+/**
+ * @brief Forget the last value sent, the next reading passes
+ */
+void sensormgr_deadband_reset(sensormgr_deadband_t *db);
+
+/**
+ * @brief Whether a sample is to be sent, remembering it when it is
+ *
+ * @param db        Filter state of the channel
+ * @param cfg       Filter configuration of the channel
+ * @param sample    Sample
+ * @param timestamp When the sample was measured, in ms
+ */
+bool sensormgr_deadband_pass(sensormgr_deadband_t *db,
+                             const sensormgr_deadband_cfg_t *cfg,
+                             const sensormgr_sample_t *sample,
+                             int64_t timestamp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
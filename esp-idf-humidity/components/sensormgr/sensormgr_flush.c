@@ -0,0 +1,88 @@
+#include "sensormgr_flush.h"
+
+#include "sensormgr_sample.h"
+
+void sensormgr_flush_defaults(sensormgr_flush_cfg_t *cfg) {
+  *cfg = (sensormgr_flush_cfg_t){
+      .items = SENSORMGR_FLUSH_ITEMS_DEFAULT,
+      .bytes = 0,
+      .age_sec = 0,
+      .fill_pct = SENSORMGR_FLUSH_FILL_PCT_DEFAULT,
+      .spill_pct = SENSORMGR_FLUSH_SPILL_PCT_DEFAULT,
+      .fs_reserve_kb = SENSORMGR_FLUSH_FS_RESERVE_KB_DEFAULT,
+      .adaptive = false,
+  };
+}
+
+esp_err_t sensormgr_flush_validate(const sensormgr_flush_cfg_t *cfg) {
+  if (cfg->fill_pct == 0 || cfg->spill_pct > 100 ||
+      cfg->spill_pct < cfg->fill_pct) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  return ESP_OK;
+}
+
+void sensormgr_flush_init(sensormgr_flush_t *flush,
+                          const sensormgr_flush_cfg_t *cfg) {
+  flush->cfg = *cfg;
+  flush->stretch = 1;
+  flush->good_streak = 0;
+}
+
+/**
+ * @brief Samples taking up a share of the sample queue, at least one
+ */
+static uint32_t sensormgr_flush_share(uint32_t slot_cnt, uint8_t pct) {
+  uint32_t cnt = (uint64_t)slot_cnt * pct / 100;
+
+  return cnt != 0 ? cnt : 1;
+}
+
+uint32_t sensormgr_flush_lowwater(const sensormgr_flush_t *flush,
+                                  uint32_t slot_cnt) {
+  return sensormgr_flush_share(slot_cnt, flush->cfg.fill_pct);
+}
+
+uint32_t sensormgr_flush_highwater(const sensormgr_flush_t *flush,
+                                   uint32_t slot_cnt) {
+  return sensormgr_flush_share(slot_cnt, flush->cfg.spill_pct);
+}
+
+/**
+ * @brief Whether a value reached a limit stretched by the link quality
+ */
+static bool sensormgr_flush_reached(const sensormgr_flush_t *flush,
+                                    uint64_t value, uint32_t limit) {
+  return limit != 0 && value >= (uint64_t)limit * flush->stretch;
+}
+
+bool sensormgr_flush_due(const sensormgr_flush_t *flush, uint32_t slot_cnt,
+                         uint32_t queued, uint32_t age_sec) {
+  if (queued == 0) {
+    return false;
+  }
+  return queued >= sensormgr_flush_lowwater(flush, slot_cnt) ||
+         sensormgr_flush_reached(flush, queued, flush->cfg.items) ||
+         sensormgr_flush_reached(
+             flush, (uint64_t)queued * sizeof(sensormgr_sample_t),
+             flush->cfg.bytes) ||
+         sensormgr_flush_reached(flush, age_sec, flush->cfg.age_sec);
+}
+
+void sensormgr_flush_link(sensormgr_flush_t *flush, bool delivered) {
+  if (!flush->cfg.adaptive) {
+    return;
+  }
+  if (!delivered) {
+    flush->good_streak = 0;
+    if (flush->stretch < SENSORMGR_FLUSH_STRETCH_MAX) {
+      flush->stretch *= 2;
+    }
+    return;
+  }
+  if (flush->stretch > 1 &&
+      ++flush->good_streak >= SENSORMGR_FLUSH_GOOD_STREAK) {
+    flush->good_streak = 0;
+    flush->stretch /= 2;
+  }
+}
@@ -0,0 +1,106 @@
+#ifndef SENSORMGR_FLUSH_H
+#define SENSORMGR_FLUSH_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * When to drain the sample queue
+ *
+ * The sample queue is flushed (low-water) once it holds items samples, bytes
+ * of samples, or its oldest sample is age_sec old, whichever comes first, and
+ * always once fill_pct of its slots are taken. While offline it is spilled to
+ * flash (high-water) at spill_pct. Adaptive policies stretch items, bytes and
+ * age on a link that keeps failing to deliver, so a device on a flaky AP sends
+ * bigger batches less often, and shrink them back as deliveries succeed.
+ */
+
+// Default flush thresholds, flush at 16 queued samples or half the queue
+#define SENSORMGR_FLUSH_ITEMS_DEFAULT 16
+#define SENSORMGR_FLUSH_FILL_PCT_DEFAULT 50
+// 12% of the slots remaining means spill the queue to the FS
+#define SENSORMGR_FLUSH_SPILL_PCT_DEFAULT 88
+// 128K left on FS means stop spilling for now
+#define SENSORMGR_FLUSH_FS_RESERVE_KB_DEFAULT 128
+// Largest factor an adaptive policy stretches thresholds by
+#define SENSORMGR_FLUSH_STRETCH_MAX 8
+// Deliveries in a row before a stretched policy is halved again
+#define SENSORMGR_FLUSH_GOOD_STREAK 4
+
+typedef struct {
+  uint32_t items;          // Queued samples, 0 for no limit
+  uint32_t bytes;          // Of queued samples, 0 for no limit
+  uint32_t age_sec;        // Of the oldest queued sample, 0 for no limit
+  uint8_t fill_pct;        // Of the sample queue, always flushes
+  uint8_t spill_pct;       // Of the sample queue, spills while offline
+  uint32_t fs_reserve_kb;  // Left free on the FS when spilling
+  bool adaptive;           // Stretch thresholds on a failing link
+} sensormgr_flush_cfg_t;
+
+typedef struct {
+  sensormgr_flush_cfg_t cfg;
+  uint8_t stretch;      // Of items, bytes and age, 1 on a good link
+  uint8_t good_streak;  // Deliveries since the last failure or halving
+} sensormgr_flush_t;
+
+/**
+ * @brief Fill in the default policy, matches the old compile time thresholds
+ */
+void sensormgr_flush_defaults(sensormgr_flush_cfg_t *cfg);
+
+/**
+ * @brief Check a policy before using it
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: A share is 0 or over 100, or spilling comes before
+ *    flushing
+ */
+esp_err_t sensormgr_flush_validate(const sensormgr_flush_cfg_t *cfg);
+
+/**
+ * @brief Start using a policy, unstretched
+ */
+void sensormgr_flush_init(sensormgr_flush_t *flush,
+                          const sensormgr_flush_cfg_t *cfg);
+
+/**
+ * @brief Queued samples that always mean flush
+ */
+uint32_t sensormgr_flush_lowwater(const sensormgr_flush_t *flush,
+                                  uint32_t slot_cnt);
+
+/**
+ * @brief Queued samples that mean spill while offline
+ */
+uint32_t sensormgr_flush_highwater(const sensormgr_flush_t *flush,
+                                   uint32_t slot_cnt);
+
+/**
+ * @brief Whether the sample queue is to be flushed
+ *
+ * @param flush    Policy
+ * @param slot_cnt Size of the sample queue
+ * @param queued   Samples in the sample queue
+ * @param age_sec  Since the first sample queued after the last flush
+ */
+bool sensormgr_flush_due(const sensormgr_flush_t *flush, uint32_t slot_cnt,
+                         uint32_t queued, uint32_t age_sec);
+
+/**
+ * @brief Feed back whether flushed samples made it out
+ *
+ * A failure doubles the stretch of an adaptive policy, every
+ * SENSORMGR_FLUSH_GOOD_STREAK deliveries in a row halve it.
+ */
+void sensormgr_flush_link(sensormgr_flush_t *flush, bool delivered);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
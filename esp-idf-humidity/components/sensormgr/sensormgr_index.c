@@ -0,0 +1,261 @@
+#include "sensormgr_index.h"
+
+#include <string.h>
+
+#define INDEX_OP_ADD 'A'
+#define INDEX_OP_DRAINED 'D'
+#define INDEX_OP_REMOVED 'R'
+
+typedef struct {
+  uint8_t op;
+  sensormgr_index_entry_t entry;
+  uint32_t value;
+} index_record_t;
+
+static void index_le_put(uint8_t *buf, uint64_t value, uint8_t len) {
+  uint8_t idx;
+
+  for (idx = 0; idx < len; idx++) {
+    buf[idx] = value >> (idx * 8);
+  }
+}
+
+static uint64_t index_le_get(const uint8_t *buf, uint8_t len) {
+  uint8_t idx;
+  uint64_t value = 0;
+
+  for (idx = 0; idx < len; idx++) {
+    value |= (uint64_t)buf[idx] << (idx * 8);
+  }
+  return value;
+}
+
+static uint8_t index_checksum(const uint8_t *buf) {
+  size_t idx;
+  uint8_t sum = 0;
+
+  for (idx = 0; idx < SENSORMGR_INDEX_RECORD_LEN - 1; idx++) {
+    sum += buf[idx];
+  }
+  return sum;
+}
+
+static void index_serialize(const index_record_t *rec, uint8_t *buf) {
+  uint8_t *p = buf;
+
+  *p++ = rec->op;
+  memset(p, 0, SENSORMGR_INDEX_NAME_LEN);
+  memcpy(p, rec->entry.name,
+         strnlen(rec->entry.name, SENSORMGR_INDEX_NAME_LEN));
+  p += SENSORMGR_INDEX_NAME_LEN;
+  index_le_put(p, rec->entry.first_timestamp, 8);
+  p += 8;
+  index_le_put(p, rec->entry.last_timestamp, 8);
+  p += 8;
+  index_le_put(p, rec->entry.reading_cnt, 4);
+  p += 4;
+  index_le_put(p, rec->value, 4);
+  p += 4;
+  *p = index_checksum(buf);
+}
+
+/**
+ * @brief Read the record at the current position
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NOT_FOUND: End of the index, or a record torn by a power loss
+ *  - ESP_ERR_INVALID_CRC: Corrupt record, the position is after it
+ */
+static esp_err_t index_read(FILE *f, index_record_t *rec) {
+  uint8_t buf[SENSORMGR_INDEX_RECORD_LEN];
+  const uint8_t *p = buf;
+
+  if (fread(buf, sizeof(buf), 1, f) != 1) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (index_checksum(buf) != buf[SENSORMGR_INDEX_RECORD_LEN - 1]) {
+    return ESP_ERR_INVALID_CRC;
+  }
+  memset(rec, 0, sizeof(*rec));
+  rec->op = *p++;
+  memcpy(rec->entry.name, p, SENSORMGR_INDEX_NAME_LEN);
+  p += SENSORMGR_INDEX_NAME_LEN;
+  rec->entry.first_timestamp = index_le_get(p, 8);
+  p += 8;
+  rec->entry.last_timestamp = index_le_get(p, 8);
+  p += 8;
+  rec->entry.reading_cnt = index_le_get(p, 4);
+  p += 4;
+  rec->value = index_le_get(p, 4);
+  if (rec->op == INDEX_OP_ADD) {
+    rec->entry.len = rec->value;
+  }
+  return ESP_OK;
+}
+
+/**
+ * @brief Make the first 'A' record after the head the new head
+ *
+ * Leaves the position of f wherever the search ended.
+ */
+static void index_next_head(sensormgr_index_t *idx, FILE *f) {
+  long pos = idx->head_pos + SENSORMGR_INDEX_RECORD_LEN;
+  esp_err_t ret;
+  index_record_t rec;
+
+  idx->reading_cnt -= idx->head.reading_cnt;
+  idx->len -= idx->head.len;
+  idx->file_cnt--;
+  memset(&idx->head, 0, sizeof(idx->head));
+  idx->head_pos = -1;
+  if (idx->file_cnt == 0 || fseek(f, pos, SEEK_SET) != 0) {
+    return;
+  }
+  while (ESP_ERR_NOT_FOUND != (ret = index_read(f, &rec))) {
+    if (ret == ESP_OK && rec.op == INDEX_OP_ADD) {
+      idx->head = rec.entry;
+      idx->head_pos = pos;
+      return;
+    }
+    pos += SENSORMGR_INDEX_RECORD_LEN;
+  }
+}
+
+static void index_apply(sensormgr_index_t *idx, FILE *f,
+                        const index_record_t *rec, long pos) {
+  bool is_head = idx->file_cnt != 0 &&
+                 strcmp(rec->entry.name, idx->head.name) == 0;
+
+  idx->record_cnt++;
+  switch (rec->op) {
+    case INDEX_OP_ADD:
+      if (idx->file_cnt++ == 0) {
+        idx->head = rec->entry;
+        idx->head_pos = pos;
+      }
+      idx->reading_cnt += rec->entry.reading_cnt;
+      idx->len += rec->entry.len;
+      break;
+    case INDEX_OP_DRAINED:
+      if (is_head) {
+        idx->head.drained = rec->value;
+      }
+      break;
+    case INDEX_OP_REMOVED:
+      if (is_head) {
+        index_next_head(idx, f);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+static esp_err_t index_append(sensormgr_index_t *idx, FILE *f,
+                              const index_record_t *rec) {
+  uint8_t buf[SENSORMGR_INDEX_RECORD_LEN];
+  long pos;
+
+  index_serialize(rec, buf);
+  if (fseek(f, 0, SEEK_END) != 0 || (pos = ftell(f)) < 0 ||
+      fwrite(buf, sizeof(buf), 1, f) != 1 || fflush(f) != 0) {
+    return ESP_FAIL;
+  }
+  index_apply(idx, f, rec, pos);
+  return ESP_OK;
+}
+
+esp_err_t sensormgr_index_load(sensormgr_index_t *idx, FILE *f) {
+  long pos = 0;
+  esp_err_t ret, status = ESP_OK;
+  index_record_t rec;
+
+  memset(idx, 0, sizeof(*idx));
+  idx->head_pos = -1;
+  if (f == NULL || fseek(f, 0, SEEK_SET) != 0) {
+    return ESP_OK;
+  }
+  while (ESP_ERR_NOT_FOUND != (ret = index_read(f, &rec))) {
+    if (ret == ESP_OK) {
+      index_apply(idx, f, &rec, pos);
+    } else {
+      status = ESP_ERR_INVALID_CRC;
+    }
+    pos += SENSORMGR_INDEX_RECORD_LEN;
+    // Finding the next head moves the position
+    fseek(f, pos, SEEK_SET);
+  }
+  if (fseek(f, 0, SEEK_END) == 0 && ftell(f) != pos) {
+    status = ESP_ERR_INVALID_CRC;  // Torn record, appends would be misaligned
+  }
+  return status;
+}
+
+esp_err_t sensormgr_index_add(sensormgr_index_t *idx, FILE *f,
+                              const sensormgr_index_entry_t *entry) {
+  index_record_t rec = {.op = INDEX_OP_ADD, .entry = *entry};
+
+  if (strnlen(entry->name, sizeof(entry->name)) > SENSORMGR_INDEX_NAME_LEN) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  rec.entry.drained = 0;
+  rec.value = entry->len;
+  return index_append(idx, f, &rec);
+}
+
+esp_err_t sensormgr_index_drained(sensormgr_index_t *idx, FILE *f,
+                                  uint32_t offset) {
+  index_record_t rec = {.op = INDEX_OP_DRAINED, .value = offset};
+
+  if (idx->file_cnt == 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  memcpy(rec.entry.name, idx->head.name, sizeof(rec.entry.name));
+  return index_append(idx, f, &rec);
+}
+
+esp_err_t sensormgr_index_remove(sensormgr_index_t *idx, FILE *f) {
+  index_record_t rec = {.op = INDEX_OP_REMOVED};
+
+  if (idx->file_cnt == 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  memcpy(rec.entry.name, idx->head.name, sizeof(rec.entry.name));
+  return index_append(idx, f, &rec);
+}
+
+bool sensormgr_index_needs_compact(const sensormgr_index_t *idx) {
+  return idx->record_cnt >
+         (uint32_t)idx->file_cnt + SENSORMGR_INDEX_COMPACT_SLACK;
+}
+
+esp_err_t sensormgr_index_compact(sensormgr_index_t *idx, FILE *in,
+                                  FILE *out) {
+  esp_err_t ret;
+  index_record_t rec;
+  sensormgr_index_t compacted = {.head_pos = -1};
+
+  if (idx->file_cnt != 0 && fseek(in, idx->head_pos, SEEK_SET) != 0) {
+    return ESP_FAIL;
+  }
+  while (idx->file_cnt != 0 &&
+         ESP_ERR_NOT_FOUND != (ret = index_read(in, &rec))) {
+    if (ret != ESP_OK || rec.op != INDEX_OP_ADD) {
+      continue;
+    }
+    if (ESP_OK != index_append(&compacted, out, &rec)) {
+      return ESP_FAIL;
+    }
+    if (compacted.file_cnt == 1 && idx->head.drained != 0) {
+      rec = (index_record_t){.op = INDEX_OP_DRAINED,
+                             .entry = idx->head,
+                             .value = idx->head.drained};
+      if (ESP_OK != index_append(&compacted, out, &rec)) {
+        return ESP_FAIL;
+      }
+    }
+  }
+  *idx = compacted;
+  return ESP_OK;
+}
@@ -0,0 +1,127 @@
+#ifndef SENSORMGR_INDEX_H
+#define SENSORMGR_INDEX_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Spill index format, an append-only log of fixed size records, all integers
+ * little-endian
+ *
+ *   uint8_t  op          'A' file added, 'D' file drained up to value,
+ *                        'R' file removed
+ *   char[12] name        8.3 file name, NUL padded
+ *   int64_t  first_timestamp
+ *   int64_t  last_timestamp
+ *   uint32_t reading_cnt
+ *   uint32_t value       'A' file length, 'D' offset of the next unsent block
+ *   uint8_t  checksum    Sum of the preceding bytes
+ *
+ * Spill files are drained in the order they were written, so the live files
+ * are the 'A' records following the one of the oldest file (the head). Only
+ * the head is kept in RAM, the next one is read from the index when the head
+ * is removed. A torn record at the end of the index, e.g. from a power loss
+ * while appending, is ignored.
+ */
+
+#define SENSORMGR_INDEX_NAME_LEN 12
+#define SENSORMGR_INDEX_RECORD_LEN \
+  (1 + SENSORMGR_INDEX_NAME_LEN + 8 + 8 + 4 + 4 + 1)
+// Records beyond the live files before the index is worth compacting
+#define SENSORMGR_INDEX_COMPACT_SLACK 128
+
+typedef struct {
+  char name[SENSORMGR_INDEX_NAME_LEN + 1];
+  int64_t first_timestamp;
+  int64_t last_timestamp;
+  uint32_t reading_cnt;
+  uint32_t len;
+  uint32_t drained;  // Offset of the next unsent block, 0 if none sent
+} sensormgr_index_entry_t;
+
+typedef struct {
+  uint16_t file_cnt;     // Live files, including the head
+  uint32_t reading_cnt;  // Readings in the live files
+  uint32_t len;          // Bytes in the live files
+  uint32_t record_cnt;   // Records in the index
+  long head_pos;         // Index offset of the head's 'A' record
+  sensormgr_index_entry_t head;
+} sensormgr_index_t;
+
+/**
+ * @brief Replay an index into memory
+ *
+ * @param idx Index state
+ * @param f   Index file opened for reading and appending ("a+b"), NULL when
+ *            there is no index yet
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_CRC: A record other than the last was corrupt, the
+ *    records after it are ignored
+ */
+esp_err_t sensormgr_index_load(sensormgr_index_t *idx, FILE *f);
+
+/**
+ * @brief Record a closed spill file
+ *
+ * @param idx   Index state
+ * @param f     Index file opened for reading and appending ("a+b")
+ * @param entry The file, name is the 8.3 name without the directory
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: Name doesn't fit an 8.3 name
+ *  - ESP_FAIL: Writing the record failed
+ */
+esp_err_t sensormgr_index_add(sensormgr_index_t *idx, FILE *f,
+                              const sensormgr_index_entry_t *entry);
+
+/**
+ * @brief Record how far the head file has been drained
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NOT_FOUND: No files in the index
+ *  - ESP_FAIL: Writing the record failed
+ */
+esp_err_t sensormgr_index_drained(sensormgr_index_t *idx, FILE *f,
+                                  uint32_t offset);
+
+/**
+ * @brief Drop the head file and move on to the next one
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NOT_FOUND: No files in the index
+ *  - ESP_FAIL: Writing the record failed
+ */
+esp_err_t sensormgr_index_remove(sensormgr_index_t *idx, FILE *f);
+
+/**
+ * @brief Are there enough dead records to make compacting worthwhile
+ */
+bool sensormgr_index_needs_compact(const sensormgr_index_t *idx);
+
+/**
+ * @brief Write only the live records to a new index
+ *
+ * The caller replaces the old index with out afterwards.
+ *
+ * @param idx Index state, updated to point into out
+ * @param in  Current index
+ * @param out New, empty index opened for reading and appending ("a+b")
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_FAIL: Reading or writing failed, idx is unchanged
+ */
+esp_err_t sensormgr_index_compact(sensormgr_index_t *idx, FILE *in, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
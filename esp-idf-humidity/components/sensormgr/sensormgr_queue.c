@@ -0,0 +1,78 @@
+#include "sensormgr_queue.h"
+
+// Indices run over twice the slots, full and empty stay apart without giving
+// up a slot and any slot count works
+static inline uint32_t sensormgr_queue_wrap(sensormgr_queue_t *q,
+                                            uint32_t idx) {
+  return idx >= 2 * q->slot_cnt ? idx - 2 * q->slot_cnt : idx;
+}
+
+static inline uint8_t *sensormgr_queue_slot(sensormgr_queue_t *q,
+                                            uint32_t idx) {
+  return q->slots +
+         (idx >= q->slot_cnt ? idx - q->slot_cnt : idx) * q->slot_size;
+}
+
+static inline uint32_t sensormgr_queue_used(sensormgr_queue_t *q,
+                                            uint32_t head, uint32_t tail) {
+  return head >= tail ? head - tail : head + 2 * q->slot_cnt - tail;
+}
+
+esp_err_t sensormgr_queue_init(sensormgr_queue_t *q, void *storage,
+                               size_t storage_len, size_t slot_size) {
+  if (slot_size == 0 || storage_len / slot_size < 2 ||
+      storage_len / slot_size > UINT32_MAX / 2) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  q->slots = (uint8_t *)storage;
+  q->slot_size = slot_size;
+  q->slot_cnt = storage_len / slot_size;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return ESP_OK;
+}
+
+void *sensormgr_queue_acquire(sensormgr_queue_t *q) {
+  // Only this side writes head, the consumer's tail needs to be seen before
+  // reusing the slot it released
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  if (sensormgr_queue_used(q, head, tail) >= q->slot_cnt) {
+    return NULL;
+  }
+  return sensormgr_queue_slot(q, head);
+}
+
+void sensormgr_queue_commit(sensormgr_queue_t *q) {
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+  // Release so the record is written out before the consumer can see it
+  atomic_store_explicit(&q->head, sensormgr_queue_wrap(q, head + 1),
+                        memory_order_release);
+}
+
+void *sensormgr_queue_peek(sensormgr_queue_t *q, uint32_t pos) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (sensormgr_queue_used(q, head, tail) <= pos) {
+    return NULL;
+  }
+  return sensormgr_queue_slot(q, sensormgr_queue_wrap(q, tail + pos));
+}
+
+void sensormgr_queue_release(sensormgr_queue_t *q, uint32_t cnt) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+  // Release so the record is read before the producer can reuse the slot
+  atomic_store_explicit(&q->tail, sensormgr_queue_wrap(q, tail + cnt),
+                        memory_order_release);
+}
+
+uint32_t sensormgr_queue_count(sensormgr_queue_t *q) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  return sensormgr_queue_used(q, head, tail);
+}
@@ -0,0 +1,89 @@
+#ifndef SENSORMGR_QUEUE_H
+#define SENSORMGR_QUEUE_H
+
+#include <esp_err.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Single producer / single consumer queue of fixed size sample records
+ *
+ * The sensor read task is the only producer and the dispatch task the only
+ * consumer, so the queue needs no lock. Each side owns one index, the other
+ * side only reads it: head is advanced by the producer once a slot is filled,
+ * tail by the consumer once it is done with a slot. Occupancy is always
+ * exactly head - tail, modulo twice the slot count.
+ *
+ * The consumer can peek at several records before releasing them, records
+ * stay queued until the message holding them has been handed off.
+ */
+
+typedef struct {
+  uint8_t *slots;
+  size_t slot_size;
+  uint32_t slot_cnt;
+  atomic_uint_fast32_t head;  // Next slot to fill, only moved by the producer
+  atomic_uint_fast32_t tail;  // Oldest record, only moved by the consumer
+} sensormgr_queue_t;
+
+/**
+ * @brief Split storage into as many slots as fit
+ *
+ * Slots are packed back to back, records with alignment needs have to be a
+ * multiple of it in size.
+ *
+ * @param q           Queue
+ * @param storage     Slots, must outlive the queue
+ * @param storage_len Bytes of storage
+ * @param slot_size   Bytes of each record
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_SIZE: Storage doesn't fit two slots
+ */
+esp_err_t sensormgr_queue_init(sensormgr_queue_t *q, void *storage,
+                               size_t storage_len, size_t slot_size);
+
+/**
+ * @brief Producer, next slot to fill
+ *
+ * @return The slot, or NULL when full. Calling again before committing
+ *         returns the same slot.
+ */
+void *sensormgr_queue_acquire(sensormgr_queue_t *q);
+
+/**
+ * @brief Producer, hand the acquired slot to the consumer
+ */
+void sensormgr_queue_commit(sensormgr_queue_t *q);
+
+/**
+ * @brief Consumer, look at a queued record without removing it
+ *
+ * @param q   Queue
+ * @param pos 0 for the oldest record
+ * @return The record, or NULL when fewer than pos + 1 are queued
+ */
+void *sensormgr_queue_peek(sensormgr_queue_t *q, uint32_t pos);
+
+/**
+ * @brief Consumer, remove the oldest records
+ *
+ * @param q   Queue
+ * @param cnt Records to remove, no more than were peeked at
+ */
+void sensormgr_queue_release(sensormgr_queue_t *q, uint32_t cnt);
+
+/**
+ * @brief Records queued, including the ones peeked at but not released yet
+ */
+uint32_t sensormgr_queue_count(sensormgr_queue_t *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,44 @@
+#include "sensormgr_rtc.h"
+
+bool sensormgr_rtc_open(sensormgr_rtc_t *rtc, uint8_t channel_cnt,
+                        bool from_sleep) {
+  if (from_sleep && rtc->magic == SENSORMGR_RTC_MAGIC &&
+      rtc->channel_cnt == channel_cnt && rtc->head < SENSORMGR_RTC_SAMPLES &&
+      rtc->cnt <= SENSORMGR_RTC_SAMPLES) {
+    return true;
+  }
+  rtc->magic = SENSORMGR_RTC_MAGIC;
+  rtc->channel_cnt = channel_cnt;
+  sensormgr_rtc_clear(rtc);
+  return false;
+}
+
+void sensormgr_rtc_clear(sensormgr_rtc_t *rtc) {
+  rtc->head = 0;
+  rtc->cnt = 0;
+}
+
+bool sensormgr_rtc_push(sensormgr_rtc_t *rtc,
+                        const sensormgr_sample_t *sample) {
+  bool kept_all = rtc->cnt < SENSORMGR_RTC_SAMPLES;
+
+  rtc->samples[rtc->head] = *sample;
+  rtc->head = (rtc->head + 1) % SENSORMGR_RTC_SAMPLES;
+  if (kept_all) {
+    rtc->cnt++;
+  }
+  return kept_all;
+}
+
+uint16_t sensormgr_rtc_room(const sensormgr_rtc_t *rtc) {
+  return SENSORMGR_RTC_SAMPLES - rtc->cnt;
+}
+
+const sensormgr_sample_t *sensormgr_rtc_peek(const sensormgr_rtc_t *rtc,
+                                             uint16_t idx) {
+  if (idx >= rtc->cnt) {
+    return NULL;
+  }
+  return &rtc->samples[(rtc->head + SENSORMGR_RTC_SAMPLES - rtc->cnt + idx) %
+                       SENSORMGR_RTC_SAMPLES];
+}
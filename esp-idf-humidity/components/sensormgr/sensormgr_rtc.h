@@ -0,0 +1,76 @@
+#ifndef SENSORMGR_RTC_H
+#define SENSORMGR_RTC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensormgr_sample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Samples kept in RTC memory through deep sleep
+ *
+ * Woken up by the timer, a device measures into this ring and goes back to
+ * sleep without starting WiFi or mounting flash. Only once it can't hold
+ * another round of readings does the device boot all the way and hand the
+ * samples to the sample queue. The ring survives deep sleep but not a reset
+ * or power loss, so it's only trusted after a wake from deep sleep with the
+ * same channels registered as when it was filled.
+ */
+
+// 9 bytes each, fits the 8K of RTC slow memory with room to spare
+#define SENSORMGR_RTC_SAMPLES 384
+#define SENSORMGR_RTC_MAGIC 0x53524243
+
+typedef struct {
+  uint32_t magic;       // SENSORMGR_RTC_MAGIC once set up
+  uint8_t channel_cnt;  // Registered when the samples were taken
+  uint16_t head;        // Next slot to fill
+  uint16_t cnt;         // Samples held
+  sensormgr_sample_t samples[SENSORMGR_RTC_SAMPLES];
+} sensormgr_rtc_t;
+
+/**
+ * @brief Check the ring left in RTC memory, emptying it if it can't be used
+ *
+ * @param rtc         Ring
+ * @param channel_cnt Channels registered now
+ * @param from_sleep  Woken up from deep sleep, RTC memory is garbage otherwise
+ * @return Whether samples from before the sleep were kept
+ */
+bool sensormgr_rtc_open(sensormgr_rtc_t *rtc, uint8_t channel_cnt,
+                        bool from_sleep);
+
+/**
+ * @brief Drop every sample
+ */
+void sensormgr_rtc_clear(sensormgr_rtc_t *rtc);
+
+/**
+ * @brief Add a sample, replacing the oldest one when full
+ *
+ * @return Whether no sample was replaced
+ */
+bool sensormgr_rtc_push(sensormgr_rtc_t *rtc, const sensormgr_sample_t *sample);
+
+/**
+ * @brief Samples that can still be added without replacing any
+ */
+uint16_t sensormgr_rtc_room(const sensormgr_rtc_t *rtc);
+
+/**
+ * @brief Sample held, oldest first
+ *
+ * @return NULL when idx is past the samples held
+ */
+const sensormgr_sample_t *sensormgr_rtc_peek(const sensormgr_rtc_t *rtc,
+                                             uint16_t idx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
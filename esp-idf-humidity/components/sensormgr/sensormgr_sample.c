@@ -0,0 +1,64 @@
+#include "sensormgr_sample.h"
+
+static const double sample_scale[SENSORMGR_SAMPLE_DECIMALS_MAX + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000};
+
+esp_err_t sensormgr_sample_set(sensormgr_sample_t *sample, uint8_t channel,
+                               uint8_t decimals, int64_t timestamp,
+                               float value) {
+  return sensormgr_sample_set_stat(sample, channel, decimals,
+                                   SENSORMGR_STAT_RAW, timestamp, value);
+}
+
+esp_err_t sensormgr_sample_set_stat(sensormgr_sample_t *sample,
+                                    uint8_t channel, uint8_t decimals,
+                                    sensormgr_stat_t stat, int64_t timestamp,
+                                    double value) {
+  double scaled;
+
+  if (decimals > SENSORMGR_SAMPLE_DECIMALS_MAX ||
+      channel > SENSORMGR_SAMPLE_CHANNEL_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  scaled = stat == SENSORMGR_STAT_COUNT ? value
+                                        : value * sample_scale[decimals];
+  // Also false for NaN
+  if (!(scaled > INT32_MIN - 0.5 && scaled < INT32_MAX + 0.5)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  sample->channel = channel;
+  sample->stat = stat;
+  if (timestamp >= SENSORMGR_SAMPLE_EPOCH_MS) {
+    sample->timestamp = (timestamp - SENSORMGR_SAMPLE_EPOCH_MS) / 1000;
+  } else {
+    // The flag takes the place of bit 31, leaving ms modulo 2^31
+    sample->timestamp = (timestamp > 0 ? (uint32_t)timestamp : 0) |
+                        SENSORMGR_SAMPLE_MONOTONIC;
+  }
+  sample->value = (int32_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+  return ESP_OK;
+}
+
+double sensormgr_sample_value(const sensormgr_sample_t *sample,
+                              uint8_t decimals) {
+  if (sample->stat == SENSORMGR_STAT_COUNT) {
+    return sample->value;
+  }
+  return sample->value / sample_scale[decimals];
+}
+
+int64_t sensormgr_sample_timestamp(const sensormgr_sample_t *sample,
+                                   int64_t now) {
+  uint32_t age;
+
+  if (sensormgr_sample_monotonic(sample)) {
+    // Modulo 2^31, like the timestamp
+    age = ((uint32_t)now - sample->timestamp) & ~SENSORMGR_SAMPLE_MONOTONIC;
+    return now - age;
+  }
+  return (SENSORMGR_SAMPLE_EPOCH + (int64_t)sample->timestamp) * 1000;
+}
+
+bool sensormgr_sample_monotonic(const sensormgr_sample_t *sample) {
+  return (sample->timestamp & SENSORMGR_SAMPLE_MONOTONIC) != 0;
+}
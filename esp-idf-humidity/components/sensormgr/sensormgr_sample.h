@@ -0,0 +1,124 @@
+#ifndef SENSORMGR_SAMPLE_H
+#define SENSORMGR_SAMPLE_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed size sample record, the layout shared by the sample queue, the spill
+ * files and the backfill wire format
+ *
+ * Every value a sensor measures is its own channel, registered once with a
+ * sensormgr_channel_t naming its sensor, unit and decimals. A sample only
+ * carries the channel index, its timestamp and the value as a fixed point
+ * integer scaled by 10^decimals. Sensors with several values (temperature and
+ * humidity) add one sample per channel.
+ *
+ * Readings are stamped with the ms since boot, flagged with
+ * SENSORMGR_SAMPLE_MONOTONIC, and only turned into wall clock time when
+ * they're sent. The 31 bits left hold the ms since boot modulo 2^31, about 24
+ * days, which is unwrapped against the current time since boot. A sample
+ * queued for longer than that comes out 24 days late.
+ *
+ * Readings taken in deep sleep, where the time since boot restarts with every
+ * wakeup, are stamped with whole seconds since SENSORMGR_SAMPLE_EPOCH instead.
+ * So are window statistics once the clock is known, aggregated channels send
+ * a summary per window instead of every reading, one sample per statistic
+ * stamped with the start of the window.
+ */
+
+// 2020-01-01T00:00:00Z, readings before it were taken without a synced clock
+#define SENSORMGR_SAMPLE_EPOCH 1577836800
+#define SENSORMGR_SAMPLE_EPOCH_MS (SENSORMGR_SAMPLE_EPOCH * 1000LL)
+// Timestamp flag of samples stamped with ms since boot
+#define SENSORMGR_SAMPLE_MONOTONIC 0x80000000u
+// Largest decimals a channel can have
+#define SENSORMGR_SAMPLE_DECIMALS_MAX 6
+// Largest channel index a sample can hold
+#define SENSORMGR_SAMPLE_CHANNEL_MAX 31
+
+// What the value of a sample is, same values as sensormgr.stat_t
+typedef enum {
+  SENSORMGR_STAT_RAW = 0,  // A single reading
+  SENSORMGR_STAT_MEAN,
+  SENSORMGR_STAT_MIN,
+  SENSORMGR_STAT_MAX,
+  SENSORMGR_STAT_STDDEV,
+  SENSORMGR_STAT_COUNT,  // Readings in the window, not scaled by decimals
+} sensormgr_stat_t;
+
+typedef struct {
+  const char *sensor;  // e.g. "sht4x", must outlive sensormgr
+  const char *unit;    // e.g. "%rH", must outlive sensormgr
+  uint8_t decimals;    // Fixed point precision of the values
+} sensormgr_channel_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t channel : 5;  // Index into the sensormgr channel table
+  uint8_t stat : 3;     // sensormgr_stat_t
+  uint32_t timestamp;   // See SENSORMGR_SAMPLE_MONOTONIC
+  int32_t value;       // Value * 10^decimals of the channel
+} sensormgr_sample_t;
+
+/**
+ * @brief Fill in a raw sample, rounding the value to the channel's decimals
+ *
+ * Timestamps before SENSORMGR_SAMPLE_EPOCH_MS are taken as ms since boot,
+ * the sample is flagged as monotonic. Later ones are Unix time, of which only
+ * whole seconds are kept.
+ *
+ * @param sample    Sample to fill in
+ * @param channel   Channel index
+ * @param decimals  Decimals of the channel
+ * @param timestamp When the value was measured, in ms
+ * @param value     Measured value
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: Channel index too large, or value is NaN or doesn't
+ *    fit the fixed point range
+ */
+esp_err_t sensormgr_sample_set(sensormgr_sample_t *sample, uint8_t channel,
+                               uint8_t decimals, int64_t timestamp,
+                               float value);
+
+/**
+ * @brief Fill in a sample of a window statistic
+ *
+ * Same as sensormgr_sample_set, except that SENSORMGR_STAT_COUNT values are
+ * not scaled.
+ */
+esp_err_t sensormgr_sample_set_stat(sensormgr_sample_t *sample,
+                                    uint8_t channel, uint8_t decimals,
+                                    sensormgr_stat_t stat, int64_t timestamp,
+                                    double value);
+
+/**
+ * @brief Value of a sample, exact to the decimals of its channel
+ */
+double sensormgr_sample_value(const sensormgr_sample_t *sample,
+                              uint8_t decimals);
+
+/**
+ * @brief Timestamp of a sample in ms
+ *
+ * @param sample Sample
+ * @param now    ms since boot, not before the sample was stamped
+ * @return Unix time, ms since boot for monotonic samples
+ */
+int64_t sensormgr_sample_timestamp(const sensormgr_sample_t *sample,
+                                   int64_t now);
+
+/**
+ * @brief Whether a sample was stamped before the clock was synced
+ */
+bool sensormgr_sample_monotonic(const sensormgr_sample_t *sample);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
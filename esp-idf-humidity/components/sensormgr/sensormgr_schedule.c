@@ -0,0 +1,93 @@
+#include "sensormgr_schedule.h"
+
+// Signed distance handles the tick count wrapping around
+static inline bool sensormgr_schedule_before(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+static void sensormgr_schedule_swap(sensormgr_schedule_t *s, uint8_t a,
+                                    uint8_t b) {
+  sensormgr_schedule_entry_t tmp = s->heap[a];
+
+  s->heap[a] = s->heap[b];
+  s->heap[b] = tmp;
+}
+
+static void sensormgr_schedule_sift_up(sensormgr_schedule_t *s, uint8_t idx) {
+  uint8_t parent;
+
+  while (idx > 0) {
+    parent = (idx - 1) / 2;
+    if (!sensormgr_schedule_before(s->heap[idx].deadline,
+                                   s->heap[parent].deadline)) {
+      return;
+    }
+    sensormgr_schedule_swap(s, idx, parent);
+    idx = parent;
+  }
+}
+
+static void sensormgr_schedule_sift_down(sensormgr_schedule_t *s,
+                                         uint8_t idx) {
+  uint8_t child, smallest;
+
+  for (;;) {
+    smallest = idx;
+    for (child = 2 * idx + 1; child <= 2 * idx + 2 && child < s->cnt;
+         child++) {
+      if (sensormgr_schedule_before(s->heap[child].deadline,
+                                    s->heap[smallest].deadline)) {
+        smallest = child;
+      }
+    }
+    if (smallest == idx) {
+      return;
+    }
+    sensormgr_schedule_swap(s, idx, smallest);
+    idx = smallest;
+  }
+}
+
+void sensormgr_schedule_init(sensormgr_schedule_t *s) { s->cnt = 0; }
+
+esp_err_t sensormgr_schedule_add(sensormgr_schedule_t *s, uint8_t id,
+                                 uint32_t period, uint32_t deadline) {
+  if (period == 0 || period > INT32_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (s->cnt >= SENSORMGR_SCHEDULE_MAX) {
+    return ESP_ERR_NO_MEM;
+  }
+  s->heap[s->cnt] = (sensormgr_schedule_entry_t){
+      .deadline = deadline,
+      .period = period,
+      .id = id,
+  };
+  sensormgr_schedule_sift_up(s, s->cnt++);
+  return ESP_OK;
+}
+
+bool sensormgr_schedule_pop_due(sensormgr_schedule_t *s, uint32_t now,
+                                uint8_t *id) {
+  sensormgr_schedule_entry_t *next = &s->heap[0];
+
+  if (s->cnt == 0 || sensormgr_schedule_before(now, next->deadline)) {
+    return false;
+  }
+  *id = next->id;
+  // Next deadline after now, on the same phase
+  next->deadline +=
+      ((now - next->deadline) / next->period + 1) * next->period;
+  sensormgr_schedule_sift_down(s, 0);
+  return true;
+}
+
+uint32_t sensormgr_schedule_wait(const sensormgr_schedule_t *s, uint32_t now) {
+  if (s->cnt == 0) {
+    return UINT32_MAX;
+  }
+  if (sensormgr_schedule_before(now, s->heap[0].deadline)) {
+    return s->heap[0].deadline - now;
+  }
+  return 0;
+}
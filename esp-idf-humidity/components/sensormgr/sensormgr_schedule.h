@@ -0,0 +1,81 @@
+#ifndef SENSORMGR_SCHEDULE_H
+#define SENSORMGR_SCHEDULE_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Deadline ordered polling schedule of the registered sensors
+ *
+ * Every sensor has its own period, the sensor read task only wakes when the
+ * earliest deadline is due. Deadlines are kept in a binary min-heap, finding
+ * the next one is O(1) and rescheduling a sensor O(log n).
+ *
+ * Times are FreeRTOS ticks and allowed to wrap, deadlines are compared by
+ * their signed distance so periods have to stay below 2^31 ticks.
+ */
+
+// Sensors that can be scheduled
+#define SENSORMGR_SCHEDULE_MAX 8
+
+typedef struct {
+  uint32_t deadline;  // Tick of the next poll
+  uint32_t period;    // Ticks between polls
+  uint8_t id;         // Index of the sensor
+} sensormgr_schedule_entry_t;
+
+typedef struct {
+  sensormgr_schedule_entry_t heap[SENSORMGR_SCHEDULE_MAX];
+  uint8_t cnt;
+} sensormgr_schedule_t;
+
+/**
+ * @brief Start with nothing scheduled
+ */
+void sensormgr_schedule_init(sensormgr_schedule_t *s);
+
+/**
+ * @brief Schedule a sensor
+ *
+ * @param s        Schedule
+ * @param id       Index of the sensor, returned when it is due
+ * @param period   Ticks between polls
+ * @param deadline Tick of the first poll, the phase of the sensor
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: Period is 0 or too long
+ *  - ESP_ERR_NO_MEM: SENSORMGR_SCHEDULE_MAX sensors are scheduled already
+ */
+esp_err_t sensormgr_schedule_add(sensormgr_schedule_t *s, uint8_t id,
+                                 uint32_t period, uint32_t deadline);
+
+/**
+ * @brief Take the next sensor that is due and move it to its next deadline
+ *
+ * Deadlines missed while polling was held up are skipped rather than
+ * caught up on, a sensor keeps its phase and is polled once.
+ *
+ * @param s   Schedule
+ * @param now Current tick
+ * @param id  Index of the sensor to poll
+ * @return Whether a sensor was due
+ */
+bool sensormgr_schedule_pop_due(sensormgr_schedule_t *s, uint32_t now,
+                                uint8_t *id);
+
+/**
+ * @brief Ticks until the next sensor is due
+ *
+ * @return 0 when one is due already, UINT32_MAX with nothing scheduled
+ */
+uint32_t sensormgr_schedule_wait(const sensormgr_schedule_t *s, uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,615 @@
+#include "sensormgr_spill.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define SPILL_MAGIC "SMSP"
+#define SPILL_MAGIC_LEN 4
+#define SPILL_NO_WINDOW 0xFF
+// Largest encoding of a timestamp and a single column
+#define SPILL_TIMESTAMP_BITS_MAX (4 + 32)
+#define SPILL_VALUE_BITS_MAX (2 + 5 + 5 + 32)
+
+/**
+ * @brief Size of the timestamp column of a version
+ */
+static size_t spill_timestamp_len(uint8_t version) {
+  return version < 4 ? sizeof(time_t) : sizeof(int64_t);
+}
+
+/**
+ * @brief Number of 32 bit columns following the timestamp
+ *
+ * @return Column count, -1 if data_len can't be split into columns
+ */
+static int spill_value_cnt(uint8_t version, size_t data_len) {
+  size_t values_len;
+
+  if (data_len < spill_timestamp_len(version)) {
+    return -1;
+  }
+  values_len = data_len - spill_timestamp_len(version);
+  if (values_len % sizeof(uint32_t) != 0 ||
+      values_len / sizeof(uint32_t) > SENSORMGR_SPILL_VALUES_MAX) {
+    return -1;
+  }
+  return values_len / sizeof(uint32_t);
+}
+
+static void spill_le_put(uint8_t *buf, uint64_t value, uint8_t len) {
+  uint8_t idx;
+
+  for (idx = 0; idx < len; idx++) {
+    buf[idx] = value >> (idx * 8);
+  }
+}
+
+static uint64_t spill_le_get(const uint8_t *buf, uint8_t len) {
+  uint8_t idx;
+  uint64_t value = 0;
+
+  for (idx = 0; idx < len; idx++) {
+    value |= (uint64_t)buf[idx] << (idx * 8);
+  }
+  return value;
+}
+
+static void spill_block_reset(sensormgr_spill_block_t *block,
+                              uint8_t type_idx) {
+  memset(block, 0, sizeof(*block));
+  block->type_idx = type_idx;
+  memset(block->prev_lead, SPILL_NO_WINDOW, sizeof(block->prev_lead));
+}
+
+static void spill_bits_put(sensormgr_spill_block_t *block, uint32_t value,
+                           uint8_t nbits) {
+  while (nbits--) {
+    if ((value >> nbits) & 1) {
+      block->buf[block->bit_pos >> 3] |= 0x80 >> (block->bit_pos & 7);
+    }
+    block->bit_pos++;
+  }
+}
+
+static bool spill_bits_get(sensormgr_spill_block_t *block, size_t bit_len,
+                           uint8_t nbits, uint32_t *value) {
+  if (block->bit_pos + nbits > bit_len) {
+    return false;
+  }
+  *value = 0;
+  while (nbits--) {
+    *value = (*value << 1) |
+             ((block->buf[block->bit_pos >> 3] >> (7 - (block->bit_pos & 7))) &
+              1);
+    block->bit_pos++;
+  }
+  return true;
+}
+
+static size_t spill_header_put(uint8_t *buf, uint8_t version,
+                               int64_t base_timestamp, const uint8_t *data_len,
+                               uint8_t sensor_cnt, uint32_t boot_id,
+                               const sensormgr_clock_t *clk) {
+  uint8_t idx;
+  size_t len = 0;
+  const sensormgr_clock_anchor_t *anchor;
+
+  memcpy(buf, SPILL_MAGIC, SPILL_MAGIC_LEN);
+  len += SPILL_MAGIC_LEN;
+  buf[len++] = version;
+  buf[len++] = sensor_cnt;
+  memcpy(&buf[len], data_len, sensor_cnt);
+  len += sensor_cnt;
+  spill_le_put(&buf[len], base_timestamp, 8);
+  len += 8;
+  if (version < 3) {
+    return len;
+  }
+  spill_le_put(&buf[len], boot_id, 4);
+  len += 4;
+  buf[len++] = clk->anchor_cnt;
+  for (idx = 0; idx < clk->anchor_cnt; idx++) {
+    anchor = &clk->anchors[idx];
+    if (version < 4) {
+      spill_le_put(&buf[len], anchor->mono / 1000, 4);
+      spill_le_put(&buf[len + 4], anchor->wall / 1000, 8);
+      len += 4 + 8;
+    } else {
+      spill_le_put(&buf[len], anchor->mono, 8);
+      spill_le_put(&buf[len + 8], anchor->wall, 8);
+      len += 8 + 8;
+    }
+  }
+  return len;
+}
+
+esp_err_t sensormgr_spill_encoder_init(sensormgr_spill_encoder_t *enc, FILE *f,
+                                       int64_t base_timestamp,
+                                       const uint8_t *data_len,
+                                       uint8_t sensor_cnt, uint32_t boot_id,
+                                       const sensormgr_clock_t *clk) {
+  uint8_t idx, header[SENSORMGR_SPILL_HEADER_MAX];
+  size_t len;
+
+  if (sensor_cnt > SENSORMGR_SPILL_SENSORS_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  for (idx = 0; idx < sensor_cnt; idx++) {
+    // 0 marks a sensor type that hasn't been measured yet
+    if (data_len[idx] != 0 &&
+        spill_value_cnt(SENSORMGR_SPILL_VERSION, data_len[idx]) < 0) {
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+
+  memset(enc, 0, sizeof(*enc));
+  enc->f = f;
+  enc->base_timestamp = base_timestamp;
+  enc->sensor_cnt = sensor_cnt;
+  memcpy(enc->data_len, data_len, sensor_cnt);
+  enc->boot_id = boot_id;
+  if (clk != NULL) {
+    enc->clk = *clk;
+  } else {
+    sensormgr_clock_init(&enc->clk);
+  }
+  for (idx = 0; idx < SENSORMGR_SPILL_SENSORS_MAX; idx++) {
+    spill_block_reset(&enc->blocks[idx], idx);
+  }
+
+  len = spill_header_put(header, SENSORMGR_SPILL_VERSION, base_timestamp,
+                         data_len, sensor_cnt, boot_id, &enc->clk);
+  if (fwrite(header, len, 1, f) != 1) {
+    return ESP_FAIL;
+  }
+  enc->bytes_written = len;
+  return ESP_OK;
+}
+
+static esp_err_t spill_block_flush(sensormgr_spill_encoder_t *enc,
+                                   sensormgr_spill_block_t *block) {
+  uint8_t header[SENSORMGR_SPILL_BLOCK_HEADER_LEN];
+  size_t payload_len = (block->bit_pos + 7) / 8;
+
+  if (block->reading_cnt == 0) {
+    return ESP_OK;
+  }
+  header[0] = block->type_idx;
+  spill_le_put(&header[1], block->reading_cnt, 2);
+  spill_le_put(&header[3], payload_len, 2);
+  if (fwrite(header, sizeof(header), 1, enc->f) != 1 ||
+      fwrite(block->buf, payload_len, 1, enc->f) != 1) {
+    return ESP_FAIL;
+  }
+  enc->bytes_written += sizeof(header) + payload_len;
+  spill_block_reset(block, block->type_idx);
+  return ESP_OK;
+}
+
+static void spill_put_timestamp(sensormgr_spill_block_t *block, int32_t dod) {
+  if (dod == 0) {
+    spill_bits_put(block, 0x0, 1);
+  } else if (dod >= -63 && dod <= 64) {
+    spill_bits_put(block, 0x2, 2);
+    spill_bits_put(block, dod + 63, 7);
+  } else if (dod >= -255 && dod <= 256) {
+    spill_bits_put(block, 0x6, 3);
+    spill_bits_put(block, dod + 255, 9);
+  } else if (dod >= -2047 && dod <= 2048) {
+    spill_bits_put(block, 0xE, 4);
+    spill_bits_put(block, dod + 2047, 12);
+  } else {
+    spill_bits_put(block, 0xF, 4);
+    spill_bits_put(block, dod, 32);
+  }
+}
+
+static void spill_put_value(sensormgr_spill_block_t *block, uint8_t col,
+                            uint32_t value) {
+  uint8_t lead, trail;
+  uint32_t xor = value ^ block->prev_value[col];
+
+  block->prev_value[col] = value;
+  if (xor == 0) {
+    spill_bits_put(block, 0x0, 1);
+    return;
+  }
+  lead = __builtin_clz(xor);
+  trail = __builtin_ctz(xor);
+  if (block->prev_lead[col] != SPILL_NO_WINDOW &&
+      lead >= block->prev_lead[col] && trail >= block->prev_trail[col]) {
+    // Fits the previous window, skip describing it again
+    spill_bits_put(block, 0x2, 2);
+    spill_bits_put(block, xor >> block->prev_trail[col],
+                   32 - block->prev_lead[col] - block->prev_trail[col]);
+    return;
+  }
+  spill_bits_put(block, 0x3, 2);
+  spill_bits_put(block, lead, 5);
+  spill_bits_put(block, 32 - lead - trail - 1, 5);
+  spill_bits_put(block, xor >> trail, 32 - lead - trail);
+  block->prev_lead[col] = lead;
+  block->prev_trail[col] = trail;
+}
+
+esp_err_t sensormgr_spill_encode(sensormgr_spill_encoder_t *enc,
+                                 uint8_t type_idx, const void *sensor_data,
+                                 size_t sensor_data_len) {
+  uint8_t col;
+  int value_cnt;
+  int64_t timestamp, delta = 0, dod = 0;
+  uint32_t value;
+  esp_err_t ret;
+  sensormgr_spill_block_t *block;
+
+  if (type_idx >= enc->sensor_cnt || enc->data_len[type_idx] == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (sensor_data_len != enc->data_len[type_idx]) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  value_cnt = spill_value_cnt(SENSORMGR_SPILL_VERSION, sensor_data_len);
+  memcpy(&timestamp, sensor_data, sizeof(timestamp));
+  block = &enc->blocks[type_idx];
+
+  if (block->reading_cnt > 0) {
+    delta = timestamp - block->prev_timestamp;
+    dod = delta - block->prev_delta;
+    // Start a new block when full or the timestamp jumps too far to encode
+    if (block->bit_pos + SPILL_TIMESTAMP_BITS_MAX +
+                value_cnt * SPILL_VALUE_BITS_MAX >
+            SENSORMGR_SPILL_BLOCK_SIZE * 8 ||
+        block->reading_cnt == UINT16_MAX || delta != (int32_t)delta ||
+        dod != (int32_t)dod) {
+      ret = spill_block_flush(enc, block);
+      if (ret != ESP_OK) {
+        return ret;
+      }
+    }
+  }
+
+  if (block->reading_cnt == 0) {
+    delta = timestamp - enc->base_timestamp;
+    spill_bits_put(block, (uint64_t)delta >> 32, 32);
+    spill_bits_put(block, delta, 32);
+    block->prev_delta = 0;
+    for (col = 0; col < value_cnt; col++) {
+      memcpy(&value,
+             (const uint8_t *)sensor_data + sizeof(timestamp) +
+                 col * sizeof(uint32_t),
+             sizeof(uint32_t));
+      spill_bits_put(block, value, 32);
+      block->prev_value[col] = value;
+    }
+  } else {
+    spill_put_timestamp(block, dod);
+    block->prev_delta = delta;
+    for (col = 0; col < value_cnt; col++) {
+      memcpy(&value,
+             (const uint8_t *)sensor_data + sizeof(timestamp) +
+                 col * sizeof(uint32_t),
+             sizeof(uint32_t));
+      spill_put_value(block, col, value);
+    }
+  }
+  block->prev_timestamp = timestamp;
+  block->reading_cnt++;
+  return ESP_OK;
+}
+
+esp_err_t sensormgr_spill_encoder_finish(sensormgr_spill_encoder_t *enc) {
+  uint8_t idx;
+  esp_err_t ret;
+
+  for (idx = 0; idx < enc->sensor_cnt; idx++) {
+    ret = spill_block_flush(enc, &enc->blocks[idx]);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t sensormgr_spill_decoder_init(sensormgr_spill_decoder_t *dec,
+                                       FILE *f) {
+  uint8_t idx, version, anchor_len, header[SENSORMGR_SPILL_HEADER_MAX];
+  uint8_t *data_len = &header[SPILL_MAGIC_LEN + 2], *anchor;
+
+  memset(dec, 0, sizeof(*dec));
+  dec->f = f;
+  sensormgr_clock_init(&dec->clk);
+  if (fread(header, SPILL_MAGIC_LEN + 2, 1, f) != 1 ||
+      memcmp(header, SPILL_MAGIC, SPILL_MAGIC_LEN) != 0 ||
+      header[SPILL_MAGIC_LEN + 1] > SENSORMGR_SPILL_SENSORS_MAX) {
+    goto not_spill;
+  }
+  version = header[SPILL_MAGIC_LEN];
+  if (version == 0 || version > SENSORMGR_SPILL_VERSION) {
+    goto not_spill;
+  }
+  dec->version = version;
+  dec->sensor_cnt = header[SPILL_MAGIC_LEN + 1];
+  if (fread(data_len, dec->sensor_cnt + 8, 1, f) != 1) {
+    goto not_spill;
+  }
+  for (idx = 0; idx < dec->sensor_cnt; idx++) {
+    if (data_len[idx] != 0 && spill_value_cnt(version, data_len[idx]) < 0) {
+      goto not_spill;
+    }
+  }
+  memcpy(dec->data_len, data_len, dec->sensor_cnt);
+  dec->base_timestamp = spill_le_get(&data_len[dec->sensor_cnt], 8);
+  if (version < 3) {
+    dec->header_len = ftell(f);
+    return ESP_OK;
+  }
+
+  anchor = &data_len[dec->sensor_cnt + 8];
+  if (fread(anchor, 4 + 1, 1, f) != 1 ||
+      anchor[4] > SENSORMGR_CLOCK_ANCHORS_MAX) {
+    goto not_spill;
+  }
+  dec->boot_id = spill_le_get(anchor, 4);
+  dec->clk.anchor_cnt = anchor[4];
+  anchor_len = version < 4 ? 4 + 8 : 8 + 8;
+  if (dec->clk.anchor_cnt != 0 &&
+      fread(anchor, anchor_len, dec->clk.anchor_cnt, f) !=
+          dec->clk.anchor_cnt) {
+    goto not_spill;
+  }
+  for (idx = 0; idx < dec->clk.anchor_cnt; idx++, anchor += anchor_len) {
+    if (version < 4) {
+      dec->clk.anchors[idx].mono = spill_le_get(anchor, 4) * 1000;
+      dec->clk.anchors[idx].wall = (int64_t)spill_le_get(&anchor[4], 8) * 1000;
+    } else {
+      dec->clk.anchors[idx].mono = spill_le_get(anchor, 8);
+      dec->clk.anchors[idx].wall = spill_le_get(&anchor[8], 8);
+    }
+  }
+  dec->header_len = ftell(f);
+  return ESP_OK;
+
+not_spill:
+  rewind(f);
+  return ESP_ERR_INVALID_VERSION;
+}
+
+static bool spill_block_header_valid(sensormgr_spill_decoder_t *dec,
+                                     const uint8_t *header) {
+  return header[0] < dec->sensor_cnt && dec->data_len[header[0]] != 0 &&
+         spill_le_get(&header[1], 2) != 0 &&
+         spill_le_get(&header[3], 2) <= SENSORMGR_SPILL_BLOCK_SIZE;
+}
+
+static esp_err_t spill_block_load(sensormgr_spill_decoder_t *dec) {
+  uint8_t header[SENSORMGR_SPILL_BLOCK_HEADER_LEN];
+  uint16_t reading_cnt;
+
+  dec->block_offset = ftell(dec->f);
+  if (fread(header, sizeof(header), 1, dec->f) != 1) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (!spill_block_header_valid(dec, header)) {
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  reading_cnt = spill_le_get(&header[1], 2);
+  dec->payload_len = spill_le_get(&header[3], 2);
+  spill_block_reset(&dec->block, header[0]);
+  dec->block.reading_cnt = reading_cnt;
+  dec->reading_idx = 0;
+  if (fread(dec->block.buf, dec->payload_len, 1, dec->f) != 1) {
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  return ESP_OK;
+}
+
+static bool spill_get_timestamp(sensormgr_spill_block_t *block,
+                                size_t bit_len, int32_t *dod) {
+  static const uint8_t widths[] = {7, 9, 12, 32};
+  static const int32_t bias[] = {63, 255, 2047, 0};
+  uint8_t ones;
+  uint32_t bit, value;
+
+  for (ones = 0; ones < 4; ones++) {
+    if (!spill_bits_get(block, bit_len, 1, &bit)) {
+      return false;
+    }
+    if (bit == 0) {
+      break;
+    }
+  }
+  if (ones == 0) {
+    *dod = 0;
+    return true;
+  }
+  if (!spill_bits_get(block, bit_len, widths[ones - 1], &value)) {
+    return false;
+  }
+  *dod = (int32_t)value - bias[ones - 1];
+  return true;
+}
+
+static bool spill_get_value(sensormgr_spill_block_t *block, size_t bit_len,
+                            uint8_t col, uint32_t *value) {
+  uint32_t bit, lead, len, xor;
+
+  if (!spill_bits_get(block, bit_len, 1, &bit)) {
+    return false;
+  }
+  if (bit == 0) {
+    *value = block->prev_value[col];
+    return true;
+  }
+  if (!spill_bits_get(block, bit_len, 1, &bit)) {
+    return false;
+  }
+  if (bit == 1) {
+    if (!spill_bits_get(block, bit_len, 5, &lead) ||
+        !spill_bits_get(block, bit_len, 5, &len)) {
+      return false;
+    }
+    len++;
+    if (lead + len > 32) {
+      return false;
+    }
+    block->prev_lead[col] = lead;
+    block->prev_trail[col] = 32 - lead - len;
+  } else if (block->prev_lead[col] == SPILL_NO_WINDOW) {
+    return false;
+  }
+  len = 32 - block->prev_lead[col] - block->prev_trail[col];
+  if (!spill_bits_get(block, bit_len, len, &xor)) {
+    return false;
+  }
+  *value = block->prev_value[col] ^ (xor << block->prev_trail[col]);
+  block->prev_value[col] = *value;
+  return true;
+}
+
+esp_err_t sensormgr_spill_decode(sensormgr_spill_decoder_t *dec,
+                                 uint8_t *type_idx, void *sensor_data,
+                                 size_t sensor_data_max,
+                                 size_t *sensor_data_len) {
+  uint8_t col;
+  int value_cnt;
+  int32_t dod;
+  size_t bit_len, timestamp_len = spill_timestamp_len(dec->version);
+  time_t narrow_timestamp;
+  uint32_t value, value_hi;
+  esp_err_t ret;
+  sensormgr_spill_block_t *block = &dec->block;
+
+  if (dec->reading_idx >= block->reading_cnt) {
+    ret = spill_block_load(dec);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+  if (dec->data_len[block->type_idx] > sensor_data_max) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  value_cnt = spill_value_cnt(dec->version, dec->data_len[block->type_idx]);
+  bit_len = dec->payload_len * 8;
+
+  if (dec->reading_idx == 0) {
+    if (dec->version < 4) {
+      if (!spill_bits_get(block, bit_len, 32, &value)) {
+        return ESP_ERR_INVALID_RESPONSE;
+      }
+      block->prev_timestamp = dec->base_timestamp + (int32_t)value;
+    } else {
+      if (!spill_bits_get(block, bit_len, 32, &value_hi) ||
+          !spill_bits_get(block, bit_len, 32, &value)) {
+        return ESP_ERR_INVALID_RESPONSE;
+      }
+      block->prev_timestamp =
+          dec->base_timestamp +
+          (int64_t)(((uint64_t)value_hi << 32) | value);
+    }
+    block->prev_delta = 0;
+    for (col = 0; col < value_cnt; col++) {
+      if (!spill_bits_get(block, bit_len, 32, &block->prev_value[col])) {
+        return ESP_ERR_INVALID_RESPONSE;
+      }
+    }
+  } else {
+    if (!spill_get_timestamp(block, bit_len, &dod)) {
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    block->prev_delta += dod;
+    block->prev_timestamp += block->prev_delta;
+    for (col = 0; col < value_cnt; col++) {
+      if (!spill_get_value(block, bit_len, col, &value)) {
+        return ESP_ERR_INVALID_RESPONSE;
+      }
+    }
+  }
+
+  if (timestamp_len == sizeof(int64_t)) {
+    memcpy(sensor_data, &block->prev_timestamp, sizeof(int64_t));
+  } else {
+    narrow_timestamp = block->prev_timestamp;
+    memcpy(sensor_data, &narrow_timestamp, sizeof(time_t));
+  }
+  for (col = 0; col < value_cnt; col++) {
+    memcpy((uint8_t *)sensor_data + timestamp_len + col * sizeof(uint32_t),
+           &block->prev_value[col], sizeof(uint32_t));
+  }
+  *type_idx = block->type_idx;
+  *sensor_data_len = dec->data_len[block->type_idx];
+  dec->reading_idx++;
+  return ESP_OK;
+}
+
+size_t sensormgr_spill_header(const sensormgr_spill_decoder_t *dec,
+                              uint8_t *buf) {
+  uint8_t header[SENSORMGR_SPILL_HEADER_MAX];
+
+  return spill_header_put(buf != NULL ? buf : header, dec->version,
+                          dec->base_timestamp, dec->data_len, dec->sensor_cnt,
+                          dec->boot_id, &dec->clk);
+}
+
+esp_err_t sensormgr_spill_next_blocks(sensormgr_spill_decoder_t *dec,
+                                      size_t max_len, uint32_t *offset_out,
+                                      size_t *len_out) {
+  uint8_t header[SENSORMGR_SPILL_BLOCK_HEADER_LEN];
+  long start, end;
+  size_t block_len, len = 0;
+  esp_err_t ret = ESP_OK;
+
+  if (dec->reading_idx < dec->block.reading_cnt) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  start = ftell(dec->f);
+  fseek(dec->f, 0, SEEK_END);
+  end = ftell(dec->f);
+  fseek(dec->f, start, SEEK_SET);
+
+  // Only the block headers are read, payloads are skipped over
+  while (fread(header, sizeof(header), 1, dec->f) == 1) {
+    block_len = sizeof(header) + spill_le_get(&header[3], 2);
+    if (!spill_block_header_valid(dec, header) ||
+        start + len + block_len > (size_t)end) {
+      ret = len == 0 ? ESP_ERR_INVALID_RESPONSE : ESP_OK;
+      break;
+    }
+    if (len + block_len > max_len) {
+      ret = len == 0 ? ESP_ERR_INVALID_SIZE : ESP_OK;
+      break;
+    }
+    len += block_len;
+    fseek(dec->f, start + len, SEEK_SET);
+  }
+  if (ret == ESP_OK && len == 0) {
+    ret = start == end ? ESP_ERR_NOT_FOUND : ESP_ERR_INVALID_RESPONSE;
+  }
+  fseek(dec->f, start, SEEK_SET);
+  *offset_out = start;
+  *len_out = len;
+  return ret;
+}
+
+uint32_t sensormgr_spill_resume_offset(const sensormgr_spill_decoder_t *dec) {
+  if (dec->reading_idx < dec->block.reading_cnt) {
+    return dec->block_offset;
+  }
+  return ftell(dec->f);
+}
+
+esp_err_t sensormgr_spill_seek(sensormgr_spill_decoder_t *dec,
+                               uint32_t offset) {
+  long pos, end;
+
+  pos = ftell(dec->f);
+  fseek(dec->f, 0, SEEK_END);
+  end = ftell(dec->f);
+  if (offset < dec->header_len || offset > end) {
+    fseek(dec->f, pos, SEEK_SET);  // Still decodes from where it was
+    return ESP_ERR_INVALID_ARG;
+  }
+  fseek(dec->f, offset, SEEK_SET);
+  dec->block.reading_cnt = 0;
+  dec->reading_idx = 0;
+  return ESP_OK;
+}
@@ -0,0 +1,267 @@
+#ifndef SENSORMGR_SPILL_H
+#define SENSORMGR_SPILL_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sensormgr_clock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Spill file format, all integers little-endian
+ *
+ * Header
+ *   char[4]  magic "SMSP"
+ *   uint8_t  version
+ *   uint8_t  sensor_cnt
+ *   uint8_t  data_len[sensor_cnt]  sensor_data_len of each sensor type
+ *   int64_t  base_timestamp
+ *   uint32_t boot_id                 Boot the file was written in
+ *   uint8_t  anchor_cnt
+ *   anchors[anchor_cnt]              Clock anchors of that boot
+ *     int64_t  mono                  ms since boot
+ *     int64_t  wall                  Unix time in ms at mono
+ *
+ * Followed by blocks, each holding the readings of a single sensor type
+ *   uint8_t  type_idx
+ *   uint16_t reading_cnt
+ *   uint16_t payload_len
+ *   uint8_t  payload[payload_len]
+ *
+ * Sensor data is expected to start with an int64_t timestamp followed by 32
+ * bit fields (floats, enums, ...), every 32 bit field is its own column. The
+ * payload is a bitstream, MSB first, of every reading in the block:
+ *
+ *   timestamp  first reading: int64 offset from base_timestamp
+ *              then delta-of-delta, '0' | '10' 7b | '110' 9b | '1110' 12b |
+ *              '1111' 32b
+ *   columns    first reading: raw 32 bits
+ *              then XOR with the previous value, '0' when equal, '10' +
+ *              meaningful bits when they fit the previous leading/trailing
+ *              zero window, else '11' + 5b leading zeros + 5b length - 1 +
+ *              meaningful bits
+ *
+ * Slowly changing sensor values at a fixed sample rate end up at a few bits
+ * per reading instead of a full sensor_reading_t.
+ *
+ * sensormgr spills samples (sensormgr_sample.h): the sensor type is the
+ * channel and the data an int64_t timestamp in ms followed by the int32 fixed
+ * point value and the sensormgr_stat_t of the sample. Files without the stat
+ * column only hold raw readings. Timestamps before SENSORMGR_SAMPLE_EPOCH_MS
+ * are ms since boot, turned into Unix time with the clock anchors
+ * (sensormgr_clock.h).
+ *
+ * Version 3 files count in seconds instead of ms: the timestamp column is a
+ * time_t, the first timestamp of a block an int32 offset and the anchors a
+ * uint32_t mono followed by the int64_t wall clock. The decoder hands out
+ * their anchors in ms like any other.
+ * Version 2 files are version 3 without the boot_id and anchors.
+ * Version 1 files are laid out like version 2 but held whole driver readings
+ * instead of samples: the sensor type is the sensor in registration order and
+ * the columns are the 32 bit fields of its reading.
+ */
+
+#define SENSORMGR_SPILL_VERSION 4
+// Sensor types a spill file can describe
+#define SENSORMGR_SPILL_SENSORS_MAX 8
+// 32 bit columns after the timestamp per sensor type
+#define SENSORMGR_SPILL_VALUES_MAX 4
+// Payload bytes of a single block, one block per sensor type is buffered while
+// encoding
+#define SENSORMGR_SPILL_BLOCK_SIZE 512
+#define SENSORMGR_SPILL_HEADER_MAX                     \
+  (4 + 2 + SENSORMGR_SPILL_SENSORS_MAX + 8 + 4 + 1 + \
+   SENSORMGR_CLOCK_ANCHORS_MAX * (8 + 8))
+#define SENSORMGR_SPILL_BLOCK_HEADER_LEN 5
+
+// Sensor data of a sample as sensormgr spills it
+typedef struct __attribute__((packed)) {
+  int64_t timestamp;  // ms, a time_t in seconds before spill version 4
+  int32_t value;
+  uint32_t stat;  // Not in files from before aggregation, those are raw
+} sensormgr_spill_sample_t;
+
+typedef struct {
+  uint8_t type_idx;
+  uint16_t reading_cnt;
+  size_t bit_pos;
+  int64_t prev_timestamp;
+  int32_t prev_delta;
+  uint32_t prev_value[SENSORMGR_SPILL_VALUES_MAX];
+  uint8_t prev_lead[SENSORMGR_SPILL_VALUES_MAX];  // 0xFF when no window yet
+  uint8_t prev_trail[SENSORMGR_SPILL_VALUES_MAX];
+  uint8_t buf[SENSORMGR_SPILL_BLOCK_SIZE];
+} sensormgr_spill_block_t;
+
+typedef struct {
+  FILE *f;
+  int64_t base_timestamp;
+  uint8_t sensor_cnt;
+  uint8_t data_len[SENSORMGR_SPILL_SENSORS_MAX];
+  uint32_t boot_id;
+  sensormgr_clock_t clk;
+  size_t bytes_written;  // Header and flushed blocks
+  sensormgr_spill_block_t blocks[SENSORMGR_SPILL_SENSORS_MAX];
+} sensormgr_spill_encoder_t;
+
+typedef struct {
+  FILE *f;
+  uint8_t version;      // Of the file, sensor data is laid out by it
+  uint32_t header_len;  // As read from the file
+  int64_t base_timestamp;
+  uint8_t sensor_cnt;
+  uint8_t data_len[SENSORMGR_SPILL_SENSORS_MAX];
+  uint32_t boot_id;       // 0 for version 1 and 2 files
+  sensormgr_clock_t clk;  // Of the boot the file was written in
+  uint16_t payload_len;
+  uint16_t reading_idx;   // Next reading to decode from block
+  uint32_t block_offset;  // File offset of the block being decoded
+  sensormgr_spill_block_t block;
+} sensormgr_spill_decoder_t;
+
+/**
+ * @brief Start a spill file by writing its header
+ *
+ * @param enc            Encoder state
+ * @param f              File opened for writing, positioned at the start
+ * @param base_timestamp Timestamp the reading timestamps are relative to
+ * @param data_len       sensor_data_len of each sensor type
+ * @param sensor_cnt     Number of entries in data_len
+ * @param boot_id        Identifies the boot the readings were taken in
+ * @param clk            Clock anchors of that boot, NULL for none
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: Too many sensors or an unsupported data_len
+ *  - ESP_FAIL: Writing the header failed
+ */
+esp_err_t sensormgr_spill_encoder_init(sensormgr_spill_encoder_t *enc, FILE *f,
+                                       int64_t base_timestamp,
+                                       const uint8_t *data_len,
+                                       uint8_t sensor_cnt, uint32_t boot_id,
+                                       const sensormgr_clock_t *clk);
+
+/**
+ * @brief Append a sensor reading, flushing its block to the file when full
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: Unknown type_idx
+ *  - ESP_ERR_INVALID_SIZE: sensor_data_len doesn't match the header
+ *  - ESP_FAIL: Writing a block failed
+ */
+esp_err_t sensormgr_spill_encode(sensormgr_spill_encoder_t *enc,
+                                 uint8_t type_idx, const void *sensor_data,
+                                 size_t sensor_data_len);
+
+/**
+ * @brief Flush all partially filled blocks
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_FAIL: Writing a block failed
+ */
+esp_err_t sensormgr_spill_encoder_finish(sensormgr_spill_encoder_t *enc);
+
+/**
+ * @brief Read the header of a spill file
+ *
+ * @param dec Decoder state
+ * @param f   File opened for reading, positioned at the start
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_VERSION: Not a spill file or an unknown version, f is
+ *    rewound to the start
+ */
+esp_err_t sensormgr_spill_decoder_init(sensormgr_spill_decoder_t *dec,
+                                       FILE *f);
+
+/**
+ * @brief Decode the next reading of a spill file
+ *
+ * Sensor data is laid out as in the version of the file, a time_t timestamp
+ * before version 4.
+ *
+ * @param dec             Decoder state
+ * @param type_idx        Sensor type of the reading
+ * @param sensor_data     Output buffer for the sensor data
+ * @param sensor_data_max Size of sensor_data
+ * @param sensor_data_len Bytes written to sensor_data
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NOT_FOUND: End of file
+ *  - ESP_ERR_INVALID_RESPONSE: Corrupt or truncated block
+ *  - ESP_ERR_INVALID_SIZE: sensor_data is too small
+ */
+esp_err_t sensormgr_spill_decode(sensormgr_spill_decoder_t *dec,
+                                 uint8_t *type_idx, void *sensor_data,
+                                 size_t sensor_data_max,
+                                 size_t *sensor_data_len);
+
+/**
+ * @brief Serialize the header of the file being decoded
+ *
+ * In the version of the file, with the clock anchors of dec.
+ *
+ * @param dec Decoder state
+ * @param buf Output buffer of at least SENSORMGR_SPILL_HEADER_MAX bytes, NULL
+ *            to only get the length
+ * @return Header length
+ */
+size_t sensormgr_spill_header(const sensormgr_spill_decoder_t *dec,
+                              uint8_t *buf);
+
+/**
+ * @brief Find the run of whole blocks following the current position
+ *
+ * Used to send spill files as is. The blocks are left unread, the caller
+ * reads len_out bytes from the file itself which leaves the decoder on the
+ * block boundary after them. A header plus any run of blocks is a valid spill
+ * file.
+ *
+ * @param dec        Decoder state, must be on a block boundary
+ * @param max_len    Largest run to return
+ * @param offset_out File offset of the first block
+ * @param len_out    Bytes in the run
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_NOT_FOUND: End of file
+ *  - ESP_ERR_INVALID_STATE: A block has been partially decoded
+ *  - ESP_ERR_INVALID_SIZE: The next block is larger than max_len
+ *  - ESP_ERR_INVALID_RESPONSE: Corrupt or truncated block
+ */
+esp_err_t sensormgr_spill_next_blocks(sensormgr_spill_decoder_t *dec,
+                                      size_t max_len, uint32_t *offset_out,
+                                      size_t *len_out);
+
+/**
+ * @brief Offset to resume at without skipping any decoded reading
+ *
+ * The start of the block being decoded, or the next block once every reading
+ * of it has been decoded. Resuming a partially decoded block decodes its first
+ * readings again.
+ */
+uint32_t sensormgr_spill_resume_offset(const sensormgr_spill_decoder_t *dec);
+
+/**
+ * @brief Continue decoding from a block boundary
+ *
+ * @param dec    Decoder state
+ * @param offset File offset of a block, as returned by
+ *               sensormgr_spill_next_blocks
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_ARG: Offset is inside the header or past the end, the
+ *    position is unchanged
+ */
+esp_err_t sensormgr_spill_seek(sensormgr_spill_decoder_t *dec,
+                               uint32_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,57 @@
+#include <math.h>
+
+#include "sensormgr_aggregate.h"
+#include "unity.h"
+
+#define AGGREGATE_TIMESTAMP 1650000000
+#define AGGREGATE_WINDOW 300
+
+static sensormgr_aggregate_t agg;
+
+TEST_CASE("sensormgr_aggregate summarizes a window", "[sensormgr]") {
+  float values[] = {2, 4, 4, 4, 5, 5, 7, 9};
+  uint8_t idx;
+
+  sensormgr_aggregate_reset(&agg, AGGREGATE_TIMESTAMP);
+  TEST_ASSERT_EQUAL(0, sensormgr_aggregate_stddev(&agg));
+  for (idx = 0; idx < sizeof(values) / sizeof(values[0]); idx++) {
+    sensormgr_aggregate_add(&agg, values[idx]);
+  }
+  TEST_ASSERT_EQUAL(8, agg.count);
+  TEST_ASSERT_TRUE(5 == agg.mean);
+  TEST_ASSERT_TRUE(2 == agg.min);
+  TEST_ASSERT_TRUE(9 == agg.max);
+  TEST_ASSERT_TRUE(2 == sensormgr_aggregate_stddev(&agg));
+
+  // A single reading has no spread
+  sensormgr_aggregate_reset(&agg, AGGREGATE_TIMESTAMP);
+  sensormgr_aggregate_add(&agg, -3.5f);
+  TEST_ASSERT_TRUE(-3.5 == agg.mean);
+  TEST_ASSERT_TRUE(-3.5f == agg.min && -3.5f == agg.max);
+  TEST_ASSERT_EQUAL(0, sensormgr_aggregate_stddev(&agg));
+}
+
+TEST_CASE("sensormgr_aggregate keeps precision around a large mean",
+          "[sensormgr]") {
+  uint32_t idx;
+
+  // Summing squares would lose the spread of lux readings this bright
+  sensormgr_aggregate_reset(&agg, AGGREGATE_TIMESTAMP);
+  for (idx = 0; idx < 1000; idx++) {
+    sensormgr_aggregate_add(&agg, 100000.0f + (idx % 2 ? 0.5f : -0.5f));
+  }
+  TEST_ASSERT_TRUE(fabs(agg.mean - 100000.0) < 1e-6);
+  TEST_ASSERT_TRUE(fabs(sensormgr_aggregate_stddev(&agg) - 0.5) < 1e-6);
+}
+
+TEST_CASE("sensormgr_aggregate aligns windows to the epoch", "[sensormgr]") {
+  TEST_ASSERT_EQUAL(AGGREGATE_TIMESTAMP,
+                    sensormgr_aggregate_window(AGGREGATE_TIMESTAMP + 299,
+                                               AGGREGATE_WINDOW));
+  TEST_ASSERT_EQUAL(AGGREGATE_TIMESTAMP + 300,
+                    sensormgr_aggregate_window(AGGREGATE_TIMESTAMP + 300,
+                                               AGGREGATE_WINDOW));
+  TEST_ASSERT_EQUAL(AGGREGATE_TIMESTAMP,
+                    sensormgr_aggregate_window(AGGREGATE_TIMESTAMP, 1));
+  TEST_ASSERT_EQUAL(-300, sensormgr_aggregate_window(-1, AGGREGATE_WINDOW));
+}
@@ -0,0 +1,147 @@
+#include <cJSON.h>
+#include <commands.pb-c.h>
+#include <esp_heap_caps.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensormgr.h"
+#include "sensormgr_batch.h"
+#include "unity.h"
+
+// Same shape as a sensormgr_task_queuesend message, one sht4x reading adds a
+// temperature and a humidity value
+#define BENCH_READING_CNT 10
+#define BENCH_TIMESTAMP 1650000000
+// Polls start on a 10 ms tick
+#define BENCH_TIMESTAMP_MS (BENCH_TIMESTAMP * 1000LL + 250)
+
+static size_t json_alloc_cnt;
+static sensormgr_batch_t batch;
+static uint8_t batch_buffer[512];
+static char location_name[] = "office";
+
+static void *counting_malloc(size_t sz) {
+  json_alloc_cnt++;
+  return malloc(sz);
+}
+
+static void bench_marshall(time_t timestamp, float temp, float humidity,
+                           cJSON *data_array) {
+  char iso8601[32];
+  cJSON *sensor_json;
+
+  SENSORMGR_ISO8601(timestamp, iso8601);
+  sensor_json = cJSON_CreateObject();
+  cJSON_AddStringToObject(sensor_json, "timestamp", iso8601);
+  cJSON_AddNumberToObject(sensor_json, "value", temp);
+  cJSON_AddStringToObject(sensor_json, "unit", "C");
+  cJSON_AddStringToObject(sensor_json, "sensor", "sht4x");
+  cJSON_AddItemToArray(data_array, sensor_json);
+
+  sensor_json = cJSON_CreateObject();
+  cJSON_AddStringToObject(sensor_json, "timestamp", iso8601);
+  cJSON_AddNumberToObject(sensor_json, "value", humidity);
+  cJSON_AddStringToObject(sensor_json, "unit", "%rH");
+  cJSON_AddStringToObject(sensor_json, "sensor", "sht4x");
+  cJSON_AddItemToArray(data_array, sensor_json);
+}
+
+static size_t bench_json(void) {
+  uint8_t idx;
+  size_t len;
+  cJSON *root, *metadata, *sensor_array;
+  char *json_text;
+
+  root = cJSON_CreateObject();
+  cJSON_AddItemToObject(root, "metadata", metadata = cJSON_CreateObject());
+  cJSON_AddStringToObject(metadata, "location", location_name);
+  cJSON_AddItemToObject(root, "data", sensor_array = cJSON_CreateArray());
+  for (idx = 0; idx < BENCH_READING_CNT; idx++) {
+    bench_marshall(BENCH_TIMESTAMP + idx * 5, 21.5f + idx * 0.01f,
+                   45.25f - idx * 0.1f, sensor_array);
+  }
+  json_text = cJSON_PrintUnformatted(root);
+  TEST_ASSERT_NOT_NULL(json_text);
+  len = strlen(json_text);
+  cJSON_Delete(root);
+  free(json_text);
+  return len;
+}
+
+static size_t bench_protobuf(void) {
+  uint8_t idx;
+  size_t len;
+
+  sensormgr_batch_reset(&batch, location_name);
+  for (idx = 0; idx < BENCH_READING_CNT; idx++) {
+    TEST_ASSERT_EQUAL(ESP_OK,
+                      sensormgr_batch_add(&batch, "sht4x", "C",
+                                          BENCH_TIMESTAMP_MS + idx * 5000,
+                                          21.5f + idx * 0.01f));
+    TEST_ASSERT_EQUAL(ESP_OK,
+                      sensormgr_batch_add(&batch, "sht4x", "%rH",
+                                          BENCH_TIMESTAMP_MS + idx * 5000,
+                                          45.25f - idx * 0.1f));
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_batch_pack(&batch, batch_buffer,
+                                                 sizeof(batch_buffer), &len));
+  return len;
+}
+
+TEST_CASE("sensormgr_batch packs and unpacks a batch", "[sensormgr]") {
+  size_t len;
+  Sensormgr__SensorBatch *unpacked;
+
+  len = bench_protobuf();
+  unpacked = sensormgr__sensor_batch__unpack(NULL, len, batch_buffer);
+  TEST_ASSERT_NOT_NULL(unpacked);
+  TEST_ASSERT_EQUAL_STRING(location_name, unpacked->location_name);
+  TEST_ASSERT_EQUAL_INT64(BENCH_TIMESTAMP, unpacked->base_timestamp);
+  TEST_ASSERT_EQUAL(2, unpacked->n_channels);
+  TEST_ASSERT_EQUAL_STRING("C", unpacked->channels[0]->unit);
+  TEST_ASSERT_EQUAL_STRING("%rH", unpacked->channels[1]->unit);
+  TEST_ASSERT_EQUAL(BENCH_READING_CNT * 2, unpacked->n_readings);
+  TEST_ASSERT_EQUAL(1, unpacked->readings[19]->channel);
+  TEST_ASSERT_EQUAL_INT32(250, unpacked->readings[0]->timestamp_offset);
+  TEST_ASSERT_EQUAL_INT32(45250, unpacked->readings[19]->timestamp_offset);
+  TEST_ASSERT_EQUAL_FLOAT(45.25f - 9 * 0.1f, unpacked->readings[19]->value);
+  sensormgr__sensor_batch__free_unpacked(unpacked, NULL);
+}
+
+TEST_CASE("sensormgr_batch rejects readings past capacity", "[sensormgr]") {
+  uint8_t idx;
+  size_t len;
+
+  sensormgr_batch_reset(&batch, location_name);
+  for (idx = 0; idx < SENSORMGR_BATCH_READINGS_MAX; idx++) {
+    TEST_ASSERT_EQUAL(ESP_OK, sensormgr_batch_add(&batch, "ltr390", "lux",
+                                                  BENCH_TIMESTAMP_MS, idx));
+  }
+  TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM,
+                    sensormgr_batch_add(&batch, "ltr390", "lux",
+                                        BENCH_TIMESTAMP_MS, 0));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE,
+                    sensormgr_batch_pack(&batch, batch_buffer, 8, &len));
+}
+
+TEST_CASE("sensormgr bench - JSON vs protobuf per 10 reading batch",
+          "[sensormgr][bench]") {
+  size_t json_len, pb_len, heap_before, heap_after;
+  cJSON_Hooks hooks = {.malloc_fn = counting_malloc, .free_fn = free};
+
+  cJSON_InitHooks(&hooks);
+  json_alloc_cnt = 0;
+  json_len = bench_json();
+  cJSON_InitHooks(NULL);
+
+  heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  pb_len = bench_protobuf();
+  heap_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+  printf("JSON:     %u bytes, %u heap allocations\n", json_len,
+         json_alloc_cnt);
+  printf("protobuf: %u bytes, %d heap bytes used\n", pb_len,
+         (int)(heap_before - heap_after));
+  TEST_ASSERT_EQUAL(heap_before, heap_after);
+  TEST_ASSERT_LESS_THAN(json_len / 4, pb_len);
+}
@@ -0,0 +1,266 @@
+#include <mqttmgr.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sensormgr_checkpoint.h"
+#include "sensormgr_spill.h"
+#include "unity.h"
+
+#define DRAIN_READING_CNT 1000
+#define DRAIN_TIMESTAMP 1650000000000LL
+#define DRAIN_PERIOD 5000
+#define DRAIN_SENSOR_CNT 2
+// Same limits as sensormgr and mqttmgr
+#define DRAIN_MSG_READING_CNT SENSORMGR_MSG_READING_CNT
+#define DRAIN_INFLIGHT_MAX MQTTMGR_INFLIGHT_MAX
+
+typedef struct {
+  int64_t timestamp;
+  float temp;
+  float humidity;
+} drain_reading_t;
+
+typedef struct {
+  uint32_t seq;
+  uint16_t reading_cnt;
+  uint16_t reading_ids[DRAIN_MSG_READING_CNT];
+} drain_msg_t;
+
+// What the broker ends up with, and what it took to get there
+typedef struct {
+  uint16_t delivered[DRAIN_SENSOR_CNT * DRAIN_READING_CNT];
+  int crash_cnt;
+  int republished;
+  int checkpoints;
+} drain_result_t;
+
+static const uint8_t drain_data_len[] = {sizeof(drain_reading_t),
+                                         sizeof(drain_reading_t)};
+static uint8_t spill_buffer[16 * 1024];
+static size_t spill_len;
+static int max_block_readings;
+static sensormgr_spill_encoder_t enc;
+static sensormgr_spill_decoder_t dec;
+static sensormgr_checkpoint_t cp;
+static drain_result_t result;
+static uint32_t drain_seed;
+
+static uint32_t drain_rand(uint32_t range) {
+  drain_seed = drain_seed * 1103515245 + 12345;
+  return (drain_seed >> 16) % range;
+}
+
+static void drain_encode(void) {
+  int idx;
+  uint8_t type_idx;
+  drain_reading_t reading;
+  size_t reading_len;
+  FILE *f = fmemopen(spill_buffer, sizeof(spill_buffer), "wb");
+
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    sensormgr_spill_encoder_init(&enc, f, DRAIN_TIMESTAMP,
+                                                 drain_data_len,
+                                                 DRAIN_SENSOR_CNT, 1, NULL));
+  drain_seed = 7;
+  for (idx = 0; idx < DRAIN_READING_CNT; idx++) {
+    for (type_idx = 0; type_idx < DRAIN_SENSOR_CNT; type_idx++) {
+      reading = (drain_reading_t){
+          .timestamp = DRAIN_TIMESTAMP + DRAIN_PERIOD * idx,
+          .temp = 20 + drain_rand(100) / 100.0f,
+          .humidity = 40 + drain_rand(100) / 100.0f,
+      };
+      TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_encode(&enc, type_idx, &reading,
+                                                       sizeof(reading)));
+    }
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_encoder_finish(&enc));
+  fclose(f);
+  spill_len = enc.bytes_written;
+
+  // A resumed block decodes its first readings again, at most this many
+  f = fmemopen(spill_buffer, spill_len, "rb");
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  max_block_readings = 0;
+  while (ESP_OK == sensormgr_spill_decode(&dec, &type_idx, &reading,
+                                          sizeof(reading), &reading_len)) {
+    if (dec.block.reading_cnt > max_block_readings) {
+      max_block_readings = dec.block.reading_cnt;
+    }
+  }
+  fclose(f);
+}
+
+static void drain_deliver(const drain_msg_t *msg) {
+  uint16_t idx;
+
+  for (idx = 0; idx < msg->reading_cnt; idx++) {
+    result.delivered[msg->reading_ids[idx]]++;
+  }
+}
+
+/**
+ * @brief Drain the spill file like sensormgr_task_queuesend, resetting at
+ *        random points
+ *
+ * Only the durable offset survives a reset. The broker keeps every reading it
+ * received, a PUBACK can be lost which has mqttmgr publish the message again,
+ * and PUBACKs of the messages in flight arrive in any order.
+ */
+static void drain_run(uint32_t seed, uint32_t interval, uint32_t crash_odds) {
+  int idx;
+  bool eof;
+  uint8_t type_idx, inflight_cnt;
+  uint32_t durable = 0, resume_offset = 0;
+  drain_reading_t reading;
+  size_t reading_len;
+  drain_msg_t inflight[DRAIN_INFLIGHT_MAX], *msg;
+  FILE *f;
+
+  memset(&result, 0, sizeof(result));
+  memset(&cp, 0, sizeof(cp));
+  drain_seed = seed;
+boot:
+  f = fmemopen(spill_buffer, spill_len, "rb");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  if (durable != 0) {
+    TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_seek(&dec, durable));
+  }
+  sensormgr_checkpoint_reset(&cp, durable);
+  inflight_cnt = 0;
+  eof = false;
+  while (!eof || !sensormgr_checkpoint_idle(&cp)) {
+    if (drain_rand(crash_odds) == 0) {
+      result.crash_cnt++;
+      fclose(f);
+      goto boot;
+    }
+    if (!eof && inflight_cnt < DRAIN_INFLIGHT_MAX &&
+        !sensormgr_checkpoint_full(&cp) &&
+        (inflight_cnt == 0 || drain_rand(2) == 0)) {
+      msg = &inflight[inflight_cnt];
+      msg->reading_cnt = 0;
+      while (msg->reading_cnt < DRAIN_MSG_READING_CNT) {
+        if (ESP_OK != sensormgr_spill_decode(&dec, &type_idx, &reading,
+                                             sizeof(reading), &reading_len)) {
+          eof = true;
+          break;
+        }
+        resume_offset = sensormgr_spill_resume_offset(&dec);
+        msg->reading_ids[msg->reading_cnt++] =
+            type_idx * DRAIN_READING_CNT +
+            (reading.timestamp - DRAIN_TIMESTAMP) / DRAIN_PERIOD;
+      }
+      if (msg->reading_cnt != 0) {
+        TEST_ASSERT_EQUAL(ESP_OK, sensormgr_checkpoint_sent(&cp, resume_offset,
+                                                            &msg->seq));
+        drain_deliver(msg);
+        inflight_cnt++;
+      }
+    } else if (inflight_cnt != 0) {
+      idx = drain_rand(inflight_cnt);
+      if (drain_rand(10) == 0) {
+        // PUBACK lost, mqttmgr publishes it again after the outbox expires
+        drain_deliver(&inflight[idx]);
+        result.republished += inflight[idx].reading_cnt;
+        continue;
+      }
+      sensormgr_checkpoint_acked(&cp, inflight[idx].seq);
+      inflight[idx] = inflight[--inflight_cnt];
+    }
+    if (sensormgr_checkpoint_due(&cp, interval)) {
+      durable = cp.acked;
+      cp.durable = durable;
+      result.checkpoints++;
+    }
+  }
+  TEST_ASSERT_EQUAL(spill_len, cp.acked);
+  fclose(f);
+}
+
+static void drain_assert_bounded(uint32_t interval) {
+  int idx, duplicates = 0, crash_max;
+
+  for (idx = 0; idx < DRAIN_SENSOR_CNT * DRAIN_READING_CNT; idx++) {
+    TEST_ASSERT_GREATER_THAN(0, result.delivered[idx]);  // Nothing lost
+    duplicates += result.delivered[idx] - 1;
+  }
+  // A reset sends again whatever was in flight, the partially sent block and
+  // anything acknowledged since the last checkpoint
+  crash_max = (DRAIN_INFLIGHT_MAX + 1) * DRAIN_MSG_READING_CNT +
+              max_block_readings * (interval == 0 ? 1 : 3);
+  printf("resets: %d, checkpoints: %d, duplicates: %d (%d republished)\n",
+         result.crash_cnt, result.checkpoints, duplicates, result.republished);
+  TEST_ASSERT_LESS_OR_EQUAL(result.crash_cnt * crash_max + result.republished,
+                            duplicates);
+}
+
+TEST_CASE("sensormgr_checkpoint only advances over acknowledged messages",
+          "[sensormgr]") {
+  uint32_t seq[3];
+
+  memset(&cp, 0, sizeof(cp));
+  sensormgr_checkpoint_reset(&cp, 20);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_checkpoint_sent(&cp, 100, &seq[0]));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_checkpoint_sent(&cp, 200, &seq[1]));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_checkpoint_sent(&cp, 300, &seq[2]));
+  sensormgr_checkpoint_acked(&cp, seq[1]);
+  TEST_ASSERT_EQUAL(20, cp.acked);
+  TEST_ASSERT_FALSE(sensormgr_checkpoint_due(&cp, 0));
+  sensormgr_checkpoint_acked(&cp, seq[0]);
+  TEST_ASSERT_EQUAL(200, cp.acked);
+  TEST_ASSERT_TRUE(sensormgr_checkpoint_due(&cp, 100));
+  TEST_ASSERT_FALSE(sensormgr_checkpoint_due(&cp, 1000));
+  sensormgr_checkpoint_acked(&cp, seq[0]);  // Duplicate PUBACK
+  TEST_ASSERT_EQUAL(200, cp.acked);
+  sensormgr_checkpoint_acked(&cp, seq[2]);
+  TEST_ASSERT_EQUAL(300, cp.acked);
+  TEST_ASSERT_TRUE(sensormgr_checkpoint_idle(&cp));
+  TEST_ASSERT_TRUE(sensormgr_checkpoint_due(&cp, 1000));
+
+  // Late PUBACKs of the previous file don't move the next one
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_checkpoint_sent(&cp, 400, &seq[0]));
+  sensormgr_checkpoint_reset(&cp, 0);
+  sensormgr_checkpoint_acked(&cp, seq[0]);
+  TEST_ASSERT_EQUAL(0, cp.acked);
+}
+
+TEST_CASE("sensormgr_checkpoint limits messages waiting on a PUBACK",
+          "[sensormgr]") {
+  int idx;
+  uint32_t seq;
+
+  memset(&cp, 0, sizeof(cp));
+  sensormgr_checkpoint_reset(&cp, 0);
+  for (idx = 0; idx < SENSORMGR_CHECKPOINT_PENDING_MAX; idx++) {
+    TEST_ASSERT_EQUAL(ESP_OK, sensormgr_checkpoint_sent(&cp, idx, &seq));
+  }
+  TEST_ASSERT_TRUE(sensormgr_checkpoint_full(&cp));
+  TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, sensormgr_checkpoint_sent(&cp, idx, &seq));
+  sensormgr_checkpoint_acked(&cp, seq - SENSORMGR_CHECKPOINT_PENDING_MAX + 1);
+  TEST_ASSERT_FALSE(sensormgr_checkpoint_full(&cp));
+}
+
+TEST_CASE("sensormgr_checkpoint fault injection - checkpoint every PUBACK",
+          "[sensormgr]") {
+  uint32_t seed;
+
+  drain_encode();
+  for (seed = 1; seed <= 20; seed++) {
+    drain_run(seed, 0, 50);
+    drain_assert_bounded(0);
+  }
+}
+
+TEST_CASE("sensormgr_checkpoint fault injection - checkpoint every block",
+          "[sensormgr]") {
+  uint32_t seed;
+
+  drain_encode();
+  for (seed = 1; seed <= 20; seed++) {
+    drain_run(seed, SENSORMGR_SPILL_BLOCK_SIZE, 50);
+    drain_assert_bounded(SENSORMGR_SPILL_BLOCK_SIZE);
+  }
+}
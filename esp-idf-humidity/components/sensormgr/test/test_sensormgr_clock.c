@@ -0,0 +1,58 @@
+#include "sensormgr_clock.h"
+#include "unity.h"
+
+#define CLOCK_BOOT_TIME 1650000000000LL
+
+static sensormgr_clock_t clk;
+
+TEST_CASE("sensormgr_clock is unknown till anchored", "[sensormgr]") {
+  sensormgr_clock_init(&clk);
+  TEST_ASSERT_EQUAL_INT64(0, sensormgr_clock_boot_time(&clk, 100000));
+
+  TEST_ASSERT_TRUE(
+      sensormgr_clock_anchor(&clk, 30000, CLOCK_BOOT_TIME + 30000));
+  // Readings from before SNTP synced take the first anchor
+  TEST_ASSERT_EQUAL_INT64(CLOCK_BOOT_TIME,
+                          sensormgr_clock_boot_time(&clk, 5000));
+  TEST_ASSERT_EQUAL_INT64(CLOCK_BOOT_TIME,
+                          sensormgr_clock_boot_time(&clk, 3600000));
+
+  // Nothing new, or going backwards
+  TEST_ASSERT_FALSE(
+      sensormgr_clock_anchor(&clk, 3630000, CLOCK_BOOT_TIME + 3630000));
+  TEST_ASSERT_FALSE(sensormgr_clock_anchor(&clk, 10000, CLOCK_BOOT_TIME));
+  TEST_ASSERT_EQUAL(1, clk.anchor_cnt);
+}
+
+TEST_CASE("sensormgr_clock spreads SNTP corrections between anchors",
+          "[sensormgr]") {
+  sensormgr_clock_init(&clk);
+  sensormgr_clock_anchor(&clk, 0, CLOCK_BOOT_TIME);
+  // The monotonic clock ran 4s slow over the hour
+  TEST_ASSERT_TRUE(
+      sensormgr_clock_anchor(&clk, 3600000, CLOCK_BOOT_TIME + 3604000));
+
+  TEST_ASSERT_EQUAL_INT64(CLOCK_BOOT_TIME + 2000,
+                          sensormgr_clock_boot_time(&clk, 1800000));
+  // Spread down to the ms
+  TEST_ASSERT_EQUAL_INT64(CLOCK_BOOT_TIME + 1,
+                          sensormgr_clock_boot_time(&clk, 900));
+  TEST_ASSERT_EQUAL_INT64(CLOCK_BOOT_TIME + 4000,
+                          sensormgr_clock_boot_time(&clk, 3600000));
+  TEST_ASSERT_EQUAL_INT64(CLOCK_BOOT_TIME + 4000,
+                          sensormgr_clock_boot_time(&clk, 7200000));
+}
+
+TEST_CASE("sensormgr_clock keeps the latest anchors", "[sensormgr]") {
+  uint32_t idx;
+
+  sensormgr_clock_init(&clk);
+  for (idx = 0; idx < SENSORMGR_CLOCK_ANCHORS_MAX + 2; idx++) {
+    TEST_ASSERT_TRUE(sensormgr_clock_anchor(
+        &clk, idx * 3600000LL, CLOCK_BOOT_TIME + idx * 3601000LL));
+  }
+  TEST_ASSERT_EQUAL(SENSORMGR_CLOCK_ANCHORS_MAX, clk.anchor_cnt);
+  TEST_ASSERT_EQUAL_INT64(2 * 3600000, clk.anchors[0].mono);
+  TEST_ASSERT_EQUAL_INT64(CLOCK_BOOT_TIME + 2000,
+                          sensormgr_clock_boot_time(&clk, 0));
+}
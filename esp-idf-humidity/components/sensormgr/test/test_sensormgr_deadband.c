@@ -0,0 +1,63 @@
+#include <math.h>
+
+#include "sensormgr_deadband.h"
+#include "unity.h"
+
+#define DEADBAND_TIMESTAMP 1650000000000LL
+
+static sensormgr_deadband_t db;
+static sensormgr_deadband_cfg_t cfg;
+
+static bool deadband_pass(int64_t timestamp, float value) {
+  sensormgr_sample_t sample;
+
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    sensormgr_sample_set(&sample, 0, 2, timestamp, value));
+  return sensormgr_deadband_pass(&db, &cfg, &sample, timestamp);
+}
+
+TEST_CASE("sensormgr_deadband only passes changes past the deadband",
+          "[sensormgr]") {
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_deadband_config(&cfg, 2, 0.1f, 0));
+  TEST_ASSERT_EQUAL(10, cfg.deadband);
+  sensormgr_deadband_reset(&db);
+
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP, 21.50f));
+  TEST_ASSERT_FALSE(deadband_pass(DEADBAND_TIMESTAMP + 2000, 21.55f));
+  TEST_ASSERT_FALSE(deadband_pass(DEADBAND_TIMESTAMP + 4000, 21.40f));
+  // Compared to the last value sent, slow drifts still get through
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP + 6000, 21.61f));
+  TEST_ASSERT_FALSE(deadband_pass(DEADBAND_TIMESTAMP + 8000, 21.52f));
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP + 10000, 21.50f));
+
+  // Clock stepped back
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP, 21.50f));
+}
+
+TEST_CASE("sensormgr_deadband sends a heartbeat when silent", "[sensormgr]") {
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_deadband_config(&cfg, 2, 0, 60));
+  sensormgr_deadband_reset(&db);
+
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP, 45.25f));
+  TEST_ASSERT_FALSE(deadband_pass(DEADBAND_TIMESTAMP + 30000, 45.25f));
+  TEST_ASSERT_FALSE(deadband_pass(DEADBAND_TIMESTAMP + 59999, 45.25f));
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP + 60000, 45.25f));
+  // A deadband of 0 still sends every change
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP + 61000, 45.26f));
+}
+
+TEST_CASE("sensormgr_deadband is off without deadband or heartbeat",
+          "[sensormgr]") {
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_deadband_config(&cfg, 2, 0, 0));
+  sensormgr_deadband_reset(&db);
+
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP, 1.0f));
+  TEST_ASSERT_TRUE(deadband_pass(DEADBAND_TIMESTAMP, 1.0f));
+
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_deadband_config(&cfg, 2, -0.1f, 0));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_deadband_config(&cfg, 2, NAN, 0));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_deadband_config(&cfg, 6, 1e6f, 0));
+}
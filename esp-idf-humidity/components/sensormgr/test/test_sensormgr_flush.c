@@ -0,0 +1,90 @@
+#include "sensormgr_flush.h"
+#include "unity.h"
+
+// A sample queue of the default size holds about this many samples
+#define FLUSH_SLOT_CNT 1000
+
+static sensormgr_flush_cfg_t cfg;
+static sensormgr_flush_t flush;
+
+TEST_CASE("sensormgr_flush defaults match the fixed thresholds",
+          "[sensormgr]") {
+  sensormgr_flush_defaults(&cfg);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_flush_validate(&cfg));
+  sensormgr_flush_init(&flush, &cfg);
+
+  TEST_ASSERT_EQUAL(500, sensormgr_flush_lowwater(&flush, FLUSH_SLOT_CNT));
+  TEST_ASSERT_EQUAL(880, sensormgr_flush_highwater(&flush, FLUSH_SLOT_CNT));
+  TEST_ASSERT_FALSE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 0, 3600));
+  TEST_ASSERT_FALSE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 15, 3600));
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 16, 0));
+  // Without an item limit only half the queue flushes
+  cfg.items = 0;
+  sensormgr_flush_init(&flush, &cfg);
+  TEST_ASSERT_FALSE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 499, 0));
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 500, 0));
+
+  cfg.fill_pct = 0;
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, sensormgr_flush_validate(&cfg));
+  cfg.fill_pct = 90;
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, sensormgr_flush_validate(&cfg));
+  cfg.spill_pct = 101;
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, sensormgr_flush_validate(&cfg));
+}
+
+TEST_CASE("sensormgr_flush flushes on whichever limit comes first",
+          "[sensormgr]") {
+  sensormgr_flush_defaults(&cfg);
+  cfg.items = 100;
+  cfg.bytes = 9 * 50;
+  cfg.age_sec = 60;
+  sensormgr_flush_init(&flush, &cfg);
+
+  TEST_ASSERT_FALSE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 49, 59));
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 50, 0));
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 1, 60));
+  cfg.bytes = 0;
+  sensormgr_flush_init(&flush, &cfg);
+  TEST_ASSERT_FALSE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 99, 59));
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 100, 59));
+}
+
+TEST_CASE("sensormgr_flush batches bigger on a failing link",
+          "[sensormgr]") {
+  uint8_t idx;
+
+  sensormgr_flush_defaults(&cfg);
+  cfg.age_sec = 10;
+  cfg.adaptive = true;
+  sensormgr_flush_init(&flush, &cfg);
+
+  for (idx = 0; idx < 10; idx++) {
+    sensormgr_flush_link(&flush, false);
+  }
+  TEST_ASSERT_EQUAL(SENSORMGR_FLUSH_STRETCH_MAX, flush.stretch);
+  TEST_ASSERT_FALSE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 127, 79));
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 128, 0));
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 1, 80));
+  // The fill share still flushes however long the link is down
+  cfg.items = 0;
+  flush.cfg = cfg;
+  TEST_ASSERT_TRUE(sensormgr_flush_due(&flush, FLUSH_SLOT_CNT, 500, 0));
+
+  // Recovers slower than it backs off
+  for (idx = 0; idx < SENSORMGR_FLUSH_GOOD_STREAK - 1; idx++) {
+    sensormgr_flush_link(&flush, true);
+  }
+  TEST_ASSERT_EQUAL(SENSORMGR_FLUSH_STRETCH_MAX, flush.stretch);
+  sensormgr_flush_link(&flush, true);
+  TEST_ASSERT_EQUAL(SENSORMGR_FLUSH_STRETCH_MAX / 2, flush.stretch);
+  for (idx = 0; idx < 4 * SENSORMGR_FLUSH_GOOD_STREAK; idx++) {
+    sensormgr_flush_link(&flush, true);
+  }
+  TEST_ASSERT_EQUAL(1, flush.stretch);
+
+  // Fixed policies never stretch
+  cfg.adaptive = false;
+  sensormgr_flush_init(&flush, &cfg);
+  sensormgr_flush_link(&flush, false);
+  TEST_ASSERT_EQUAL(1, flush.stretch);
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sensormgr_index.h"
+#include "unity.h"
+
+#define INDEX_FILE_CNT 5
+#define INDEX_TIMESTAMP 1650000000
+
+static uint8_t index_buffer[8 * 1024];
+static uint8_t compact_buffer[8 * 1024];
+static sensormgr_index_t idx;
+
+static sensormgr_index_entry_t index_file(int file) {
+  sensormgr_index_entry_t entry = {
+      .first_timestamp = INDEX_TIMESTAMP + file * 3600,
+      .last_timestamp = INDEX_TIMESTAMP + file * 3600 + 3599,
+      .reading_cnt = 100 + file,
+      .len = 1000 + file,
+  };
+
+  snprintf(entry.name, sizeof(entry.name), "0%d120000.BIN", file);
+  return entry;
+}
+
+static FILE *index_create(void) {
+  int file;
+  sensormgr_index_entry_t entry;
+  FILE *f;
+
+  memset(index_buffer, 0, sizeof(index_buffer));
+  f = fmemopen(index_buffer, sizeof(index_buffer), "w+b");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_load(&idx, NULL));
+  for (file = 0; file < INDEX_FILE_CNT; file++) {
+    entry = index_file(file);
+    TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_add(&idx, f, &entry));
+  }
+  return f;
+}
+
+// Reload what has been written so far, like after a reboot
+static FILE *index_reload(FILE *f, long len, esp_err_t expected) {
+  if (len < 0) {
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+  }
+  fclose(f);
+  memcpy(compact_buffer, index_buffer, len);
+  f = fmemopen(index_buffer, sizeof(index_buffer), "w+b");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(1, fwrite(compact_buffer, len, 1, f));
+  TEST_ASSERT_EQUAL(expected, sensormgr_index_load(&idx, f));
+  return f;
+}
+
+static void index_assert_head(int head, uint32_t drained) {
+  int file;
+  sensormgr_index_entry_t entry = index_file(head);
+  uint32_t reading_cnt = 0, len = 0;
+
+  for (file = head; file < INDEX_FILE_CNT; file++) {
+    reading_cnt += index_file(file).reading_cnt;
+    len += index_file(file).len;
+  }
+  TEST_ASSERT_EQUAL_STRING(entry.name, idx.head.name);
+  TEST_ASSERT_EQUAL_INT64(entry.first_timestamp, idx.head.first_timestamp);
+  TEST_ASSERT_EQUAL_INT64(entry.last_timestamp, idx.head.last_timestamp);
+  TEST_ASSERT_EQUAL(entry.reading_cnt, idx.head.reading_cnt);
+  TEST_ASSERT_EQUAL(entry.len, idx.head.len);
+  TEST_ASSERT_EQUAL(drained, idx.head.drained);
+  TEST_ASSERT_EQUAL(INDEX_FILE_CNT - head, idx.file_cnt);
+  TEST_ASSERT_EQUAL(reading_cnt, idx.reading_cnt);
+  TEST_ASSERT_EQUAL(len, idx.len);
+}
+
+TEST_CASE("sensormgr_index drains files in the order they were written",
+          "[sensormgr]") {
+  int file;
+  FILE *f = index_create();
+
+  for (file = 0; file < INDEX_FILE_CNT; file++) {
+    TEST_ASSERT_EQUAL(INDEX_FILE_CNT - file, idx.file_cnt);
+    index_assert_head(file, 0);
+    TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_remove(&idx, f));
+  }
+  TEST_ASSERT_EQUAL(0, idx.file_cnt);
+  TEST_ASSERT_EQUAL(0, idx.reading_cnt);
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, sensormgr_index_remove(&idx, f));
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, sensormgr_index_drained(&idx, f, 10));
+  fclose(f);
+}
+
+TEST_CASE("sensormgr_index resumes a partially drained file after a reboot",
+          "[sensormgr]") {
+  FILE *f = index_create();
+
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_drained(&idx, f, 200));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_remove(&idx, f));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_drained(&idx, f, 300));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_drained(&idx, f, 600));
+  f = index_reload(f, -1, ESP_OK);
+  TEST_ASSERT_EQUAL(INDEX_FILE_CNT - 1, idx.file_cnt);
+  index_assert_head(1, 600);
+
+  // Draining carries on with the next file
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_remove(&idx, f));
+  index_assert_head(2, 0);
+  fclose(f);
+}
+
+TEST_CASE("sensormgr_index ignores a record torn by a power loss",
+          "[sensormgr]") {
+  long len;
+  FILE *f = index_create();
+
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_drained(&idx, f, 200));
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_remove(&idx, f));
+  f = index_reload(f, len + SENSORMGR_INDEX_RECORD_LEN / 2,
+                   ESP_ERR_INVALID_CRC);
+  index_assert_head(0, 200);
+
+  // A flipped bit only loses its own record
+  index_buffer[len - 3] ^= 0x10;
+  f = index_reload(f, len, ESP_ERR_INVALID_CRC);
+  index_assert_head(0, 0);
+  fclose(f);
+}
+
+TEST_CASE("sensormgr_index compacts down to the live files", "[sensormgr]") {
+  int idx_drain;
+  FILE *f = index_create(), *f_out;
+
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_remove(&idx, f));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_remove(&idx, f));
+  for (idx_drain = 1; !sensormgr_index_needs_compact(&idx); idx_drain++) {
+    TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_drained(&idx, f, idx_drain));
+  }
+
+  memset(compact_buffer, 0, sizeof(compact_buffer));
+  f_out = fmemopen(compact_buffer, sizeof(compact_buffer), "w+b");
+  TEST_ASSERT_NOT_NULL(f_out);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_index_compact(&idx, f, f_out));
+  fclose(f);
+  TEST_ASSERT_EQUAL(INDEX_FILE_CNT - 2 + 1, idx.record_cnt);
+  index_assert_head(2, idx_drain - 1);
+
+  fseek(f_out, 0, SEEK_END);
+  memcpy(index_buffer, compact_buffer, ftell(f_out));
+  f = index_reload(f_out, -1, ESP_OK);
+  index_assert_head(2, idx_drain - 1);
+  fclose(f);
+}
@@ -0,0 +1,202 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sensormgr_queue.h"
+#include "unity.h"
+
+// Few slots so the stress runs wrap around and fill up often, not a power of
+// two like the sample queue itself
+#define STRESS_SLOT_CNT 60
+#define STRESS_DATA_LEN 32
+#define STRESS_SENSOR_CNT 4
+#define STRESS_MSG_READING_CNT 10
+// Sensor polling 100x faster than the default rate
+#define STRESS_PERIOD_MS (CONFIG_SENSORMGR_SAMPLE_RATE / 100)
+#define STRESS_PACED_POLL_CNT 250
+#define STRESS_BURST_POLL_CNT 5000
+
+typedef struct {
+  uint32_t seq;
+  uint8_t type_idx;
+  uint8_t data[STRESS_DATA_LEN];
+} stress_record_t;
+
+typedef struct {
+  uint32_t poll_cnt;
+  uint32_t period_ms;
+  uint32_t full_cnt;  // Producer found the queue full
+  SemaphoreHandle_t done;
+} stress_producer_t;
+
+static stress_record_t storage[STRESS_SLOT_CNT];
+static sensormgr_queue_t queue;
+static uint32_t stress_seed;
+
+static uint32_t stress_rand(uint32_t range) {
+  stress_seed = stress_seed * 1103515245 + 12345;
+  return (stress_seed >> 16) % range;
+}
+
+// Stands in for sensormgr_task_sensorread
+static void stress_produce(void *pvParam) {
+  uint8_t type_idx;
+  uint32_t poll, seq = 0;
+  stress_producer_t *producer = (stress_producer_t *)pvParam;
+  stress_record_t *record;
+
+  for (poll = 0; poll < producer->poll_cnt; poll++) {
+    for (type_idx = 0; type_idx < STRESS_SENSOR_CNT; type_idx++) {
+      while (NULL == (record = (stress_record_t *)sensormgr_queue_acquire(
+                          &queue))) {
+        producer->full_cnt++;
+        vTaskDelay(1);
+      }
+      record->seq = seq++;
+      record->type_idx = type_idx;
+      memset(record->data, (uint8_t)record->seq, sizeof(record->data));
+      sensormgr_queue_commit(&queue);
+    }
+    if (producer->period_ms != 0) {
+      vTaskDelay(producer->period_ms / portTICK_PERIOD_MS);
+    }
+  }
+  xSemaphoreGive(producer->done);
+  vTaskDelete(NULL);
+}
+
+static void stress_assert_record(const stress_record_t *record, uint32_t seq) {
+  uint8_t idx;
+
+  TEST_ASSERT_EQUAL(seq, record->seq);
+  TEST_ASSERT_EQUAL(seq % STRESS_SENSOR_CNT, record->type_idx);
+  for (idx = 0; idx < STRESS_DATA_LEN; idx++) {
+    TEST_ASSERT_EQUAL((uint8_t)seq, record->data[idx]);
+  }
+}
+
+/**
+ * @brief Drain the queue like the dispatch task while a producer fills it
+ *
+ * Readings are peeked at a message worth at a time and only released when the
+ * message "queues", a failed one leaves them for the next attempt. Every
+ * reading has to come out once and in order.
+ */
+static void stress_run(uint32_t poll_cnt, uint32_t period_ms) {
+  bool producing = true;
+  uint32_t pos, consumed = 0, rewinds = 0;
+  stress_record_t *record;
+  stress_producer_t producer = {
+      .poll_cnt = poll_cnt,
+      .period_ms = period_ms,
+      .full_cnt = 0,
+      .done = xSemaphoreCreateBinary(),
+  };
+
+  TEST_ASSERT_NOT_NULL(producer.done);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_queue_init(&queue, storage,
+                                                 sizeof(storage),
+                                                 sizeof(stress_record_t)));
+  TEST_ASSERT_EQUAL(STRESS_SLOT_CNT, queue.slot_cnt);
+  stress_seed = poll_cnt;
+  TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(stress_produce, "stress", 2048,
+                                        &producer, 5, NULL));
+  while (producing || sensormgr_queue_count(&queue) != 0) {
+    if (producing && pdTRUE == xSemaphoreTake(producer.done, 0)) {
+      producing = false;
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(STRESS_SLOT_CNT, sensormgr_queue_count(&queue));
+    for (pos = 0; pos < STRESS_MSG_READING_CNT; pos++) {
+      record = (stress_record_t *)sensormgr_queue_peek(&queue, pos);
+      if (record == NULL) {
+        break;
+      }
+      stress_assert_record(record, consumed + pos);
+    }
+    if (pos == 0) {
+      vTaskDelay(1);
+      continue;
+    }
+    if (stress_rand(8) == 0) {
+      rewinds++;  // mqttmgr had no room, send them again
+      continue;
+    }
+    sensormgr_queue_release(&queue, pos);
+    consumed += pos;
+    if (!producing) {
+      // Nothing is added anymore, so the count has to be exact
+      TEST_ASSERT_EQUAL(poll_cnt * STRESS_SENSOR_CNT - consumed,
+                        sensormgr_queue_count(&queue));
+    }
+    if (stress_rand(4) == 0) {
+      vTaskDelay(1);  // Waiting on a PUBACK
+    }
+  }
+  printf("consumed: %u, rewinds: %u, queue full: %u\n", consumed, rewinds,
+         producer.full_cnt);
+  TEST_ASSERT_EQUAL(poll_cnt * STRESS_SENSOR_CNT, consumed);
+  TEST_ASSERT_NULL(sensormgr_queue_peek(&queue, 0));
+  vSemaphoreDelete(producer.done);
+}
+
+TEST_CASE("sensormgr_queue counts and orders records exactly", "[sensormgr]") {
+  uint32_t idx;
+  stress_record_t *record;
+
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE,
+                    sensormgr_queue_init(&queue, storage,
+                                         sizeof(stress_record_t),
+                                         sizeof(stress_record_t)));
+  // Partial slots are left unused
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_queue_init(&queue, storage,
+                                                 sizeof(storage) - 1,
+                                                 sizeof(stress_record_t)));
+  TEST_ASSERT_EQUAL(STRESS_SLOT_CNT - 1, queue.slot_cnt);
+
+  // Wrap around the slots a few times
+  for (idx = 0; idx < queue.slot_cnt * 3; idx++) {
+    record = (stress_record_t *)sensormgr_queue_acquire(&queue);
+    TEST_ASSERT_NOT_NULL(record);
+    TEST_ASSERT_EQUAL(record, sensormgr_queue_acquire(&queue));
+    record->seq = idx;
+    TEST_ASSERT_NULL(sensormgr_queue_peek(&queue, 0));  // Not committed
+    sensormgr_queue_commit(&queue);
+    TEST_ASSERT_EQUAL(1, sensormgr_queue_count(&queue));
+    TEST_ASSERT_EQUAL(
+        idx, ((stress_record_t *)sensormgr_queue_peek(&queue, 0))->seq);
+    sensormgr_queue_release(&queue, 1);
+    TEST_ASSERT_EQUAL(0, sensormgr_queue_count(&queue));
+  }
+
+  for (idx = 0; idx < queue.slot_cnt; idx++) {
+    record = (stress_record_t *)sensormgr_queue_acquire(&queue);
+    TEST_ASSERT_NOT_NULL(record);
+    record->seq = idx;
+    sensormgr_queue_commit(&queue);
+  }
+  TEST_ASSERT_NULL(sensormgr_queue_acquire(&queue));
+  TEST_ASSERT_EQUAL(queue.slot_cnt, sensormgr_queue_count(&queue));
+  TEST_ASSERT_NULL(sensormgr_queue_peek(&queue, queue.slot_cnt));
+  TEST_ASSERT_EQUAL(queue.slot_cnt - 1,
+                    ((stress_record_t *)sensormgr_queue_peek(
+                         &queue, queue.slot_cnt - 1))
+                        ->seq);
+
+  // Peeking doesn't free anything up, releasing does
+  sensormgr_queue_release(&queue, 3);
+  TEST_ASSERT_EQUAL(queue.slot_cnt - 3, sensormgr_queue_count(&queue));
+  TEST_ASSERT_EQUAL(3,
+                    ((stress_record_t *)sensormgr_queue_peek(&queue, 0))->seq);
+  TEST_ASSERT_NOT_NULL(sensormgr_queue_acquire(&queue));
+}
+
+TEST_CASE("sensormgr_queue stress - 100x sample rate", "[sensormgr]") {
+  stress_run(STRESS_PACED_POLL_CNT, STRESS_PERIOD_MS);
+}
+
+TEST_CASE("sensormgr_queue stress - producer never sleeps", "[sensormgr]") {
+  stress_run(STRESS_BURST_POLL_CNT, 0);
+}
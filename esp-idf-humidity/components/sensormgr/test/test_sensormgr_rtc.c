@@ -0,0 +1,63 @@
+#include "sensormgr_rtc.h"
+#include "unity.h"
+
+#define RTC_TIMESTAMP 1650000000000LL
+
+static sensormgr_rtc_t rtc;
+
+static void rtc_push(uint16_t cnt) {
+  sensormgr_sample_t sample;
+  uint16_t idx;
+
+  for (idx = 0; idx < cnt; idx++) {
+    TEST_ASSERT_EQUAL(ESP_OK,
+                      sensormgr_sample_set(&sample, idx % 4, 0,
+                                           RTC_TIMESTAMP + idx * 1000, idx));
+    sensormgr_rtc_push(&rtc, &sample);
+  }
+}
+
+TEST_CASE("sensormgr_rtc only keeps samples through deep sleep",
+          "[sensormgr]") {
+  TEST_ASSERT_FALSE(sensormgr_rtc_open(&rtc, 4, true));
+  TEST_ASSERT_EQUAL(SENSORMGR_RTC_SAMPLES, sensormgr_rtc_room(&rtc));
+  rtc_push(10);
+
+  TEST_ASSERT_TRUE(sensormgr_rtc_open(&rtc, 4, true));
+  TEST_ASSERT_EQUAL(SENSORMGR_RTC_SAMPLES - 10, sensormgr_rtc_room(&rtc));
+  // Channels changed, e.g. a sensor failed to come up this time
+  TEST_ASSERT_FALSE(sensormgr_rtc_open(&rtc, 3, true));
+  TEST_ASSERT_NULL(sensormgr_rtc_peek(&rtc, 0));
+
+  rtc_push(10);
+  TEST_ASSERT_FALSE(sensormgr_rtc_open(&rtc, 3, false));
+  TEST_ASSERT_EQUAL(SENSORMGR_RTC_SAMPLES, sensormgr_rtc_room(&rtc));
+}
+
+TEST_CASE("sensormgr_rtc replays samples oldest first", "[sensormgr]") {
+  const sensormgr_sample_t *sample;
+  sensormgr_sample_t newest;
+
+  sensormgr_rtc_open(&rtc, 4, false);
+  rtc_push(SENSORMGR_RTC_SAMPLES);
+  TEST_ASSERT_EQUAL(0, sensormgr_rtc_room(&rtc));
+  sample = sensormgr_rtc_peek(&rtc, 0);
+  TEST_ASSERT_EQUAL_INT64(RTC_TIMESTAMP, sensormgr_sample_timestamp(sample, 0));
+  TEST_ASSERT_NULL(sensormgr_rtc_peek(&rtc, SENSORMGR_RTC_SAMPLES));
+
+  // Full, the oldest sample makes room
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&newest, 1, 0,
+                                                 RTC_TIMESTAMP + 1000000, 1));
+  TEST_ASSERT_FALSE(sensormgr_rtc_push(&rtc, &newest));
+  sample = sensormgr_rtc_peek(&rtc, 0);
+  TEST_ASSERT_EQUAL_INT64(RTC_TIMESTAMP + 1000,
+                          sensormgr_sample_timestamp(sample, 0));
+  TEST_ASSERT_EQUAL(1, sample->channel);
+  sample = sensormgr_rtc_peek(&rtc, SENSORMGR_RTC_SAMPLES - 1);
+  TEST_ASSERT_EQUAL_INT64(RTC_TIMESTAMP + 1000000,
+                          sensormgr_sample_timestamp(sample, 0));
+
+  sensormgr_rtc_clear(&rtc);
+  TEST_ASSERT_NULL(sensormgr_rtc_peek(&rtc, 0));
+  TEST_ASSERT_TRUE(sensormgr_rtc_push(&rtc, &newest));
+}
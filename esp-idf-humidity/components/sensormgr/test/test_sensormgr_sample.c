@@ -0,0 +1,126 @@
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sensormgr_sample.h"
+#include "unity.h"
+
+#define SAMPLE_TIMESTAMP 1650000000000LL
+
+// Sample queue slot of the variable length readings, one per sensor poll
+typedef struct {
+  uint8_t type_idx;
+  size_t sensor_data_len;
+  uint8_t sensor_data[32];
+} sample_legacy_slot_t;
+
+TEST_CASE("sensormgr_sample round trips fixed point values", "[sensormgr]") {
+  sensormgr_sample_t sample;
+
+  TEST_ASSERT_EQUAL(9, sizeof(sensormgr_sample_t));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&sample, 3, 2,
+                                                 SAMPLE_TIMESTAMP, 21.37f));
+  TEST_ASSERT_EQUAL(3, sample.channel);
+  TEST_ASSERT_EQUAL(2137, sample.value);
+  TEST_ASSERT_EQUAL_INT64(SAMPLE_TIMESTAMP,
+                          sensormgr_sample_timestamp(&sample, 0));
+  TEST_ASSERT_TRUE(21.37 == sensormgr_sample_value(&sample, 2));
+
+  // Rounded to nearest, also below zero
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&sample, 0, 1,
+                                                 SAMPLE_TIMESTAMP, -5.46f));
+  TEST_ASSERT_EQUAL(-55, sample.value);
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    sensormgr_sample_set(&sample, 0, 0, SAMPLE_TIMESTAMP,
+                                         2147483647.0f - 128));
+  TEST_ASSERT_EQUAL(2147483520, sample.value);
+}
+
+TEST_CASE("sensormgr_sample rejects values it can't hold", "[sensormgr]") {
+  sensormgr_sample_t sample;
+
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_sample_set(&sample, 0, 2, SAMPLE_TIMESTAMP, NAN));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_sample_set(&sample, 0, 2, SAMPLE_TIMESTAMP,
+                                         INFINITY));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_sample_set(&sample, 0, 6, SAMPLE_TIMESTAMP,
+                                         3000.0f));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_sample_set(&sample, 0,
+                                         SENSORMGR_SAMPLE_DECIMALS_MAX + 1,
+                                         SAMPLE_TIMESTAMP, 1.0f));
+
+}
+
+TEST_CASE("sensormgr_sample keeps the ms since boot", "[sensormgr]") {
+  sensormgr_sample_t sample;
+  int64_t wrap = 1LL << 31;
+
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&sample, 0, 2, 10250, 1.0f));
+  TEST_ASSERT_TRUE(sensormgr_sample_monotonic(&sample));
+  TEST_ASSERT_EQUAL_INT64(10250, sensormgr_sample_timestamp(&sample, 10250));
+  TEST_ASSERT_EQUAL_INT64(10250, sensormgr_sample_timestamp(&sample, 60000));
+  TEST_ASSERT_TRUE(1.0 == sensormgr_sample_value(&sample, 2));
+
+  // Unwrapped against the time since boot, after 24 days of uptime
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&sample, 0, 2,
+                                                 wrap - 100, 1.0f));
+  TEST_ASSERT_EQUAL_INT64(wrap - 100,
+                          sensormgr_sample_timestamp(&sample, wrap + 100));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&sample, 0, 2,
+                                                 3 * wrap + 10250, 1.0f));
+  TEST_ASSERT_EQUAL_INT64(
+      3 * wrap + 10250, sensormgr_sample_timestamp(&sample, 3 * wrap + 60000));
+
+  // Readings taken by the wall clock keep whole seconds
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&sample, 0, 2,
+                                                 SAMPLE_TIMESTAMP + 999,
+                                                 1.0f));
+  TEST_ASSERT_FALSE(sensormgr_sample_monotonic(&sample));
+  TEST_ASSERT_EQUAL_INT64(SAMPLE_TIMESTAMP,
+                          sensormgr_sample_timestamp(&sample, 60000));
+}
+
+TEST_CASE("sensormgr_sample bench - readings per KB of sample queue",
+          "[sensormgr][bench]") {
+  // An sht4x reading held two values, an ltr390 one only one
+  float legacy_per_kb = 1024.0f / sizeof(sample_legacy_slot_t) * 2;
+  float sample_per_kb = 1024.0f / sizeof(sensormgr_sample_t);
+
+  printf("legacy: %u bytes per sht4x reading, %.0f values/KB\n",
+         (unsigned)sizeof(sample_legacy_slot_t), legacy_per_kb);
+  printf("sample: %u bytes per value, %.0f values/KB, %.1fx\n",
+         (unsigned)sizeof(sensormgr_sample_t), sample_per_kb,
+         sample_per_kb / legacy_per_kb);
+  TEST_ASSERT_GREATER_THAN(2 * legacy_per_kb, sample_per_kb);
+}
+
+TEST_CASE("sensormgr_sample carries window statistics", "[sensormgr]") {
+  sensormgr_sample_t sample;
+
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set_stat(
+                                &sample, SENSORMGR_SAMPLE_CHANNEL_MAX, 2,
+                                SENSORMGR_STAT_STDDEV, SAMPLE_TIMESTAMP,
+                                0.125));
+  TEST_ASSERT_EQUAL(SENSORMGR_SAMPLE_CHANNEL_MAX, sample.channel);
+  TEST_ASSERT_EQUAL(SENSORMGR_STAT_STDDEV, sample.stat);
+  TEST_ASSERT_EQUAL(13, sample.value);
+
+  // Counts aren't scaled, they'd overflow with many decimals
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set_stat(
+                                &sample, 0, SENSORMGR_SAMPLE_DECIMALS_MAX,
+                                SENSORMGR_STAT_COUNT, SAMPLE_TIMESTAMP, 3000));
+  TEST_ASSERT_EQUAL(3000, sample.value);
+  TEST_ASSERT_TRUE(3000 == sensormgr_sample_value(&sample, 6));
+
+  // Plain readings are raw
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_sample_set(&sample, 1, 2,
+                                                 SAMPLE_TIMESTAMP, 1.0f));
+  TEST_ASSERT_EQUAL(SENSORMGR_STAT_RAW, sample.stat);
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_sample_set(&sample,
+                                         SENSORMGR_SAMPLE_CHANNEL_MAX + 1, 2,
+                                         SAMPLE_TIMESTAMP, 1.0f));
+}
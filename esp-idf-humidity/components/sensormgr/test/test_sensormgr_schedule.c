@@ -0,0 +1,100 @@
+#include <stdint.h>
+
+#include "sensormgr_schedule.h"
+#include "unity.h"
+
+// Sensors of very different rates, like an ltr390 next to an sht4x
+#define SCHEDULE_FAST_PERIOD 10
+#define SCHEDULE_SLOW_PERIOD 6000
+#define SCHEDULE_RUN_TICKS 60000
+
+static sensormgr_schedule_t schedule;
+
+TEST_CASE("sensormgr_schedule polls each sensor on its own period",
+          "[sensormgr]") {
+  uint32_t now, last[3] = {0}, cnt[3] = {0};
+  uint8_t id;
+
+  sensormgr_schedule_init(&schedule);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_schedule_add(&schedule, 0,
+                                                   SCHEDULE_FAST_PERIOD, 0));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_schedule_add(&schedule, 1,
+                                                   SCHEDULE_SLOW_PERIOD, 5));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_schedule_add(&schedule, 2,
+                                                   SCHEDULE_SLOW_PERIOD, 3005));
+
+  // Jump straight from deadline to deadline like the read task
+  for (now = 0; now < SCHEDULE_RUN_TICKS;
+       now += sensormgr_schedule_wait(&schedule, now)) {
+    TEST_ASSERT_TRUE(sensormgr_schedule_pop_due(&schedule, now, &id));
+    TEST_ASSERT_LESS_THAN(3, id);
+    if (cnt[id]++ > 0) {
+      TEST_ASSERT_EQUAL(id == 0 ? SCHEDULE_FAST_PERIOD : SCHEDULE_SLOW_PERIOD,
+                        now - last[id]);
+    }
+    last[id] = now;
+  }
+  TEST_ASSERT_EQUAL(SCHEDULE_RUN_TICKS / SCHEDULE_FAST_PERIOD, cnt[0]);
+  TEST_ASSERT_EQUAL(SCHEDULE_RUN_TICKS / SCHEDULE_SLOW_PERIOD, cnt[1]);
+  TEST_ASSERT_EQUAL(SCHEDULE_RUN_TICKS / SCHEDULE_SLOW_PERIOD, cnt[2]);
+  // Phase is kept
+  TEST_ASSERT_EQUAL(5, last[1] % SCHEDULE_SLOW_PERIOD);
+  TEST_ASSERT_EQUAL(3005, last[2] % SCHEDULE_SLOW_PERIOD);
+}
+
+TEST_CASE("sensormgr_schedule skips deadlines missed while blocked",
+          "[sensormgr]") {
+  uint8_t id;
+
+  sensormgr_schedule_init(&schedule);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_schedule_add(&schedule, 7, 100, 50));
+  TEST_ASSERT_FALSE(sensormgr_schedule_pop_due(&schedule, 49, &id));
+  TEST_ASSERT_EQUAL(1, sensormgr_schedule_wait(&schedule, 49));
+
+  // Held up for several periods, e.g. waiting on a full sample queue
+  TEST_ASSERT_TRUE(sensormgr_schedule_pop_due(&schedule, 475, &id));
+  TEST_ASSERT_EQUAL(7, id);
+  TEST_ASSERT_FALSE(sensormgr_schedule_pop_due(&schedule, 475, &id));
+  TEST_ASSERT_EQUAL(75, sensormgr_schedule_wait(&schedule, 475));
+}
+
+TEST_CASE("sensormgr_schedule handles the tick count wrapping",
+          "[sensormgr]") {
+  uint32_t now = UINT32_MAX - 15;
+  uint8_t id;
+
+  sensormgr_schedule_init(&schedule);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_schedule_add(&schedule, 0, 10, now));
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    sensormgr_schedule_add(&schedule, 1, 1000, now + 20));
+  TEST_ASSERT_TRUE(sensormgr_schedule_pop_due(&schedule, now, &id));
+  TEST_ASSERT_EQUAL(0, id);
+  TEST_ASSERT_EQUAL(10, sensormgr_schedule_wait(&schedule, now));
+
+  // Deadlines past the wrap still come after the ones before it
+  now += 10;
+  TEST_ASSERT_TRUE(sensormgr_schedule_pop_due(&schedule, now, &id));
+  TEST_ASSERT_EQUAL(0, id);
+  now += 10;
+  TEST_ASSERT_TRUE(sensormgr_schedule_pop_due(&schedule, now, &id));
+  TEST_ASSERT_TRUE(sensormgr_schedule_pop_due(&schedule, now, &id));
+  TEST_ASSERT_EQUAL(4, now);
+  TEST_ASSERT_EQUAL(10, sensormgr_schedule_wait(&schedule, now));
+}
+
+TEST_CASE("sensormgr_schedule rejects what it can't hold", "[sensormgr]") {
+  uint8_t id;
+
+  sensormgr_schedule_init(&schedule);
+  TEST_ASSERT_EQUAL(UINT32_MAX, sensormgr_schedule_wait(&schedule, 0));
+  TEST_ASSERT_FALSE(sensormgr_schedule_pop_due(&schedule, 0, &id));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_schedule_add(&schedule, 0, 0, 0));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG,
+                    sensormgr_schedule_add(&schedule, 0, UINT32_MAX, 0));
+  for (id = 0; id < SENSORMGR_SCHEDULE_MAX; id++) {
+    TEST_ASSERT_EQUAL(ESP_OK, sensormgr_schedule_add(&schedule, id, 1, 0));
+  }
+  TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM,
+                    sensormgr_schedule_add(&schedule, id, 1, 0));
+}
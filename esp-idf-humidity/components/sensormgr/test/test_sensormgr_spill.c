@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensormgr_spill.h"
+#include "unity.h"
+
+// Recorded sht4x / ltr390 traces follow a 5 second sample rate with the odd
+// 10 ms tick of jitter, and values quantized by the sensors' 16 bit ADC counts
+#define TRACE_READING_CNT 1000
+#define TRACE_TIMESTAMP 1650000000000LL
+#define TRACE_PERIOD 5000
+
+// Same shape as the driver sensor_data_t structs, stamped in ms
+typedef struct {
+  int64_t timestamp;
+  float temp;
+  float humidity;
+} trace_sht4x_t;
+
+typedef struct {
+  int64_t timestamp;
+  float measurement;
+  uint32_t mode;
+} trace_ltr390_t;
+
+// Version 3 file of a single sensor type with two readings 5 seconds apart,
+// data_len is filled in with the size of a time_t
+static uint8_t trace_v3_file[] = {
+    'S',  'M',  'S',  'P',  3,    1,    0,                     // Header
+    0x80, 0x00, 0x59, 0x62, 0x00, 0x00, 0x00, 0x00,            // 1650000000
+    0x1D, 0x07, 0xB0, 0x00, 1,                                 // Boot
+    0x1E, 0x00, 0x00, 0x00,                                    // 30s
+    0x9E, 0x00, 0x59, 0x62, 0x00, 0x00, 0x00, 0x00,            // 1650000030
+    0,    0x02, 0x00, 0x0E, 0x00,                              // Block
+    0x00, 0x00, 0x00, 0x05, 0x41, 0xAB, 0x00, 0x00, 0x00, 0x00,  // +5s
+    0x00, 0x00, 0xA2, 0x00,                                    // +5s
+};
+#define TRACE_V3_HEADER_LEN (4 + 2 + 1 + 8 + 4 + 1 + 4 + 8)
+
+// Mirrors sensor_reading_t, what older firmware used to fwrite per reading
+typedef struct {
+  uint8_t type_idx;
+  size_t sensor_data_len;
+} trace_legacy_header_t;
+
+static const uint8_t trace_data_len[] = {sizeof(trace_sht4x_t),
+                                         sizeof(trace_ltr390_t)};
+static trace_sht4x_t sht4x_trace[TRACE_READING_CNT];
+static trace_ltr390_t ltr390_trace[TRACE_READING_CNT];
+static uint8_t spill_buffer[16 * 1024];
+static sensormgr_spill_encoder_t enc;
+static sensormgr_spill_decoder_t dec;
+static uint32_t trace_seed;
+
+static int trace_rand(int range) {
+  trace_seed = trace_seed * 1103515245 + 12345;
+  return (int)((trace_seed >> 16) % (2 * range + 1)) - range;
+}
+
+static void trace_generate(void) {
+  int idx, temp_ticks = 25000, humidity_ticks = 24000, lux_ticks = 900;
+  int64_t timestamp = TRACE_TIMESTAMP;
+
+  trace_seed = 42;
+  for (idx = 0; idx < TRACE_READING_CNT; idx++) {
+    timestamp += TRACE_PERIOD + (trace_rand(20) == 20 ? 10 : 0);
+    temp_ticks += trace_rand(3);
+    humidity_ticks += trace_rand(6);
+    lux_ticks += trace_rand(4);
+    sht4x_trace[idx] = (trace_sht4x_t){
+        .timestamp = timestamp,
+        .temp = -45 + 175 * temp_ticks / 65535.0f,
+        .humidity = -6 + 125 * humidity_ticks / 65535.0f,
+    };
+    ltr390_trace[idx] = (trace_ltr390_t){
+        .timestamp = timestamp,
+        .measurement = lux_ticks * 0.6f / 3,
+        .mode = 1,
+    };
+  }
+}
+
+static size_t trace_encode(void) {
+  int idx;
+  FILE *f = fmemopen(spill_buffer, sizeof(spill_buffer), "wb");
+
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    sensormgr_spill_encoder_init(&enc, f, TRACE_TIMESTAMP,
+                                                 trace_data_len, 2, 1, NULL));
+  for (idx = 0; idx < TRACE_READING_CNT; idx++) {
+    TEST_ASSERT_EQUAL(ESP_OK,
+                      sensormgr_spill_encode(&enc, 0, &sht4x_trace[idx],
+                                             sizeof(trace_sht4x_t)));
+    TEST_ASSERT_EQUAL(ESP_OK,
+                      sensormgr_spill_encode(&enc, 1, &ltr390_trace[idx],
+                                             sizeof(trace_ltr390_t)));
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_encoder_finish(&enc));
+  fclose(f);
+  return enc.bytes_written;
+}
+
+static void trace_decode(size_t len) {
+  int sht4x_idx = 0, ltr390_idx = 0;
+  uint8_t type_idx, sensor_data[32];
+  size_t sensor_data_len;
+  esp_err_t ret;
+  FILE *f = fmemopen(spill_buffer, len, "rb");
+
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  while (ESP_OK == (ret = sensormgr_spill_decode(&dec, &type_idx, sensor_data,
+                                                 sizeof(sensor_data),
+                                                 &sensor_data_len))) {
+    TEST_ASSERT_EQUAL(trace_data_len[type_idx], sensor_data_len);
+    if (type_idx == 0) {
+      TEST_ASSERT_EQUAL_MEMORY(&sht4x_trace[sht4x_idx++], sensor_data,
+                               sensor_data_len);
+    } else {
+      TEST_ASSERT_EQUAL_MEMORY(&ltr390_trace[ltr390_idx++], sensor_data,
+                               sensor_data_len);
+    }
+  }
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, ret);
+  TEST_ASSERT_EQUAL(TRACE_READING_CNT, sht4x_idx);
+  TEST_ASSERT_EQUAL(TRACE_READING_CNT, ltr390_idx);
+  fclose(f);
+}
+
+TEST_CASE("sensormgr_spill round trips a recorded trace", "[sensormgr]") {
+  trace_generate();
+  trace_decode(trace_encode());
+}
+
+TEST_CASE("sensormgr_spill round trips clock jumps", "[sensormgr]") {
+  // Readings taken before SNTP sync are stamped with ms since boot
+  trace_generate();
+  sht4x_trace[0].timestamp = 10000;
+  sht4x_trace[1].timestamp = 15000;
+  ltr390_trace[0].timestamp = 10003;
+  ltr390_trace[500].timestamp -= 3000000;
+  trace_decode(trace_encode());
+}
+
+TEST_CASE("sensormgr_spill rejects files from before the spill format",
+          "[sensormgr]") {
+  FILE *f;
+  trace_legacy_header_t legacy = {.type_idx = 0,
+                                  .sensor_data_len = sizeof(trace_sht4x_t)};
+
+  memcpy(spill_buffer, &legacy, sizeof(legacy));
+  f = fmemopen(spill_buffer, sizeof(legacy), "rb");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_VERSION,
+                    sensormgr_spill_decoder_init(&dec, f));
+  TEST_ASSERT_EQUAL(0, ftell(f));
+  fclose(f);
+}
+
+static void trace_v3_decode(uint8_t *file, size_t len) {
+  uint8_t type_idx, sensor_data[32];
+  size_t sensor_data_len;
+  time_t timestamp;
+  float value;
+  FILE *f = fmemopen(file, len, "rb");
+
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decode(&dec, &type_idx,
+                                                   sensor_data,
+                                                   sizeof(sensor_data),
+                                                   &sensor_data_len));
+  TEST_ASSERT_EQUAL(sizeof(time_t) + 8, sensor_data_len);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decode(&dec, &type_idx,
+                                                   sensor_data,
+                                                   sizeof(sensor_data),
+                                                   &sensor_data_len));
+  memcpy(&timestamp, sensor_data, sizeof(time_t));
+  memcpy(&value, &sensor_data[sizeof(time_t)], sizeof(float));
+  TEST_ASSERT_EQUAL(1650000010, timestamp);
+  TEST_ASSERT_TRUE(21.375f == value);
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND,
+                    sensormgr_spill_decode(&dec, &type_idx, sensor_data,
+                                           sizeof(sensor_data),
+                                           &sensor_data_len));
+  fclose(f);
+}
+
+TEST_CASE("sensormgr_spill reads version 3 files in seconds",
+          "[sensormgr]") {
+  uint8_t header[SENSORMGR_SPILL_HEADER_MAX];
+
+  trace_v3_file[6] = sizeof(time_t) + 8;
+  trace_v3_decode(trace_v3_file, sizeof(trace_v3_file));
+  TEST_ASSERT_EQUAL(3, dec.version);
+  TEST_ASSERT_EQUAL_UINT32(0xB0071D, dec.boot_id);
+  TEST_ASSERT_EQUAL(1, dec.clk.anchor_cnt);
+  TEST_ASSERT_EQUAL_INT64(30000, dec.clk.anchors[0].mono);
+  TEST_ASSERT_EQUAL_INT64(1650000000000LL,
+                          sensormgr_clock_boot_time(&dec.clk, 0));
+
+  // Sent on as a version 3 file
+  TEST_ASSERT_EQUAL(TRACE_V3_HEADER_LEN, sensormgr_spill_header(&dec, header));
+  TEST_ASSERT_EQUAL_MEMORY(trace_v3_file, header, TRACE_V3_HEADER_LEN);
+}
+
+TEST_CASE("sensormgr_spill reads version 1 files", "[sensormgr]") {
+  size_t v1_header_len = 4 + 2 + 1 + 8;
+
+  // Same blocks, a header without the boot_id and anchors
+  trace_v3_file[6] = sizeof(time_t) + 8;
+  memcpy(spill_buffer, trace_v3_file, v1_header_len);
+  memcpy(&spill_buffer[v1_header_len], &trace_v3_file[TRACE_V3_HEADER_LEN],
+         sizeof(trace_v3_file) - TRACE_V3_HEADER_LEN);
+  spill_buffer[4] = 1;
+  trace_v3_decode(spill_buffer, sizeof(trace_v3_file) - TRACE_V3_HEADER_LEN +
+                                    v1_header_len);
+  TEST_ASSERT_EQUAL(1, dec.version);
+  TEST_ASSERT_EQUAL(v1_header_len, dec.header_len);
+  TEST_ASSERT_EQUAL(0, dec.clk.anchor_cnt);
+}
+
+TEST_CASE("sensormgr_spill rejects a truncated block", "[sensormgr]") {
+  uint8_t type_idx, sensor_data[32];
+  size_t len, sensor_data_len;
+  esp_err_t ret;
+  FILE *f;
+
+  trace_generate();
+  len = trace_encode();
+  f = fmemopen(spill_buffer, len - 1, "rb");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  while (ESP_OK == (ret = sensormgr_spill_decode(&dec, &type_idx, sensor_data,
+                                                 sizeof(sensor_data),
+                                                 &sensor_data_len))) {
+  }
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, ret);
+  fclose(f);
+}
+
+TEST_CASE("sensormgr_spill bench - compression ratio vs raw readings",
+          "[sensormgr][bench]") {
+  size_t raw_len, spill_len;
+
+  trace_generate();
+  spill_len = trace_encode();
+  raw_len = TRACE_READING_CNT * (2 * sizeof(trace_legacy_header_t) +
+                                 sizeof(trace_sht4x_t) +
+                                 sizeof(trace_ltr390_t));
+
+  printf("raw:   %u bytes, %.1f bytes/reading\n", (unsigned)raw_len,
+         (float)raw_len / (2 * TRACE_READING_CNT));
+  printf("spill: %u bytes, %.1f bytes/reading, %.1fx smaller\n",
+         (unsigned)spill_len, (float)spill_len / (2 * TRACE_READING_CNT),
+         (float)raw_len / spill_len);
+  TEST_ASSERT_LESS_THAN(raw_len / 4, spill_len);
+}
+
+TEST_CASE("sensormgr_spill splits a file into standalone chunks",
+          "[sensormgr]") {
+  static uint8_t chunk[1024];
+  int readings = 0;
+  uint8_t type_idx, sensor_data[32];
+  uint32_t offset, resume_offset = 0;
+  size_t len, header_len, blocks_len, sensor_data_len;
+  esp_err_t ret;
+  FILE *f, *f_chunk;
+  sensormgr_spill_decoder_t chunk_dec;
+
+  trace_generate();
+  len = trace_encode();
+  f = fmemopen(spill_buffer, len, "rb");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  header_len = sensormgr_spill_header(&dec, chunk);
+  while (ESP_OK == (ret = sensormgr_spill_next_blocks(
+                        &dec, sizeof(chunk) - header_len, &offset,
+                        &blocks_len))) {
+    TEST_ASSERT_EQUAL(1, fread(&chunk[header_len], blocks_len, 1, f));
+    f_chunk = fmemopen(chunk, header_len + blocks_len, "rb");
+    TEST_ASSERT_NOT_NULL(f_chunk);
+    TEST_ASSERT_EQUAL(ESP_OK,
+                      sensormgr_spill_decoder_init(&chunk_dec, f_chunk));
+    while (ESP_OK == sensormgr_spill_decode(&chunk_dec, &type_idx, sensor_data,
+                                            sizeof(sensor_data),
+                                            &sensor_data_len)) {
+      readings++;
+    }
+    fclose(f_chunk);
+    if (resume_offset == 0) {
+      resume_offset = offset + blocks_len;
+    }
+  }
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, ret);
+  TEST_ASSERT_EQUAL(2 * TRACE_READING_CNT, readings);
+
+  // Resume after the first chunk like after a reboot
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_seek(&dec, resume_offset));
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decode(&dec, &type_idx,
+                                                   sensor_data,
+                                                   sizeof(sensor_data),
+                                                   &sensor_data_len));
+  offset = ftell(f);
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, sensormgr_spill_seek(&dec, 3));
+  TEST_ASSERT_EQUAL(offset, ftell(f));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, sensormgr_spill_seek(&dec, len + 1));
+  TEST_ASSERT_EQUAL(offset, ftell(f));
+  fclose(f);
+}
+
+TEST_CASE("sensormgr_spill carries the clock anchors of its boot",
+          "[sensormgr]") {
+  uint8_t header[SENSORMGR_SPILL_HEADER_MAX];
+  size_t header_len, fixed_len = 4 + 2 + 2 + 8 + 4 + 1;
+  FILE *f;
+  sensormgr_clock_t clk;
+
+  sensormgr_clock_init(&clk);
+  sensormgr_clock_anchor(&clk, 30000, TRACE_TIMESTAMP);
+  sensormgr_clock_anchor(&clk, 3630000, TRACE_TIMESTAMP + 3601000);
+  f = fmemopen(spill_buffer, sizeof(spill_buffer), "wb");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    sensormgr_spill_encoder_init(&enc, f, 0, trace_data_len,
+                                                 2, 0xB0071D, &clk));
+  fclose(f);
+  f = fmemopen(spill_buffer, enc.bytes_written, "rb");
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  fclose(f);
+  TEST_ASSERT_EQUAL_UINT32(0xB0071D, dec.boot_id);
+  TEST_ASSERT_EQUAL(2, dec.clk.anchor_cnt);
+  TEST_ASSERT_EQUAL_INT64(TRACE_TIMESTAMP - 30000 + 1000,
+                          sensormgr_clock_boot_time(&dec.clk, 3630000));
+  header_len = sensormgr_spill_header(&dec, header);
+  TEST_ASSERT_EQUAL(fixed_len + 2 * (8 + 8), header_len);
+  TEST_ASSERT_EQUAL_MEMORY(spill_buffer, header, header_len);
+
+  // Version 2 header, from before the anchors
+  spill_buffer[4] = 2;
+  f = fmemopen(spill_buffer, fixed_len - 5, "rb");
+  TEST_ASSERT_EQUAL(ESP_OK, sensormgr_spill_decoder_init(&dec, f));
+  fclose(f);
+  TEST_ASSERT_EQUAL(0, dec.boot_id);
+  TEST_ASSERT_EQUAL(0, dec.clk.anchor_cnt);
+}
@@ -2,6 +2,7 @@
 #include <esp_log.h>
 #include <esp_pm.h>
 #include <esp_sntp.h>
+#include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/task.h>
@@ -83,11 +84,14 @@ void hardware_init() {
   esp_pm_configure(&pm_config);
 }
 
-void client_init() {
-  struct tm timeinfo;
-  const int retry_count = 10;
-  int retry = 0;
+static void time_synced(struct timeval *tv) {
+  now = tv->tv_sec;
+  sensormgr_time_synced(tv);
+  ESP_LOGI(TAG, "System time set over NTP");
+}
 
+// Doesn't wait for SNTP, readings taken before it syncs get rebased
+void network_init() {
   wifi_provision();
 
   //[> Network time setup <]
@@ -95,24 +99,12 @@ void client_init() {
   sntp_setservername(0,
                      "opensense.kaffi.home");  // TODO: Make this configurable
   sntp_set_sync_mode(SNTP_SYNC_MODE_SMOOTH);
+  sntp_set_time_sync_notification_cb(time_synced);
   sntp_init();
-  time(&now);
-  localtime_r(&now, &timeinfo);
-  // Is time set? If not, tm_year will be (1970 - 1900).
-  if (timeinfo.tm_year < (2016 - 1900)) {
-    ESP_LOGI(
-        TAG,
-        "Time is not set yet. Connecting to WiFi and getting time over NTP.");
-    while (sntp_get_sync_status() == SNTP_SYNC_STATUS_RESET &&
-           ++retry < retry_count) {
-      ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry,
-               retry_count);
-      vTaskDelay(2000 / portTICK_PERIOD_MS);
-    }
-    // update 'now' variable with current time
-    time(&now);
-  }
+}
 
+// Before sensor_init, sensormgr waits on the mqttmgr event bits
+void client_init() {
   // Initialize component libraries (non-hardware)
   ESP_ERROR_CHECK(mqttmgr_init(PRIVATE_ID));
   ESP_ERROR_CHECK(mqttlog_init());
@@ -143,9 +135,22 @@ void app_main() {
   hardware_init();
   client_init();
   sensor_init();
-
-  mqttmgr_start();
-  vTaskDelay(10000 / portTICK_PERIOD_MS);
+#if CONFIG_SENSORMGR_DEEP_SLEEP
+  // Woken up to measure, this goes straight back to sleep
+  sensormgr_sleep_cycle();
+#endif
+  // Sample while WiFi and SNTP come up, readings are held till they're up
   sensormgr_start();
-  MQTTLOG_LOGI(TAG, "test message", "");
+  network_init();
+  mqttmgr_start();
+  MQTTLOG_LOGI(TAG, "test message");
+#if CONFIG_SENSORMGR_DEEP_SLEEP
+  sensormgr_upload(CONFIG_SENSORMGR_DEEP_SLEEP_UPLOAD_TIMEOUT *
+                   configTICK_RATE_HZ);
+  mqttmgr_flush(CONFIG_SENSORMGR_DEEP_SLEEP_UPLOAD_TIMEOUT *
+                configTICK_RATE_HZ);
+  mqttmgr_stop();
+  esp_wifi_stop();
+  sensormgr_deep_sleep();
+#endif
 }
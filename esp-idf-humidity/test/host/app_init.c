@@ -0,0 +1,89 @@
+// The init sequence of app_main on the host shims
+//
+// hardware_init, client_init, sensor_init, sensormgr_start, network_init and
+// mqttmgr_start run in that order with the components built for the host. A
+// component that registers with the default event loop before wifi_provision
+// created it fails here as it does on the device.
+
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <ftw.h>
+#include <host_shim.h>
+#include <mqttlog.h>
+#include <mqttmgr.h>
+#include <nvs_flash.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sensormgr.h"
+#include "sim_sensors.h"
+
+#define APP_DEVICE_ID "app-init"
+#define APP_CONNECT_TIMEOUT_MS 10000
+
+static void app_event_handler(void *handler_args, esp_event_base_t base,
+                              int32_t event_id, void *event_data) {}
+
+static int app_rm(const char *path, const struct stat *st, int flag,
+                  struct FTW *ftw) {
+  return remove(path);
+}
+
+int main(void) {
+  char root[] = "/tmp/app_init.XXXXXX";
+  EventBits_t bits;
+  esp_err_t ret;
+
+  esp_log_level_set("*", ESP_LOG_ERROR);
+  if (mkdtemp(root) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  host_fat_set_root(root);
+
+  // No default loop till network_init, the same as on the device
+  ret = esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                   app_event_handler, NULL);
+  if (ret != ESP_ERR_INVALID_STATE) {
+    fprintf(stderr, "Registered before the default loop: %s\n",
+            esp_err_to_name(ret));
+    return EXIT_FAILURE;
+  }
+
+  // hardware_init
+  ESP_ERROR_CHECK(nvs_flash_init());
+  // client_init
+  ESP_ERROR_CHECK(mqttmgr_init(APP_DEVICE_ID));
+  ESP_ERROR_CHECK(mqttlog_init());
+  // sensor_init
+  ESP_ERROR_CHECK(sensormgr_init());
+  ESP_ERROR_CHECK(sensormgr_register_sensor(sim_sht4x));
+  ESP_ERROR_CHECK(sensormgr_register_sensor(sim_ltr390));
+
+  ESP_ERROR_CHECK(sensormgr_start());
+  // network_init, wifi_provision returns once it has an IP
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                             app_event_handler, NULL));
+  ESP_ERROR_CHECK(esp_wifi_start());
+  host_mqtt_set_broker_up(true);
+  ESP_ERROR_CHECK(mqttmgr_start());
+
+  bits = xEventGroupWaitBits(mqttmgr_events, MQTTMGR_CLIENT_CONNECTED_BIT,
+                             pdFALSE, pdTRUE,
+                             APP_CONNECT_TIMEOUT_MS / portTICK_PERIOD_MS);
+  ESP_ERROR_CHECK(sensormgr_stop());
+  nftw(root, app_rm, 8, FTW_DEPTH | FTW_PHYS);
+  if (!(bits & MQTTMGR_CLIENT_CONNECTED_BIT)) {
+    fprintf(stderr, "Not connected after %dms\n", APP_CONNECT_TIMEOUT_MS);
+    _exit(EXIT_FAILURE);
+  }
+  printf("app_main init sequence done, connected\n");
+  // The tasks never return, leave them running
+  fflush(stdout);
+  _exit(EXIT_SUCCESS);
+}
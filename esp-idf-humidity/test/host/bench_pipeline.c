@@ -0,0 +1,620 @@
+// End-to-end bench of sensormgr, mqttmgr and mqttlog on the host shims
+//
+// Synthetic sensors are polled by the real sensormgr tasks while the
+// loopback broker is down, so every reading is spilled to the FAT directory.
+// Once the broker is back up the spill files are drained over mqttmgr in the
+// wire format asked for, and every reading is checked to arrive exactly once.
+
+#include <cJSON.h>
+#include <commands.pb-c.h>
+#include <dirent.h>
+#include <esp_log.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <host_shim.h>
+#include <math.h>
+#include <mqttlog.h>
+#include <mqttmgr.h>
+#include <nvs_flash.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modules/sensormgr.pb-c.h"
+#include "sensormgr.h"
+#include "sensormgr_spill.h"
+#include "sim_sensors.h"
+
+#define BENCH_DEVICE_ID "bench"
+#define BENCH_READINGS 6000
+#define BENCH_CHANNELS_MAX 4
+#define BENCH_TIMEOUT_MS 60000
+#define BENCH_UUID "bench-set-options"
+
+static const char *TAG = "bench";
+
+typedef struct {
+  uint32_t cnt;
+  int64_t sum;  // Of the fixed point values, has to match at every stage
+} bench_tally_t;
+
+typedef enum {
+  BENCH_TOPIC_DATA,
+  BENCH_TOPIC_BATCH,
+  BENCH_TOPIC_BACKFILL,
+  BENCH_TOPIC_LOG,
+  BENCH_TOPIC_OTHER,
+  BENCH_TOPIC_MAX,
+} bench_topic_t;
+
+static const char *bench_topic_prefixes[BENCH_TOPIC_MAX] = {
+    "sensordata/", "sensorbatch/", "sensorbackfill/", "log", "other",
+};
+
+typedef struct {
+  uint32_t msg_cnt;
+  size_t bytes;
+} bench_wire_t;
+
+static const sensormgr_registration_t *bench_sims[] = {&sim_sht4x,
+                                                       &sim_ltr390};
+
+static struct {
+  int readings;  // To take
+  Sensormgr__DataFormatT format;
+  Sensormgr__BackfillT backfill;
+  bool verbose;
+  char root[64];
+  const sensormgr_channel_t *channels[BENCH_CHANNELS_MAX];
+  uint8_t channel_cnt;
+  atomic_int taken;
+  atomic_bool exhausted;  // Polled again after the last reading was taken
+  bench_tally_t measured[BENCH_CHANNELS_MAX];  // sensormgr read task only
+  pthread_mutex_t lock;  // What the sink saw
+  pthread_cond_t cond;
+  bench_tally_t delivered[BENCH_CHANNELS_MAX];
+  uint32_t delivered_cnt;
+  uint32_t unknown_cnt;  // Readings of channels the bench doesn't know
+  bench_wire_t wire[BENCH_TOPIC_MAX];
+  bool responded;
+  CommandResponse__RetCodeT ret_code;
+  int64_t sink_cpu_ns;
+} bench = {
+    .readings = BENCH_READINGS,
+    .format = SENSORMGR__DATA_FORMAT_T__PROTOBUF,
+    .backfill = SENSORMGR__BACKFILL_T__BACKFILL_ON,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int64_t bench_clock_ns(clockid_t clock) {
+  struct timespec now;
+
+  clock_gettime(clock, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int32_t bench_fixed(const sensormgr_channel_t *channel, double value) {
+  return (int32_t)lround(value * pow(10, channel->decimals));
+}
+
+static void bench_tally(bench_tally_t *tally, int32_t value) {
+  tally->cnt++;
+  tally->sum += value;
+}
+
+/**
+ * @brief Channel of a sensor and unit, as sensormgr numbered them
+ *
+ * @return BENCH_CHANNELS_MAX when unknown
+ */
+static uint8_t bench_channel(const char *sensor, const char *unit) {
+  uint8_t idx;
+
+  for (idx = 0; idx < bench.channel_cnt; idx++) {
+    if (0 == strcmp(bench.channels[idx]->sensor, sensor) &&
+        0 == strcmp(bench.channels[idx]->unit, unit)) {
+      return idx;
+    }
+  }
+  return BENCH_CHANNELS_MAX;
+}
+
+// Caller holds the lock
+static void bench_deliver(const char *sensor, const char *unit, bool fixed,
+                          double value) {
+  uint8_t channel = bench_channel(sensor, unit);
+
+  if (channel == BENCH_CHANNELS_MAX) {
+    bench.unknown_cnt++;
+    return;
+  }
+  bench_tally(&bench.delivered[channel],
+              fixed ? (int32_t)value
+                    : bench_fixed(bench.channels[channel], value));
+  bench.delivered_cnt++;
+}
+
+/**
+ * @brief Count the samples of a spill file
+ *
+ * @param tallies Per channel of the file, NULL to only count
+ * @return Samples decoded, -1 when the file is corrupt
+ */
+static int bench_spill_decode(FILE *f, bench_tally_t *tallies) {
+  sensormgr_spill_decoder_t dec;
+  sensormgr_spill_sample_t sample;
+  uint8_t type_idx;
+  size_t len;
+  esp_err_t ret;
+  int cnt = 0;
+
+  if (ESP_OK != sensormgr_spill_decoder_init(&dec, f)) {
+    return -1;
+  }
+  while (ESP_OK == (ret = sensormgr_spill_decode(&dec, &type_idx, &sample,
+                                                 sizeof(sample), &len))) {
+    if (len != sizeof(sample) || type_idx >= BENCH_CHANNELS_MAX) {
+      return -1;
+    }
+    if (tallies != NULL) {
+      bench_tally(&tallies[type_idx], sample.value);
+    }
+    cnt++;
+  }
+  return ret == ESP_ERR_NOT_FOUND ? cnt : -1;
+}
+
+// Caller holds the lock
+static void bench_sink_data(const uint8_t *data, size_t len) {
+  cJSON *root = cJSON_ParseWithLength((const char *)data, len);
+  cJSON *reading, *sensor, *unit, *value;
+
+  cJSON_ArrayForEach(reading, cJSON_GetObjectItem(root, "data")) {
+    sensor = cJSON_GetObjectItem(reading, "sensor");
+    unit = cJSON_GetObjectItem(reading, "unit");
+    value = cJSON_GetObjectItem(reading, "value");
+    if (!cJSON_IsString(sensor) || !cJSON_IsString(unit) ||
+        !cJSON_IsNumber(value)) {
+      bench.unknown_cnt++;
+      continue;
+    }
+    bench_deliver(sensor->valuestring, unit->valuestring, false,
+                  value->valuedouble);
+  }
+  cJSON_Delete(root);
+}
+
+// Caller holds the lock
+static void bench_sink_batch(const uint8_t *data, size_t len) {
+  Sensormgr__SensorBatch *batch =
+      sensormgr__sensor_batch__unpack(NULL, len, data);
+  Sensormgr__SensorBatch__Reading *reading;
+  size_t idx;
+
+  if (batch == NULL) {
+    bench.unknown_cnt++;
+    return;
+  }
+  for (idx = 0; idx < batch->n_readings; idx++) {
+    reading = batch->readings[idx];
+    if (reading->channel >= batch->n_channels) {
+      bench.unknown_cnt++;
+      continue;
+    }
+    bench_deliver(batch->channels[reading->channel]->sensor,
+                  batch->channels[reading->channel]->unit, false,
+                  reading->value);
+  }
+  sensormgr__sensor_batch__free_unpacked(batch, NULL);
+}
+
+// Caller holds the lock
+static void bench_sink_backfill(const uint8_t *data, size_t len) {
+  Sensormgr__SensorBackfill *backfill =
+      sensormgr__sensor_backfill__unpack(NULL, len, data);
+  bench_tally_t tallies[BENCH_CHANNELS_MAX] = {0};
+  uint8_t idx, channel;
+  FILE *f;
+
+  if (backfill == NULL) {
+    bench.unknown_cnt++;
+    return;
+  }
+  f = fmemopen(backfill->spill.data, backfill->spill.len, "rb");
+  if (f == NULL || bench_spill_decode(f, tallies) < 0 ||
+      backfill->n_channels > BENCH_CHANNELS_MAX) {
+    ESP_LOGE(TAG, "Corrupt backfill chunk of %s at %u", backfill->file_name,
+             backfill->offset);
+    bench.unknown_cnt++;
+  } else {
+    for (idx = 0; idx < backfill->n_channels; idx++) {
+      channel = bench_channel(backfill->channels[idx]->sensor,
+                              backfill->channels[idx]->unit);
+      if (channel == BENCH_CHANNELS_MAX ||
+          backfill->channels[idx]->decimals !=
+              bench.channels[channel]->decimals) {
+        bench.unknown_cnt += tallies[idx].cnt;
+        continue;
+      }
+      bench.delivered[channel].cnt += tallies[idx].cnt;
+      bench.delivered[channel].sum += tallies[idx].sum;
+      bench.delivered_cnt += tallies[idx].cnt;
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  sensormgr__sensor_backfill__free_unpacked(backfill, NULL);
+}
+
+// Caller holds the lock
+static void bench_sink_response(const uint8_t *data, size_t len) {
+  CommandResponse *resp = command_response__unpack(NULL, len, data);
+
+  if (resp != NULL && 0 == strcmp(resp->uuid, BENCH_UUID)) {
+    bench.responded = true;
+    bench.ret_code = resp->ret_code;
+  }
+  if (resp != NULL) {
+    command_response__free_unpacked(resp, NULL);
+  }
+}
+
+// Stands in for the backend, on the task of the mqttmgr client
+static void bench_sink(const char *topic, const uint8_t *data, size_t len,
+                       void *arg) {
+  int64_t start = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  bench_topic_t idx;
+
+  for (idx = 0; idx < BENCH_TOPIC_OTHER; idx++) {
+    if (0 == strncmp(topic, bench_topic_prefixes[idx],
+                     strlen(bench_topic_prefixes[idx]))) {
+      break;
+    }
+  }
+  pthread_mutex_lock(&bench.lock);
+  bench.wire[idx].msg_cnt++;
+  bench.wire[idx].bytes += len;
+  switch (idx) {
+    case BENCH_TOPIC_DATA:
+      bench_sink_data(data, len);
+      break;
+    case BENCH_TOPIC_BATCH:
+      bench_sink_batch(data, len);
+      break;
+    case BENCH_TOPIC_BACKFILL:
+      bench_sink_backfill(data, len);
+      break;
+    default:
+      if (0 == strcmp(topic, "command/" BENCH_DEVICE_ID "/resp/")) {
+        bench_sink_response(data, len);
+      }
+      break;
+  }
+  bench.sink_cpu_ns += bench_clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+  pthread_cond_broadcast(&bench.cond);
+  pthread_mutex_unlock(&bench.lock);
+}
+
+/**
+ * @brief Poll a synthetic sensor till the bench has its readings
+ *
+ * Fails every poll after that, so sensormgr queues nothing more.
+ */
+static esp_err_t bench_measure(uint8_t sim_idx, float *values) {
+  uint8_t channel = 0, idx;
+  esp_err_t ret;
+
+  if (atomic_load(&bench.taken) >= bench.readings) {
+    atomic_store(&bench.exhausted, true);
+    return ESP_ERR_NOT_FOUND;
+  }
+  ret = bench_sims[sim_idx]->measure(values);
+  for (idx = 0; idx < sim_idx; idx++) {
+    channel += bench_sims[idx]->channel_cnt;
+  }
+  for (idx = 0; ret == ESP_OK && idx < bench_sims[sim_idx]->channel_cnt;
+       idx++) {
+    if (isnan(values[idx])) {
+      continue;
+    }
+    bench_tally(&bench.measured[channel + idx],
+                bench_fixed(bench.channels[channel + idx], values[idx]));
+    atomic_fetch_add(&bench.taken, 1);
+  }
+  return ret;
+}
+
+static esp_err_t bench_sht4x_measure(float *values) {
+  return bench_measure(0, values);
+}
+
+static esp_err_t bench_ltr390_measure(float *values) {
+  return bench_measure(1, values);
+}
+
+static void bench_register() {
+  measure_fn *measures[] = {bench_sht4x_measure, bench_ltr390_measure};
+  sensormgr_registration_t reg;
+  uint8_t idx, value_idx;
+
+  sim_sensors_seed(1);
+  for (idx = 0; idx < sizeof(bench_sims) / sizeof(bench_sims[0]); idx++) {
+    for (value_idx = 0; value_idx < bench_sims[idx]->channel_cnt;
+         value_idx++) {
+      bench.channels[bench.channel_cnt++] =
+          &bench_sims[idx]->channels[value_idx];
+    }
+    reg = *bench_sims[idx];
+    reg.measure = measures[idx];
+    reg.period_ms = 1;  // As fast as the read task goes
+    ESP_ERROR_CHECK(sensormgr_register_sensor(reg));
+  }
+}
+
+/**
+ * @brief Wait on the sink till done returns true
+ *
+ * @return false on timeout
+ */
+static bool bench_wait(bool (*done)(void), uint32_t timeout_ms) {
+  struct timespec deadline;
+  bool ret;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  pthread_mutex_lock(&bench.lock);
+  while (!(ret = done()) &&
+         0 == pthread_cond_timedwait(&bench.cond, &bench.lock, &deadline)) {
+  }
+  ret = done();
+  pthread_mutex_unlock(&bench.lock);
+  return ret;
+}
+
+static bool bench_responded(void) { return bench.responded; }
+
+static bool bench_delivered(void) {
+  return bench.delivered_cnt >= (uint32_t)atomic_load(&bench.taken);
+}
+
+// Set the wire format over the command topic, like the backend would
+static void bench_set_options() {
+  Sensormgr__SetOptionsRequest options = SENSORMGR__SET_OPTIONS_REQUEST__INIT;
+  CommandRequest req = COMMAND_REQUEST__INIT;
+  uint8_t *buf;
+  size_t len;
+
+  options.data_format = bench.format;
+  options.backfill = bench.backfill;
+  req.uuid = BENCH_UUID;
+  req.cmd_case = COMMAND_REQUEST__CMD_SENSORMGR_SET_OPTIONS_REQUEST;
+  req.sensormgr_set_options_request = &options;
+  len = command_request__get_packed_size(&req);
+  buf = malloc(len);
+  command_request__pack(&req, buf);
+  // mqttmgr subscribes from its CONNECTED handler, after the bit is set
+  while (0 == host_mqtt_publish("command/" BENCH_DEVICE_ID "/req/", buf, len)) {
+    vTaskDelay(1);
+  }
+  free(buf);
+  if (!bench_wait(bench_responded, BENCH_TIMEOUT_MS) ||
+      bench.ret_code != COMMAND_RESPONSE__RET_CODE_T__HANDLED) {
+    fprintf(stderr, "SetOptions was not handled\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * @brief Size and samples of the spill files left in the FAT directory
+ */
+static void bench_spill_files(size_t *bytes, int *samples) {
+  char dir_name[128], name[512];
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir;
+  FILE *f;
+  int cnt;
+
+  *bytes = 0;
+  *samples = 0;
+  snprintf(dir_name, sizeof(dir_name), "%s/log_data", bench.root);
+  dir = opendir(dir_name);
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    if (strstr(entry->d_name, ".BIN") == NULL) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%s/%s", dir_name, entry->d_name);
+    f = fopen(name, "rb");
+    if (f == NULL || 0 != fstat(fileno(f), &st) ||
+        (cnt = bench_spill_decode(f, NULL)) < 0) {
+      fprintf(stderr, "Corrupt spill file %s\n", name);
+      exit(EXIT_FAILURE);
+    }
+    *bytes += st.st_size;
+    *samples += cnt;
+    fclose(f);
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+}
+
+static int bench_rm(const char *path, const struct stat *st, int flag,
+                    struct FTW *ftw) {
+  return remove(path);
+}
+
+static void bench_usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--readings N] [--format json|protobuf] "
+          "[--backfill on|off] [--verbose]\n",
+          name);
+  exit(EXIT_FAILURE);
+}
+
+static void bench_args(int argc, char **argv) {
+  static const struct option options[] = {
+      {"readings", required_argument, NULL, 'n'},
+      {"format", required_argument, NULL, 'f'},
+      {"backfill", required_argument, NULL, 'b'},
+      {"verbose", no_argument, NULL, 'v'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+
+  while (-1 != (opt = getopt_long(argc, argv, "", options, NULL))) {
+    switch (opt) {
+      case 'n':
+        bench.readings = atoi(optarg);
+        break;
+      case 'f':
+        if (0 == strcmp(optarg, "json")) {
+          bench.format = SENSORMGR__DATA_FORMAT_T__JSON;
+        } else if (0 == strcmp(optarg, "protobuf")) {
+          bench.format = SENSORMGR__DATA_FORMAT_T__PROTOBUF;
+        } else {
+          bench_usage(argv[0]);
+        }
+        break;
+      case 'b':
+        if (0 == strcmp(optarg, "on")) {
+          bench.backfill = SENSORMGR__BACKFILL_T__BACKFILL_ON;
+        } else if (0 == strcmp(optarg, "off")) {
+          bench.backfill = SENSORMGR__BACKFILL_T__BACKFILL_OFF;
+        } else {
+          bench_usage(argv[0]);
+        }
+        break;
+      case 'v':
+        bench.verbose = true;
+        break;
+      default:
+        bench_usage(argv[0]);
+    }
+  }
+  if (bench.readings <= 0 || optind != argc) {
+    bench_usage(argv[0]);
+  }
+}
+
+int main(int argc, char **argv) {
+  int64_t wall_ns, cpu_ns, sink_ns;
+  size_t spill_bytes;
+  int spilled, taken;
+  bool ok = true;
+  uint8_t idx;
+
+  bench_args(argc, argv);
+  esp_log_level_set("*", bench.verbose ? ESP_LOG_INFO : ESP_LOG_ERROR);
+  snprintf(bench.root, sizeof(bench.root), "/tmp/bench_pipeline.XXXXXX");
+  if (mkdtemp(bench.root) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  host_fat_set_root(bench.root);
+  host_mqtt_set_sink(bench_sink, NULL);
+
+  // Same order as app_main
+  ESP_ERROR_CHECK(nvs_flash_init());
+  ESP_ERROR_CHECK(mqttmgr_init(BENCH_DEVICE_ID));
+  ESP_ERROR_CHECK(mqttlog_init());
+  ESP_ERROR_CHECK(sensormgr_init());
+  bench_register();
+  ESP_ERROR_CHECK(esp_event_loop_create_default());  // By wifi_provision
+  ESP_ERROR_CHECK(esp_wifi_start());
+  host_mqtt_set_broker_up(true);
+  ESP_ERROR_CHECK(mqttmgr_start());
+  xEventGroupWaitBits(mqttmgr_events, MQTTMGR_CLIENT_CONNECTED_BIT, pdFALSE,
+                      pdTRUE, portMAX_DELAY);
+  bench_set_options();
+
+  // Offline: every reading is spilled
+  host_mqtt_set_broker_up(false);
+  xEventGroupWaitBits(mqttmgr_events, MQTTMGR_CLIENT_NOTCONNECTED_BIT,
+                      pdFALSE, pdTRUE, portMAX_DELAY);
+  host_heap_reset_peak();
+  wall_ns = bench_clock_ns(CLOCK_MONOTONIC);
+  cpu_ns = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  ESP_ERROR_CHECK(sensormgr_start());
+  while (!atomic_load(&bench.exhausted)) {
+    vTaskDelay(10);
+  }
+  ESP_ERROR_CHECK(sensormgr_stop());
+  taken = atomic_load(&bench.taken);
+  bench_spill_files(&spill_bytes, &spilled);
+
+  // Back online: the spill files are drained
+  host_mqtt_set_broker_up(true);
+  ESP_ERROR_CHECK(sensormgr_start());
+  if (!bench_wait(bench_delivered, BENCH_TIMEOUT_MS)) {
+    fprintf(stderr, "Timed out with %u of %d readings delivered\n",
+            bench.delivered_cnt, taken);
+    ok = false;
+  }
+  pthread_mutex_lock(&bench.lock);
+  sink_ns = bench.sink_cpu_ns;
+  pthread_mutex_unlock(&bench.lock);
+  cpu_ns = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns - sink_ns;
+  wall_ns = bench_clock_ns(CLOCK_MONOTONIC) - wall_ns;
+  // The last file is removed once its PUBACKs are in, after the sink saw it
+  ESP_ERROR_CHECK(sensormgr_stop());
+
+  pthread_mutex_lock(&bench.lock);
+  printf("format %s, backfill %s\n",
+         bench.format == SENSORMGR__DATA_FORMAT_T__JSON ? "json" : "protobuf",
+         bench.backfill == SENSORMGR__BACKFILL_T__BACKFILL_ON ? "on" : "off");
+  printf("samples: %d taken, %d spilled, %u delivered\n", taken, spilled,
+         bench.delivered_cnt);
+  printf("cpu: %.0f samples/s (%.3f s), wall: %.3f s\n",
+         taken / (cpu_ns / 1e9), cpu_ns / 1e9, wall_ns / 1e9);
+  printf("flash: %zu bytes, %.2f bytes/sample\n", spill_bytes,
+         spilled > 0 ? (double)spill_bytes / spilled : 0.0);
+  for (idx = 0; idx < BENCH_TOPIC_MAX; idx++) {
+    if (bench.wire[idx].msg_cnt == 0) {
+      continue;
+    }
+    printf("wire %-16s %5u msgs %8zu bytes", bench_topic_prefixes[idx],
+           bench.wire[idx].msg_cnt, bench.wire[idx].bytes);
+    if (idx <= BENCH_TOPIC_BACKFILL && taken > 0) {
+      printf(" %.2f bytes/sample", (double)bench.wire[idx].bytes / taken);
+    }
+    printf("\n");
+  }
+  printf("heap: %zu bytes peak\n", host_heap_peak());
+
+  if (spilled != taken) {
+    fprintf(stderr, "%d samples taken but %d spilled\n", taken, spilled);
+    ok = false;
+  }
+  if (bench.unknown_cnt != 0) {
+    fprintf(stderr, "%u readings could not be decoded\n", bench.unknown_cnt);
+    ok = false;
+  }
+  for (idx = 0; idx < bench.channel_cnt; idx++) {
+    if (bench.measured[idx].cnt != bench.delivered[idx].cnt ||
+        bench.measured[idx].sum != bench.delivered[idx].sum) {
+      fprintf(stderr, "%s %s: %u readings summing to %lld measured, %u "
+              "summing to %lld delivered\n",
+              bench.channels[idx]->sensor, bench.channels[idx]->unit,
+              bench.measured[idx].cnt, (long long)bench.measured[idx].sum,
+              bench.delivered[idx].cnt, (long long)bench.delivered[idx].sum);
+      ok = false;
+    }
+  }
+  pthread_mutex_unlock(&bench.lock);
+
+  nftw(bench.root, bench_rm, 8, FTW_DEPTH | FTW_PHYS);
+  // The tasks never return, leave them running
+  fflush(stdout);
+  _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,236 @@
+// esp_err, logging, timer, random, default event loop, Wi-Fi and sleep
+
+#include <esp_err.h>
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_sleep.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <nvs.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <time.h>
+
+ESP_EVENT_DEFINE_BASE(WIFI_EVENT);
+ESP_EVENT_DEFINE_BASE(IP_EVENT);
+
+#define EVENT_HANDLERS_MAX 16
+
+typedef struct {
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void *arg;
+} event_handler_t;
+
+static struct {
+  pthread_mutex_t lock;
+  bool loop_created;  // By esp_event_loop_create_default
+  event_handler_t handlers[EVENT_HANDLERS_MAX];
+  int handler_count;
+  esp_log_level_t log_level;
+  struct timespec start;
+} state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .log_level = CONFIG_LOG_DEFAULT_LEVEL,
+};
+
+__attribute__((constructor)) static void esp_start_init(void) {
+  clock_gettime(CLOCK_MONOTONIC, &state.start);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+    case ESP_OK:
+      return "ESP_OK";
+    case ESP_FAIL:
+      return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+      return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+      return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+      return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+      return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+      return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+      return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+      return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE:
+      return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC:
+      return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_INVALID_VERSION:
+      return "ESP_ERR_INVALID_VERSION";
+    case ESP_ERR_INVALID_MAC:
+      return "ESP_ERR_INVALID_MAC";
+    case ESP_ERR_WIFI_NOT_INIT:
+      return "ESP_ERR_WIFI_NOT_INIT";
+    case ESP_ERR_WIFI_NOT_STARTED:
+      return "ESP_ERR_WIFI_NOT_STARTED";
+    case ESP_ERR_WIFI_STATE:
+      return "ESP_ERR_WIFI_STATE";
+    case ESP_ERR_NVS_NOT_INITIALIZED:
+      return "ESP_ERR_NVS_NOT_INITIALIZED";
+    case ESP_ERR_NVS_NOT_FOUND:
+      return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_TYPE_MISMATCH:
+      return "ESP_ERR_NVS_TYPE_MISMATCH";
+    case ESP_ERR_NVS_INVALID_NAME:
+      return "ESP_ERR_NVS_INVALID_NAME";
+    case ESP_ERR_NVS_INVALID_HANDLE:
+      return "ESP_ERR_NVS_INVALID_HANDLE";
+    case ESP_ERR_NVS_KEY_TOO_LONG:
+      return "ESP_ERR_NVS_KEY_TOO_LONG";
+    case ESP_ERR_NVS_INVALID_LENGTH:
+      return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_NVS_NO_FREE_PAGES:
+      return "ESP_ERR_NVS_NO_FREE_PAGES";
+    case ESP_ERR_NVS_NEW_VERSION_FOUND:
+      return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+    default:
+      return "UNKNOWN ERROR";
+  }
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  if (0 == strcmp(tag, "*")) {
+    state.log_level = level;
+  }
+}
+
+uint32_t esp_log_timestamp(void) {
+  return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+  va_list args;
+
+  if (level > state.log_level) {
+    return;
+  }
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+int64_t esp_timer_get_time(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - state.start.tv_sec) * 1000000LL +
+         (now.tv_nsec - state.start.tv_nsec) / 1000;
+}
+
+uint32_t esp_random(void) {
+  static __thread unsigned int seed;
+
+  if (seed == 0) {
+    seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)&seed;
+  }
+  return ((uint32_t)rand_r(&seed) << 16) ^ (uint32_t)rand_r(&seed);
+}
+
+void esp_restart(void) {
+  fprintf(stderr, "esp_restart\n");
+  exit(EXIT_FAILURE);
+}
+
+esp_err_t esp_event_loop_create_default(void) {
+  esp_err_t ret = ESP_OK;
+
+  pthread_mutex_lock(&state.lock);
+  if (state.loop_created) {
+    ret = ESP_ERR_INVALID_STATE;
+  }
+  state.loop_created = true;
+  pthread_mutex_unlock(&state.lock);
+  return ret;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t event_base,
+                                     int32_t event_id,
+                                     esp_event_handler_t event_handler,
+                                     void *event_handler_arg) {
+  pthread_mutex_lock(&state.lock);
+  if (!state.loop_created) {
+    pthread_mutex_unlock(&state.lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (state.handler_count == EVENT_HANDLERS_MAX) {
+    pthread_mutex_unlock(&state.lock);
+    return ESP_ERR_NO_MEM;
+  }
+  state.handlers[state.handler_count++] = (event_handler_t){
+      .base = event_base,
+      .id = event_id,
+      .handler = event_handler,
+      .arg = event_handler_arg,
+  };
+  pthread_mutex_unlock(&state.lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id,
+                         void *event_data, size_t event_data_size,
+                         TickType_t ticks_to_wait) {
+  event_handler_t handlers[EVENT_HANDLERS_MAX];
+  int count;
+
+  // Handlers may register others, call a copy without the lock
+  pthread_mutex_lock(&state.lock);
+  if (!state.loop_created) {
+    pthread_mutex_unlock(&state.lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  count = state.handler_count;
+  memcpy(handlers, state.handlers, count * sizeof(handlers[0]));
+  pthread_mutex_unlock(&state.lock);
+  for (int i = 0; i < count; i++) {
+    if (handlers[i].base == event_base &&
+        (handlers[i].id == ESP_EVENT_ANY_ID || handlers[i].id == event_id)) {
+      handlers[i].handler(handlers[i].arg, event_base, event_id, event_data);
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+  esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL, 0, portMAX_DELAY);
+  esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, NULL, 0,
+                 portMAX_DELAY);
+  esp_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, NULL, 0, portMAX_DELAY);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void) {
+  esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, NULL, 0,
+                 portMAX_DELAY);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void) {
+  esp_wifi_disconnect();
+  esp_event_post(WIFI_EVENT, WIFI_EVENT_STA_STOP, NULL, 0, portMAX_DELAY);
+  return ESP_OK;
+}
+
+esp_sleep_source_t esp_sleep_get_wakeup_cause(void) {
+  return ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us) {
+  return ESP_OK;
+}
+
+void esp_deep_sleep_start(void) {
+  fprintf(stderr, "esp_deep_sleep_start\n");
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,155 @@
+// FAT partitions as host directories, see esp_vfs_fat.h
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <esp_vfs_fat.h>
+#include <host_shim.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// One volume, FatFs' default drive "0:" and "/" are it
+static struct {
+  const char *root;
+  char base_path[PATH_MAX];
+  char dir[PATH_MAX];
+  bool mounted;
+} state;
+
+FILE *__real_fopen(const char *path, const char *mode);
+int __real_remove(const char *path);
+int __real_rename(const char *oldpath, const char *newpath);
+
+void host_fat_set_root(const char *dir) { state.root = dir; }
+
+esp_err_t esp_vfs_fat_spiflash_mount(
+    const char *base_path, const char *partition_label,
+    const esp_vfs_fat_mount_config_t *mount_config, wl_handle_t *wl_handle) {
+  if (state.mounted || state.root == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  snprintf(state.dir, sizeof(state.dir), "%s/%s", state.root,
+           partition_label);
+  if (0 != mkdir(state.dir, 0755) && errno != EEXIST) {
+    return ESP_FAIL;
+  }
+  snprintf(state.base_path, sizeof(state.base_path), "%s", base_path);
+  state.mounted = true;
+  *wl_handle = 0;
+  return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_spiflash_unmount(const char *base_path,
+                                       wl_handle_t wl_handle) {
+  if (!state.mounted || 0 != strcmp(base_path, state.base_path)) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  state.mounted = false;
+  return ESP_OK;
+}
+
+/**
+ * @brief Rewrite a path under the mounted base path to the host directory
+ *
+ * @return path itself when it is not under the base path
+ */
+static const char *fat_path(const char *path, char *buf, size_t len) {
+  size_t base_len = strlen(state.base_path);
+
+  if (!state.mounted || 0 != strncmp(path, state.base_path, base_len) ||
+      (path[base_len] != '/' && path[base_len] != '\0')) {
+    return path;
+  }
+  snprintf(buf, len, "%s%s", state.dir, path + base_len);
+  return buf;
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode) {
+  char buf[PATH_MAX];
+
+  return __real_fopen(fat_path(path, buf, sizeof(buf)), mode);
+}
+
+int __wrap_remove(const char *path) {
+  char buf[PATH_MAX];
+
+  return __real_remove(fat_path(path, buf, sizeof(buf)));
+}
+
+int __wrap_rename(const char *oldpath, const char *newpath) {
+  char old_buf[PATH_MAX];
+  char new_buf[PATH_MAX];
+
+  return __real_rename(fat_path(oldpath, old_buf, sizeof(old_buf)),
+                       fat_path(newpath, new_buf, sizeof(new_buf)));
+}
+
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs) {
+  static FATFS fs = {
+      .n_fatent = HOST_FAT_VOLUME_KB * 1024 / HOST_FAT_CLUSTER_SIZE + 2,
+      .csize = HOST_FAT_CLUSTER_SIZE / 512,
+      .ssize = 512,
+  };
+  char name[PATH_MAX];
+  DWORD used = 0;
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir;
+
+  if (!state.mounted || (dir = opendir(state.dir)) == NULL) {
+    return FR_NOT_READY;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (snprintf(name, sizeof(name), "%s/%s", state.dir, entry->d_name) >=
+        (int)sizeof(name)) {
+      continue;
+    }
+    if (0 == stat(name, &st) && S_ISREG(st.st_mode)) {
+      used += (st.st_size + HOST_FAT_CLUSTER_SIZE - 1) / HOST_FAT_CLUSTER_SIZE;
+    }
+  }
+  closedir(dir);
+  *nclst = used < fs.n_fatent - 2 ? fs.n_fatent - 2 - used : 0;
+  *fatfs = &fs;
+  return FR_OK;
+}
+
+FRESULT f_opendir(FF_DIR *dp, const TCHAR *path) {
+  char buf[PATH_MAX];
+
+  if (!state.mounted) {
+    return FR_NOT_READY;
+  }
+  // Drive relative, "/" is the root of the volume
+  snprintf(buf, sizeof(buf), "%s%s", state.dir, path);
+  dp->dir = opendir(buf);
+  return dp->dir != NULL ? FR_OK : FR_NO_PATH;
+}
+
+FRESULT f_readdir(FF_DIR *dp, FILINFO *fno) {
+  struct dirent *entry;
+  struct stat st;
+
+  // FatFs leaves out the dot entries
+  do {
+    entry = readdir(dp->dir);
+  } while (entry != NULL && entry->d_name[0] == '.');
+  if (entry == NULL) {
+    fno->fname[0] = '\0';
+    fno->fsize = 0;
+    return FR_OK;
+  }
+  snprintf(fno->fname, sizeof(fno->fname), "%s", entry->d_name);
+  fno->fsize = 0 == fstatat(dirfd(dp->dir), entry->d_name, &st, 0)
+                   ? (FSIZE_t)st.st_size
+                   : 0;
+  return FR_OK;
+}
+
+FRESULT f_closedir(FF_DIR *dp) {
+  closedir(dp->dir);
+  dp->dir = NULL;
+  return FR_OK;
+}
@@ -0,0 +1,395 @@
+// FreeRTOS tasks, notifications, semaphores and event groups over pthreads
+
+#include <errno.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "host_freertos.h"
+
+struct host_task {
+  pthread_t thread;
+  TaskFunction_t fn;
+  void *arg;
+  char name[16];
+  void *stack;  // Counted against the heap only
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  // Notifications and resuming
+  uint32_t notify_value;
+  bool notify_pending;
+  bool suspended;
+};
+
+struct host_semaphore {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  UBaseType_t count;
+  UBaseType_t max_count;
+};
+
+struct host_event_group {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EventBits_t bits;
+};
+
+static __thread struct host_task *self;
+// Threads not created by xTaskCreate, main included. Not allocated, the heap
+// hook asks for the current task from inside malloc.
+static __thread struct host_task foreign;
+
+void host_cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+void host_deadline(TickType_t ticks, struct timespec *deadline) {
+  uint64_t ns;
+
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  ns = deadline->tv_nsec + (uint64_t)ticks * portTICK_PERIOD_MS * 1000000ULL;
+  deadline->tv_sec += ns / 1000000000ULL;
+  deadline->tv_nsec = ns % 1000000000ULL;
+}
+
+bool host_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock,
+                    TickType_t ticks, const struct timespec *deadline) {
+  if (ticks == portMAX_DELAY) {
+    pthread_cond_wait(cond, lock);
+    return true;
+  }
+  return ETIMEDOUT != pthread_cond_timedwait(cond, lock, deadline);
+}
+
+static void host_task_init(struct host_task *task, const char *name) {
+  pthread_mutex_init(&task->lock, NULL);
+  host_cond_init(&task->cond);
+  strncpy(task->name, name, sizeof(task->name) - 1);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  if (self == NULL) {
+    host_task_init(&foreign, "foreign");
+    foreign.thread = pthread_self();
+    self = &foreign;
+  }
+  return self;
+}
+
+void host_task_park(void) {
+  struct host_task *task = xTaskGetCurrentTaskHandle();
+
+  pthread_mutex_lock(&task->lock);
+  while (task->suspended) {
+    pthread_cond_wait(&task->cond, &task->lock);
+  }
+  pthread_mutex_unlock(&task->lock);
+}
+
+static void *host_task_run(void *param) {
+  struct host_task *task = param;
+
+  self = task;
+  host_task_park();  // Created by a task it was suspended by already
+  task->fn(task->arg);
+  // A FreeRTOS task must not return
+  fprintf(stderr, "Task %s returned\n", task->name);
+  abort();
+}
+
+BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
+                       uint32_t usStackDepth, void *pvParameters,
+                       UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask) {
+  pthread_attr_t attr;
+  struct host_task *task = calloc(1, sizeof(*task));
+
+  if (task == NULL) {
+    return pdFAIL;
+  }
+  task->stack = malloc(usStackDepth);
+  if (task->stack == NULL) {
+    free(task);
+    return pdFAIL;
+  }
+  host_task_init(task, pcName);
+  task->fn = pvTaskCode;
+  task->arg = pvParameters;
+  // The task may look itself up through the handle right away
+  if (pxCreatedTask != NULL) {
+    *pxCreatedTask = task;
+  }
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (0 != pthread_create(&task->thread, &attr, host_task_run, task)) {
+    pthread_attr_destroy(&attr);
+    if (pxCreatedTask != NULL) {
+      *pxCreatedTask = NULL;
+    }
+    free(task->stack);
+    free(task);
+    return pdFAIL;
+  }
+  pthread_attr_destroy(&attr);
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t xTaskToDelete) {
+  struct host_task *task = xTaskGetCurrentTaskHandle();
+
+  if (xTaskToDelete != NULL && xTaskToDelete != task) {
+    fprintf(stderr, "vTaskDelete of another task is not supported\n");
+    abort();
+  }
+  // The handle is left behind, others may still hold it
+  free(task->stack);
+  task->stack = NULL;
+  pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t xTicksToDelay) {
+  struct timespec deadline;
+
+  host_task_park();
+  host_deadline(xTicksToDelay, &deadline);
+  while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                                  NULL)) {
+  }
+  host_task_park();
+}
+
+void vTaskSuspend(TaskHandle_t xTaskToSuspend) {
+  struct host_task *task =
+      xTaskToSuspend != NULL ? xTaskToSuspend : xTaskGetCurrentTaskHandle();
+
+  pthread_mutex_lock(&task->lock);
+  task->suspended = true;
+  pthread_mutex_unlock(&task->lock);
+  if (task == xTaskGetCurrentTaskHandle()) {
+    host_task_park();
+  }
+}
+
+void vTaskResume(TaskHandle_t xTaskToResume) {
+  pthread_mutex_lock(&xTaskToResume->lock);
+  xTaskToResume->suspended = false;
+  pthread_cond_broadcast(&xTaskToResume->cond);
+  pthread_mutex_unlock(&xTaskToResume->lock);
+}
+
+eTaskState eTaskGetState(TaskHandle_t xTask) {
+  bool suspended;
+
+  pthread_mutex_lock(&xTask->lock);
+  suspended = xTask->suspended;
+  pthread_mutex_unlock(&xTask->lock);
+  return suspended ? eSuspended : eRunning;
+}
+
+static struct timespec start;
+
+__attribute__((constructor)) static void host_tick_init(void) {
+  clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+TickType_t xTaskGetTickCount(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - start.tv_sec) * 1000LL +
+          (now.tv_nsec - start.tv_nsec) / 1000000) /
+         portTICK_PERIOD_MS;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify) {
+  pthread_mutex_lock(&xTaskToNotify->lock);
+  xTaskToNotify->notify_value++;
+  xTaskToNotify->notify_pending = true;
+  pthread_cond_broadcast(&xTaskToNotify->cond);
+  pthread_mutex_unlock(&xTaskToNotify->lock);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit,
+                          TickType_t xTicksToWait) {
+  struct host_task *task = xTaskGetCurrentTaskHandle();
+  struct timespec deadline;
+  uint32_t value;
+
+  host_task_park();
+  host_deadline(xTicksToWait, &deadline);
+  pthread_mutex_lock(&task->lock);
+  while (task->notify_value == 0 &&
+         host_cond_wait(&task->cond, &task->lock, xTicksToWait, &deadline)) {
+  }
+  value = task->notify_value;
+  if (value != 0) {
+    task->notify_value = xClearCountOnExit ? 0 : value - 1;
+  }
+  task->notify_pending = false;
+  pthread_mutex_unlock(&task->lock);
+  host_task_park();
+  return value;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t ulBitsToClearOnEntry,
+                           uint32_t ulBitsToClearOnExit,
+                           uint32_t *pulNotificationValue,
+                           TickType_t xTicksToWait) {
+  struct host_task *task = xTaskGetCurrentTaskHandle();
+  struct timespec deadline;
+  BaseType_t ret = pdFALSE;
+
+  host_task_park();
+  host_deadline(xTicksToWait, &deadline);
+  pthread_mutex_lock(&task->lock);
+  if (!task->notify_pending) {
+    task->notify_value &= ~ulBitsToClearOnEntry;
+  }
+  while (!task->notify_pending &&
+         host_cond_wait(&task->cond, &task->lock, xTicksToWait, &deadline)) {
+  }
+  if (pulNotificationValue != NULL) {
+    *pulNotificationValue = task->notify_value;
+  }
+  if (task->notify_pending) {
+    task->notify_value &= ~ulBitsToClearOnExit;
+    task->notify_pending = false;
+    ret = pdTRUE;
+  }
+  pthread_mutex_unlock(&task->lock);
+  host_task_park();
+  return ret;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount,
+                                           UBaseType_t uxInitialCount) {
+  struct host_semaphore *sem = calloc(1, sizeof(*sem));
+
+  if (sem == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&sem->lock, NULL);
+  host_cond_init(&sem->cond);
+  sem->count = uxInitialCount;
+  sem->max_count = uxMaxCount;
+  return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+  return xSemaphoreCreateCounting(1, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore) {
+  pthread_cond_destroy(&xSemaphore->cond);
+  pthread_mutex_destroy(&xSemaphore->lock);
+  free(xSemaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore,
+                          TickType_t xBlockTime) {
+  struct timespec deadline;
+  BaseType_t ret = pdFALSE;
+
+  host_deadline(xBlockTime, &deadline);
+  pthread_mutex_lock(&xSemaphore->lock);
+  while (xSemaphore->count == 0 && xBlockTime != 0 &&
+         host_cond_wait(&xSemaphore->cond, &xSemaphore->lock, xBlockTime,
+                        &deadline)) {
+  }
+  if (xSemaphore->count != 0) {
+    xSemaphore->count--;
+    ret = pdTRUE;
+  }
+  pthread_mutex_unlock(&xSemaphore->lock);
+  return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore) {
+  BaseType_t ret = pdFALSE;
+
+  pthread_mutex_lock(&xSemaphore->lock);
+  if (xSemaphore->count < xSemaphore->max_count) {
+    xSemaphore->count++;
+    pthread_cond_signal(&xSemaphore->cond);
+    ret = pdTRUE;
+  }
+  pthread_mutex_unlock(&xSemaphore->lock);
+  return ret;
+}
+
+EventGroupHandle_t xEventGroupCreate(void) {
+  struct host_event_group *group = calloc(1, sizeof(*group));
+
+  if (group == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&group->lock, NULL);
+  host_cond_init(&group->cond);
+  return group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup,
+                               const EventBits_t uxBitsToSet) {
+  EventBits_t bits;
+
+  pthread_mutex_lock(&xEventGroup->lock);
+  xEventGroup->bits |= uxBitsToSet;
+  bits = xEventGroup->bits;
+  pthread_cond_broadcast(&xEventGroup->cond);
+  pthread_mutex_unlock(&xEventGroup->lock);
+  return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup,
+                                 const EventBits_t uxBitsToClear) {
+  EventBits_t bits;
+
+  pthread_mutex_lock(&xEventGroup->lock);
+  bits = xEventGroup->bits;
+  xEventGroup->bits &= ~uxBitsToClear;
+  pthread_mutex_unlock(&xEventGroup->lock);
+  return bits;
+}
+
+static bool host_event_bits_met(EventBits_t bits, EventBits_t wait_for,
+                                BaseType_t wait_all) {
+  return wait_all ? (bits & wait_for) == wait_for : (bits & wait_for) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup,
+                                const EventBits_t uxBitsToWaitFor,
+                                const BaseType_t xClearOnExit,
+                                const BaseType_t xWaitForAllBits,
+                                TickType_t xTicksToWait) {
+  struct timespec deadline;
+  EventBits_t bits;
+
+  host_task_park();
+  host_deadline(xTicksToWait, &deadline);
+  pthread_mutex_lock(&xEventGroup->lock);
+  while (!host_event_bits_met(xEventGroup->bits, uxBitsToWaitFor,
+                              xWaitForAllBits) &&
+         xTicksToWait != 0 &&
+         host_cond_wait(&xEventGroup->cond, &xEventGroup->lock, xTicksToWait,
+                        &deadline)) {
+  }
+  bits = xEventGroup->bits;
+  if (xClearOnExit &&
+      host_event_bits_met(bits, uxBitsToWaitFor, xWaitForAllBits)) {
+    xEventGroup->bits &= ~uxBitsToWaitFor;
+  }
+  pthread_mutex_unlock(&xEventGroup->lock);
+  host_task_park();
+  return bits;
+}
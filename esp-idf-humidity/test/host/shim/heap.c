@@ -0,0 +1,103 @@
+// Heap accounting, malloc and friends interposed over glibc's
+
+#include <errno.h>
+#include <esp_heap_caps.h>
+#include <host_shim.h>
+#include <malloc.h>
+#include <sdkconfig.h>
+#include <stdatomic.h>
+#include <string.h>
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+static atomic_size_t used;
+static atomic_size_t peak;
+
+__attribute__((weak)) void esp_heap_trace_alloc_hook(void *ptr, size_t size,
+                                                     uint32_t caps) {}
+
+static void *heap_track(void *ptr, size_t size) {
+  size_t now;
+  size_t prev;
+
+  if (ptr == NULL) {
+    return NULL;
+  }
+  now = atomic_fetch_add(&used, malloc_usable_size(ptr)) +
+        malloc_usable_size(ptr);
+  prev = atomic_load(&peak);
+  while (now > prev && !atomic_compare_exchange_weak(&peak, &prev, now)) {
+  }
+#if CONFIG_HEAP_USE_HOOKS
+  esp_heap_trace_alloc_hook(ptr, size, MALLOC_CAP_DEFAULT);
+#endif
+  return ptr;
+}
+
+static void heap_untrack(void *ptr) {
+  if (ptr != NULL) {
+    atomic_fetch_sub(&used, malloc_usable_size(ptr));
+  }
+}
+
+void *malloc(size_t size) { return heap_track(__libc_malloc(size), size); }
+
+void *calloc(size_t nmemb, size_t size) {
+  return heap_track(__libc_calloc(nmemb, size), nmemb * size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+  void *new_ptr = __libc_realloc(ptr, size);
+
+  // glibc frees ptr for size 0, otherwise keeps it when out of memory
+  if (new_ptr != NULL || size == 0) {
+    atomic_fetch_sub(&used, old_size);
+  }
+  return heap_track(new_ptr, size);
+}
+
+void free(void *ptr) {
+  heap_untrack(ptr);
+  __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  return heap_track(__libc_memalign(alignment, size), size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr = memalign(alignment, size);
+
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+size_t host_heap_used(void) { return atomic_load(&used); }
+
+size_t host_heap_peak(void) { return atomic_load(&peak); }
+
+void host_heap_reset_peak(void) { atomic_store(&peak, atomic_load(&used)); }
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  size_t now = host_heap_used();
+
+  return now < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - now : 0;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+  size_t max = host_heap_peak();
+
+  return max < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - max : 0;
+}
@@ -0,0 +1,28 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+// Helpers the ring buffer shares with the FreeRTOS shim
+
+#include <freertos/FreeRTOS.h>
+#include <pthread.h>
+#include <time.h>
+
+// Condition variable timed on CLOCK_MONOTONIC
+void host_cond_init(pthread_cond_t *cond);
+
+// Deadline ticks from now, for host_cond_wait
+void host_deadline(TickType_t ticks, struct timespec *deadline);
+
+/**
+ * @brief Wait on cond till signalled or the deadline passes
+ *
+ * @param ticks portMAX_DELAY waits without the deadline
+ * @return false once the deadline has passed
+ */
+bool host_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock,
+                    TickType_t ticks, const struct timespec *deadline);
+
+// Stop the calling task while it is suspended
+void host_task_park(void);
+
+#endif
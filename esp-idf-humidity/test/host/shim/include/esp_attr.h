@@ -0,0 +1,10 @@
+#ifndef ESP_ATTR_H
+#define ESP_ATTR_H
+
+// Placement attributes of the ESP32 memory map, plain memory on the host
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+
+#endif
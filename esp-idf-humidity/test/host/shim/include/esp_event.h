@@ -0,0 +1,47 @@
+#ifndef ESP_EVENT_H
+#define ESP_EVENT_H
+
+#include <esp_err.h>
+#include <esp_system.h>  // Pulled in by esp_event_legacy.h on ESP-IDF
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+
+typedef const char *esp_event_base_t;
+typedef void (*esp_event_handler_t)(void *event_handler_arg,
+                                    esp_event_base_t event_base,
+                                    int32_t event_id, void *event_data);
+
+#define ESP_EVENT_ANY_ID -1
+#define ESP_EVENT_DECLARE_BASE(id) extern esp_event_base_t const id
+#define ESP_EVENT_DEFINE_BASE(id) esp_event_base_t const id = #id
+
+/**
+ * @brief Create the default event loop
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_STATE: Already created
+ */
+esp_err_t esp_event_loop_create_default(void);
+
+/**
+ * @brief Register a handler with the default event loop
+ *
+ * Events are handled on the task posting them on the host.
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_STATE: The default loop hasn't been created, as on
+ *    ESP-IDF
+ *  - ESP_ERR_NO_MEM: No room for another handler
+ */
+esp_err_t esp_event_handler_register(esp_event_base_t event_base,
+                                     int32_t event_id,
+                                     esp_event_handler_t event_handler,
+                                     void *event_handler_arg);
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id,
+                         void *event_data, size_t event_data_size,
+                         TickType_t ticks_to_wait);
+
+#endif
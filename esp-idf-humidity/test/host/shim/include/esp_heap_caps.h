@@ -0,0 +1,27 @@
+#ifndef ESP_HEAP_CAPS_H
+#define ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+/**
+ * @brief Heap left of HOST_HEAP_SIZE, see host_shim.h
+ *
+ * Every caps is the same heap on the host.
+ */
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+
+/**
+ * @brief Called after every allocation with CONFIG_HEAP_USE_HOOKS
+ *
+ * Weak, defined by whoever wants to trace them. Runs inside malloc, must not
+ * allocate.
+ */
+void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps);
+
+#endif
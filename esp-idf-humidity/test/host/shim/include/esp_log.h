@@ -0,0 +1,73 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+#include <sdkconfig.h>
+#include <stdint.h>
+
+typedef enum {
+  ESP_LOG_NONE,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#endif
+
+/**
+ * @brief Set the level logged from tag, "*" for every tag
+ *
+ * Only the "*" level is kept on the host.
+ */
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+
+uint32_t esp_log_timestamp(void);
+
+// Left without a format attribute, the firmware formats for 32 bit size_t
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...);
+
+#define ESP_LOG_FORMAT_(letter, format) #letter " (%u) %s: " format "\n"
+
+#define ESP_LOG_LEVEL(level, tag, format, ...)                                \
+  do {                                                                        \
+    if (level == ESP_LOG_ERROR) {                                             \
+      esp_log_write(ESP_LOG_ERROR, tag, ESP_LOG_FORMAT_(E, format),           \
+                    esp_log_timestamp(), tag, ##__VA_ARGS__);                 \
+    } else if (level == ESP_LOG_WARN) {                                       \
+      esp_log_write(ESP_LOG_WARN, tag, ESP_LOG_FORMAT_(W, format),            \
+                    esp_log_timestamp(), tag, ##__VA_ARGS__);                 \
+    } else if (level == ESP_LOG_DEBUG) {                                      \
+      esp_log_write(ESP_LOG_DEBUG, tag, ESP_LOG_FORMAT_(D, format),           \
+                    esp_log_timestamp(), tag, ##__VA_ARGS__);                 \
+    } else if (level == ESP_LOG_VERBOSE) {                                    \
+      esp_log_write(ESP_LOG_VERBOSE, tag, ESP_LOG_FORMAT_(V, format),         \
+                    esp_log_timestamp(), tag, ##__VA_ARGS__);                 \
+    } else {                                                                  \
+      esp_log_write(ESP_LOG_INFO, tag, ESP_LOG_FORMAT_(I, format),            \
+                    esp_log_timestamp(), tag, ##__VA_ARGS__);                 \
+    }                                                                         \
+  } while (0)
+
+#define ESP_LOG_LEVEL_LOCAL(level, tag, format, ...)      \
+  do {                                                    \
+    if (LOG_LOCAL_LEVEL >= level) {                       \
+      ESP_LOG_LEVEL(level, tag, format, ##__VA_ARGS__);   \
+    }                                                     \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...) \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) \
+  ESP_LOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef ESP_NETIF_H
+#define ESP_NETIF_H
+
+#include <esp_event.h>
+
+ESP_EVENT_DECLARE_BASE(IP_EVENT);
+
+typedef enum {
+  IP_EVENT_STA_GOT_IP,
+  IP_EVENT_STA_LOST_IP,
+} ip_event_t;
+
+#endif
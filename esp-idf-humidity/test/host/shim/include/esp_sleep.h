@@ -0,0 +1,21 @@
+#ifndef ESP_SLEEP_H
+#define ESP_SLEEP_H
+
+#include <esp_err.h>
+#include <stdint.h>
+
+typedef enum {
+  ESP_SLEEP_WAKEUP_UNDEFINED,
+  ESP_SLEEP_WAKEUP_ALL,
+  ESP_SLEEP_WAKEUP_EXT0,
+  ESP_SLEEP_WAKEUP_EXT1,
+  ESP_SLEEP_WAKEUP_TIMER,
+} esp_sleep_source_t;
+
+// Never woken from deep sleep on the host
+esp_sleep_source_t esp_sleep_get_wakeup_cause(void);
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us);
+// Exits the process
+void esp_deep_sleep_start(void) __attribute__((noreturn));
+
+#endif
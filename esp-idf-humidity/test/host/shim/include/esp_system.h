@@ -0,0 +1,12 @@
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+
+#include <esp_err.h>
+#include <stdint.h>
+
+uint32_t esp_random(void);
+
+// Exits the process
+void esp_restart(void) __attribute__((noreturn));
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+#include <stdint.h>
+
+/**
+ * @brief Microseconds since the process started
+ */
+int64_t esp_timer_get_time(void);
+
+#endif
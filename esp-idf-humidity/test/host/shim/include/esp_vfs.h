@@ -0,0 +1,8 @@
+#ifndef ESP_VFS_H
+#define ESP_VFS_H
+
+#include <esp_err.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef ESP_VFS_FAT_H
+#define ESP_VFS_FAT_H
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ff.h"
+#include "wear_levelling.h"
+
+typedef struct {
+  bool format_if_mount_failed;
+  int max_files;
+  size_t allocation_unit_size;
+} esp_vfs_fat_mount_config_t;
+
+typedef esp_vfs_fat_mount_config_t esp_vfs_fat_sdmmc_mount_config_t;
+
+/**
+ * @brief Mount the FAT partition of partition_label at base_path
+ *
+ * The partition is a directory named after the label under the root given to
+ * host_fat_set_root, created when missing. Paths under base_path opened with
+ * fopen, remove and rename are rewritten to it.
+ *
+ * @return
+ *  - ESP_OK: Success
+ *  - ESP_ERR_INVALID_STATE: Already mounted, or no root was given
+ *  - ESP_FAIL: Creating the directory failed
+ */
+esp_err_t esp_vfs_fat_spiflash_mount(
+    const char *base_path, const char *partition_label,
+    const esp_vfs_fat_mount_config_t *mount_config, wl_handle_t *wl_handle);
+
+esp_err_t esp_vfs_fat_spiflash_unmount(const char *base_path,
+                                       wl_handle_t wl_handle);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef ESP_WIFI_H
+#define ESP_WIFI_H
+
+#include <esp_err.h>
+#include <esp_event.h>
+
+#define ESP_ERR_WIFI_NOT_INIT (ESP_ERR_WIFI_BASE + 1)
+#define ESP_ERR_WIFI_NOT_STARTED (ESP_ERR_WIFI_BASE + 2)
+#define ESP_ERR_WIFI_STATE (ESP_ERR_WIFI_BASE + 6)
+
+ESP_EVENT_DECLARE_BASE(WIFI_EVENT);
+
+typedef enum {
+  WIFI_EVENT_WIFI_READY = 0,
+  WIFI_EVENT_SCAN_DONE,
+  WIFI_EVENT_STA_START,
+  WIFI_EVENT_STA_STOP,
+  WIFI_EVENT_STA_CONNECTED,
+  WIFI_EVENT_STA_DISCONNECTED,
+} wifi_event_t;
+
+// The station associates and gets an address as soon as it is started
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_stop(void);
+esp_err_t esp_wifi_disconnect(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef FF_H
+#define FF_H
+
+#include <stdint.h>
+
+// The few FatFs calls made around the VFS, over the directory a partition is
+// mounted in
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef char TCHAR;
+typedef DWORD FSIZE_t;
+
+typedef enum {
+  FR_OK = 0,
+  FR_DISK_ERR,
+  FR_INT_ERR,
+  FR_NOT_READY,
+  FR_NO_FILE,
+  FR_NO_PATH,
+  FR_INVALID_NAME,
+  FR_DENIED,
+  FR_EXIST,
+  FR_INVALID_OBJECT,
+  FR_WRITE_PROTECTED,
+  FR_INVALID_DRIVE,
+  FR_NOT_ENABLED,
+  FR_NO_FILESYSTEM,
+} FRESULT;
+
+typedef struct {
+  DWORD n_fatent;  // Clusters + 2
+  WORD csize;      // Sectors per cluster
+  WORD ssize;      // Bytes per sector
+} FATFS;
+
+typedef struct {
+  void *dir;  // DIR of the host directory
+} FF_DIR;
+
+typedef struct {
+  FSIZE_t fsize;
+  TCHAR fname[256];
+} FILINFO;
+
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs);
+FRESULT f_opendir(FF_DIR *dp, const TCHAR *path);
+FRESULT f_readdir(FF_DIR *dp, FILINFO *fno);
+FRESULT f_closedir(FF_DIR *dp);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+// FreeRTOS API over pthreads, see shim/freertos.c
+
+#include <limits.h>
+#include <sdkconfig.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portMAX_DELAY (TickType_t)0xffffffffUL
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(xTimeInMs)                                   \
+  ((TickType_t)(((TickType_t)(xTimeInMs) *                         \
+                 (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdPASS (pdTRUE)
+#define pdFAIL (pdFALSE)
+
+#endif
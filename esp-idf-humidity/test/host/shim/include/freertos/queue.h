@@ -0,0 +1,9 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "FreeRTOS.h"
+
+// The components only use semaphores and ring buffers
+typedef struct host_queue *QueueHandle_t;
+
+#endif
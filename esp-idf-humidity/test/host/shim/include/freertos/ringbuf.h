@@ -0,0 +1,35 @@
+#ifndef FREERTOS_RINGBUF_H
+#define FREERTOS_RINGBUF_H
+
+#include "FreeRTOS.h"
+
+// Items are 8 byte aligned on the host, for the pointers of the structs
+// queued in them
+typedef struct host_ringbuf *RingbufHandle_t;
+
+typedef enum {
+  RINGBUF_TYPE_NOSPLIT = 0,
+  RINGBUF_TYPE_ALLOWSPLIT,
+  RINGBUF_TYPE_BYTEBUF,
+} RingbufferType_t;
+
+/**
+ * @brief Create a ring buffer of xBufferSize bytes, headers included
+ *
+ * Only RINGBUF_TYPE_NOSPLIT is supported. Items are received in the order
+ * they were acquired and can be returned in any order.
+ */
+RingbufHandle_t xRingbufferCreate(size_t xBufferSize,
+                                  RingbufferType_t xBufferType);
+void vRingbufferDelete(RingbufHandle_t xRingbuffer);
+BaseType_t xRingbufferSend(RingbufHandle_t xRingbuffer, const void *pvItem,
+                           size_t xItemSize, TickType_t xTicksToWait);
+BaseType_t xRingbufferSendAcquire(RingbufHandle_t xRingbuffer, void **ppvItem,
+                                  size_t xItemSize, TickType_t xTicksToWait);
+BaseType_t xRingbufferSendComplete(RingbufHandle_t xRingbuffer, void *pvItem);
+void *xRingbufferReceive(RingbufHandle_t xRingbuffer, size_t *pxItemSize,
+                         TickType_t xTicksToWait);
+void vRingbufferReturnItem(RingbufHandle_t xRingbuffer, void *pvItem);
+size_t xRingbufferGetMaxItemSize(RingbufHandle_t xRingbuffer);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "FreeRTOS.h"
+
+#define tskIDLE_PRIORITY ((UBaseType_t)0U)
+
+typedef struct host_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+typedef enum {
+  eRunning = 0,
+  eReady,
+  eBlocked,
+  eSuspended,
+  eDeleted,
+  eInvalid,
+} eTaskState;
+
+/**
+ * @brief Run a task on a thread of its own
+ *
+ * Priorities are left to the host scheduler. The stack is allocated from the
+ * heap like it is on the ESP32, so it counts against it, but the thread runs
+ * on a stack of its own.
+ *
+ * @param usStackDepth Bytes, as on ESP-IDF
+ * @return
+ *  - pdPASS: Success
+ *  - pdFAIL: Out of memory or threads
+ */
+BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
+                       uint32_t usStackDepth, void *pvParameters,
+                       UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask);
+
+// Only a task deleting itself, NULL, is supported
+void vTaskDelete(TaskHandle_t xTaskToDelete);
+
+void vTaskDelay(TickType_t xTicksToDelay);
+
+/**
+ * @brief Suspend a task, NULL for the calling one
+ *
+ * Another task is stopped once it blocks, in vTaskDelay or waiting on an
+ * event group, notification or ring buffer, or wakes up from it. A task
+ * suspended while waiting on a semaphore gets it first.
+ */
+void vTaskSuspend(TaskHandle_t xTaskToSuspend);
+void vTaskResume(TaskHandle_t xTaskToResume);
+// eSuspended from vTaskSuspend till vTaskResume, eRunning otherwise
+eTaskState eTaskGetState(TaskHandle_t xTask);
+
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify);
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit,
+                          TickType_t xTicksToWait);
+BaseType_t xTaskNotifyWait(uint32_t ulBitsToClearOnEntry,
+                           uint32_t ulBitsToClearOnExit,
+                           uint32_t *pulNotificationValue,
+                           TickType_t xTicksToWait);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef HOST_SHIM_H
+#define HOST_SHIM_H
+
+// Controls of the host shims that have no ESP-IDF counterpart
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Directory FAT partitions are mounted in, one directory per label
+ *
+ * @param dir Kept, must outlive every mount
+ */
+void host_fat_set_root(const char *dir);
+
+// Size of the FAT volume f_getfree reports, files take whole clusters of it
+#define HOST_FAT_VOLUME_KB 1024
+#define HOST_FAT_CLUSTER_SIZE 4096
+
+/**
+ * @brief Called with every message the loopback broker gets
+ *
+ * Runs on the task of the publishing client, before MQTT_EVENT_PUBLISHED is
+ * delivered to it.
+ */
+typedef void(host_mqtt_sink_fn)(const char *topic, const uint8_t *data,
+                                size_t len, void *arg);
+
+void host_mqtt_set_sink(host_mqtt_sink_fn *sink, void *arg);
+
+/**
+ * @brief Take the loopback broker up or down
+ *
+ * Started clients get one MQTT_EVENT_DISCONNECTED when it goes down and
+ * MQTT_EVENT_CONNECTED once it is back up.
+ */
+void host_mqtt_set_broker_up(bool up);
+
+/**
+ * @brief Publish from the broker side to the subscribed, connected clients
+ *
+ * @return Clients it was delivered to
+ */
+int host_mqtt_publish(const char *topic, const void *data, size_t len);
+
+// Nominal heap heap_caps_get_free_size counts down from
+#define HOST_HEAP_SIZE (4 * 1024 * 1024)
+
+// Bytes allocated from the heap, task stacks included
+size_t host_heap_used(void);
+size_t host_heap_peak(void);
+void host_heap_reset_peak(void);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+// esp-mqtt client of the loopback broker, see shim/mqtt_loopback.c
+
+#include <esp_err.h>
+#include <esp_event.h>
+#include <stdbool.h>
+
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum {
+  MQTT_EVENT_ANY = -1,
+  MQTT_EVENT_ERROR = 0,
+  MQTT_EVENT_CONNECTED,
+  MQTT_EVENT_DISCONNECTED,
+  MQTT_EVENT_SUBSCRIBED,
+  MQTT_EVENT_UNSUBSCRIBED,
+  MQTT_EVENT_PUBLISHED,
+  MQTT_EVENT_DATA,
+  MQTT_EVENT_BEFORE_CONNECT,
+  MQTT_EVENT_DELETED,
+} esp_mqtt_event_id_t;
+
+typedef struct esp_mqtt_event_t {
+  esp_mqtt_event_id_t event_id;
+  esp_mqtt_client_handle_t client;
+  void *user_context;
+  char *data;
+  int data_len;
+  int total_data_len;
+  int current_data_offset;
+  char *topic;  // NUL terminated on the host
+  int topic_len;
+  int msg_id;
+  int session_present;
+  bool retain;
+  int qos;
+  bool dup;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+typedef struct {
+  const char *uri;
+  int buffer_size;
+} esp_mqtt_client_config_t;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(
+    const esp_mqtt_client_config_t *config);
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
+                                         esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler,
+                                         void *event_handler_args);
+
+/**
+ * @brief Connect to the loopback broker, now and whenever it comes back up
+ */
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client);
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Publish to the loopback broker
+ *
+ * Messages of QoS 1 and 2 are kept in the outbox while disconnected and sent
+ * once connected, MQTT_EVENT_PUBLISHED follows their delivery. QoS 0 ones are
+ * dropped while disconnected.
+ *
+ * @param len 0 for strlen(data)
+ * @return msg_id, 0 for QoS 0 and -1 when out of memory
+ */
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
+                            const char *data, int len, int qos, int retain);
+
+// Topic filters are exact or end in "#"
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client,
+                              const char *topic, int qos);
+
+#endif
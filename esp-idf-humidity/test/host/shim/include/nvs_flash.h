@@ -0,0 +1,12 @@
+#ifndef NVS_FLASH_H
+#define NVS_FLASH_H
+
+#include <esp_err.h>
+
+#include "nvs.h"
+
+// NVS is kept in memory on the host, a fresh process starts out erased
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// Host build configuration: sdkconfig.defaults, then the Kconfig defaults.
+// Bools left off in the firmware are left undefined.
+
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#define CONFIG_HEAP_USE_HOOKS 1
+#define CONFIG_LTR390_ENABLED 1
+
+#define CONFIG_MQTTMGR_RINGBUF_SIZE 12
+#define CONFIG_MQTTMGR_CMD_ARENA_SIZE 8192
+#define CONFIG_MQTTMGR_CMD_QUEUE_SIZE 2048
+#define CONFIG_MQTTMGR_CMD_TIMEOUT 5000
+#define CONFIG_MQTTMGR_UPLINK_INTERVAL 900
+#define CONFIG_MQTTMGR_UPLINK_LINGER 5
+#define CONFIG_MQTTMGR_UPLINK_MAX_ON 120
+#define CONFIG_MQTTLOG_RINGBUF_SIZE 4
+#define CONFIG_MQTTLOG_RATE_BURST 10
+#define CONFIG_MQTTLOG_RATE_INTERVAL 1000
+
+#define CONFIG_SENSORMGR_RINGBUF_SIZE 12
+#define CONFIG_SENSORMGR_SAMPLE_RATE 5000
+#define CONFIG_SENSORMGR_CHECKPOINT_BYTES 2048
+#define CONFIG_SENSORMGR_DEEP_SLEEP_PERIOD 300
+#define CONFIG_SENSORMGR_DEEP_SLEEP_UPLOAD_TIMEOUT 60
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef HOST_UNITY_H
+#define HOST_UNITY_H
+
+// ESP-IDF's TEST_CASE over plain Unity, cases register themselves with the
+// runner in test_main.c
+
+#include <esp_err.h>  // For stdio, as ESP-IDF's unity_config.h does
+#include_next <unity.h>
+
+typedef struct {
+  const char *name;
+  const char *desc;
+  void (*fn)(void);
+  const char *file;
+  int line;
+} host_test_desc_t;
+
+void host_test_register(const host_test_desc_t *desc);
+
+#define HOST_TEST_CONCAT_(a, b) a##b
+#define HOST_TEST_UID_(what, line) HOST_TEST_CONCAT_(what, line)
+
+#define TEST_CASE(name_, desc_)                                              \
+  static void HOST_TEST_UID_(test_func_, __LINE__)(void);                    \
+  static void __attribute__((constructor))                                   \
+  HOST_TEST_UID_(test_reg_, __LINE__)(void) {                                \
+    static const host_test_desc_t test_desc_ = {                             \
+        .name = name_,                                                       \
+        .desc = desc_,                                                       \
+        .fn = HOST_TEST_UID_(test_func_, __LINE__),                          \
+        .file = __FILE__,                                                    \
+        .line = __LINE__,                                                    \
+    };                                                                       \
+    host_test_register(&test_desc_);                                         \
+  }                                                                          \
+  static void HOST_TEST_UID_(test_func_, __LINE__)(void)
+
+#endif
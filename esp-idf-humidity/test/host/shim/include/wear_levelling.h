@@ -0,0 +1,10 @@
+#ifndef WEAR_LEVELLING_H
+#define WEAR_LEVELLING_H
+
+#include <stdint.h>
+
+typedef int32_t wl_handle_t;
+
+#define WL_INVALID_HANDLE -1
+
+#endif
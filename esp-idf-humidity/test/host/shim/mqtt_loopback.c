@@ -0,0 +1,427 @@
+// esp-mqtt clients of a broker in the same process, see host_shim.h
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <host_shim.h>
+#include <mqtt_client.h>
+#include <pthread.h>
+
+#define MQTT_CLIENTS_MAX 4
+#define MQTT_SUBSCRIPTIONS_MAX 8
+#define MQTT_TASK_STACK 6144
+
+typedef enum {
+  MQTT_JOB_CONNECT,
+  MQTT_JOB_DISCONNECT,
+  MQTT_JOB_SUBSCRIBED,
+  MQTT_JOB_SEND,  // Publish from the client
+  MQTT_JOB_DATA,  // Publish to the client
+} mqtt_job_type_t;
+
+typedef struct mqtt_job {
+  struct mqtt_job *next;
+  mqtt_job_type_t type;
+  int msg_id;
+  int qos;
+  int retain;
+  char *topic;  // Points into data, after the payload
+  int len;
+  char data[];
+} mqtt_job_t;
+
+// FIFO of jobs, the outbox of a client too
+typedef struct {
+  mqtt_job_t *head;
+  mqtt_job_t **tail;
+} mqtt_jobs_t;
+
+struct esp_mqtt_client {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  TaskHandle_t task;
+  mqtt_jobs_t jobs;
+  mqtt_jobs_t outbox;
+  bool started;
+  bool connected;  // Only changed by the task of the client
+  int next_msg_id;
+  char *subscriptions[MQTT_SUBSCRIPTIONS_MAX];
+  esp_event_handler_t handler;
+  void *handler_arg;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  bool up;
+  struct esp_mqtt_client *clients[MQTT_CLIENTS_MAX];
+  int client_count;
+  host_mqtt_sink_fn *sink;
+  void *sink_arg;
+} broker = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void mqtt_jobs_push(mqtt_jobs_t *jobs, mqtt_job_t *job) {
+  job->next = NULL;
+  *jobs->tail = job;
+  jobs->tail = &job->next;
+}
+
+static mqtt_job_t *mqtt_jobs_pop(mqtt_jobs_t *jobs) {
+  mqtt_job_t *job = jobs->head;
+
+  if (job != NULL) {
+    jobs->head = job->next;
+    if (jobs->head == NULL) {
+      jobs->tail = &jobs->head;
+    }
+  }
+  return job;
+}
+
+static mqtt_job_t *mqtt_job_new(mqtt_job_type_t type, const char *topic,
+                                const void *data, int len) {
+  size_t topic_len = topic != NULL ? strlen(topic) + 1 : 0;
+  mqtt_job_t *job = calloc(1, sizeof(*job) + len + topic_len);
+
+  if (job == NULL) {
+    return NULL;
+  }
+  job->type = type;
+  job->len = len;
+  if (len != 0) {
+    memcpy(job->data, data, len);
+  }
+  if (topic != NULL) {
+    job->topic = job->data + len;
+    memcpy(job->topic, topic, topic_len);
+  }
+  return job;
+}
+
+// Caller holds the lock of the client
+static void mqtt_client_post(esp_mqtt_client_handle_t client,
+                             mqtt_job_t *job) {
+  mqtt_jobs_push(&client->jobs, job);
+  pthread_cond_signal(&client->cond);
+}
+
+static void mqtt_client_dispatch(esp_mqtt_client_handle_t client,
+                                 esp_mqtt_event_id_t event_id,
+                                 const mqtt_job_t *job) {
+  esp_mqtt_event_t event = {
+      .event_id = event_id,
+      .client = client,
+      .user_context = client->handler_arg,
+  };
+
+  if (job != NULL) {
+    event.msg_id = job->msg_id;
+    event.qos = job->qos;
+    event.retain = job->retain;
+  }
+  if (job != NULL && job->type == MQTT_JOB_DATA) {
+    event.data = (char *)job->data;
+    event.data_len = event.total_data_len = job->len;
+    event.topic = job->topic;
+    event.topic_len = strlen(job->topic);
+  }
+  if (client->handler != NULL) {
+    client->handler(client->handler_arg, "MQTT_EVENTS", event_id, &event);
+  }
+}
+
+// Deliver a message to the broker, it is freed
+static void mqtt_client_send(esp_mqtt_client_handle_t client,
+                             mqtt_job_t *job) {
+  host_mqtt_sink_fn *sink;
+  void *sink_arg;
+
+  pthread_mutex_lock(&broker.lock);
+  sink = broker.sink;
+  sink_arg = broker.sink_arg;
+  pthread_mutex_unlock(&broker.lock);
+  if (sink != NULL) {
+    sink(job->topic, (const uint8_t *)job->data, job->len, sink_arg);
+  }
+  if (job->qos > 0) {
+    mqtt_client_dispatch(client, MQTT_EVENT_PUBLISHED, job);
+  }
+  free(job);
+}
+
+static void mqtt_client_task(void *arg) {
+  esp_mqtt_client_handle_t client = arg;
+  mqtt_job_t *job;
+
+  for (;;) {
+    pthread_mutex_lock(&client->lock);
+    while ((job = mqtt_jobs_pop(&client->jobs)) == NULL) {
+      pthread_cond_wait(&client->cond, &client->lock);
+    }
+    switch (job->type) {
+      case MQTT_JOB_CONNECT:
+        if (client->connected || !client->started) {
+          break;
+        }
+        client->connected = true;
+        pthread_mutex_unlock(&client->lock);
+        mqtt_client_dispatch(client, MQTT_EVENT_CONNECTED, NULL);
+        pthread_mutex_lock(&client->lock);
+        // Resend what was published while disconnected
+        while (client->connected && client->outbox.head != NULL) {
+          mqtt_job_t *sent = mqtt_jobs_pop(&client->outbox);
+
+          pthread_mutex_unlock(&client->lock);
+          mqtt_client_send(client, sent);
+          pthread_mutex_lock(&client->lock);
+        }
+        break;
+      case MQTT_JOB_DISCONNECT:
+        if (!client->connected) {
+          break;
+        }
+        client->connected = false;
+        for (int i = 0; i < MQTT_SUBSCRIPTIONS_MAX; i++) {
+          free(client->subscriptions[i]);
+          client->subscriptions[i] = NULL;
+        }
+        pthread_mutex_unlock(&client->lock);
+        mqtt_client_dispatch(client, MQTT_EVENT_DISCONNECTED, NULL);
+        pthread_mutex_lock(&client->lock);
+        break;
+      case MQTT_JOB_SEND:
+        if (!client->connected) {
+          // Kept for when the client connects again
+          mqtt_jobs_push(&client->outbox, job);
+          job = NULL;
+          break;
+        }
+        pthread_mutex_unlock(&client->lock);
+        mqtt_client_send(client, job);
+        job = NULL;
+        pthread_mutex_lock(&client->lock);
+        break;
+      case MQTT_JOB_SUBSCRIBED:
+      case MQTT_JOB_DATA:
+        if (!client->connected) {
+          break;
+        }
+        pthread_mutex_unlock(&client->lock);
+        mqtt_client_dispatch(client,
+                             job->type == MQTT_JOB_DATA
+                                 ? MQTT_EVENT_DATA
+                                 : MQTT_EVENT_SUBSCRIBED,
+                             job);
+        pthread_mutex_lock(&client->lock);
+        break;
+    }
+    pthread_mutex_unlock(&client->lock);
+    free(job);
+  }
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(
+    const esp_mqtt_client_config_t *config) {
+  struct esp_mqtt_client *client;
+
+  pthread_mutex_lock(&broker.lock);
+  if (broker.client_count == MQTT_CLIENTS_MAX) {
+    pthread_mutex_unlock(&broker.lock);
+    return NULL;
+  }
+  client = calloc(1, sizeof(*client));
+  if (client == NULL) {
+    pthread_mutex_unlock(&broker.lock);
+    return NULL;
+  }
+  pthread_mutex_init(&client->lock, NULL);
+  pthread_cond_init(&client->cond, NULL);
+  client->jobs.tail = &client->jobs.head;
+  client->outbox.tail = &client->outbox.head;
+  client->next_msg_id = 1;
+  if (pdPASS != xTaskCreate(mqtt_client_task, "mqtt_task", MQTT_TASK_STACK,
+                            client, 5, &client->task)) {
+    free(client);
+    pthread_mutex_unlock(&broker.lock);
+    return NULL;
+  }
+  broker.clients[broker.client_count++] = client;
+  pthread_mutex_unlock(&broker.lock);
+  return client;
+}
+
+esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
+                                         esp_mqtt_event_id_t event,
+                                         esp_event_handler_t event_handler,
+                                         void *event_handler_args) {
+  if (event != MQTT_EVENT_ANY) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  pthread_mutex_lock(&client->lock);
+  client->handler = event_handler;
+  client->handler_arg = event_handler_args;
+  pthread_mutex_unlock(&client->lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client) {
+  mqtt_job_t *job = mqtt_job_new(MQTT_JOB_CONNECT, NULL, NULL, 0);
+
+  if (job == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  pthread_mutex_lock(&broker.lock);
+  pthread_mutex_lock(&client->lock);
+  if (client->started) {
+    pthread_mutex_unlock(&client->lock);
+    pthread_mutex_unlock(&broker.lock);
+    free(job);
+    return ESP_FAIL;
+  }
+  client->started = true;
+  if (broker.up) {
+    mqtt_client_post(client, job);
+  } else {
+    free(job);
+  }
+  pthread_mutex_unlock(&client->lock);
+  pthread_mutex_unlock(&broker.lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client) {
+  mqtt_job_t *job = mqtt_job_new(MQTT_JOB_DISCONNECT, NULL, NULL, 0);
+
+  if (job == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  pthread_mutex_lock(&client->lock);
+  if (!client->started) {
+    pthread_mutex_unlock(&client->lock);
+    free(job);
+    return ESP_FAIL;
+  }
+  client->started = false;
+  mqtt_client_post(client, job);
+  pthread_mutex_unlock(&client->lock);
+  return ESP_OK;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
+                            const char *data, int len, int qos, int retain) {
+  mqtt_job_t *job;
+  int msg_id = 0;
+
+  if (len == 0) {
+    len = strlen(data);
+  }
+  pthread_mutex_lock(&client->lock);
+  if (qos == 0 && !client->connected) {
+    pthread_mutex_unlock(&client->lock);
+    return 0;  // Dropped
+  }
+  job = mqtt_job_new(MQTT_JOB_SEND, topic, data, len);
+  if (job == NULL) {
+    pthread_mutex_unlock(&client->lock);
+    return -1;
+  }
+  if (qos > 0) {
+    msg_id = client->next_msg_id;
+    client->next_msg_id = msg_id == UINT16_MAX ? 1 : msg_id + 1;
+  }
+  job->msg_id = msg_id;
+  job->qos = qos;
+  job->retain = retain;
+  mqtt_client_post(client, job);
+  pthread_mutex_unlock(&client->lock);
+  return msg_id;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client,
+                              const char *topic, int qos) {
+  mqtt_job_t *job = mqtt_job_new(MQTT_JOB_SUBSCRIBED, NULL, NULL, 0);
+  int msg_id = -1;
+
+  if (job == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&client->lock);
+  for (int i = 0; client->connected && i < MQTT_SUBSCRIPTIONS_MAX; i++) {
+    if (client->subscriptions[i] == NULL) {
+      client->subscriptions[i] = strdup(topic);
+      if (client->subscriptions[i] == NULL) {
+        break;
+      }
+      msg_id = job->msg_id = client->next_msg_id;
+      client->next_msg_id = msg_id == UINT16_MAX ? 1 : msg_id + 1;
+      job->qos = qos;
+      mqtt_client_post(client, job);
+      job = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&client->lock);
+  free(job);
+  return msg_id;
+}
+
+void host_mqtt_set_sink(host_mqtt_sink_fn *sink, void *arg) {
+  pthread_mutex_lock(&broker.lock);
+  broker.sink = sink;
+  broker.sink_arg = arg;
+  pthread_mutex_unlock(&broker.lock);
+}
+
+void host_mqtt_set_broker_up(bool up) {
+  mqtt_job_t *job;
+
+  pthread_mutex_lock(&broker.lock);
+  if (broker.up != up) {
+    broker.up = up;
+    for (int i = 0; i < broker.client_count; i++) {
+      pthread_mutex_lock(&broker.clients[i]->lock);
+      job = broker.clients[i]->started
+                ? mqtt_job_new(up ? MQTT_JOB_CONNECT : MQTT_JOB_DISCONNECT,
+                               NULL, NULL, 0)
+                : NULL;
+      if (job != NULL) {
+        mqtt_client_post(broker.clients[i], job);
+      }
+      pthread_mutex_unlock(&broker.clients[i]->lock);
+    }
+  }
+  pthread_mutex_unlock(&broker.lock);
+}
+
+static bool mqtt_topic_matches(const char *filter, const char *topic) {
+  size_t len = strlen(filter);
+
+  if (len > 0 && filter[len - 1] == '#') {
+    return 0 == strncmp(filter, topic, len - 1);
+  }
+  return 0 == strcmp(filter, topic);
+}
+
+int host_mqtt_publish(const char *topic, const void *data, size_t len) {
+  struct esp_mqtt_client *client;
+  mqtt_job_t *job;
+  int delivered = 0;
+
+  pthread_mutex_lock(&broker.lock);
+  for (int i = 0; broker.up && i < broker.client_count; i++) {
+    client = broker.clients[i];
+    pthread_mutex_lock(&client->lock);
+    for (int j = 0; client->connected && j < MQTT_SUBSCRIPTIONS_MAX; j++) {
+      if (client->subscriptions[j] != NULL &&
+          mqtt_topic_matches(client->subscriptions[j], topic)) {
+        job = mqtt_job_new(MQTT_JOB_DATA, topic, data, len);
+        if (job != NULL) {
+          mqtt_client_post(client, job);
+          delivered++;
+        }
+        break;
+      }
+    }
+    pthread_mutex_unlock(&client->lock);
+  }
+  pthread_mutex_unlock(&broker.lock);
+  return delivered;
+}
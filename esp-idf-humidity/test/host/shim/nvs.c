@@ -0,0 +1,248 @@
+// NVS kept in memory, a list of entries per namespace and key
+
+#include <nvs.h>
+#include <nvs_flash.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NVS_HANDLES_MAX 16
+
+typedef enum {
+  NVS_TYPE_U8,
+  NVS_TYPE_U32,
+  NVS_TYPE_STR,
+  NVS_TYPE_BLOB,
+} nvs_type_t;
+
+typedef struct nvs_entry {
+  struct nvs_entry *next;
+  char ns[NVS_KEY_NAME_MAX_SIZE + 1];
+  char key[NVS_KEY_NAME_MAX_SIZE + 1];
+  nvs_type_t type;
+  size_t len;
+  uint8_t value[];
+} nvs_entry_t;
+
+static struct {
+  pthread_mutex_t lock;
+  bool initialized;
+  nvs_entry_t *entries;
+  // Namespace of each handle, handles count from 1
+  char handles[NVS_HANDLES_MAX][NVS_KEY_NAME_MAX_SIZE + 1];
+  bool writable[NVS_HANDLES_MAX];
+} state = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+esp_err_t nvs_flash_erase(void) {
+  nvs_entry_t *entry;
+
+  pthread_mutex_lock(&state.lock);
+  while ((entry = state.entries) != NULL) {
+    state.entries = entry->next;
+    free(entry);
+  }
+  pthread_mutex_unlock(&state.lock);
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void) {
+  state.initialized = true;
+  return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode,
+                   nvs_handle_t *out_handle) {
+  if (!state.initialized) {
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+  }
+  if (strlen(name) > NVS_KEY_NAME_MAX_SIZE - 1) {
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+  }
+  pthread_mutex_lock(&state.lock);
+  for (int i = 0; i < NVS_HANDLES_MAX; i++) {
+    if (state.handles[i][0] == '\0') {
+      strcpy(state.handles[i], name);
+      state.writable[i] = open_mode == NVS_READWRITE;
+      pthread_mutex_unlock(&state.lock);
+      *out_handle = i + 1;
+      return ESP_OK;
+    }
+  }
+  pthread_mutex_unlock(&state.lock);
+  return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle) {
+  if (handle != 0 && handle <= NVS_HANDLES_MAX) {
+    pthread_mutex_lock(&state.lock);
+    state.handles[handle - 1][0] = '\0';
+    pthread_mutex_unlock(&state.lock);
+  }
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  if (handle == 0 || handle > NVS_HANDLES_MAX) {
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  }
+  return ESP_OK;
+}
+
+// Link pointing at the entry of key, or at the NULL ending the list
+static nvs_entry_t **nvs_find(const char *ns, const char *key) {
+  nvs_entry_t **link = &state.entries;
+
+  while (*link != NULL &&
+         (0 != strcmp((*link)->ns, ns) || 0 != strcmp((*link)->key, key))) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static esp_err_t nvs_check(nvs_handle_t handle, const char *key,
+                           bool write) {
+  if (handle == 0 || handle > NVS_HANDLES_MAX ||
+      state.handles[handle - 1][0] == '\0') {
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  }
+  if (write && !state.writable[handle - 1]) {
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  }
+  if (key == NULL || key[0] == '\0') {
+    return ESP_ERR_NVS_INVALID_NAME;
+  }
+  if (strlen(key) > NVS_KEY_NAME_MAX_SIZE - 1) {
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t nvs_set(nvs_handle_t handle, const char *key,
+                         nvs_type_t type, const void *value, size_t len) {
+  nvs_entry_t **link;
+  nvs_entry_t *entry;
+  esp_err_t ret;
+
+  pthread_mutex_lock(&state.lock);
+  ret = nvs_check(handle, key, true);
+  if (ret != ESP_OK) {
+    pthread_mutex_unlock(&state.lock);
+    return ret;
+  }
+  entry = malloc(sizeof(*entry) + len);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&state.lock);
+    return ESP_ERR_NO_MEM;
+  }
+  strcpy(entry->ns, state.handles[handle - 1]);
+  strcpy(entry->key, key);
+  entry->type = type;
+  entry->len = len;
+  memcpy(entry->value, value, len);
+  link = nvs_find(entry->ns, key);
+  if (*link != NULL) {
+    entry->next = (*link)->next;
+    free(*link);
+  } else {
+    entry->next = NULL;
+  }
+  *link = entry;
+  pthread_mutex_unlock(&state.lock);
+  return ESP_OK;
+}
+
+/**
+ * @brief Copy the value of key out
+ *
+ * @param length In: room in out_value, out: length of the value. Only the
+ *  length is returned when out_value is NULL.
+ */
+static esp_err_t nvs_get(nvs_handle_t handle, const char *key,
+                         nvs_type_t type, void *out_value, size_t *length) {
+  nvs_entry_t *entry;
+  esp_err_t ret;
+
+  pthread_mutex_lock(&state.lock);
+  ret = nvs_check(handle, key, false);
+  if (ret != ESP_OK) {
+    pthread_mutex_unlock(&state.lock);
+    return ret;
+  }
+  entry = *nvs_find(state.handles[handle - 1], key);
+  if (entry == NULL) {
+    ret = ESP_ERR_NVS_NOT_FOUND;
+  } else if (entry->type != type) {
+    ret = ESP_ERR_NVS_TYPE_MISMATCH;
+  } else if (out_value != NULL && *length < entry->len) {
+    ret = ESP_ERR_NVS_INVALID_LENGTH;
+  } else {
+    if (out_value != NULL) {
+      memcpy(out_value, entry->value, entry->len);
+    }
+    *length = entry->len;
+  }
+  pthread_mutex_unlock(&state.lock);
+  return ret;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  nvs_entry_t **link;
+  nvs_entry_t *entry;
+  esp_err_t ret;
+
+  pthread_mutex_lock(&state.lock);
+  ret = nvs_check(handle, key, true);
+  if (ret == ESP_OK) {
+    link = nvs_find(state.handles[handle - 1], key);
+    if (*link == NULL) {
+      ret = ESP_ERR_NVS_NOT_FOUND;
+    } else {
+      entry = *link;
+      *link = entry->next;
+      free(entry);
+    }
+  }
+  pthread_mutex_unlock(&state.lock);
+  return ret;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value) {
+  return nvs_set(handle, key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value) {
+  return nvs_set(handle, key, NVS_TYPE_U32, &value, sizeof(value));
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key,
+                      const char *value) {
+  return nvs_set(handle, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value,
+                       size_t length) {
+  return nvs_set(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value) {
+  size_t length = sizeof(*out_value);
+
+  return nvs_get(handle, key, NVS_TYPE_U8, out_value, &length);
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key,
+                      uint32_t *out_value) {
+  size_t length = sizeof(*out_value);
+
+  return nvs_get(handle, key, NVS_TYPE_U32, out_value, &length);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out_value,
+                      size_t *length) {
+  return nvs_get(handle, key, NVS_TYPE_STR, out_value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value,
+                       size_t *length) {
+  return nvs_get(handle, key, NVS_TYPE_BLOB, out_value, length);
+}
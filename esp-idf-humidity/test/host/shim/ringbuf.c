@@ -0,0 +1,215 @@
+// No-split FreeRTOS ring buffer, items laid out like the ESP-IDF one
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/ringbuf.h>
+
+#include "host_freertos.h"
+
+#define RB_ALIGN 8
+#define RB_ALIGN_UP(x) (((x) + RB_ALIGN - 1) & ~(size_t)(RB_ALIGN - 1))
+#define RB_ALIGN_DOWN(x) ((x) & ~(size_t)(RB_ALIGN - 1))
+
+#define RB_FLAG_WRITTEN 1  // Sent, can be received
+#define RB_FLAG_READ 2     // Received, not returned yet
+#define RB_FLAG_FREE 4     // Returned, freed once all before it are
+#define RB_FLAG_DUMMY 8    // Rest of the buffer skipped, items go on at 0
+
+typedef struct {
+  uint32_t len;
+  uint32_t flags;
+} rb_header_t;
+
+struct host_ringbuf {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  // Signalled on sending and freeing
+  uint8_t *buffer;
+  size_t size;
+  size_t acquire_pos;  // Where the next item goes
+  size_t read_pos;     // Next item to receive
+  size_t free_pos;     // Oldest item not freed
+  size_t count;        // Items not freed
+  size_t unread;       // Items acquired but not received
+};
+
+static rb_header_t *rb_header(RingbufHandle_t rb, size_t pos) {
+  return (rb_header_t *)(rb->buffer + pos);
+}
+
+static size_t rb_next(RingbufHandle_t rb, size_t pos) {
+  rb_header_t *header = rb_header(rb, pos);
+
+  if (header->flags & RB_FLAG_DUMMY) {
+    return 0;
+  }
+  pos += sizeof(rb_header_t) + RB_ALIGN_UP(header->len);
+  return pos == rb->size ? 0 : pos;
+}
+
+/**
+ * @brief Claim need bytes at acquire_pos, wrapping to 0 if they do not fit
+ *
+ * @return The position claimed, rb->size if there is no room
+ */
+static size_t rb_claim(RingbufHandle_t rb, size_t need) {
+  size_t pos;
+
+  if (rb->count == 0) {
+    rb->acquire_pos = rb->read_pos = rb->free_pos = 0;
+  }
+  if (rb->count != 0 && rb->acquire_pos == rb->free_pos) {
+    return rb->size;  // Full
+  }
+  if (rb->acquire_pos < rb->free_pos) {
+    pos = need <= rb->free_pos - rb->acquire_pos ? rb->acquire_pos : rb->size;
+  } else if (need <= rb->size - rb->acquire_pos) {
+    pos = rb->acquire_pos;
+  } else if (need <= rb->free_pos) {
+    rb_header(rb, rb->acquire_pos)->flags = RB_FLAG_DUMMY;
+    pos = 0;
+  } else {
+    pos = rb->size;
+  }
+  if (pos != rb->size) {
+    rb->acquire_pos = pos + need == rb->size ? 0 : pos + need;
+  }
+  return pos;
+}
+
+RingbufHandle_t xRingbufferCreate(size_t xBufferSize,
+                                  RingbufferType_t xBufferType) {
+  struct host_ringbuf *rb;
+
+  if (xBufferType != RINGBUF_TYPE_NOSPLIT) {
+    fprintf(stderr, "Only RINGBUF_TYPE_NOSPLIT is supported\n");
+    abort();
+  }
+  rb = calloc(1, sizeof(*rb));
+  if (rb == NULL) {
+    return NULL;
+  }
+  rb->size = RB_ALIGN_DOWN(xBufferSize);
+  rb->buffer = malloc(rb->size);
+  if (rb->buffer == NULL) {
+    free(rb);
+    return NULL;
+  }
+  pthread_mutex_init(&rb->lock, NULL);
+  host_cond_init(&rb->cond);
+  return rb;
+}
+
+void vRingbufferDelete(RingbufHandle_t xRingbuffer) {
+  pthread_cond_destroy(&xRingbuffer->cond);
+  pthread_mutex_destroy(&xRingbuffer->lock);
+  free(xRingbuffer->buffer);
+  free(xRingbuffer);
+}
+
+size_t xRingbufferGetMaxItemSize(RingbufHandle_t xRingbuffer) {
+  return RB_ALIGN_DOWN(xRingbuffer->size / 2) - sizeof(rb_header_t);
+}
+
+BaseType_t xRingbufferSendAcquire(RingbufHandle_t xRingbuffer, void **ppvItem,
+                                  size_t xItemSize, TickType_t xTicksToWait) {
+  RingbufHandle_t rb = xRingbuffer;
+  size_t need = sizeof(rb_header_t) + RB_ALIGN_UP(xItemSize);
+  struct timespec deadline;
+  size_t pos;
+
+  if (xItemSize > xRingbufferGetMaxItemSize(rb)) {
+    return pdFALSE;
+  }
+  host_deadline(xTicksToWait, &deadline);
+  pthread_mutex_lock(&rb->lock);
+  while ((pos = rb_claim(rb, need)) == rb->size && xTicksToWait != 0 &&
+         host_cond_wait(&rb->cond, &rb->lock, xTicksToWait, &deadline)) {
+  }
+  if (pos == rb->size) {
+    pthread_mutex_unlock(&rb->lock);
+    return pdFALSE;
+  }
+  *rb_header(rb, pos) = (rb_header_t){.len = xItemSize, .flags = 0};
+  rb->count++;
+  rb->unread++;
+  pthread_mutex_unlock(&rb->lock);
+  *ppvItem = rb->buffer + pos + sizeof(rb_header_t);
+  return pdTRUE;
+}
+
+BaseType_t xRingbufferSendComplete(RingbufHandle_t xRingbuffer, void *pvItem) {
+  rb_header_t *header = (rb_header_t *)pvItem - 1;
+
+  pthread_mutex_lock(&xRingbuffer->lock);
+  header->flags |= RB_FLAG_WRITTEN;
+  pthread_cond_broadcast(&xRingbuffer->cond);
+  pthread_mutex_unlock(&xRingbuffer->lock);
+  return pdTRUE;
+}
+
+BaseType_t xRingbufferSend(RingbufHandle_t xRingbuffer, const void *pvItem,
+                           size_t xItemSize, TickType_t xTicksToWait) {
+  void *item;
+
+  if (pdTRUE != xRingbufferSendAcquire(xRingbuffer, &item, xItemSize,
+                                       xTicksToWait)) {
+    return pdFALSE;
+  }
+  memcpy(item, pvItem, xItemSize);
+  return xRingbufferSendComplete(xRingbuffer, item);
+}
+
+// Skip the dummy at read_pos, if any, and check the item there is sent
+static bool rb_readable(RingbufHandle_t rb) {
+  if (rb->unread == 0) {
+    return false;
+  }
+  if (rb_header(rb, rb->read_pos)->flags & RB_FLAG_DUMMY) {
+    rb->read_pos = 0;
+  }
+  return rb_header(rb, rb->read_pos)->flags & RB_FLAG_WRITTEN;
+}
+
+void *xRingbufferReceive(RingbufHandle_t xRingbuffer, size_t *pxItemSize,
+                         TickType_t xTicksToWait) {
+  RingbufHandle_t rb = xRingbuffer;
+  struct timespec deadline;
+  rb_header_t *header = NULL;
+
+  host_task_park();
+  host_deadline(xTicksToWait, &deadline);
+  pthread_mutex_lock(&rb->lock);
+  while (!rb_readable(rb) && xTicksToWait != 0 &&
+         host_cond_wait(&rb->cond, &rb->lock, xTicksToWait, &deadline)) {
+  }
+  if (rb_readable(rb)) {
+    header = rb_header(rb, rb->read_pos);
+    header->flags |= RB_FLAG_READ;
+    rb->read_pos = rb_next(rb, rb->read_pos);
+    rb->unread--;
+    if (pxItemSize != NULL) {
+      *pxItemSize = header->len;
+    }
+  }
+  pthread_mutex_unlock(&rb->lock);
+  host_task_park();
+  return header != NULL ? header + 1 : NULL;
+}
+
+void vRingbufferReturnItem(RingbufHandle_t xRingbuffer, void *pvItem) {
+  RingbufHandle_t rb = xRingbuffer;
+  rb_header_t *header = (rb_header_t *)pvItem - 1;
+
+  pthread_mutex_lock(&rb->lock);
+  header->flags |= RB_FLAG_FREE;
+  rb->count--;
+  if (rb->count == 0) {
+    rb->acquire_pos = rb->read_pos = rb->free_pos = 0;
+  } else {
+    while (rb_header(rb, rb->free_pos)->flags &
+           (RB_FLAG_FREE | RB_FLAG_DUMMY)) {
+      rb->free_pos = rb_next(rb, rb->free_pos);
+    }
+  }
+  pthread_cond_broadcast(&rb->cond);
+  pthread_mutex_unlock(&rb->lock);
+}
@@ -0,0 +1,80 @@
+#include "sim_sensors.h"
+
+#include <stdbool.h>
+
+typedef struct {
+  uint32_t seed;
+  float temp;
+  float humidity;
+  float lux;
+  float uvi;
+  bool uvi_next;  // ltr390 alternates between its modes
+} sim_state_t;
+
+static const sensormgr_channel_t sim_sht4x_channels[] = {
+    {.sensor = "sht4x", .unit = "C", .decimals = 2},
+    {.sensor = "sht4x", .unit = "%rH", .decimals = 2},
+};
+
+static const sensormgr_channel_t sim_ltr390_channels[] = {
+    {.sensor = "ltr390", .unit = "lux", .decimals = 2},
+    {.sensor = "ltr390", .unit = "uvi", .decimals = 2},
+};
+
+static sim_state_t sim;
+
+/**
+ * @brief Step of at most step * range / 2 either way, in multiples of step
+ */
+static float sim_walk(float value, float step, uint32_t range) {
+  sim.seed = sim.seed * 1103515245 + 12345;
+  return value + step * ((int32_t)((sim.seed >> 16) % range) -
+                         (int32_t)(range / 2));
+}
+
+static esp_err_t sim_sht4x_measure(float *values) {
+  // Mostly unchanged between polls, like a room
+  sim.temp = sim_walk(sim.temp, 0.01f, 5);
+  sim.humidity = sim_walk(sim.humidity, 0.01f, 9);
+  values[0] = sim.temp;
+  values[1] = sim.humidity;
+  return ESP_OK;
+}
+
+static esp_err_t sim_ltr390_measure(float *values) {
+  if (sim.uvi_next) {
+    sim.uvi = sim_walk(sim.uvi, 0.01f, 3);
+    values[1] = sim.uvi < 0 ? 0 : sim.uvi;
+  } else {
+    sim.lux = sim_walk(sim.lux, 0.25f, 41);
+    values[0] = sim.lux < 0 ? 0 : sim.lux;
+  }
+  sim.uvi_next = !sim.uvi_next;
+  return ESP_OK;
+}
+
+const sensormgr_registration_t sim_sht4x = {
+    .measure = sim_sht4x_measure,
+    .channels = sim_sht4x_channels,
+    .channel_cnt = sizeof(sim_sht4x_channels) / sizeof(sim_sht4x_channels[0]),
+    .period_ms = 60000,
+};
+
+const sensormgr_registration_t sim_ltr390 = {
+    .measure = sim_ltr390_measure,
+    .channels = sim_ltr390_channels,
+    .channel_cnt =
+        sizeof(sim_ltr390_channels) / sizeof(sim_ltr390_channels[0]),
+    .period_ms = 100,
+};
+
+void sim_sensors_seed(uint32_t seed) {
+  sim = (sim_state_t){
+      .seed = seed,
+      .temp = 21.5f,
+      .humidity = 45.25f,
+      .lux = 320.0f,
+      .uvi = 0.5f,
+      .uvi_next = false,
+  };
+}
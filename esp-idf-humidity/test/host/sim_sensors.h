@@ -0,0 +1,31 @@
+#ifndef SIM_SENSORS_H
+#define SIM_SENSORS_H
+
+#include <stdint.h>
+
+#include "sensormgr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Synthetic sensors with the channels of the real drivers
+ *
+ * Registered with sensormgr_register_sensor they stand in for the hardware in
+ * the host pipeline bench. Values random walk at the resolution of the real
+ * sensor, seeded so runs repeat.
+ */
+
+extern const sensormgr_registration_t sim_sht4x;
+extern const sensormgr_registration_t sim_ltr390;
+
+/**
+ * @brief Restart every synthetic sensor from the same values
+ */
+void sim_sensors_seed(uint32_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,34 @@
+// Runs every TEST_CASE linked in, in the order they registered
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#define HOST_TESTS_MAX 256
+
+static const host_test_desc_t *tests[HOST_TESTS_MAX];
+static int test_cnt;
+
+void host_test_register(const host_test_desc_t *desc) {
+  if (test_cnt == HOST_TESTS_MAX) {
+    fprintf(stderr, "Too many test cases, raise HOST_TESTS_MAX\n");
+    abort();
+  }
+  tests[test_cnt++] = desc;
+}
+
+int main(int argc, char **argv) {
+  int idx;
+
+  UNITY_BEGIN();
+  for (idx = 0; idx < test_cnt; idx++) {
+    // Filtered on the [tag] of the description, as idf.py's runner does
+    if (argc > 1 && strstr(tests[idx]->desc, argv[1]) == NULL) {
+      continue;
+    }
+    Unity.TestFile = tests[idx]->file;
+    UnityDefaultTestRun(tests[idx]->fn, tests[idx]->name, tests[idx]->line);
+  }
+  return UNITY_END();
+}
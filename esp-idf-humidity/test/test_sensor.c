@@ -1,23 +1,24 @@
 #include <unity.h>
 
-#include "sensor.h"
-
-void test_sensor_jsonify(void) {
-  char *formatted;
-
-  sensor_data_t data = {.temp = 24.0, .humidity = 20.0, .timestamp = 0};
-
-  cJSON *root = cJSON_CreateObject();
-  jsonify(&data, root);
-
-  formatted = cJSON_PrintUnformatted(root);
-  printf(formatted);
+#include "sensormgr_sample.h"
+
+void test_sensor_sample(void) {
+  sensormgr_sample_t sample;
+
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    sensormgr_sample_set(&sample, 1, 2, 1650000000000LL,
+                                         24.0f));
+  TEST_ASSERT_EQUAL(1, sample.channel);
+  TEST_ASSERT_EQUAL(2400, sample.value);
+  TEST_ASSERT_EQUAL_INT64(1650000000000LL,
+                          sensormgr_sample_timestamp(&sample, 0));
+  TEST_ASSERT_TRUE(24.0 == sensormgr_sample_value(&sample, 2));
 }
 
 void app_main() {
   UNITY_BEGIN();
 
-  RUN_TEST(test_sensor_jsonify);
+  RUN_TEST(test_sensor_sample);
 
   UNITY_END();
 }
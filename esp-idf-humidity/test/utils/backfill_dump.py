@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+"""Subscribe to sensorbackfill/+/ and print every decoded reading as JSON.
+
+The spill format is described in components/sensormgr/sensormgr_spill.h.
+Every spill sensor type is a sensormgr channel holding a single fixed point
+value and what statistic it is, the channel table in the message gives its
+sensor, unit and decimals. Timestamps are in ms, those taken before SNTP
+synced are ms since boot, turned into Unix time with the clock anchors of the
+file. Files older than version 4 count in seconds.
+"""
+
+import argparse
+import asyncio
+import json
+import logging
+import struct
+
+from modules import sensormgr_pb2
+from asyncio_mqtt import Client, ProtocolVersion
+
+backfill_topic = "sensorbackfill/+/"
+# SENSORMGR_SAMPLE_EPOCH_MS, earlier timestamps are ms since boot
+sample_epoch_ms = 1577836800 * 1000
+
+
+class BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def get(self, nbits):
+        value = 0
+        for _ in range(nbits):
+            byte = self.data[self.pos >> 3]
+            value = (value << 1) | ((byte >> (7 - (self.pos & 7))) & 1)
+            self.pos += 1
+        return value
+
+
+def signed32(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def signed64(value):
+    return value - (1 << 64) if value & (1 << 63) else value
+
+
+def decode_timestamp(bits):
+    ones = 0
+    while ones < 4 and bits.get(1):
+        ones += 1
+    if ones == 0:
+        return 0
+    width, bias = [(7, 63), (9, 255), (12, 2047), (32, 0)][ones - 1]
+    value = bits.get(width)
+    return signed32(value) if width == 32 else value - bias
+
+
+def decode_value(bits, prev, window):
+    if not bits.get(1):
+        return prev, window
+    if bits.get(1):
+        lead = bits.get(5)
+        length = bits.get(5) + 1
+        window = (lead, 32 - lead - length)
+    lead, trail = window
+    return prev ^ (bits.get(32 - lead - trail) << trail), window
+
+
+def boot_time(anchors, mono):
+    """Unix time in ms of boot seen from mono, see sensormgr_clock_boot_time."""
+    if not anchors:
+        return 0
+    if mono <= anchors[0][0]:
+        return anchors[0][1] - anchors[0][0]
+    for prev, cur in zip(anchors, anchors[1:]):
+        if mono < cur[0]:
+            prev_offset = prev[1] - prev[0]
+            step = (cur[1] - cur[0] - prev_offset) * (mono - prev[0])
+            # C division, truncated towards zero
+            step = abs(step) // (cur[0] - prev[0]) * (1 if step >= 0 else -1)
+            return prev_offset + step
+    return anchors[-1][1] - anchors[-1][0]
+
+
+def wall_time(anchors, timestamp):
+    """Rebase ms since boot, see sensormgr_wall_time."""
+    if timestamp >= sample_epoch_ms:
+        return timestamp
+    return max(boot_time(anchors, timestamp) + timestamp, sample_epoch_ms)
+
+
+def decode_spill(spill, time_t_size):
+    """Yield (sensor type, timestamp in ms, [values]) for every reading."""
+    version = spill[4]
+    if spill[:4] != b"SMSP" or version not in (2, 3, 4):
+        raise ValueError("not a version 2 to 4 spill file")
+    # Older versions count in seconds
+    scale = 1000 if version < 4 else 1
+    timestamp_size = time_t_size if version < 4 else 8
+    sensor_cnt = spill[5]
+    data_len = spill[6:6 + sensor_cnt]
+    base_timestamp, = struct.unpack_from("<q", spill, 6 + sensor_cnt)
+    pos = 6 + sensor_cnt + 8
+    anchors = []
+    if version >= 3:
+        # boot_id only matters to the device
+        anchor_cnt = spill[pos + 4]
+        pos += 5
+        anchor_format = "<Iq" if version < 4 else "<qq"
+        for _ in range(anchor_cnt):
+            mono, wall = struct.unpack_from(anchor_format, spill, pos)
+            anchors.append((mono * scale, wall * scale))
+            pos += struct.calcsize(anchor_format)
+    while pos < len(spill):
+        type_idx, reading_cnt, payload_len = struct.unpack_from("<BHH", spill, pos)
+        pos += 5
+        bits = BitReader(spill[pos:pos + payload_len])
+        pos += payload_len
+        value_cnt = (data_len[type_idx] - timestamp_size) // 4
+        if version < 4:
+            timestamp = base_timestamp + signed32(bits.get(32))
+        else:
+            timestamp = base_timestamp + signed64(bits.get(64))
+        delta = 0
+        values = [bits.get(32) for _ in range(value_cnt)]
+        windows = [None] * value_cnt
+        yield type_idx, wall_time(anchors, timestamp * scale), values
+        for _ in range(reading_cnt - 1):
+            delta += decode_timestamp(bits)
+            timestamp += delta
+            for col in range(value_cnt):
+                values[col], windows[col] = decode_value(bits, values[col], windows[col])
+            yield type_idx, wall_time(anchors, timestamp * scale), list(values)
+
+
+async def dump_backfill(time_t_size):
+    async with Client('mqtt.iot.kaffi.home', protocol=ProtocolVersion.V311) as client:
+        async with client.filtered_messages(backfill_topic) as messages:
+            await client.subscribe(backfill_topic)
+            async for message in messages:
+                backfill = sensormgr_pb2.SensorBackfill()
+                backfill.ParseFromString(message.payload)
+                logging.info('backfill: %s %s@%u (%u bytes)', message.topic,
+                             backfill.file_name, backfill.offset, len(backfill.spill))
+                for type_idx, timestamp, values in decode_spill(backfill.spill, time_t_size):
+                    channel = backfill.channels[type_idx]
+                    # Files from before aggregation only have raw readings
+                    stat = values[1] if len(values) > 1 else sensormgr_pb2.STAT_RAW
+                    reading = {
+                        "location": backfill.location_name,
+                        "sensor": channel.sensor,
+                        "unit": channel.unit,
+                        "timestamp": timestamp / 1000,
+                        "value": signed32(values[0]) / 10 ** channel.decimals,
+                    }
+                    if stat == sensormgr_pb2.STAT_COUNT:
+                        reading["value"] = values[0]
+                    if stat != sensormgr_pb2.STAT_RAW:
+                        reading["stat"] = sensormgr_pb2.stat_t.Name(stat)[5:].lower()
+                    print(json.dumps(reading))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--time-t-size', type=int, default=8,
+                        help='sizeof(time_t) on the device, 4 before ESP-IDF 5, '
+                             'only for files older than version 4')
+    args = parser.parse_args()
+    logging.basicConfig(level='INFO')
+    asyncio.run(dump_backfill(args.time_t_size))
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+
+import contextlib
+import asyncio
+import logging
+import uuid
+
+import commands_pb2
+from modules import ltr390_pb2, sht4x_pb2
+from asyncio_mqtt import Client, ProtocolVersion
+
+
+device_uuid = ["05474d0c-8e72-45de-8d32-a7dec3ec79bf", "0ea9ac26-d952-4094-bc0b-17622a788b0c"]
+cmd_req_topic = [f"command/{did}/req/" for did in device_uuid]
+cmd_resp_topic = [f"command/{did}/resp/" for did in device_uuid]
+
+async def comm_stack():
+
+
+    async with contextlib.AsyncExitStack() as stack:
+        tasks = set()
+        stack.push_async_callback(cancel_tasks, tasks)
+        client = Client('mqtt.iot.kaffi.home', protocol=ProtocolVersion.V311)
+        await stack.enter_async_context(client)
+
+        for resp_topic in cmd_resp_topic:
+            manager = client.filtered_messages(resp_topic)
+            messages = await stack.enter_async_context(manager)
+            task = asyncio.create_task(log_cmd_result(messages))
+            tasks.add(task)
+
+            await client.subscribe(resp_topic)
+
+        task = asyncio.create_task(post_cmds(client))
+        tasks.add(task)
+
+        await asyncio.gather(*tasks)
+
+
+async def log_cmd_result(messages, count=1):
+    idx = 0
+    async for message in messages:
+        idx += 1
+        payload = message.payload
+        cmd_resp = commands_pb2.CommandResponse()
+        logging.info(b'resp unparsed: "%s"', payload)
+        cmd_resp.ParseFromString(payload)
+        resp_type = cmd_resp.WhichOneof('resp')
+        logging.info('resp parsed: UUID (%s) Ret (%s):(%s)', cmd_resp.uuid, cmd_resp.ret_code, resp_type)
+        if resp_type == 'batch_response':
+            for resp in cmd_resp.batch_response.responses:
+                logging.info('  batch resp: UUID (%s) Ret (%s):(%s)', resp.uuid, resp.ret_code, resp.WhichOneof('resp'))
+        if idx == count:
+            return
+
+
+def batch_add(batch):
+    cmd = batch.requests.add()
+    cmd.uuid = str(uuid.uuid4())
+    return cmd
+
+
+async def post_cmds(client):
+    # Reconfigure the sensors in one round trip, stop at the first failure
+    cmd = commands_pb2.CommandRequest()
+    cmd.uuid = str(uuid.uuid4())
+    batch = cmd.batch_request
+    batch.stop_on_error = True
+
+    batch_add(batch).sensormgr_set_options_request.location_name = "bedroom"
+    sht4x = batch_add(batch).sht4x_set_options_request
+    sht4x.enable = True
+    sht4x.mode = sht4x_pb2.NO_HEATER_HIGH
+    ltr390 = batch_add(batch).ltr390_set_options_request
+    ltr390.enable = True
+    ltr390.mode = ltr390_pb2.UVS
+    ltr390.resolution = ltr390_pb2.RESOLUTION_18BIT
+    ltr390.measurerate = ltr390_pb2.MEASURE_100MS
+    ltr390.gain = ltr390_pb2.GAIN_18
+    batch_add(batch).sensormgr_get_options_request.SetInParent()
+
+    logging.info('cmd batch_request: %s', cmd.SerializeToString())
+    await asyncio.gather(
+        *[asyncio.create_task(client.publish(tpc, payload=cmd.SerializeToString(), qos=2, retain=False))
+        for tpc in cmd_req_topic]
+    )
+
+async def cancel_tasks(tasks):
+    for task in tasks:
+        if task.done:
+            continue
+        task.cancel()
+    try:
+        await task
+    except asyncio.CancelledError as e:
+        logging.exception('Failed to cancel task, moving on...')
+
+
+async def main():
+    logging.info('Setting up Client')
+    await comm_stack()
+
+if __name__ == "__main__":
+    logging.basicConfig(level='INFO')
+    asyncio.run(main())
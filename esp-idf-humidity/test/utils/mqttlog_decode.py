@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""Subscribe to logbin/+/ and print every binary log record as JSON.
+
+The record format is described in components/mqttmgr/mqttlog_record.h. The
+source, event and tag keys of a record are hashes of the string literals at
+its MQTTLOG_LOG* call site, they are looked up in a dictionary built by
+hashing every string literal of the firmware sources. The JSON printed is the
+same as devices send to logs/<device>/, one message per line, so this can run
+as a telegraf execd input.
+"""
+
+import argparse
+import asyncio
+import json
+import logging
+import os
+import re
+import struct
+import sys
+import time
+
+from asyncio_mqtt import Client, ProtocolVersion
+
+logbin_topic = "logbin/+/"
+# MQTTLOG_RECORD_VERSION
+record_version = 1
+# esp_log_level_t, as mqtt_log_level_to_str names them
+levels = {1: "ERROR", 2: "WARN", 3: "INFO", 4: "DEBUG", 5: "VERBOSE"}
+# mqttlog_tag_type_t
+TAG_STR, TAG_BOOL, TAG_INT, TAG_UINT, TAG_INT64, TAG_FLOAT = range(6)
+
+firmware_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..")
+string_literal = re.compile(r'"((?:[^"\\\n]|\\.)*)"')
+c_escapes = {"n": "\n", "t": "\t", "r": "\r", "b": "\b", "f": "\f",
+             '"': '"', "\\": "\\", "'": "'", "0": "\0"}
+
+
+def fnv1a(s):
+    """32 bit FNV-1a of s, see mqttlog_record_hash."""
+    value = 2166136261
+    for byte in s.encode():
+        value = ((value ^ byte) * 16777619) & 0xFFFFFFFF
+    return value
+
+
+def build_dictionary(source_dir=firmware_dir):
+    """Map the hash of every string literal in the firmware to the string."""
+    dictionary = {}
+    for root, dirs, files in os.walk(source_dir):
+        dirs[:] = [d for d in dirs if d not in ("build", "managed_components", ".git")]
+        for name in files:
+            if not name.endswith((".c", ".h")):
+                continue
+            with open(os.path.join(root, name), errors="replace") as f:
+                for match in string_literal.finditer(f.read()):
+                    s = re.sub(r"\\(.)", lambda m: c_escapes.get(m[1], m[1]), match[1])
+                    other = dictionary.setdefault(fnv1a(s), s)
+                    if other != s:
+                        logging.warning("hash collision: %r and %r", other, s)
+    return dictionary
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def u8(self):
+        self.pos += 1
+        return self.data[self.pos - 1]
+
+    def u32(self):
+        self.pos += 4
+        return struct.unpack_from("<I", self.data, self.pos - 4)[0]
+
+    def double(self):
+        self.pos += 8
+        return struct.unpack_from("<d", self.data, self.pos - 8)[0]
+
+    def varint(self):
+        value = shift = 0
+        while True:
+            byte = self.u8()
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def zigzag(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+    def done(self):
+        return self.pos >= len(self.data)
+
+
+def decode(payload, dictionary):
+    """Yield the JSON dict of every record in a logbin message."""
+    if not payload or payload[0] != record_version:
+        raise ValueError("not a version %u log message" % record_version)
+    reader = Reader(payload)
+    reader.pos = 1
+    timestamp = 0
+
+    def lookup(hash_value):
+        return dictionary.get(hash_value, "#%08x" % hash_value)
+
+    while not reader.done():
+        timestamp += reader.zigzag()
+        level = reader.u8()
+        source = lookup(reader.u32())
+        event = lookup(reader.u32())
+        tags = {}
+        for _ in range(reader.u8()):
+            key = lookup(reader.u32())
+            tag_type = reader.u8()
+            if tag_type == TAG_STR:
+                length = reader.varint()
+                reader.pos += length
+                value = bytes(reader.data[reader.pos - length:reader.pos]).decode(errors="replace")
+            elif tag_type == TAG_BOOL:
+                value = bool(reader.u8())
+            elif tag_type in (TAG_INT, TAG_INT64):
+                value = reader.zigzag()
+            elif tag_type == TAG_UINT:
+                value = reader.varint()
+            elif tag_type == TAG_FLOAT:
+                value = reader.double()
+                if value != value or value in (float("inf"), float("-inf")):
+                    value = None
+            else:
+                raise ValueError("unknown tag type %u" % tag_type)
+            tags[key] = value
+        yield {
+            "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime(timestamp)),
+            "source": source,
+            "level": levels.get(level, "UNKONWN"),
+            "event": event,
+            "tags": tags,
+        }
+
+
+async def dump_logs(dictionary):
+    async with Client('mqtt.iot.kaffi.home', protocol=ProtocolVersion.V311) as client:
+        async with client.filtered_messages(logbin_topic) as messages:
+            await client.subscribe(logbin_topic)
+            async for message in messages:
+                try:
+                    for record in decode(message.payload, dictionary):
+                        print(json.dumps(record, separators=(",", ":")), flush=True)
+                except (ValueError, IndexError, struct.error) as e:
+                    logging.error('bad log message on %s: %s', message.topic, e)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--source-dir', default=firmware_dir,
+                        help='firmware sources the devices were built from')
+    parser.add_argument('--dump-dictionary', action='store_true',
+                        help='print the hash of every string and exit')
+    args = parser.parse_args()
+    # stdout carries the JSON for telegraf, keep logging off it
+    logging.basicConfig(level='INFO', stream=sys.stderr)
+    dictionary = build_dictionary(args.source_dir)
+    if args.dump_dictionary:
+        for hash_value, s in sorted(dictionary.items()):
+            print("%08x %s" % (hash_value, json.dumps(s)))
+    else:
+        asyncio.run(dump_logs(dictionary))